@@ -0,0 +1,172 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "bodygen.h"
+
+static mnhtesto_bodygen_t gen_y;
+static mnhtesto_bodygen_t gen_rnd;
+static mnhtesto_bodygen_t gen_pat[MNHTESTO_BODYGEN_PAT_ENTROPY_MAX + 1];
+static mnhtesto_bodygen_t gen_file;
+static size_t file_mapsz;
+
+
+static uint64_t
+splitmix64(uint64_t *state)
+{
+    uint64_t z;
+
+    z = (*state += 0x9e3779b97f4a7c15ul);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ul;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebul;
+    return z ^ (z >> 31);
+}
+
+
+/*
+ * Fill buf a word at a time, bits random bits per byte.
+ */
+static void
+bodygen_fill(char *buf, size_t sz, uint64_t *state, unsigned bits)
+{
+    uint64_t mask;
+    size_t i;
+
+    mask = 0x0101010101010101ul * ((1u << bits) - 1);
+    for (i = 0; i < sz; i += sizeof(uint64_t)) {
+        uint64_t w;
+
+        w = splitmix64(state);
+        if (bits < 8) {
+            /* printable, 'a' and on */
+            w = (w & mask) + 0x6161616161616161ul;
+        }
+        memcpy(buf + i, &w, MIN(sizeof(uint64_t), sz - i));
+    }
+}
+
+
+static char *
+bodygen_alloc(size_t sz)
+{
+    char *buf;
+
+    if ((buf = malloc(sz)) == NULL) {
+        FAIL("malloc");
+    }
+    return buf;
+}
+
+
+/*
+ * Precompute the generators.  The pattern period is chunk, the size
+ * of the record payload, so that every record repeats it as a whole.
+ */
+int
+mnhtesto_bodygen_init(size_t chunk, uint64_t seed, const char *corpus)
+{
+    char *buf;
+    unsigned i;
+
+    buf = bodygen_alloc(chunk);
+    memset(buf, 'Y', chunk);
+    gen_y.name = "y";
+    gen_y.buf = buf;
+    gen_y.sz = chunk;
+
+    buf = bodygen_alloc(MNHTESTO_BODYGEN_RND_SIZE);
+    bodygen_fill(buf, MNHTESTO_BODYGEN_RND_SIZE, &seed, 8);
+    gen_rnd.name = "rnd";
+    gen_rnd.buf = buf;
+    gen_rnd.sz = MNHTESTO_BODYGEN_RND_SIZE;
+
+    for (i = 0; i < countof(gen_pat); ++i) {
+        buf = bodygen_alloc(chunk);
+        bodygen_fill(buf, chunk, &seed, i);
+        gen_pat[i].name = "pat";
+        gen_pat[i].buf = buf;
+        gen_pat[i].sz = chunk;
+    }
+
+    gen_file.name = "file";
+    if (corpus != NULL) {
+        int fd;
+        struct stat sb;
+        void *m;
+
+        if ((fd = open(corpus, O_RDONLY)) == -1) {
+            TRRET(MNHTESTO_BODYGEN_INIT + 1);
+        }
+        if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+            (void)close(fd);
+            TRRET(MNHTESTO_BODYGEN_INIT + 2);
+        }
+        if ((m = mmap(NULL,
+                      sb.st_size,
+                      PROT_READ,
+                      MAP_PRIVATE,
+                      fd,
+                      0)) == MAP_FAILED) {
+            (void)close(fd);
+            TRRET(MNHTESTO_BODYGEN_INIT + 3);
+        }
+        (void)close(fd);
+        file_mapsz = sb.st_size;
+        gen_file.buf = m;
+        gen_file.sz = sb.st_size;
+    }
+
+    return 0;
+}
+
+
+void
+mnhtesto_bodygen_fini(void)
+{
+    unsigned i;
+
+    free((void *)gen_y.buf);
+    gen_y.buf = NULL;
+    free((void *)gen_rnd.buf);
+    gen_rnd.buf = NULL;
+    for (i = 0; i < countof(gen_pat); ++i) {
+        free((void *)gen_pat[i].buf);
+        gen_pat[i].buf = NULL;
+    }
+    if (gen_file.buf != NULL) {
+        (void)munmap((void *)gen_file.buf, file_mapsz);
+        gen_file.buf = NULL;
+    }
+}
+
+
+/*
+ * Return the generator by name, or NULL if there is no such one.  No
+ * name means y.  Entropy only applies to pat.
+ */
+const mnhtesto_bodygen_t *
+mnhtesto_bodygen_get(const char *name, int entropy)
+{
+    if (name == NULL || strcmp(name, "y") == 0) {
+        return &gen_y;
+    } else if (strcmp(name, "rnd") == 0) {
+        return &gen_rnd;
+    } else if (strcmp(name, "pat") == 0) {
+        if (!INB0(0, entropy, MNHTESTO_BODYGEN_PAT_ENTROPY_MAX)) {
+            entropy = MNHTESTO_BODYGEN_PAT_ENTROPY_DEFAULT;
+        }
+        return &gen_pat[entropy];
+    } else if (strcmp(name, "file") == 0 && gen_file.buf != NULL) {
+        return &gen_file;
+    }
+    return NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef MNHTESTO_BODYGEN_H
+#define MNHTESTO_BODYGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Body generators.  A generator is a buffer precomputed at startup,
+ * bodies are rendered by cycling through it from a start offset.
+ *
+ *  y       the byte 'Y'
+ *  rnd     pseudo-random bytes, the start offset is drawn from the
+ *          seed= query term
+ *  pat     a repeating pattern of ent= random bits per byte, 0 to 8
+ *  file    the corpus file, --corpus
+ */
+typedef struct _mnhtesto_bodygen {
+    const char *name;
+    const char *buf;
+    size_t sz;
+} mnhtesto_bodygen_t;
+
+#define MNHTESTO_BODYGEN_PAT_ENTROPY_MAX 8
+#define MNHTESTO_BODYGEN_PAT_ENTROPY_DEFAULT 4
+/*
+ * The period of rnd, well over the deflate window, and still cache
+ * resident
+ */
+#define MNHTESTO_BODYGEN_RND_SIZE (1ul << 20)
+
+int mnhtesto_bodygen_init(size_t, uint64_t, const char *);
+void mnhtesto_bodygen_fini(void);
+const mnhtesto_bodygen_t *mnhtesto_bodygen_get(const char *, int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_BODYGEN_H */
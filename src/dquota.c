@@ -0,0 +1,377 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "dquota.h"
+
+#define DTABLE_NEXT(dt, slot) (((slot) + 1) & ((dt)->nslots - 1))
+
+
+/*
+ * Reserve the memory of cap instances, pages are touched as the
+ * instances are taken.  Shared with the processes forked afterwards
+ * if shared.  No dynamic quotas if cap is zero.
+ */
+void
+mnhtesto_dtable_init(mnhtesto_dtable_t *dt, size_t cap, bool shared)
+{
+    char *p;
+
+    assert(cap < UINT32_MAX / 2);
+
+    memset(dt, 0, sizeof(mnhtesto_dtable_t));
+    if ((dt->cap = cap) == 0) {
+        return;
+    }
+    dt->shared = shared;
+    for (dt->nslots = 1; dt->nslots < cap * 2; dt->nslots <<= 1) {
+    }
+    dt->memsz = sizeof(mnhtesto_dtable_state_t) +
+                sizeof(mnhtesto_dquota_t) * cap +
+                sizeof(uint32_t) * dt->nslots;
+    if ((p = mmap(NULL,
+                  dt->memsz,
+                  PROT_READ | PROT_WRITE,
+                  (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS,
+                  -1,
+                  0)) == MAP_FAILED) {
+        FAIL("mmap");
+    }
+    dt->state = (mnhtesto_dtable_state_t *)p;
+    p += sizeof(mnhtesto_dtable_state_t);
+    dt->entries = (mnhtesto_dquota_t *)p;
+    p += sizeof(mnhtesto_dquota_t) * cap;
+    dt->slots = (uint32_t *)p;
+}
+
+
+void
+mnhtesto_dtable_fini(mnhtesto_dtable_t *dt)
+{
+    if (dt->state != NULL) {
+        (void)munmap(dt->state, dt->memsz);
+    }
+    free(dt->tmpls);
+    free(dt->tmpllens);
+    memset(dt, 0, sizeof(mnhtesto_dtable_t));
+}
+
+
+/*
+ * The slot of the instance of the key of hash, made of the parts, and
+ * len bytes long inline, or else the empty slot it would take.
+ */
+static uint32_t
+dtable_probe(const mnhtesto_dtable_t *dt,
+             uint64_t hash,
+             const mnhtesto_qpart_t *parts,
+             size_t nparts,
+             size_t len)
+{
+    uint32_t slot;
+
+    for (slot = hash & (dt->nslots - 1);
+         dt->slots[slot] != 0;
+         slot = DTABLE_NEXT(dt, slot)) {
+        mnhtesto_dquota_t *dq;
+
+        dq = &dt->entries[dt->slots[slot] - 1];
+        if (dq->hash == hash &&
+            dq->len == len &&
+            mnhtesto_qparts_prefix(parts, nparts, dq->key, len)) {
+            break;
+        }
+    }
+    return slot;
+}
+
+
+static void
+dtable_index(mnhtesto_dtable_t *dt, mnhtesto_dquota_t *dq)
+{
+    uint32_t slot;
+
+    for (slot = dq->hash & (dt->nslots - 1);
+         dt->slots[slot] != 0;
+         slot = DTABLE_NEXT(dt, slot)) {
+    }
+    dt->slots[slot] = (uint32_t)(dq - dt->entries) + 1;
+}
+
+
+/*
+ * Backward shift, the slots after the deleted one move up unless
+ * they are at their home slot already.
+ */
+static void
+dtable_unindex(mnhtesto_dtable_t *dt, mnhtesto_dquota_t *dq)
+{
+    mnhtesto_qpart_t part;
+    uint32_t slot, next;
+
+    part.data = dq->key;
+    part.len = dq->len;
+    slot = dtable_probe(dt, dq->hash, &part, 1, dq->len);
+    assert(dt->slots[slot] != 0);
+    for (next = DTABLE_NEXT(dt, slot);
+         dt->slots[next] != 0;
+         next = DTABLE_NEXT(dt, next)) {
+        uint32_t home;
+
+        home = dt->entries[dt->slots[next] - 1].hash & (dt->nslots - 1);
+        /* home cyclically in (slot, next] stays */
+        if (slot <= next ? (slot < home && home <= next) :
+                           (slot < home || home <= next)) {
+            continue;
+        }
+        dt->slots[slot] = dt->slots[next];
+        slot = next;
+    }
+    dt->slots[slot] = 0;
+}
+
+
+/*
+ * A free instance, or else the first one the hand finds idle.  The
+ * hand makes at most two sweeps.
+ */
+static mnhtesto_dquota_t *
+dtable_victim(mnhtesto_dtable_t *dt)
+{
+    mnhtesto_dtable_state_t *st;
+
+    st = dt->state;
+    if (st->nentries < dt->cap) {
+        return &dt->entries[st->nentries++];
+    }
+    while (true) {
+        mnhtesto_dquota_t *dq;
+
+        dq = &dt->entries[st->hand];
+        if (++st->hand == dt->cap) {
+            st->hand = 0;
+        }
+        if (dq->tmpl == MNHTESTO_QTABLE_NONE) {
+            return dq;
+        }
+        if (!dq->ref) {
+            dtable_unindex(dt, dq);
+            --st->nused;
+            ++st->nevicted;
+            return dq;
+        }
+        dq->ref = 0;
+    }
+}
+
+
+/*
+ * Whether the limits of the templates a of ta and b of tb are the
+ * same.
+ */
+static bool
+dtable_same_limits(mnhtesto_qtable_t *ta,
+                   uint32_t a,
+                   mnhtesto_qtable_t *tb,
+                   uint32_t b)
+{
+    uint32_t i;
+
+    if (MNHTESTO_QTABLE_NLIMITS(ta, a) != MNHTESTO_QTABLE_NLIMITS(tb, b)) {
+        return false;
+    }
+    for (i = 0; i < MNHTESTO_QTABLE_NLIMITS(ta, a); ++i) {
+        if (memcmp(MNHTESTO_QTABLE_SPEC(ta, a + i),
+                   MNHTESTO_QTABLE_SPEC(tb, b + i),
+                   sizeof(mnhtesto_quota_spec_t)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Take the templates of table.  When table replaces old, the instances
+ * of the templates whose limits are unchanged are carried over, the
+ * rest are freed.
+ */
+void
+mnhtesto_dtable_bind(mnhtesto_dtable_t *dt,
+                     mnhtesto_qtable_t *table,
+                     mnhtesto_qtable_t *old)
+{
+    uint32_t id;
+    size_t i;
+
+    free(dt->tmpls);
+    free(dt->tmpllens);
+    dt->tmpls = NULL;
+    dt->tmpllens = NULL;
+    dt->ntmpls = 0;
+
+    for (id = 0; id < table->nelems; ++id) {
+        mnbytes_t *qname;
+        size_t len, j;
+
+        qname = MNHTESTO_QTABLE_QNAME(table, id);
+        len = strnlen(BCDATA(qname), BSZ(qname));
+        if (len == 0 || BCDATA(qname)[len - 1] != '*') {
+            continue;
+        }
+        --len;
+        if ((dt->tmpls = realloc(dt->tmpls,
+                                 sizeof(uint32_t) *
+                                    (dt->ntmpls + 1))) == NULL) {
+            FAIL("realloc");
+        }
+        if ((dt->tmpllens = realloc(dt->tmpllens,
+                                    sizeof(size_t) *
+                                        (dt->ntmpls + 1))) == NULL) {
+            FAIL("realloc");
+        }
+        /*
+         * the longest prefix first
+         */
+        for (j = dt->ntmpls; j > 0 && dt->tmpllens[j - 1] < len; --j) {
+            dt->tmpls[j] = dt->tmpls[j - 1];
+            dt->tmpllens[j] = dt->tmpllens[j - 1];
+        }
+        dt->tmpls[j] = id;
+        dt->tmpllens[j] = len;
+        ++dt->ntmpls;
+    }
+
+    if (dt->cap == 0 || old == NULL) {
+        return;
+    }
+
+    memset(dt->slots, 0, sizeof(uint32_t) * dt->nslots);
+    for (i = 0; i < dt->state->nentries; ++i) {
+        mnhtesto_dquota_t *dq;
+
+        dq = &dt->entries[i];
+        if (dq->tmpl == MNHTESTO_QTABLE_NONE) {
+            continue;
+        }
+        id = mnhtesto_qtable_get(table, MNHTESTO_QTABLE_QNAME(old, dq->tmpl));
+        if (id == MNHTESTO_QTABLE_NONE ||
+            !dtable_same_limits(table, id, old, dq->tmpl)) {
+            dq->tmpl = MNHTESTO_QTABLE_NONE;
+            --dt->state->nused;
+            continue;
+        }
+        dq->tmpl = id;
+        dtable_index(dt, dq);
+    }
+}
+
+
+/*
+ * The dynamic quota of the key made of the parts, of the hash given by
+ * mnhtesto_qparts_hash(), instantiated from its template at now if
+ * need be, and the template key id.  NULL
+ * if no template applies.  New instances are not referenced until used
+ * again, so that a flood of one-off keys evicts one another rather
+ * than the keys in use.
+ */
+mnhtesto_dquota_t *
+mnhtesto_dtable_get(mnhtesto_dtable_t *dt,
+                    mnhtesto_qtable_t *table,
+                    const mnhtesto_qpart_t *parts,
+                    size_t nparts,
+                    uint64_t hash,
+                    uint64_t now,
+                    uint32_t *tmpl)
+{
+    mnhtesto_dquota_t *dq;
+    uint32_t slot;
+    size_t i, len;
+
+    if (dt->ntmpls == 0 || dt->cap == 0) {
+        return NULL;
+    }
+
+    len = mnhtesto_qparts_len(parts, nparts);
+    slot = dtable_probe(dt,
+                        hash,
+                        parts,
+                        nparts,
+                        MIN(len, MNHTESTO_DQUOTA_KEYSZ));
+    if (dt->slots[slot] != 0) {
+        dq = &dt->entries[dt->slots[slot] - 1];
+        dq->ref = 1;
+        *tmpl = dq->tmpl;
+        return dq;
+    }
+
+    for (i = 0; i < dt->ntmpls; ++i) {
+        if (len >= dt->tmpllens[i] &&
+            mnhtesto_qparts_prefix(
+                parts,
+                nparts,
+                BCDATA(MNHTESTO_QTABLE_QNAME(table, dt->tmpls[i])),
+                dt->tmpllens[i])) {
+            break;
+        }
+    }
+    if (i == dt->ntmpls) {
+        return NULL;
+    }
+
+    dq = dtable_victim(dt);
+    dq->hash = hash;
+    dq->tmpl = dt->tmpls[i];
+    dq->len = (uint16_t)mnhtesto_qparts_copy(parts,
+                                             nparts,
+                                             dq->key,
+                                             MNHTESTO_DQUOTA_KEYSZ);
+    dq->ref = 0;
+    memset(&dq->count, 0, sizeof(mnhtesto_qcount_t));
+    assert(MNHTESTO_QTABLE_NLIMITS(table, dq->tmpl) <=
+           MNHTESTO_QUOTA_MAX_LIMITS);
+    for (i = 0; i < MNHTESTO_QTABLE_NLIMITS(table, dq->tmpl); ++i) {
+        mnhtesto_quota_init(MNHTESTO_QTABLE_SPEC(table, dq->tmpl + i),
+                            &dq->quota[i],
+                            now,
+                            hash);
+    }
+    dtable_index(dt, dq);
+    ++dt->state->nused;
+    *tmpl = dq->tmpl;
+    return dq;
+}
+
+
+/*
+ * The instance of the key of hash, NULL if there is none, or if it has
+ * been evicted.  Keys longer than MNHTESTO_DQUOTA_KEYSZ of the same
+ * hash are not told apart.
+ */
+mnhtesto_dquota_t *
+mnhtesto_dtable_find(mnhtesto_dtable_t *dt, uint64_t hash)
+{
+    uint32_t slot;
+
+    if (dt->cap == 0) {
+        return NULL;
+    }
+    for (slot = hash & (dt->nslots - 1);
+         dt->slots[slot] != 0;
+         slot = DTABLE_NEXT(dt, slot)) {
+        mnhtesto_dquota_t *dq;
+
+        dq = &dt->entries[dt->slots[slot] - 1];
+        if (dq->hash == hash) {
+            return dq;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,114 @@
+#ifndef MNHTESTO_DQUOTA_H
+#define MNHTESTO_DQUOTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "qtable.h"
+#include "quota.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Dynamic quotas, instantiated on the first sight of a key that has no
+ * quota of its own.  A quota of the quota table named "prefix*" is a
+ * template for the keys starting with prefix, the longest prefix wins,
+ * and "*" is the template for any key.
+ *
+ * There are at most cap instances, in memory reserved at init.  A new
+ * key takes over a free instance, or else evicts an idle one by CLOCK:
+ * the hand sweeps the instances, clearing their reference bits, and
+ * takes the first one not referenced since it last passed.
+ *
+ * Keys are kept inline up to MNHTESTO_DQUOTA_KEYSZ bytes, longer keys
+ * are told apart by the hash of the whole key, the same as that of the
+ * quota table index.  The instances are
+ * indexed by open addressing.
+ *
+ * An instance has the states of the limits of its template, those of
+ * the parents of the template are shared by all of the instances.  It
+ * counts the requests accepted and rejected by its own key, the counts
+ * go with the instance when it is evicted.
+ */
+#define MNHTESTO_DQUOTA_KEYSZ (64)
+#define MNHTESTO_DQUOTA_DEFAULT_CAP (65536)
+
+typedef struct _mnhtesto_dquota {
+    uint64_t hash;
+    /* template key id, MNHTESTO_QTABLE_NONE for a free instance */
+    uint32_t tmpl;
+    uint16_t len;
+    /* referenced since the hand last passed */
+    uint16_t ref;
+    char key[MNHTESTO_DQUOTA_KEYSZ];
+    mnhtesto_qcount_t count;
+    mnhtesto_quota_t quota[MNHTESTO_QUOTA_MAX_LIMITS];
+} mnhtesto_dquota_t;
+
+/*
+ * Shared with the processes forked afterwards, along with the
+ * instances and the index.
+ */
+typedef struct _mnhtesto_dtable_state {
+    uint32_t lock;
+    /* instances ever taken, those past it are free */
+    size_t nentries;
+    size_t nused;
+    size_t hand;
+    uint64_t nevicted;
+} mnhtesto_dtable_state_t;
+
+typedef struct _mnhtesto_dtable {
+    mnhtesto_dtable_state_t *state;
+    mnhtesto_dquota_t *entries;
+    size_t cap;
+    /* instance index + 1, zero for an empty slot */
+    uint32_t *slots;
+    /* power of 2 */
+    size_t nslots;
+    bool shared;
+    size_t memsz;
+
+    /*
+     * template key ids by descending prefix length, and the lengths
+     */
+    uint32_t *tmpls;
+    size_t *tmpllens;
+    size_t ntmpls;
+} mnhtesto_dtable_t;
+
+#define MNHTESTO_DTABLE_LOCK(dt)                                       \
+do {                                                                   \
+    if ((dt)->shared) {                                                \
+        mnhtesto_qtable_spin(&(dt)->state->lock);                      \
+    }                                                                  \
+} while (0)
+#define MNHTESTO_DTABLE_UNLOCK(dt)                                     \
+do {                                                                   \
+    if ((dt)->shared) {                                                \
+        __atomic_store_n(&(dt)->state->lock, 0, __ATOMIC_RELEASE);     \
+    }                                                                  \
+} while (0)
+
+void mnhtesto_dtable_init(mnhtesto_dtable_t *, size_t, bool);
+void mnhtesto_dtable_fini(mnhtesto_dtable_t *);
+void mnhtesto_dtable_bind(mnhtesto_dtable_t *,
+                          mnhtesto_qtable_t *,
+                          mnhtesto_qtable_t *);
+mnhtesto_dquota_t *mnhtesto_dtable_get(mnhtesto_dtable_t *,
+                                       mnhtesto_qtable_t *,
+                                       const mnhtesto_qpart_t *,
+                                       size_t,
+                                       uint64_t,
+                                       uint64_t,
+                                       uint32_t *);
+mnhtesto_dquota_t *mnhtesto_dtable_find(mnhtesto_dtable_t *, uint64_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_DQUOTA_H */
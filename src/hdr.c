@@ -0,0 +1,131 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "hdr.h"
+
+#define HDR_SUBMASK ((1ul << MNHTESTO_HDR_SUBBITS) - 1)
+
+
+void
+mnhtesto_hdr_init(mnhtesto_hdr_t *hdr)
+{
+    memset(hdr, 0, sizeof(mnhtesto_hdr_t));
+}
+
+
+/*
+ * Bucket of v: the power of two above the sub-buckets, and the
+ * MNHTESTO_HDR_SUBBITS bits below the most significant bit.
+ */
+unsigned
+mnhtesto_hdr_index(uint64_t v)
+{
+    unsigned shift;
+
+    if (v <= HDR_SUBMASK) {
+        return (unsigned)v;
+    }
+    shift = 63 - __builtin_clzll(v) - MNHTESTO_HDR_SUBBITS;
+    if (shift > MNHTESTO_HDR_MAXBITS - MNHTESTO_HDR_SUBBITS - 1) {
+        return MNHTESTO_HDR_NBUCKETS - 1;
+    }
+    return ((shift + 1) << MNHTESTO_HDR_SUBBITS) |
+           (unsigned)((v >> shift) & HDR_SUBMASK);
+}
+
+
+/*
+ * The highest value of the bucket idx.
+ */
+uint64_t
+mnhtesto_hdr_upper(unsigned idx)
+{
+    unsigned shift;
+
+    if (idx <= HDR_SUBMASK) {
+        return idx;
+    }
+    shift = (idx >> MNHTESTO_HDR_SUBBITS) - 1;
+    return ((((uint64_t)idx & HDR_SUBMASK) | (1ul << MNHTESTO_HDR_SUBBITS))
+            << shift) + ((1ul << shift) - 1);
+}
+
+
+void
+mnhtesto_hdr_record(mnhtesto_hdr_t *hdr, uint64_t v)
+{
+    ++hdr->buckets[mnhtesto_hdr_index(v)];
+    ++hdr->count;
+    hdr->sum += v;
+    if (v > hdr->max) {
+        hdr->max = v;
+    }
+}
+
+
+/*
+ * Add the samples of src to dst.
+ */
+void
+mnhtesto_hdr_merge(mnhtesto_hdr_t *dst, const mnhtesto_hdr_t *src)
+{
+    unsigned i;
+
+    if (src->count == 0) {
+        return;
+    }
+    for (i = 0; i < MNHTESTO_HDR_NBUCKETS; ++i) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->max = MAX(dst->max, src->max);
+}
+
+
+/*
+ * The n percentiles ps, in ascending order, in one pass.  A percentile
+ * is the upper bound of its bucket, but the max is exact.
+ */
+void
+mnhtesto_hdr_percentiles(const mnhtesto_hdr_t *hdr,
+                         const double *ps,
+                         uint64_t *res,
+                         size_t n)
+{
+    uint64_t seen;
+    unsigned i;
+    size_t j;
+
+    for (i = 0, j = 0, seen = 0; i < MNHTESTO_HDR_NBUCKETS && j < n; ++i) {
+        seen += hdr->buckets[i];
+        while (j < n) {
+            uint64_t rank;
+
+            rank = (uint64_t)((double)hdr->count * ps[j] / 100.0 + 0.5);
+            if (seen < MAX(rank, 1)) {
+                break;
+            }
+            res[j++] = MIN(mnhtesto_hdr_upper(i), hdr->max);
+        }
+    }
+    for (; j < n; ++j) {
+        res[j] = hdr->max;
+    }
+}
+
+
+uint64_t
+mnhtesto_hdr_percentile(const mnhtesto_hdr_t *hdr, double p)
+{
+    uint64_t res;
+
+    mnhtesto_hdr_percentiles(hdr, &p, &res, 1);
+    return res;
+}
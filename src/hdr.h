@@ -0,0 +1,49 @@
+#ifndef MNHTESTO_HDR_H
+#define MNHTESTO_HDR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * HDR-style histogram of non-negative values, in fixed memory.  Values
+ * below 2^MNHTESTO_HDR_SUBBITS have a bucket each, above that every
+ * power of two is split in 2^MNHTESTO_HDR_SUBBITS buckets, so a value
+ * is kept to within 1 / 2^MNHTESTO_HDR_SUBBITS of itself.  Values of
+ * 2^MNHTESTO_HDR_MAXBITS and over go to the last bucket.
+ *
+ * Recording only increments, so a single writer needs no lock, and a
+ * reader is consistent to within the samples recorded meanwhile.
+ */
+#define MNHTESTO_HDR_SUBBITS (5)
+#define MNHTESTO_HDR_MAXBITS (45)
+#define MNHTESTO_HDR_NBUCKETS                                          \
+    ((MNHTESTO_HDR_MAXBITS - MNHTESTO_HDR_SUBBITS + 1) <<              \
+     MNHTESTO_HDR_SUBBITS)
+
+typedef struct _mnhtesto_hdr {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[MNHTESTO_HDR_NBUCKETS];
+} mnhtesto_hdr_t;
+
+void mnhtesto_hdr_init(mnhtesto_hdr_t *);
+unsigned mnhtesto_hdr_index(uint64_t);
+uint64_t mnhtesto_hdr_upper(unsigned);
+void mnhtesto_hdr_record(mnhtesto_hdr_t *, uint64_t);
+void mnhtesto_hdr_merge(mnhtesto_hdr_t *, const mnhtesto_hdr_t *);
+uint64_t mnhtesto_hdr_percentile(const mnhtesto_hdr_t *, double);
+void mnhtesto_hdr_percentiles(const mnhtesto_hdr_t *,
+                              const double *,
+                              uint64_t *,
+                              size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_HDR_H */
@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "inflight.h"
+
+#define INFLIGHT_NEXT(f, slot) (((slot) + 1) & ((f)->nslots - 1))
+
+
+void
+mnhtesto_inflight_init(mnhtesto_inflight_t *inflight)
+{
+    memset(inflight, 0, sizeof(mnhtesto_inflight_t));
+    inflight->nslots = MNHTESTO_INFLIGHT_MIN_SLOTS;
+    if ((inflight->slots = calloc(inflight->nslots,
+                                  sizeof(mnhtesto_islot_t))) == NULL) {
+        FAIL("calloc");
+    }
+}
+
+
+void
+mnhtesto_inflight_fini(mnhtesto_inflight_t *inflight)
+{
+    free(inflight->slots);
+    memset(inflight, 0, sizeof(mnhtesto_inflight_t));
+}
+
+
+/*
+ * The slot of the counter of hash, or else the empty slot it would
+ * take.
+ */
+static size_t
+inflight_probe(const mnhtesto_inflight_t *inflight, uint64_t hash)
+{
+    size_t slot;
+
+    for (slot = hash & (inflight->nslots - 1);
+         inflight->slots[slot].count != 0;
+         slot = INFLIGHT_NEXT(inflight, slot)) {
+        if (inflight->slots[slot].hash == hash) {
+            break;
+        }
+    }
+    return slot;
+}
+
+
+static void
+inflight_grow(mnhtesto_inflight_t *inflight)
+{
+    mnhtesto_islot_t *slots;
+    size_t nslots, i;
+
+    slots = inflight->slots;
+    nslots = inflight->nslots;
+    inflight->nslots <<= 1;
+    if ((inflight->slots = calloc(inflight->nslots,
+                                  sizeof(mnhtesto_islot_t))) == NULL) {
+        FAIL("calloc");
+    }
+    for (i = 0; i < nslots; ++i) {
+        if (slots[i].count != 0) {
+            inflight->slots[inflight_probe(inflight, slots[i].hash)] =
+                slots[i];
+        }
+    }
+    free(slots);
+}
+
+
+/*
+ * Backward shift, the counters after the deleted one move up unless
+ * they are at their home slot already.
+ */
+static void
+inflight_delete(mnhtesto_inflight_t *inflight, size_t slot)
+{
+    size_t next;
+
+    for (next = INFLIGHT_NEXT(inflight, slot);
+         inflight->slots[next].count != 0;
+         next = INFLIGHT_NEXT(inflight, next)) {
+        size_t home;
+
+        home = inflight->slots[next].hash & (inflight->nslots - 1);
+        /* home cyclically in (slot, next] stays */
+        if (slot <= next ? (slot < home && home <= next) :
+                           (slot < home || home <= next)) {
+            continue;
+        }
+        inflight->slots[slot] = inflight->slots[next];
+        slot = next;
+    }
+    memset(&inflight->slots[slot], 0, sizeof(mnhtesto_islot_t));
+    --inflight->nused;
+}
+
+
+uint32_t
+mnhtesto_inflight_count(const mnhtesto_inflight_t *inflight, uint64_t hash)
+{
+    return inflight->slots[inflight_probe(inflight, hash)].count;
+}
+
+
+/*
+ * Take a slot of the counter of hash, of at most limit, into held, and
+ * return non-zero if there are limit requests in flight already, the
+ * counter is then recorded in held.
+ */
+int
+mnhtesto_inflight_acquire(mnhtesto_inflight_t *inflight,
+                          uint64_t hash,
+                          uint32_t limit,
+                          mnhtesto_iheld_t *held)
+{
+    mnhtesto_islot_t *slot;
+
+    assert(held->n < countof(held->hashes));
+
+    if ((inflight->nused + 1) * 2 > inflight->nslots) {
+        inflight_grow(inflight);
+    }
+    slot = &inflight->slots[inflight_probe(inflight, hash)];
+    if (slot->count >= limit) {
+        held->over = hash;
+        held->full = true;
+        return 1;
+    }
+    if (slot->count++ == 0) {
+        slot->hash = hash;
+        ++inflight->nused;
+    }
+    held->hashes[held->n++] = hash;
+    return 0;
+}
+
+
+/*
+ * Give back the slots of held, and empty it.
+ */
+void
+mnhtesto_inflight_release(mnhtesto_inflight_t *inflight,
+                          mnhtesto_iheld_t *held)
+{
+    size_t i;
+
+    for (i = 0; i < held->n; ++i) {
+        size_t slot;
+
+        slot = inflight_probe(inflight, held->hashes[i]);
+        assert(inflight->slots[slot].count > 0);
+        if (--inflight->slots[slot].count == 0) {
+            inflight_delete(inflight, slot);
+        }
+    }
+    held->n = 0;
+}
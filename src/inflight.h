@@ -0,0 +1,66 @@
+#ifndef MNHTESTO_INFLIGHT_H
+#define MNHTESTO_INFLIGHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "quota.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counters of the requests in flight per limit of the "inflight"
+ * kind.  A request takes a slot of each of the in-flight limits of its
+ * quota and of the parents as it is let in, and gives them back as it
+ * is finished, see mnhtesto_iheld_t.
+ *
+ * The counters are indexed by the hash of the limit key, by open
+ * addressing, and are there only while there are requests in flight.
+ * They guard the coroutines of a process, and so are per process,
+ * rather than in the quota states shared by the workers, and are
+ * neither evicted along with a dynamic quota nor reset on reload.
+ */
+#define MNHTESTO_INFLIGHT_MIN_SLOTS (16)
+
+typedef struct _mnhtesto_islot {
+    uint64_t hash;
+    /* zero for an empty slot */
+    uint32_t count;
+} mnhtesto_islot_t;
+
+typedef struct _mnhtesto_inflight {
+    mnhtesto_islot_t *slots;
+    /* power of 2 */
+    size_t nslots;
+    size_t nused;
+} mnhtesto_inflight_t;
+
+/*
+ * The slots held by a request, at most one per limit of its chain, and
+ * the counter that was full when a slot was last refused, if full is
+ * set.  The caller clears full.
+ */
+typedef struct _mnhtesto_iheld {
+    uint64_t hashes[MNHTESTO_QUOTA_MAX_CHAIN];
+    size_t n;
+    uint64_t over;
+    bool full;
+} mnhtesto_iheld_t;
+
+void mnhtesto_inflight_init(mnhtesto_inflight_t *);
+void mnhtesto_inflight_fini(mnhtesto_inflight_t *);
+uint32_t mnhtesto_inflight_count(const mnhtesto_inflight_t *, uint64_t);
+int mnhtesto_inflight_acquire(mnhtesto_inflight_t *,
+                              uint64_t,
+                              uint32_t,
+                              mnhtesto_iheld_t *);
+void mnhtesto_inflight_release(mnhtesto_inflight_t *, mnhtesto_iheld_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_INFLIGHT_H */
@@ -0,0 +1,402 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "latency.h"
+
+#define LATENCY_NSEC 1000000000.0
+
+static uint64_t rnd_state = 0x9e3779b97f4a7c15ul;
+
+
+/*
+ * xorshift64*, uniform in [0, 1)
+ */
+static double
+latency_uniform(void)
+{
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return (double)((rnd_state * 0x2545f4914f6cdd1dul) >> 11) /
+           (double)(1ul << 53);
+}
+
+
+/*
+ * Delay in nanoseconds, the default unit is a millisecond.
+ */
+static const char *
+latency_delay(const char *s, double *v)
+{
+    char *end;
+
+    errno = 0;
+    *v = strtod(s, &end);
+    if (end == s || errno == ERANGE || !(*v >= 0.0)) {
+        return NULL;
+    }
+    if (strncmp(end, "us", 2) == 0) {
+        *v *= 1000.0;
+        end += 2;
+    } else if (strncmp(end, "ms", 2) == 0) {
+        *v *= 1000000.0;
+        end += 2;
+    } else if (*end == 's') {
+        *v *= LATENCY_NSEC;
+        ++end;
+    } else {
+        *v *= 1000000.0;
+    }
+    return end;
+}
+
+
+/*
+ * Acklam's rational approximation of the inverse of the standard
+ * normal CDF, good to about 1e-9 over (0, 1).
+ */
+static double
+latency_normal_quantile(double p)
+{
+    static const double a[] = {
+        -3.969683028665376e+01, 2.209460984245205e+02,
+        -2.759285104469687e+02, 1.383577518672690e+02,
+        -3.066479806614716e+01, 2.506628277459239e+00,
+    };
+    static const double b[] = {
+        -5.447609879822406e+01, 1.615858368580409e+02,
+        -1.556989798598866e+02, 6.680131188771972e+01,
+        -1.328068155288572e+01,
+    };
+    static const double c[] = {
+        -7.784894002430293e-03, -3.223964580411365e-01,
+        -2.400758277161838e+00, -2.549732539343734e+00,
+        4.374664141464968e+00, 2.938163982698783e+00,
+    };
+    static const double d[] = {
+        7.784695709041462e-03, 3.224671290700398e-01,
+        2.445134137142996e+00, 3.754408661907416e+00,
+    };
+    double q, r;
+
+    if (p < 0.02425) {
+        q = sqrt(-2.0 * log(p));
+        return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) *
+                q + c[5]) /
+               ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+    } else if (p > 1.0 - 0.02425) {
+        q = sqrt(-2.0 * log(1.0 - p));
+        return -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) *
+                 q + c[5]) /
+                ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+    }
+    q = p - 0.5;
+    r = q * q;
+    return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r +
+            a[5]) * q /
+           (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r +
+            1.0);
+}
+
+
+#define LATENCY_EXP         (1)
+#define LATENCY_LOGNORMAL   (2)
+#define LATENCY_PARETO      (3)
+
+static double
+latency_quantile(int dist, double x, double y, double p)
+{
+    switch (dist) {
+    case LATENCY_EXP:
+        return -x * log(1.0 - p);
+
+    case LATENCY_LOGNORMAL:
+        if (p == 0.0) {
+            return 0.0;
+        }
+        return x * exp(y * latency_normal_quantile(p));
+
+    case LATENCY_PARETO:
+        return x / pow(1.0 - p, 1.0 / y);
+
+    default:
+        FAIL("latency_quantile");
+    }
+    return 0.0;
+}
+
+
+static void
+latency_table(mnhtesto_latency_t *lat, int dist, double x, double y)
+{
+    size_t i;
+
+    lat->ty = MNHTESTO_LATENCY_TABLE;
+    lat->n = MNHTESTO_LATENCY_NQ;
+    if ((lat->values = malloc(sizeof(uint64_t) * (lat->n + 1))) == NULL) {
+        FAIL("malloc");
+    }
+    for (i = 0; i < lat->n; ++i) {
+        lat->values[i] = (uint64_t)latency_quantile(
+            dist, x, y, (double)i / (double)lat->n);
+    }
+    lat->values[lat->n] = (uint64_t)latency_quantile(
+        dist, x, y, 1.0 - 1.0 / (4.0 * (double)lat->n));
+}
+
+
+/*
+ * Vose's alias method over the bins of weights.
+ */
+static void
+latency_alias(mnhtesto_latency_t *lat, double *weights)
+{
+    size_t *small, *large;
+    size_t nsmall, nlarge, i;
+    double total;
+
+    if ((lat->alias = malloc(sizeof(uint32_t) * lat->n)) == NULL) {
+        FAIL("malloc");
+    }
+    if ((lat->prob = malloc(sizeof(double) * lat->n)) == NULL) {
+        FAIL("malloc");
+    }
+    if ((small = malloc(sizeof(size_t) * lat->n)) == NULL) {
+        FAIL("malloc");
+    }
+    if ((large = malloc(sizeof(size_t) * lat->n)) == NULL) {
+        FAIL("malloc");
+    }
+
+    for (i = 0, total = 0.0; i < lat->n; ++i) {
+        total += weights[i];
+    }
+    for (i = 0, nsmall = 0, nlarge = 0; i < lat->n; ++i) {
+        lat->prob[i] = weights[i] * (double)lat->n / total;
+        lat->alias[i] = i;
+        if (lat->prob[i] < 1.0) {
+            small[nsmall++] = i;
+        } else {
+            large[nlarge++] = i;
+        }
+    }
+    while (nsmall > 0 && nlarge > 0) {
+        size_t s, l;
+
+        s = small[--nsmall];
+        l = large[--nlarge];
+        lat->alias[s] = l;
+        lat->prob[l] -= 1.0 - lat->prob[s];
+        if (lat->prob[l] < 1.0) {
+            small[nsmall++] = l;
+        } else {
+            large[nlarge++] = l;
+        }
+    }
+    /*
+     * leftovers are 1.0 up to rounding
+     */
+    while (nlarge > 0) {
+        lat->prob[large[--nlarge]] = 1.0;
+    }
+    while (nsmall > 0) {
+        lat->prob[small[--nsmall]] = 1.0;
+    }
+
+    free(small);
+    free(large);
+}
+
+
+static int
+latency_hist(mnhtesto_latency_t *lat, const char *path)
+{
+    int res = 0;
+    FILE *f;
+    char line[256];
+    double *weights = NULL;
+    double total;
+    size_t cap = 0, i;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        TRRET(MNHTESTO_LATENCY_PARSE + 1);
+    }
+
+    lat->ty = MNHTESTO_LATENCY_ALIAS;
+    lat->n = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        const char *p;
+        char *end;
+        double v, w;
+
+        if (*line == '\n' || *line == '#') {
+            continue;
+        }
+        if ((p = latency_delay(line, &v)) == NULL) {
+            res = MNHTESTO_LATENCY_PARSE + 2;
+            goto end;
+        }
+        w = strtod(p, &end);
+        if (end == p || !(w >= 0.0)) {
+            res = MNHTESTO_LATENCY_PARSE + 3;
+            goto end;
+        }
+        if (lat->n == cap) {
+            cap = cap == 0 ? 64 : cap << 1;
+            if ((lat->values = realloc(lat->values,
+                                       sizeof(uint64_t) * cap)) == NULL) {
+                FAIL("realloc");
+            }
+            if ((weights = realloc(weights, sizeof(double) * cap)) == NULL) {
+                FAIL("realloc");
+            }
+        }
+        lat->values[lat->n] = (uint64_t)v;
+        weights[lat->n] = w;
+        ++lat->n;
+    }
+
+    if (lat->n == 0 || lat->n > UINT32_MAX) {
+        res = MNHTESTO_LATENCY_PARSE + 4;
+        goto end;
+    }
+    for (i = 0, total = 0.0; i < lat->n; ++i) {
+        total += weights[i];
+    }
+    if (!(total > 0.0) || !isfinite(total)) {
+        res = MNHTESTO_LATENCY_PARSE + 12;
+        goto end;
+    }
+    latency_alias(lat, weights);
+
+end:
+    free(weights);
+    (void)fclose(f);
+    TRRET(res);
+}
+
+
+int
+mnhtesto_latency_parse(mnhtesto_latency_t *lat, const char *s)
+{
+    int dist;
+    const char *p;
+    char *end;
+    double x, y;
+
+    memset(lat, 0, sizeof(mnhtesto_latency_t));
+
+    if (strncmp(s, "hist:@", 6) == 0) {
+        if (latency_hist(lat, s + 6) != 0) {
+            mnhtesto_latency_fini(lat);
+            TRRET(MNHTESTO_LATENCY_PARSE + 5);
+        }
+        return 0;
+    }
+
+    if (strncmp(s, "fixed:", 6) == 0) {
+        if ((p = latency_delay(s + 6, &x)) == NULL || *p != '\0') {
+            TRRET(MNHTESTO_LATENCY_PARSE + 6);
+        }
+        lat->ty = MNHTESTO_LATENCY_FIXED;
+        lat->a = (uint64_t)x;
+        return 0;
+    }
+
+    if (strncmp(s, "uniform:", 8) == 0) {
+        if ((p = latency_delay(s + 8, &x)) == NULL || *p != ':' ||
+            (p = latency_delay(p + 1, &y)) == NULL || *p != '\0' ||
+            !(y >= x)) {
+            TRRET(MNHTESTO_LATENCY_PARSE + 7);
+        }
+        lat->ty = MNHTESTO_LATENCY_UNIFORM;
+        lat->a = (uint64_t)x;
+        lat->b = (uint64_t)y;
+        return 0;
+    }
+
+    if (strncmp(s, "exp:", 4) == 0) {
+        if ((p = latency_delay(s + 4, &x)) == NULL || *p != '\0') {
+            TRRET(MNHTESTO_LATENCY_PARSE + 8);
+        }
+        latency_table(lat, LATENCY_EXP, x, 0.0);
+        return 0;
+    }
+
+    if (strncmp(s, "lognormal:", 10) == 0) {
+        dist = LATENCY_LOGNORMAL;
+        p = s + 10;
+    } else if (strncmp(s, "pareto:", 7) == 0) {
+        dist = LATENCY_PARETO;
+        p = s + 7;
+    } else {
+        TRRET(MNHTESTO_LATENCY_PARSE + 9);
+    }
+    if ((p = latency_delay(p, &x)) == NULL || *p != ':') {
+        TRRET(MNHTESTO_LATENCY_PARSE + 10);
+    }
+    y = strtod(p + 1, &end);
+    if (end == p + 1 || *end != '\0' || !(y > 0.0)) {
+        TRRET(MNHTESTO_LATENCY_PARSE + 11);
+    }
+    latency_table(lat, dist, x, y);
+    return 0;
+}
+
+
+void
+mnhtesto_latency_fini(mnhtesto_latency_t *lat)
+{
+    free(lat->values);
+    lat->values = NULL;
+    free(lat->alias);
+    lat->alias = NULL;
+    free(lat->prob);
+    lat->prob = NULL;
+    lat->n = 0;
+}
+
+
+/*
+ * A delay in nanoseconds.
+ */
+uint64_t
+mnhtesto_latency_sample(const mnhtesto_latency_t *lat)
+{
+    double u;
+    size_t i;
+
+    switch (lat->ty) {
+    case MNHTESTO_LATENCY_FIXED:
+        return lat->a;
+
+    case MNHTESTO_LATENCY_UNIFORM:
+        return lat->a + (uint64_t)((double)(lat->b - lat->a) *
+                                   latency_uniform());
+
+    case MNHTESTO_LATENCY_TABLE:
+        u = latency_uniform() * (double)lat->n;
+        i = (size_t)u;
+        return lat->values[i] +
+               (uint64_t)((double)(lat->values[i + 1] - lat->values[i]) *
+                          (u - (double)i));
+
+    case MNHTESTO_LATENCY_ALIAS:
+        u = latency_uniform() * (double)lat->n;
+        i = (size_t)u;
+        return lat->values[u - (double)i < lat->prob[i] ?
+                           i : lat->alias[i]];
+
+    default:
+        return 0;
+    }
+}
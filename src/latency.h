@@ -0,0 +1,57 @@
+#ifndef MNHTESTO_LATENCY_H
+#define MNHTESTO_LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * latency distribution syntax:
+ *  latency         ::= "fixed" ":" delay
+ *                    / "uniform" ":" delay ":" delay
+ *                    / "exp" ":" mean-delay
+ *                    / "lognormal" ":" median-delay ":" sigma
+ *                    / "pareto" ":" min-delay ":" alpha
+ *                    / "hist" ":" "@" file
+ *  delay           ::= FLOATNUM ["us" / "ms" / "s"] ;; default ms
+ *  file            ::= lines of delay SP weight
+ *
+ * The continuous distributions are sampled from a precomputed
+ * inverse CDF table, and histograms from an alias table, both in
+ * constant time.  The unbounded tails are cut at the quantile
+ * 1 - 1 / (4 * MNHTESTO_LATENCY_NQ).
+ */
+typedef struct _mnhtesto_latency {
+#define MNHTESTO_LATENCY_FIXED      (1)
+#define MNHTESTO_LATENCY_UNIFORM    (2)
+#define MNHTESTO_LATENCY_TABLE      (3)
+#define MNHTESTO_LATENCY_ALIAS      (4)
+    int ty;
+    /* nanoseconds */
+    uint64_t a;
+    uint64_t b;
+    /*
+     * MNHTESTO_LATENCY_TABLE: n + 1 quantiles,
+     * MNHTESTO_LATENCY_ALIAS: n bins, their alias bins and
+     * probabilities
+     */
+    uint64_t *values;
+    uint32_t *alias;
+    double *prob;
+    size_t n;
+} mnhtesto_latency_t;
+
+#define MNHTESTO_LATENCY_NQ (1 << 12)
+
+int mnhtesto_latency_parse(mnhtesto_latency_t *, const char *);
+void mnhtesto_latency_fini(mnhtesto_latency_t *);
+uint64_t mnhtesto_latency_sample(const mnhtesto_latency_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_LATENCY_H */
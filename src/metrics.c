@@ -0,0 +1,299 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "metrics.h"
+
+#define METRICS_MINCAP (1 << 16)
+/* enough for a formatted number */
+#define METRICS_NUMSZ (32)
+
+/*
+ * Histogram bucket bounds, nanoseconds, and as rendered in seconds.
+ * Counts are by the HDR buckets whose upper value is within a bound,
+ * so they are as precise as the HDR buckets are.
+ */
+static struct {
+    uint64_t ns;
+    const char *le;
+} bounds[] = {
+    {10000ul, "1e-05"},
+    {25000ul, "2.5e-05"},
+    {50000ul, "5e-05"},
+    {100000ul, "0.0001"},
+    {250000ul, "0.00025"},
+    {500000ul, "0.0005"},
+    {1000000ul, "0.001"},
+    {2500000ul, "0.0025"},
+    {5000000ul, "0.005"},
+    {10000000ul, "0.01"},
+    {25000000ul, "0.025"},
+    {50000000ul, "0.05"},
+    {100000000ul, "0.1"},
+    {250000000ul, "0.25"},
+    {500000000ul, "0.5"},
+    {1000000000ul, "1"},
+    {2500000000ul, "2.5"},
+    {5000000000ul, "5"},
+    {10000000000ul, "10"},
+};
+
+
+void
+mnhtesto_metrics_init(mnhtesto_metrics_t *m)
+{
+    m->buf = NULL;
+    m->sz = 0;
+    m->cap = 0;
+    m->nlabels = 0;
+}
+
+
+void
+mnhtesto_metrics_fini(mnhtesto_metrics_t *m)
+{
+    free(m->buf);
+    mnhtesto_metrics_init(m);
+}
+
+
+void
+mnhtesto_metrics_reset(mnhtesto_metrics_t *m)
+{
+    m->sz = 0;
+    m->nlabels = 0;
+}
+
+
+static char *
+metrics_reserve(mnhtesto_metrics_t *m, size_t sz)
+{
+    if (MRKUNLIKELY(m->sz + sz > m->cap)) {
+        size_t cap;
+
+        cap = MAX(m->cap, METRICS_MINCAP);
+        while (cap < m->sz + sz) {
+            cap <<= 1;
+        }
+        if ((m->buf = realloc(m->buf, cap)) == NULL) {
+            FAIL("realloc");
+        }
+        m->cap = cap;
+    }
+    return m->buf + m->sz;
+}
+
+
+static void
+metrics_cat(mnhtesto_metrics_t *m, const char *s, size_t sz)
+{
+    memcpy(metrics_reserve(m, sz), s, sz);
+    m->sz += sz;
+}
+
+
+static void
+metrics_str(mnhtesto_metrics_t *m, const char *s)
+{
+    metrics_cat(m, s, strlen(s));
+}
+
+
+/*
+ * Decimal, printf would dominate the rendering of large tables.
+ */
+static void
+metrics_dec(mnhtesto_metrics_t *m, uint64_t v)
+{
+    char buf[METRICS_NUMSZ];
+    char *p;
+
+    p = buf + sizeof(buf);
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    metrics_cat(m, p, buf + sizeof(buf) - p);
+}
+
+
+/*
+ * "# HELP name help", and "# TYPE name type".
+ */
+void
+mnhtesto_metrics_type(mnhtesto_metrics_t *m,
+                      const char *name,
+                      const char *type,
+                      const char *help)
+{
+    metrics_str(m, "# HELP ");
+    metrics_str(m, name);
+    metrics_cat(m, " ", 1);
+    metrics_str(m, help);
+    metrics_str(m, "\n# TYPE ");
+    metrics_str(m, name);
+    metrics_cat(m, " ", 1);
+    metrics_str(m, type);
+    metrics_cat(m, "\n", 1);
+}
+
+
+void
+mnhtesto_metrics_begin(mnhtesto_metrics_t *m, const char *name)
+{
+    metrics_str(m, name);
+    m->nlabels = 0;
+}
+
+
+static void
+metrics_label_name(mnhtesto_metrics_t *m, const char *name)
+{
+    metrics_cat(m, m->nlabels++ == 0 ? "{" : ",", 1);
+    metrics_str(m, name);
+    metrics_cat(m, "=\"", 2);
+}
+
+
+/*
+ * Label values escape backslash, double quote and line feed.
+ */
+void
+mnhtesto_metrics_label(mnhtesto_metrics_t *m,
+                       const char *name,
+                       const char *value)
+{
+    metrics_label_name(m, name);
+    while (true) {
+        size_t sz;
+
+        sz = strcspn(value, "\\\"\n");
+        metrics_cat(m, value, sz);
+        value += sz;
+        if (*value == '\0') {
+            break;
+        }
+        switch (*value++) {
+        case '\n':
+            metrics_cat(m, "\\n", 2);
+            break;
+        case '"':
+            metrics_cat(m, "\\\"", 2);
+            break;
+        default:
+            metrics_cat(m, "\\\\", 2);
+        }
+    }
+    metrics_cat(m, "\"", 1);
+}
+
+
+void
+mnhtesto_metrics_label_int(mnhtesto_metrics_t *m, const char *name, int v)
+{
+    metrics_label_name(m, name);
+    if (v < 0) {
+        metrics_cat(m, "-", 1);
+        v = -v;
+    }
+    metrics_dec(m, (uint64_t)v);
+    metrics_cat(m, "\"", 1);
+}
+
+
+static void
+metrics_value(mnhtesto_metrics_t *m)
+{
+    if (m->nlabels > 0) {
+        metrics_cat(m, "} ", 2);
+    } else {
+        metrics_cat(m, " ", 1);
+    }
+    m->nlabels = 0;
+}
+
+
+void
+mnhtesto_metrics_u64(mnhtesto_metrics_t *m, uint64_t v)
+{
+    metrics_value(m);
+    metrics_dec(m, v);
+    metrics_cat(m, "\n", 1);
+}
+
+
+void
+mnhtesto_metrics_double(mnhtesto_metrics_t *m, double v)
+{
+    int n;
+
+    metrics_value(m);
+    n = snprintf(metrics_reserve(m, METRICS_NUMSZ), METRICS_NUMSZ, "%.9g", v);
+    assert(n > 0 && n < METRICS_NUMSZ);
+    m->sz += n;
+    metrics_cat(m, "\n", 1);
+}
+
+
+static void
+metrics_labels(mnhtesto_metrics_t *m,
+               const char *const *labels,
+               unsigned nlabels)
+{
+    unsigned i;
+
+    for (i = 0; i < nlabels; ++i) {
+        mnhtesto_metrics_label(m, labels[2 * i], labels[2 * i + 1]);
+    }
+}
+
+
+/*
+ * A histogram of nanoseconds in seconds: name_bucket, name_sum and
+ * name_count, labels are nlabels name and value pairs.
+ */
+void
+mnhtesto_metrics_histogram(mnhtesto_metrics_t *m,
+                           const char *name,
+                           const char *const *labels,
+                           unsigned nlabels,
+                           const mnhtesto_hdr_t *hdr)
+{
+    uint64_t seen;
+    unsigned i, j;
+
+    for (i = 0, j = 0, seen = 0; j < countof(bounds); ++j) {
+        for (; i < MNHTESTO_HDR_NBUCKETS &&
+               mnhtesto_hdr_upper(i) <= bounds[j].ns;
+             ++i) {
+            seen += hdr->buckets[i];
+        }
+        mnhtesto_metrics_begin(m, name);
+        metrics_str(m, "_bucket");
+        metrics_labels(m, labels, nlabels);
+        mnhtesto_metrics_label(m, "le", bounds[j].le);
+        mnhtesto_metrics_u64(m, seen);
+    }
+    mnhtesto_metrics_begin(m, name);
+    metrics_str(m, "_bucket");
+    metrics_labels(m, labels, nlabels);
+    mnhtesto_metrics_label(m, "le", "+Inf");
+    mnhtesto_metrics_u64(m, hdr->count);
+
+    mnhtesto_metrics_begin(m, name);
+    metrics_str(m, "_sum");
+    metrics_labels(m, labels, nlabels);
+    mnhtesto_metrics_double(m, (double)hdr->sum / 1000000000.0);
+
+    mnhtesto_metrics_begin(m, name);
+    metrics_str(m, "_count");
+    metrics_labels(m, labels, nlabels);
+    mnhtesto_metrics_u64(m, hdr->count);
+}
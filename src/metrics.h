@@ -0,0 +1,50 @@
+#ifndef MNHTESTO_METRICS_H
+#define MNHTESTO_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hdr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Prometheus text exposition.  The buffer is kept across scrapes, and
+ * only grows when a scrape outgrows all of the previous ones.
+ *
+ * A sample is mnhtesto_metrics_begin(), then any number of
+ * mnhtesto_metrics_label(), then a value.
+ */
+typedef struct _mnhtesto_metrics {
+    char *buf;
+    size_t sz;
+    size_t cap;
+    /* labels of the sample being rendered */
+    unsigned nlabels;
+} mnhtesto_metrics_t;
+
+void mnhtesto_metrics_init(mnhtesto_metrics_t *);
+void mnhtesto_metrics_fini(mnhtesto_metrics_t *);
+void mnhtesto_metrics_reset(mnhtesto_metrics_t *);
+void mnhtesto_metrics_type(mnhtesto_metrics_t *,
+                           const char *,
+                           const char *,
+                           const char *);
+void mnhtesto_metrics_begin(mnhtesto_metrics_t *, const char *);
+void mnhtesto_metrics_label(mnhtesto_metrics_t *, const char *, const char *);
+void mnhtesto_metrics_label_int(mnhtesto_metrics_t *, const char *, int);
+void mnhtesto_metrics_u64(mnhtesto_metrics_t *, uint64_t);
+void mnhtesto_metrics_double(mnhtesto_metrics_t *, double);
+void mnhtesto_metrics_histogram(mnhtesto_metrics_t *,
+                                const char *,
+                                const char *const *,
+                                unsigned,
+                                const mnhtesto_hdr_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_METRICS_H */
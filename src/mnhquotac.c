@@ -0,0 +1,103 @@
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "qload.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+static struct option optinfo[] = {
+#define MNHQUOTAC_OPT_HELP      0
+    {"help", no_argument, NULL, 'h'},
+#define MNHQUOTAC_OPT_VERSION   1
+    {"version", no_argument, NULL, 'V'},
+#define MNHQUOTAC_OPT_OUTPUT    2
+    {"output", required_argument, NULL, 'o'},
+
+    {NULL, 0, NULL, 0},
+};
+
+
+static void
+usage(char *p)
+{
+    printf("Usage: %s [OPTIONS] FILE ...\n"
+"\n"
+"Compile quota files into a quota image for mnhtesto -Q @IMAGE.\n"
+"\n"
+"Options:\n"
+"  --help|-h        Show this message and exit.\n"
+"  --version|-V     Print version and exit.\n"
+"  --output|-o      Image to write. Required.\n"
+        ,
+        basename(p));
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int res;
+    int ch;
+    int idx;
+    char *output = NULL;
+    mnhtesto_qtable_t table;
+
+    while ((ch = getopt_long(argc,
+                             argv,
+                             "ho:V",
+                             optinfo,
+                             &idx)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'V':
+            printf("%s\n", PACKAGE_STRING);
+            exit(0);
+
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (output == NULL || argc == 0) {
+        usage(argv[-optind]);
+        exit(1);
+    }
+
+    res = 0;
+    mnhtesto_qtable_init(&table, 0);
+    for (idx = 0; idx < argc; ++idx) {
+        if ((res = mnhtesto_qload_file(&table, argv[idx], 0, NULL)) != 0) {
+            TRACE("failed to load %s", argv[idx]);
+            goto end;
+        }
+    }
+    if ((res = mnhtesto_qimage_write(&table, output)) != 0) {
+        TRACE("failed to write %s", output);
+        goto end;
+    }
+    TRACE("%zu quotas, %zu specs", table.nelems, table.nspecs);
+
+end:
+    mnhtesto_qtable_fini(&table);
+    return res != 0;
+}
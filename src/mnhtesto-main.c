@@ -1,13 +1,18 @@
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
+#include <sched.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -39,10 +44,36 @@ static int max_conn;
 #define MNHTESTO_DEFAULT_MAX_REQ 1
 static int max_req;
 static int suppress_quotas = 0;
-
-extern unsigned long nreq[600];
-extern unsigned long nbytes[600];
-extern mnhash_t quotas;
+/* heavy hitters reported */
+#define MNHTESTO_TOPK_REPORT 10
+/*
+ * the heavy hitters as last reported, by name, as key ids do not
+ * survive reloads, nor do evicted dynamic quotas
+ */
+typedef struct _topk_report {
+    struct {
+        mnbytes_t *qname;
+        uint64_t count;
+    } last[MNHTESTO_TOPK_REPORT];
+    size_t nlast;
+} topk_report_t;
+static topk_report_t consumed_report;
+static topk_report_t rejected_report;
+static char *corpus = NULL;
+#define MNHTESTO_DEFAULT_SEED 0
+static uint64_t seed = MNHTESTO_DEFAULT_SEED;
+/* forked, if any, and pinned, and which one is this */
+static unsigned nworkers = 0;
+static int affinity = 0;
+static unsigned worker = 0;
+
+extern mnhtesto_stats_t totals;
+extern char *state_file;
+extern size_t dquota_cap;
+extern size_t shape_depth;
+extern uint64_t shape_wait;
+extern uint64_t shed_latency;
+extern size_t shed_max;
 
 
 static struct option optinfo[] = {
@@ -64,6 +95,30 @@ static struct option optinfo[] = {
     {"quota", required_argument, NULL, 'Q'},
 #define MNHTESTO_SUPPRESS_QUOTAS    8
     {"suppress-quotas", no_argument, &suppress_quotas, 1},
+#define MNHTESTO_STATE_FILE         9
+    {"state-file", required_argument, NULL, 'S'},
+#define MNHTESTO_CORPUS            10
+    {"corpus", required_argument, NULL, 'B'},
+#define MNHTESTO_SEED              11
+    {"seed", required_argument, NULL, 'E'},
+#define MNHTESTO_LATENCY           12
+    {"latency", required_argument, NULL, 'L'},
+#define MNHTESTO_ROUTES            13
+    {"routes", required_argument, NULL, 'U'},
+#define MNHTESTO_WORKERS           14
+    {"workers", required_argument, NULL, 'W'},
+#define MNHTESTO_AFFINITY          15
+    {"affinity", no_argument, &affinity, 1},
+#define MNHTESTO_DYNAMIC_QUOTAS    16
+    {"dynamic-quotas", required_argument, NULL, 'D'},
+#define MNHTESTO_SELECTOR          17
+    {"selector", required_argument, NULL, 'K'},
+#define MNHTESTO_SHAPE_DEPTH       18
+    {"shape-depth", required_argument, NULL, 'J'},
+#define MNHTESTO_SHAPE_WAIT        19
+    {"shape-wait", required_argument, NULL, 'T'},
+#define MNHTESTO_SHED_LATENCY      20
+    {"shed-latency", required_argument, NULL, 'A'},
 
     {NULL, 0, NULL, 0},
 };
@@ -77,6 +132,12 @@ int sigshutdown_sent = 0;
 
 static mnfcgi_app_t *fcgi_app = NULL;
 
+/*
+ * the parent of the workers
+ */
+static pid_t *workers = NULL;
+static volatile sig_atomic_t supervisor_sig = 0;
+
 
 static int
 initall(void)
@@ -97,15 +158,34 @@ initall(void)
     if (max_req <= 0) {
         max_req = MNHTESTO_DEFAULT_MAX_REQ;
     }
+    if (mnhtesto_bodygen_init(MNHTESTO_BODY_CHUNK, seed, corpus) != 0) {
+        TRACE("Failed to load the corpus %s.", corpus);
+        res = 1;
+    }
 
     return res;
 }
 
 
+static void
+topk_report_fini(topk_report_t *report)
+{
+    size_t i;
+
+    for (i = 0; i < report->nlast; ++i) {
+        BYTES_DECREF(&report->last[i].qname);
+    }
+    report->nlast = 0;
+}
+
+
 static void
 finiall(void)
 {
+    topk_report_fini(&consumed_report);
+    topk_report_fini(&rejected_report);
     mnhtesto_fini();
+    mnhtesto_bodygen_fini();
     assert(host != NULL);
     free(host);
     host = NULL;
@@ -113,6 +193,14 @@ finiall(void)
         free(port);
         port = NULL;
     }
+    if (state_file != NULL) {
+        free(state_file);
+        state_file = NULL;
+    }
+    if (corpus != NULL) {
+        free(corpus);
+        corpus = NULL;
+    }
 }
 
 
@@ -130,13 +218,75 @@ usage(char *p)
 "  --max-conn|-C    Max concurrent connections. Default %d.\n"
 "  --max-req|-R     Max concurrent requests. Default %d.\n"
 "  --quota|-Q       Apply this quota. Multiple. Quota selector is\n"
-"                   %s: HTTP header.\n"
+"                   %s: HTTP header. @FILE loads a quota\n"
+"                   file, or an image made by mnhquotac.\n"
+"                   Quotas are reloaded on SIGHUP. A quota\n"
+"                   named PREFIX* is a template for the keys\n"
+"                   starting with PREFIX that have no quota of\n"
+"                   their own, * for any key. A quota\n"
+"                   NAME^PARENT:LIMIT,LIMIT counts a request\n"
+"                   against every limit of NAME and of its\n"
+"                   parents, or against none. A LIMIT of the\n"
+"                   s flag queues the requests over it rather\n"
+"                   than reject them.\n"
+"  --shape-depth|-J Max requests queued per quota key, the\n"
+"                   rest are rejected. Default %d.\n"
+"  --shape-wait|-T  Max milliseconds a request is queued,\n"
+"                   then it is rejected. Default %d.\n"
+"  --shed-latency|-A  Shed requests with 503 and Retry-After\n"
+"                   once their latency, less deliberate delays\n"
+"                   and with the event loop lag, goes over this\n"
+"                   many milliseconds, by an adaptive limit of\n"
+"                   the requests served at once per process.\n"
+"                   Priority class from the %s\n"
+"                   HTTP header, 0 (the last shed) to %d,\n"
+"                   default %d. Default 0, do not shed.\n"
+"  --selector|-K    Select the quota key from the request by\n"
+"                   PART+PART..., tried before the HTTP header.\n"
+"                   Multiple, the first one whose key has a\n"
+"                   quota applies. PART is one of addr, path,\n"
+"                   path:NSEG (the first NSEG path segments),\n"
+"                   query:TERM, header:FIELD. The key is the\n"
+"                   values of the parts joined by %s.\n"
+"  --dynamic-quotas|-D  Max quotas instantiated from templates,\n"
+"                   idle ones are evicted beyond that. Default\n"
+"                   %d.\n"
+"  --state-file|-S   Keep quota states in this file across\n"
+"                   restarts.\n"
+"  --corpus|-B       Serve this file for gen=file.\n"
+"  --seed|-E         Seed of gen=rnd and gen=pat. Default %d.\n"
+"  --latency|-L      Define a latency distribution NAME=SPEC for\n"
+"                   lat=NAME. Multiple. A NAME starting with /\n"
+"                   applies to that endpoint by default. SPEC is\n"
+"                   one of fixed:D, uniform:D:D, exp:MEAN,\n"
+"                   lognormal:MEDIAN:SIGMA, pareto:MIN:ALPHA,\n"
+"                   hist:@FILE of \"D WEIGHT\" lines. D is in\n"
+"                   us, ms (default), or s.\n"
+"  --routes|-U       Load routes from this file. Multiple. A\n"
+"                   route is a path, or a path prefix ending in\n"
+"                   *, and its lat=SPEC, status=CODE:WEIGHT,...,\n"
+"                   quota=NAME, and query term defaults.\n"
+"  --workers|-W      Fork this many worker processes listening on\n"
+"                   the same port, and respawn them as they\n"
+"                   exit. They share quota states, and worker 0\n"
+"                   reports the stats of all. SIGHUP restarts\n"
+"                   them all. Default 0, do not fork.\n"
+"  --affinity        Pin worker N to CPU N modulo the number of\n"
+"                   CPUs.\n"
         ,
         basename(p),
         MNHTESTO_DEFAULT_HOST,
         MNHTESTO_DEFAULT_MAX_CONN,
         MNHTESTO_DEFAULT_MAX_REQ,
-        BDATA(&_x_mnhtesto_quota));
+        BDATA(&_x_mnhtesto_quota),
+        MNHTESTO_SHAPER_DEFAULT_DEPTH,
+        MNHTESTO_SHAPER_DEFAULT_WAIT_MSEC,
+        BDATA(&_x_mnhtesto_priority),
+        MNHTESTO_SHED_NCLASSES - 1,
+        MNHTESTO_SHED_DEFAULT_CLASS,
+        MNHTESTO_SELECTOR_SEP,
+        MNHTESTO_DQUOTA_DEFAULT_CAP,
+        MNHTESTO_DEFAULT_SEED);
 }
 
 
@@ -180,15 +330,40 @@ myterm(UNUSED int sig)
 
 
 static int
-print_quotas(mnbytes_t *qname, mnhtesto_quota_t *quota, UNUSED void *udata)
+sigreload(UNUSED int argc, UNUSED void **argv)
+{
+    (void)mnhtesto_reload_quotas();
+    return 0;
+}
+
+
+static void
+myhup(UNUSED int sig)
+{
+    (void)MRKTHR_SPAWN_SIG("sigreload", sigreload);
+}
+
+
+static int
+print_quotas(mnbytes_t *qname,
+             mnhtesto_quota_spec_t *spec,
+             mnhtesto_quota_t *quota,
+             UNUSED void *udata)
 {
     mnbytes_t *what;
     //mnbytes_t *prorated;
     mnbytes_t *per;
 
-    what = mnhtest_unit_str(&quota->spec.denom_unit, quota->value, MNHTEST_UNIT_STR_VBASE);
-    //prorated = mnhtest_unit_str(&quota->spec.denom_unit, quota->prorated, MNHTEST_UNIT_STR_VBASE);
-    per = mnhtest_unit_str(&quota->spec.divisor_unit, quota->spec.divisor, 0);
+    if (spec->flags & MNHTESTO_QF_INFLIGHT) {
+        TRACEC("%s: %.0lf in flight\n", BDATA(qname), spec->denom);
+        return 0;
+    }
+
+    what = mnhtest_unit_str(&spec->denom_unit,
+                            MNHTESTO_QUOTA_VALUE(spec, quota->value),
+                            MNHTEST_UNIT_STR_VBASE);
+    //prorated = mnhtest_unit_str(&spec->denom_unit, MNHTESTO_QUOTA_VALUE(spec, quota->prorated), MNHTEST_UNIT_STR_VBASE);
+    per = mnhtest_unit_str(&spec->divisor_unit, spec->divisor, 0);
     TRACEC("%s: %s per %s\n",
            BDATA(qname),
            BDATA(what),
@@ -200,30 +375,160 @@ print_quotas(mnbytes_t *qname, mnhtesto_quota_t *quota, UNUSED void *udata)
 }
 
 
+/*
+ * The heavy hitters since the last report, and their quotas, then
+ * start over.  Those new to the report, or moved, are told so, and
+ * those gone from it are listed after.  The cost is by the number
+ * reported, not by the number of quotas.
+ */
+static void
+print_topk(const char *what, mnhtesto_topk_t *topk, topk_report_t *report)
+{
+    mnhtesto_topk_counter_t top[MNHTESTO_TOPK_REPORT];
+    mnbytes_t *names[MNHTESTO_TOPK_REPORT];
+    bool kept[MNHTESTO_TOPK_REPORT];
+    size_t i, j, n;
+
+    if (topk->total == 0 && report->nlast == 0) {
+        return;
+    }
+    n = mnhtesto_topk_top(topk, top, countof(top));
+    TRACEC("%s %" PRIu64 " in total\n", what, topk->total);
+    memset(kept, 0, sizeof(kept));
+    for (i = 0; i < n; ++i) {
+        mnbytes_t *qname;
+        mnhtesto_quota_spec_t *spec;
+        mnhtesto_quota_t quota;
+
+        qname = mnhtesto_topk_quota(top[i].key, &spec, &quota);
+        names[i] = qname;
+        for (j = 0; j < report->nlast; ++j) {
+            if (bytes_cmp(report->last[j].qname, qname) == 0) {
+                break;
+            }
+        }
+        if (j == report->nlast) {
+            TRACEC(" new");
+        } else {
+            kept[j] = true;
+            if (j != i) {
+                TRACEC(" was #%zu", j + 1);
+            }
+        }
+        if (top[i].error > 0) {
+            TRACEC(" %" PRIu64 " (+-%" PRIu64 ") ",
+                   top[i].count,
+                   top[i].error);
+        } else {
+            TRACEC(" %" PRIu64 " ", top[i].count);
+        }
+        if (spec != NULL) {
+            (void)print_quotas(qname, spec, &quota, NULL);
+        } else {
+            TRACEC("%s: evicted\n", BDATA(qname));
+        }
+    }
+    for (j = 0; j < report->nlast; ++j) {
+        if (!kept[j]) {
+            TRACEC(" gone, was #%zu %" PRIu64 " %s\n",
+                   j + 1,
+                   report->last[j].count,
+                   BDATA(report->last[j].qname));
+        }
+    }
+
+    topk_report_fini(report);
+    for (i = 0; i < n; ++i) {
+        report->last[i].qname = names[i];
+        report->last[i].count = top[i].count;
+    }
+    report->nlast = n;
+    mnhtesto_topk_init(topk);
+}
+
+
+/*
+ * Latency percentiles, in microseconds, of the endpoints that have
+ * seen requests since the last report.  The histograms are cumulative.
+ */
+static void
+print_rstats(void)
+{
+    static const double ps[] = {50.0, 90.0, 99.0, 99.9};
+    size_t i;
+
+    for (i = 0; i < totals.rstats.nentries; ++i) {
+        mnhtesto_rstat_t *rstat;
+        uint64_t svc[countof(ps)], ovr[countof(ps)];
+
+        rstat = totals.rstats.entries[i];
+        if (rstat->service.count == rstat->nreported) {
+            continue;
+        }
+        rstat->nreported = rstat->service.count;
+        mnhtesto_hdr_percentiles(&rstat->service, ps, svc, countof(ps));
+        mnhtesto_hdr_percentiles(&rstat->overshoot, ps, ovr, countof(ps));
+        TRACEC("%s %d: n %" PRIu64
+               " svc %.1lf %.1lf %.1lf %.1lf max %.1lf"
+               " ovr %.1lf %.1lf %.1lf %.1lf max %.1lf us\n",
+               rstat->endpoint,
+               rstat->status,
+               rstat->service.count,
+               (double)svc[0] / 1000.0,
+               (double)svc[1] / 1000.0,
+               (double)svc[2] / 1000.0,
+               (double)svc[3] / 1000.0,
+               (double)rstat->service.max / 1000.0,
+               (double)ovr[0] / 1000.0,
+               (double)ovr[1] / 1000.0,
+               (double)ovr[2] / 1000.0,
+               (double)ovr[3] / 1000.0,
+               (double)rstat->overshoot.max / 1000.0);
+    }
+}
+
+
+/*
+ * The stats of all of the workers, as collected.
+ */
 static void
 print_stats(void)
 {
-    mnfcgi_stats_t *stats;
+    static unsigned long lastreq[countof(totals.nreq)];
+    static unsigned long lastbytes[countof(totals.nbytes)];
     unsigned i;
 
     if (fcgi_app == NULL) {
         return;
     }
 
-    stats = mnfcgi_app_get_stats(fcgi_app);
-
-    TRACEC("nthreads %d", stats->nthreads);
+    TRACEC("nthreads %d", totals.nthreads);
 
-    for (i = 0; i < countof(nreq); ++i) {
-        if (nreq[i] > 0) {
-            TRACEC(" % 3d: % 6ld % 9ld", i, nreq[i], nbytes[i]);
-            nreq[i] = 0;
-            nbytes[i] = 0;
+    /*
+     * the counters are cumulative, for /metrics
+     */
+    for (i = 0; i < countof(totals.nreq); ++i) {
+        if (totals.nreq[i] > lastreq[i]) {
+            TRACEC(" % 3d: % 6ld % 9ld",
+                   i,
+                   totals.nreq[i] - lastreq[i],
+                   totals.nbytes[i] - lastbytes[i]);
+            lastreq[i] = totals.nreq[i];
+            lastbytes[i] = totals.nbytes[i];
         }
     }
     TRACEC("\n");
+    if (shed_latency > 0) {
+        TRACEC("shed limit %.1lf", totals.shed_limit);
+        for (i = 0; i < countof(totals.nshed); ++i) {
+            TRACEC(" % 3d: % 6ld", i, totals.nshed[i]);
+        }
+        TRACEC("\n");
+    }
+    print_rstats();
     if (!suppress_quotas) {
-        hash_traverse(&quotas, (hash_traverser_t)print_quotas, NULL);
+        print_topk("consumed", &totals.consumers, &consumed_report);
+        print_topk("rejected", &totals.offenders, &rejected_report);
         TRACEC("\n");
     }
 }
@@ -233,7 +538,21 @@ static int
 stats0(UNUSED int argc, UNUSED void **argv)
 {
     while (mrkthr_sleep(1000) == 0) {
-        print_stats();
+        mnhtesto_publish_stats();
+        if (worker == 0) {
+            mnhtesto_collect_stats();
+            print_stats();
+        }
+    }
+    return 0;
+}
+
+
+static int
+overuse0(UNUSED int argc, UNUSED void **argv)
+{
+    while (mrkthr_sleep(1000) == 0) {
+        mnhtesto_overuse_flush();
     }
     return 0;
 }
@@ -243,13 +562,15 @@ static int
 run0(UNUSED int argc, UNUSED void **argv)
 {
     MRKTHR_SPAWN("stats0", stats0);
+    MRKTHR_SPAWN("overuse0", overuse0);
+    MRKTHR_SPAWN("pacer0", mnhtesto_pacer_run);
 
     while (true) {
         int res;
 
         mnfcgi_app_callback_table_t t = {
             .init_app = mnhtesto_app_init,
-            .params_complete = mnfcgi_app_params_complete_select_exact,
+            .params_complete = mnhtesto_params_complete,
             .stdin_end = mnhtesto_stdin_end,
         };
         fcgi_app = mnfcgi_app_new(host, port, max_conn, max_req, &t);
@@ -267,12 +588,165 @@ run0(UNUSED int argc, UNUSED void **argv)
 }
 
 
+static void
+mysupervise(int sig)
+{
+    if (sig != SIGCHLD) {
+        supervisor_sig = sig;
+    }
+}
+
+
+static void
+pin_worker(unsigned idx)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t set;
+    long ncpu;
+
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+        ncpu = 1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(idx % ncpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        CTRACE("failed to pin worker %u: %s", idx, strerror(errno));
+    }
+#else
+    CTRACE("cannot pin worker %u on this platform", idx);
+#endif
+}
+
+
+/*
+ * Fork the worker idx, it gets the signal handling of a single
+ * process back.  Returns zero in the worker.
+ */
+static pid_t
+spawn_worker(unsigned idx, const sigset_t *omask)
+{
+    pid_t pid;
+
+    if ((pid = fork()) == -1) {
+        CTRACE("failed to fork worker %u: %s", idx, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        worker = idx;
+        (void)signal(SIGINT, myterm);
+        (void)signal(SIGTERM, myterm);
+        (void)signal(SIGHUP, SIG_IGN);
+        (void)signal(SIGCHLD, SIG_DFL);
+        (void)sigprocmask(SIG_SETMASK, omask, NULL);
+        if (affinity) {
+            pin_worker(idx);
+        }
+        mnhtesto_worker_start(idx);
+    }
+    return pid;
+}
+
+
+/*
+ * Fork the workers, and respawn them as they exit, until terminated.
+ * Returns in a worker only.  SIGHUP terminates the workers, and
+ * starts over from exec, reloading the quotas.  Quota states survive
+ * that with --state-file only.
+ */
+static void
+supervise(char **argv)
+{
+    struct sigaction sa;
+    sigset_t mask, omask;
+    unsigned i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mysupervise;
+    (void)sigemptyset(&sa.sa_mask);
+    (void)sigemptyset(&mask);
+    (void)sigaddset(&mask, SIGINT);
+    (void)sigaddset(&mask, SIGTERM);
+    (void)sigaddset(&mask, SIGHUP);
+    (void)sigaddset(&mask, SIGCHLD);
+    (void)sigprocmask(SIG_BLOCK, &mask, &omask);
+    (void)sigaction(SIGINT, &sa, NULL);
+    (void)sigaction(SIGTERM, &sa, NULL);
+    (void)sigaction(SIGHUP, &sa, NULL);
+    (void)sigaction(SIGCHLD, &sa, NULL);
+
+    if ((workers = calloc(nworkers, sizeof(pid_t))) == NULL) {
+        FAIL("calloc");
+    }
+
+    for (i = 0; i < nworkers && supervisor_sig == 0; ++i) {
+        if ((workers[i] = spawn_worker(i, &omask)) == 0) {
+            return;
+        } else if (workers[i] == -1) {
+            supervisor_sig = SIGTERM;
+        }
+    }
+
+    while (supervisor_sig == 0) {
+        pid_t pid;
+        int status;
+
+        (void)sigsuspend(&omask);
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < nworkers; ++i) {
+                if (workers[i] == pid) {
+                    CTRACE("worker %u exited with %d", i, status);
+                    mnhtesto_worker_gone(pid);
+                    workers[i] = -1;
+                }
+            }
+        }
+
+        for (i = 0; i < nworkers && supervisor_sig == 0; ++i) {
+            if (workers[i] != -1) {
+                continue;
+            }
+            /*
+             * do not spin on a worker failing at startup
+             */
+            (void)sleep(1);
+            if ((workers[i] = spawn_worker(i, &omask)) == 0) {
+                return;
+            } else if (workers[i] == -1) {
+                supervisor_sig = SIGTERM;
+            }
+        }
+    }
+
+    for (i = 0; i < nworkers; ++i) {
+        if (workers[i] > 0) {
+            (void)kill(workers[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) != -1) {
+    }
+    free(workers);
+    workers = NULL;
+
+    if (supervisor_sig == SIGHUP) {
+        CTRACE("restarting the workers");
+        (void)sigprocmask(SIG_SETMASK, &omask, NULL);
+        (void)execvp(argv[0], argv);
+        CTRACE("failed to exec %s: %s", argv[0], strerror(errno));
+        exit(1);
+    }
+    finiall();
+    exit(0);
+}
+
+
 int
 main(int argc, char **argv)
 {
     int res;
     int ch;
     int idx;
+    char **args;
 
     res = 0;
 
@@ -302,6 +776,9 @@ main(int argc, char **argv)
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
         return 1;
     }
+    if (signal(SIGHUP, myhup) == SIG_ERR) {
+        return 1;
+    }
 #ifdef SIGINFO
     if (signal(SIGINFO, myinfo) == SIG_ERR) {
         return 1;
@@ -310,16 +787,37 @@ main(int argc, char **argv)
 
     mnhtesto_init();
 
+    /*
+     * for the restarts of the workers
+     */
+    args = argv;
+
     while ((ch = getopt_long(argc,
                              argv,
-                             "C:hH:P:Q:R:V",
+                             "A:B:C:D:E:hH:J:K:L:P:Q:R:S:T:U:VW:",
                              optinfo,
                              &idx)) != -1) {
         switch (ch) {
+        case 'A':
+            shed_latency = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'B':
+            corpus = strdup(optarg);
+            break;
+
         case 'C':
             max_conn = strtol(optarg, NULL, 10);
             break;
 
+        case 'D':
+            dquota_cap = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'E':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+
         case 'h':
             usage(argv[0]);
             exit(0);
@@ -328,46 +826,32 @@ main(int argc, char **argv)
             host = strdup(optarg);
             break;
 
+        case 'J':
+            shape_depth = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'K':
+            if (mnhtesto_add_selector(optarg) != 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'L':
+            if (mnhtesto_add_latency(optarg) != 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
         case 'P':
             port = strdup(optarg);
             break;
 
         case 'Q':
-            if (*optarg == '@') {
-                int fd;
-                struct stat sb;
-                char *buf;
-                char *s0, *s1;
-
-                if ((fd = open(optarg + 1, O_RDONLY)) == -1) {
-                    FAIL("open");
-                }
-                if (fstat(fd, &sb) == -1) {
-                    FAIL("fstat");
-                }
-                if ((buf = malloc(sb.st_size + 1)) == NULL) {
-                    FAIL("malloc");
-                }
-                if (read(fd, buf, sb.st_size) != sb.st_size) {
-                    FAIL("read");
-                }
-                buf[sb.st_size] = '\0';
-                (void)close(fd);
-                for (s0 = buf, s1 = strchr(s0, '\n');
-                     s1 != NULL;
-                     s0 = s1 + 1, s1 = strchr(s0, '\n')) {
-
-                    if (parse_quota(s0) != 0) {
-                        usage(argv[0]);
-                        exit(1);
-                    }
-                }
-                free(buf);
-            } else {
-                if (parse_quota(optarg) != 0) {
-                    usage(argv[0]);
-                    exit(1);
-                }
+            if (mnhtesto_add_quotas(optarg) != 0) {
+                usage(argv[0]);
+                exit(1);
             }
             break;
 
@@ -375,10 +859,29 @@ main(int argc, char **argv)
             max_req = strtol(optarg, NULL, 10);
             break;
 
+        case 'S':
+            state_file = strdup(optarg);
+            break;
+
+        case 'T':
+            shape_wait = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'U':
+            if (mnhtesto_add_routes(optarg) != 0) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
         case 'V':
             printf("%s\n", PACKAGE_STRING);
             exit(0);
 
+        case 'W':
+            nworkers = strtoul(optarg, NULL, 10);
+            break;
+
         case 0:
         case 1:
             /*
@@ -397,6 +900,11 @@ main(int argc, char **argv)
     if ((res = initall()) != 0) {
         goto end;
     }
+    shed_max = (size_t)max_conn * (size_t)max_req;
+    if ((res = mnhtesto_workers_init(nworkers)) != 0) {
+        TRACE("Failed to prepare the quotas.");
+        goto end;
+    }
 
     if (develop) {
         CTRACE("will run in develop mode");
@@ -407,6 +915,10 @@ main(int argc, char **argv)
         //daemon_ize();
     }
 
+    if (nworkers > 0) {
+        supervise(args);
+    }
+
     (void)mrkthr_init();
     (void)MRKTHR_SPAWN("run0", run0, argc, argv);
     (void)mrkthr_loop();
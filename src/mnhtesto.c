@@ -1,10 +1,15 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
+#include <mrkcommon/array.h>
 #include <mrkcommon/bytes.h>
+#include <mrkcommon/hash.h>
 #include <mrkcommon/dumpm.h>
 #include <mrkcommon/util.h>
 
@@ -17,6 +22,8 @@
 #include "mnhtesto.h"
 
 static mnbytes_t _not_implemented = BYTES_INITIALIZER("Not Implemented");
+static mnbytes_t _script_name = BYTES_INITIALIZER("SCRIPT_NAME");
+static mnbytes_t _bad_request = BYTES_INITIALIZER("Bad Request");
 static mnbytes_t _server = BYTES_INITIALIZER("Server");
 static mnbytes_t _date = BYTES_INITIALIZER("Date");
 static mnbytes_t _cache_control = BYTES_INITIALIZER("Cache-Control");
@@ -25,7 +32,11 @@ static mnbytes_t _pragma = BYTES_INITIALIZER("Pragma");
 static mnbytes_t _no_cache = BYTES_INITIALIZER("no-cache");
 static mnbytes_t _content_length = BYTES_INITIALIZER("Content-Length");
 static mnbytes_t _retry_after = BYTES_INITIALIZER("Retry-After");
+static mnbytes_t _content_type = BYTES_INITIALIZER("Content-Type");
+static mnbytes_t _text_plain =
+    BYTES_INITIALIZER("text/plain; version=0.0.4");
 static mnbytes_t __root = BYTES_INITIALIZER("/");
+static mnbytes_t __metrics = BYTES_INITIALIZER("/metrics");
 static mnbytes_t __qwe0 = BYTES_INITIALIZER("/qwe(0)=привіт");
 static mnbytes_t __qwe1 = BYTES_INITIALIZER("/qwe 1");
 static mnbytes_t __qwe2 = BYTES_INITIALIZER("/qwe02");
@@ -40,9 +51,22 @@ static mnbytes_t __qwea = BYTES_INITIALIZER("/qwe0a");
 static mnbytes_t __qweb = BYTES_INITIALIZER("/qwe0b");
 static mnbytes_t _ok = BYTES_INITIALIZER("OK");
 static mnbytes_t _too_much = BYTES_INITIALIZER("Too Much");
+static mnbytes_t _forbidden = BYTES_INITIALIZER("Forbidden");
+static mnbytes_t _not_found = BYTES_INITIALIZER("Not Found");
+static mnbytes_t _internal_server_error =
+    BYTES_INITIALIZER("Internal Server Error");
+static mnbytes_t _bad_gateway = BYTES_INITIALIZER("Bad Gateway");
+static mnbytes_t _service_unavailable =
+    BYTES_INITIALIZER("Service Unavailable");
+static mnbytes_t _gateway_timeout = BYTES_INITIALIZER("Gateway Timeout");
+static mnbytes_t _error = BYTES_INITIALIZER("Error");
+static mnbytes_t _unknown = BYTES_INITIALIZER("-");
 
 mnbytes_t _x_mnhtesto_quota = BYTES_INITIALIZER("x-mnhtesto-quota");
 mnbytes_t _http_x_mnhtesto_quota = BYTES_INITIALIZER("HTTP_X_MNHTESTO_QUOTA");
+mnbytes_t _x_mnhtesto_priority = BYTES_INITIALIZER("x-mnhtesto-priority");
+static mnbytes_t _http_x_mnhtesto_priority =
+    BYTES_INITIALIZER("HTTP_X_MNHTESTO_PRIORITY");
 
 
 #define BSIZE_MIN  10
@@ -51,25 +75,204 @@ mnbytes_t _http_x_mnhtesto_quota = BYTES_INITIALIZER("HTTP_X_MNHTESTO_QUOTA");
 #define DELAY_MIN   1
 #define DELAY_MAX  14
 #define DELAY_DEFAULT DELAY_MIN
+/*
+ * clen=, bodies are rendered by MNHTESTO_BODY_CHUNK, and flushed by
+ * mnfcgi as the connection takes them, the memory per request does
+ * not depend on clen
+ */
+#define CLEN_MAX (1ul << 40)
+#define JITTER_MAX 100
+
+/* --selector */
+#define MNHTESTO_MAX_SELECTORS (8)
+/*
+ * nanoseconds, between the tries of a shaped request over a limit that
+ * tells no retry-after
+ */
+#define MNHTESTO_SHAPE_MIN_WAIT (1000000ul)
 
-#define MNHTESTO_DEFAULT_POENA_FACTOR   (0.0l)
+/* quotas loaded between yields on reload */
+#define MNHTESTO_RELOAD_CHUNK (1 << 12)
 
 
-static char d[1<<(BSIZE_MAX + 1)];
+/*
+ * Per request accounting for the latency histograms.
+ */
+typedef struct _mnhtesto_reqstat {
+    mnbytes_t *endpoint;
+    uint64_t start;
+    /* nanoseconds spent in, and overshot by, the timed waits */
+    uint64_t waited;
+    uint64_t overshoot;
+    bool timed;
+} mnhtesto_reqstat_t;
+
+
+/*
+ * A request of mnhtesto_root_get() till it is finished, see
+ * mnhtesto_stdin_end().
+ */
+typedef struct _mnhtesto_reqctx {
+    mnhtesto_reqstat_t rs;
+    /* the slots of the in-flight limits */
+    mnhtesto_iheld_t held;
+    /* let in by the shedder */
+    bool admitted;
+} mnhtesto_reqctx_t;
+
+
+typedef struct _mnhtesto_body_params {
+    int bsize;
+    uint64_t clen;
+    int delay;
+    /* nanoseconds */
+    uint64_t tts;
+    uint64_t offset;
+    /*
+     * records cycle through the generator buffer from goffset
+     */
+    const mnhtesto_bodygen_t *gen;
+    size_t goffset;
+    /*
+     * record payload, and the pace in bytes/sec, zero for none
+     */
+    size_t chunk;
+    double rate;
+    int jitter;
+} mnhtesto_body_params_t;
 
-unsigned long nreq[600];
-unsigned long nbytes[600];
+/*
+ * of this worker, cumulative
+ */
+static unsigned long nreq[MNHTESTO_NCODES];
+static unsigned long nbytes[MNHTESTO_NCODES];
 
-mnhash_t quotas;
+mnhtesto_qtable_t quotas;
+/*
+ * instantiated from the templates in quotas, at most dquota_cap
+ */
+static mnhtesto_dtable_t dquotas;
+size_t dquota_cap = MNHTESTO_DQUOTA_DEFAULT_CAP;
+/*
+ * mnbytes_t *, -Q arguments
+ */
+static mnarray_t quota_sources;
+static bool reloading = false;
+/*
+ * --state-file
+ */
+char *state_file = NULL;
+/*
+ * mnbytes_t * -> mnhtesto_latency_t *, -L arguments
+ */
+static mnhash_t latencies;
+/*
+ * --routes
+ */
+static mnhtesto_routes_t routes;
+/*
+ * --selector, in the order given
+ */
+static mnhtesto_selector_t selectors[MNHTESTO_MAX_SELECTORS];
+static size_t nselectors = 0;
+/*
+ * the requests parked by the quotas of the "s" flag, --shape-depth,
+ * --shape-wait
+ */
+static mnhtesto_shaper_t shaper;
+size_t shape_depth = MNHTESTO_SHAPER_DEFAULT_DEPTH;
+uint64_t shape_wait = MNHTESTO_SHAPER_DEFAULT_WAIT_MSEC;
+/*
+ * the requests in flight by the "inflight" limits, and the heads of the
+ * shaper queues parked on a full counter, by the hash of the counter
+ */
+static mnhtesto_inflight_t inflight;
+static mnhtesto_shaper_t iparked;
+/*
+ * the adaptive limit of the requests of this worker, --shed-latency
+ * in milliseconds, and at most --max-conn times --max-req
+ */
+static mnhtesto_shedder_t shedder;
+uint64_t shed_latency = 0;
+size_t shed_max = 0;
+/*
+ * per endpoint and status
+ */
+static mnhtesto_rstats_t rstats;
+/*
+ * quota keys by the amount accepted, and by the requests rejected,
+ * since the last publication
+ */
+static mnhtesto_topk_t consumers;
+static mnhtesto_topk_t offenders;
+
+/*
+ * --workers, the published stats of each, and their aggregate.  There
+ * is a single worker unless forked.
+ */
+static mnhtesto_wstats_t *wstats = NULL;
+static mnhtesto_wstats_t *wscratch = NULL;
+static unsigned nworkers = 0;
+static unsigned worker = 0;
+mnhtesto_stats_t totals;
+
+/*
+ * /metrics, rendered into the buffer kept across scrapes, one scrape
+ * at a time
+ */
+static mnfcgi_app_t *fcgi_app = NULL;
+static mnhtesto_metrics_t metrics;
+static bool scraping = false;
+
+
+/*
+ * Request handling time less the timed waits, nanoseconds.
+ */
+static uint64_t
+reqstat_service(const mnhtesto_reqstat_t *rs)
+{
+    uint64_t elapsed;
+
+    elapsed = mnhtesto_pacer_now() - rs->start;
+    return elapsed - MIN(elapsed, rs->waited);
+}
 
 
 static void
-update_stats(UNUSED mnfcgi_request_t *req, int code, int amount)
+update_stats(mnhtesto_reqstat_t *rs, int code, uint64_t amount)
 {
+    mnhtesto_rstat_t *rstat;
+
     if ((unsigned)code < countof(nreq)) {
         ++nreq[code];
         nbytes[code] += amount;
     }
+
+    rstat = mnhtesto_rstats_get(&rstats, BCDATA(rs->endpoint), code);
+    mnhtesto_hdr_record(&rstat->service, reqstat_service(rs));
+    if (rs->timed) {
+        mnhtesto_hdr_record(&rstat->overshoot, rs->overshoot);
+    }
+}
+
+
+static int
+request_wait_until(mnhtesto_reqstat_t *rs, uint64_t when)
+{
+    int res;
+    uint64_t now;
+
+    if (when <= (now = mnhtesto_pacer_now())) {
+        return 0;
+    }
+    res = mnhtesto_pacer_wait_until(when);
+    rs->timed = true;
+    rs->waited += (when - now);
+    if ((now = mnhtesto_pacer_now()) > when) {
+        rs->overshoot += now - when;
+        rs->waited += now - when;
+    }
+    return res;
 }
 
 
@@ -78,154 +281,721 @@ mnhtesto_body(mnfcgi_record_t *rec, mnbytestream_t *bs, void *udata)
 {
     ssize_t res;
     UNUSED mnfcgi_request_t *req;
-    struct {
-        int bsize;
-        int clen;
-        int delay;
-        int tts;
-        int offset;
-    } *params = mnfcgi_stdout_get_udata(rec);
-    int sz;
+    mnhtesto_body_params_t *params = mnfcgi_stdout_get_udata(rec);
+    size_t sz;
 
     req = udata;
-    sz = MIN(MNFCGI_MAX_PAYLOAD, params->clen - params->offset);
-    res = mnfcgi_cat(bs, sz, d + sizeof(char) * params->offset);
+    sz = MIN(params->chunk, params->clen - params->offset);
+    sz = MIN(sz, params->gen->sz - params->goffset);
+    res = mnfcgi_cat(bs, sz, params->gen->buf + params->goffset);
     params->offset += sz;
+    params->goffset += sz;
+    if (params->goffset == params->gen->sz) {
+        params->goffset = 0;
+    }
     return res;
 }
 
 
+/*
+ * Overuse events are recorded on the rejection path into a
+ * preallocated ring, and traced later by mnhtesto_overuse_flush().
+ * When the ring is full, new events are dropped and counted.
+ */
+typedef struct _mnhtesto_overuse {
+    uint32_t id;
+    int res;
+    uint64_t now;
+    uint64_t ts;
+    uint32_t value;
+    uint32_t prorated;
+    uint64_t amount;
+    double ra;
+} mnhtesto_overuse_t;
+
+#define MNHTESTO_OVERUSE_RING (1 << 14)
+/* max quotas traced per flush */
+#define MNHTESTO_OVERUSE_MAX_TRACES 16
+
+static mnhtesto_overuse_t overuse[MNHTESTO_OVERUSE_RING];
+static uint64_t overuse_head = 0;
+static uint64_t overuse_tail = 0;
+static uint64_t overuse_dropped = 0;
+
+
 static void
-quota_init(mnhtesto_quota_t *quota, uint64_t now)
+overuse_record(uint32_t id,
+               int res,
+               uint64_t now,
+               mnhtesto_quota_t *quota,
+               uint64_t amount,
+               double ra)
 {
-    quota->ts = now;
-    quota->ts -= quota->ts % (unsigned)MNHTESTO_QUOTA_UNITS(quota);
-    quota->value = 0.0;
-    quota->prorated = 0.0;
+    mnhtesto_overuse_t *ou;
+
+    if (MRKUNLIKELY(overuse_head - overuse_tail >= MNHTESTO_OVERUSE_RING)) {
+        ++overuse_dropped;
+        return;
+    }
+    ou = &overuse[overuse_head & (MNHTESTO_OVERUSE_RING - 1)];
+    ou->id = id;
+    ou->res = res;
+    ou->now = now;
+    ou->ts = quota->ts;
+    ou->value = quota->value;
+    ou->prorated = quota->prorated;
+    ou->amount = amount;
+    ou->ra = ra;
+    ++overuse_head;
 }
 
 
-static int
-mnhtesto_update_quota(mnfcgi_request_t *req, int amount, double *ra)
+static void
+overuse_trace(mnhtesto_overuse_t *ou, unsigned count)
 {
-    int res = 0;
     mnbytes_t *qname;
+    mnhtesto_quota_spec_t *spec;
+
+    qname = MNHTESTO_QTABLE_QNAME(&quotas, ou->id);
+    spec = MNHTESTO_QTABLE_SPEC(&quotas, ou->id);
+
+    if (ou->res == MNHTESTO_QUOTA_OVER) {
+        mnbytes_t *s, *ss, *sss;
+
+        if (spec->flags & MNHTESTO_QF_INFLIGHT) {
+            CTRACE("inflight quota %s overuse: over %.0lf in flight "
+                   "(%u times)",
+                   BDATA(qname),
+                   spec->denom,
+                   count);
+
+        } else if (spec->flags & MNHTESTO_QF_GCRA) {
+            ss = mnhtest_unit_str(&spec->denom_unit,
+                                  spec->denom, 0);
+            sss = mnhtest_unit_str(&spec->divisor_unit,
+                                   spec->divisor, 0);
+            CTRACE("gcra quota %s overuse: %" PRIu64 " over %s per %s "
+                   "(burst %" PRIu64 ") ra %lf sec (%u times)",
+                   BDATA(qname),
+                   ou->amount,
+                   BDATA(ss),
+                   BDATA(sss),
+                   spec->burst,
+                   ou->ra,
+                   count);
+            BYTES_DECREF(&ss);
+            BYTES_DECREF(&sss);
+
+        } else if (spec->flags & MNHTESTO_QF_SWC) {
+            mnbytes_t *ssss;
+
+            s = mnhtest_unit_str(&spec->denom_unit,
+                                 MNHTESTO_QUOTA_VALUE(spec, ou->value),
+                                 MNHTEST_UNIT_STR_VBASE);
+            ss = mnhtest_unit_str(&spec->denom_unit,
+                                  MNHTESTO_QUOTA_VALUE(spec, ou->prorated),
+                                  MNHTEST_UNIT_STR_VBASE);
+            sss = mnhtest_unit_str(&spec->denom_unit,
+                                   spec->denom, 0);
+            ssss = mnhtest_unit_str(&spec->divisor_unit,
+                                    spec->divisor, 0);
+            CTRACE("sliding quota %s overuse: %s (previous %s) "
+                   "(over %s) per %s ra %lf sec (%u times)",
+                   BDATA(qname),
+                   BDATA(s),
+                   BDATA(ss),
+                   BDATA(sss),
+                   BDATA(ssss),
+                   ou->ra,
+                   count);
+
+            BYTES_DECREF(&s);
+            BYTES_DECREF(&ss);
+            BYTES_DECREF(&sss);
+            BYTES_DECREF(&ssss);
 
-    if ((qname = mnfcgi_request_get_param(req,
-                                          &_http_x_mnhtesto_quota)) != NULL) {
-        mnhash_item_t *hit;
+        } else {
+            s = mnhtest_unit_str(&spec->denom_unit,
+                                 MNHTESTO_QUOTA_VALUE(spec, ou->value),
+                                 MNHTEST_UNIT_STR_VBASE);
+            ss = mnhtest_unit_str(&spec->denom_unit,
+                                  spec->denom, 0);
+            sss = mnhtest_unit_str(&spec->divisor_unit,
+                                   spec->divisor, 0);
+            CTRACE("current quota %s overuse: %s (over %s) per %s "
+                   "ra %lf sec (%u times)",
+                   BDATA(qname),
+                   BDATA(s),
+                   BDATA(ss),
+                   BDATA(sss),
+                   ou->ra,
+                   count);
+
+            BYTES_DECREF(&s);
+            BYTES_DECREF(&ss);
+            BYTES_DECREF(&sss);
+        }
+
+    } else if (ou->res == MNHTESTO_QUOTA_OVERPREV) {
+        mnbytes_t *xtot, *ytot, *xp, *xnom, *ynom;
+
+        xtot = mnhtest_unit_str(&spec->denom_unit,
+                             MNHTESTO_QUOTA_VALUE(spec, ou->value),
+                             MNHTEST_UNIT_STR_VBASE);
+        ytot = mnhtest_unit_str(&spec->divisor_unit,
+                               (double)(ou->now / MNHTESTO_NSEC - ou->ts), 0);
+        xp = mnhtest_unit_str(&spec->denom_unit,
+                              MNHTESTO_QUOTA_VALUE(spec, ou->prorated),
+                              MNHTEST_UNIT_STR_VBASE);
+        xnom = mnhtest_unit_str(&spec->denom_unit,
+                               spec->denom, 0);
+        ynom = mnhtest_unit_str(&spec->divisor_unit,
+                               spec->divisor, 0);
+        CTRACE("previous quota %s (%" PRId64 ") overuse: "
+               "%s per %s (prorated %s) (over %s per %s) ra %lf sec "
+               "(%u times)",
+               BDATA(qname),
+               ou->ts,
+               BDATA(xtot),
+               BDATA(ytot),
+               BDATA(xp),
+               BDATA(xnom),
+               BDATA(ynom),
+               ou->ra,
+               count);
+
+        BYTES_DECREF(&xtot);
+        BYTES_DECREF(&ytot);
+        BYTES_DECREF(&xp);
+        BYTES_DECREF(&xnom);
+        BYTES_DECREF(&ynom);
+    }
+}
 
-        if ((hit = hash_get_item(&quotas, qname)) != NULL) {
-            mnhtesto_quota_t *quota;
-            uint64_t now;
 
-            quota = hit->value;
-            if (quota->spec.denom_unit.ty == MNHTEST_UREQ) {
-                amount = 1;
+/*
+ * Drain the overuse ring.  Events are aggregated per quota, the
+ * latest event of a quota is traced along with the number of events.
+ * At most MNHTESTO_OVERUSE_MAX_TRACES quotas are traced, the rest are
+ * only counted.
+ */
+void
+mnhtesto_overuse_flush(void)
+{
+    struct {
+        mnhtesto_overuse_t *ou;
+        unsigned count;
+    } traces[MNHTESTO_OVERUSE_MAX_TRACES];
+    unsigned ntraces, i;
+    uint64_t nsuppressed;
+
+    ntraces = 0;
+    nsuppressed = 0;
+    for (; overuse_tail != overuse_head; ++overuse_tail) {
+        mnhtesto_overuse_t *ou;
+
+        ou = &overuse[overuse_tail & (MNHTESTO_OVERUSE_RING - 1)];
+        for (i = 0; i < ntraces; ++i) {
+            if (traces[i].ou->id == ou->id) {
+                traces[i].ou = ou;
+                ++traces[i].count;
+                break;
             }
+        }
+        if (i == ntraces) {
+            if (ntraces < countof(traces)) {
+                traces[ntraces].ou = ou;
+                traces[ntraces].count = 1;
+                ++ntraces;
+            } else {
+                ++nsuppressed;
+            }
+        }
+    }
+
+    for (i = 0; i < ntraces; ++i) {
+        overuse_trace(traces[i].ou, traces[i].count);
+    }
+    if (nsuppressed > 0 || overuse_dropped > 0) {
+        CTRACE("overuse: %" PRIu64 " more events suppressed, "
+               "%" PRIu64 " dropped",
+               nsuppressed,
+               overuse_dropped);
+        overuse_dropped = 0;
+    }
+}
+
+
+/*
+ * The key of the counter of the in-flight limit i of the chain of ids,
+ * the first nown of them the own limits of a dynamic instance.  The
+ * first limit of the quota of the key has the key hash.
+ */
+static uint64_t
+inflight_key(const uint32_t *ids, size_t i, size_t nown, uint64_t hash)
+{
+    mnbytes_t *qname;
+    mnhtesto_qpart_t part;
+
+    if (i == 0 || i < nown) {
+        return hash + i;
+    }
+    qname = MNHTESTO_QTABLE_QNAME(&quotas, ids[i]);
+    part.data = BCDATA(qname);
+    part.len = strnlen(BCDATA(qname), BSZ(qname));
+    return mnhtesto_qparts_hash(&part, 1);
+}
+
+
+/*
+ * Give back the in-flight slots of held, and wake the heads of the
+ * shaper queues parked on the counters.
+ */
+static void
+inflight_release(mnhtesto_iheld_t *held)
+{
+    uint64_t hashes[MNHTESTO_QUOTA_MAX_CHAIN];
+    size_t i, n;
+
+    n = held->n;
+    (void)memcpy(hashes, held->hashes, sizeof(uint64_t) * n);
+    mnhtesto_inflight_release(&inflight, held);
+    for (i = 0; i < n && iparked.nqueues > 0; ++i) {
+        mnhtesto_swaiter_t *w;
+
+        for (w = mnhtesto_shaper_head(&iparked, hashes[i]);
+             w != NULL;
+             w = w->next) {
+            mrkthr_cond_signal_one(w->udata);
+        }
+    }
+}
+
+
+/*
+ * Account the request in the n limits of the chain of ids, the first
+ * nown of them the own limits of a dynamic instance, whose states are
+ * not in the table.  The slots of the in-flight limits are taken to
+ * held first, and then the rest are updated, all of them or none.
+ * The limit over is recorded unless the request is parked, see
+ * quota_update_key().
+ */
+static int
+quota_update_limits(const uint32_t *ids,
+                    const mnhtesto_quota_spec_t **specs,
+                    mnhtesto_quota_t **states,
+                    size_t n,
+                    size_t nown,
+                    uint64_t hash,
+                    uint64_t now,
+                    uint64_t amount,
+                    bool *park,
+                    mnhtesto_iheld_t *held,
+                    double *ra,
+                    size_t *over)
+{
+    int res;
+    size_t i;
+
+    res = MNHTESTO_QUOTA_OK;
+    *ra = 0.0;
+    for (i = 0; i < n; ++i) {
+        if ((specs[i]->flags & MNHTESTO_QF_INFLIGHT) &&
+            mnhtesto_inflight_acquire(
+                &inflight,
+                inflight_key(ids, i, nown, hash),
+                (uint32_t)MNHTESTO_QUOTA_LIMIT(specs[i]),
+                held) != 0) {
+            res = MNHTESTO_QUOTA_OVER;
+            *over = i;
+            break;
+        }
+    }
+
+    mnhtesto_qtable_lock_chain(&quotas, ids + nown, n - nown);
+    if (res == MNHTESTO_QUOTA_OK) {
+        res = mnhtesto_quota_update_chain(specs,
+                                          states,
+                                          n,
+                                          now,
+                                          amount,
+                                          ra,
+                                          over);
+    }
+    *park = res != 0 && *park && (specs[*over]->flags & MNHTESTO_QF_SHAPE);
+    if (res != 0 && !*park) {
+        overuse_record(ids[*over], res, now, states[*over], amount, *ra);
+    }
+    mnhtesto_qtable_unlock_chain(&quotas, ids + nown, n - nown);
+
+    if (res != 0) {
+        mnhtesto_inflight_release(&inflight, held);
+    }
+    return res;
+}
+
+
+/*
+ * Account the request in the quota of the key made of the parts, of
+ * hash, and return whether the key has one.  The slots of the
+ * in-flight limits taken, if let in, are left in held.  A key that has no quota
+ * of its own gets a dynamic one, if a template applies.  The request
+ * is accounted in all of the limits of the quota and of its parents,
+ * or in none of them.
+ *
+ * If *park, a rejection by a limit of the "s" flag is not counted, for
+ * the caller to park the request and try again, and *park tells
+ * whether it is so.
+ */
+static bool
+quota_update_key(const mnhtesto_qpart_t *parts,
+                 size_t nparts,
+                 uint64_t hash,
+                 uint64_t amount,
+                 bool *park,
+                 mnhtesto_iheld_t *held,
+                 double *ra,
+                 int *res)
+{
+    uint32_t ids[MNHTESTO_QUOTA_MAX_CHAIN];
+    const mnhtesto_quota_spec_t *specs[MNHTESTO_QUOTA_MAX_CHAIN];
+    mnhtesto_quota_t *states[MNHTESTO_QUOTA_MAX_CHAIN];
+    mnhtesto_quota_t *quota;
+    mnhtesto_qcount_t *count;
+    uint64_t now, key;
+    uint32_t id;
+    size_t n, over, i;
+    bool may_park;
+
+    now = mrkthr_get_now_nsec();
+    may_park = *park;
+    *park = false;
+    quota = NULL;
+    count = NULL;
+    key = 0;
+    over = 0;
+    *res = 0;
+
+    /*
+     * quota update, the states may be shared by the workers
+     */
+    if ((id = mnhtesto_qtable_get_parts(&quotas, parts, nparts, hash)) !=
+            MNHTESTO_QTABLE_NONE) {
+        MNHTESTO_QTABLE_CHAIN(&quotas, id, ids, n);
+        for (i = 0; i < n; ++i) {
+            specs[i] = MNHTESTO_QTABLE_SPEC(&quotas, ids[i]);
+            states[i] = MNHTESTO_QTABLE_QUOTA(&quotas, ids[i]);
+        }
+        quota = states[0];
+        count = MNHTESTO_QTABLE_COUNT(&quotas, id);
+        key = id;
+
+        *park = may_park;
+        *res = quota_update_limits(ids,
+                                   specs,
+                                   states,
+                                   n,
+                                   0,
+                                   hash,
+                                   now,
+                                   amount,
+                                   park,
+                                   held,
+                                   ra,
+                                   &over);
+
+    } else if (dquotas.ntmpls > 0) {
+        mnhtesto_dquota_t *dq;
+
+        /*
+         * the instance may be evicted once unlocked, it is counted
+         * while locked, and is a heavy hitter by its hash
+         */
+        MNHTESTO_DTABLE_LOCK(&dquotas);
+        if ((dq = mnhtesto_dtable_get(&dquotas,
+                                      &quotas,
+                                      parts,
+                                      nparts,
+                                      hash,
+                                      now,
+                                      &id)) != NULL) {
+            size_t nown;
+
+            quota = dq->quota;
+            key = MNHTESTO_TOPK_DQUOTA | hash;
+
             /*
-             * quota update
+             * the states of the own limits are the instance's,
+             * those of the parents are in the table
              */
-            now = MRKTHR_GET_NOW_SEC();
-            if (MNHTESTO_IN_QUOTA(quota, now)) {
-                quota->value += (double)amount;
-                if (quota->value <= MNHTESTO_QUOTA_LIMIT(quota)) {
-                    /*
-                     * 200
-                     */
+            nown = MNHTESTO_QTABLE_NLIMITS(&quotas, id);
+            MNHTESTO_QTABLE_CHAIN(&quotas, id, ids, n);
+            for (i = 0; i < n; ++i) {
+                specs[i] = MNHTESTO_QTABLE_SPEC(&quotas, ids[i]);
+                states[i] = i < nown ?
+                    &quota[i] : MNHTESTO_QTABLE_QUOTA(&quotas, ids[i]);
+            }
+
+            *park = may_park;
+            *res = quota_update_limits(ids,
+                                       specs,
+                                       states,
+                                       n,
+                                       nown,
+                                       hash,
+                                       now,
+                                       amount,
+                                       park,
+                                       held,
+                                       ra,
+                                       &over);
+            if (!*park) {
+                if (*res != 0) {
+                    ++dq->count.rejected;
                 } else {
-                    mnbytes_t *s, *ss, *sss;
-
-                    /*
-                     * 429
-                     */
-                    res = -1;
-                    *ra = (quota->value / MNHTESTO_QUOTA_LIMIT(quota)) *
-                            MNHTESTO_QUOTA_UNITS(quota);
-
-                    s = mnhtest_unit_str(&quota->spec.denom_unit,
-                                         quota->value, MNHTEST_UNIT_STR_VBASE);
-                    ss = mnhtest_unit_str(&quota->spec.denom_unit,
-                                          quota->spec.denom, 0);
-                    sss = mnhtest_unit_str(&quota->spec.divisor_unit,
-                                           quota->spec.divisor, 0);
-                    CTRACE("current quota %s overuse: %s (over %s) per %s ra %lf sec",
-                           BDATA(qname),
-                           BDATA(s),
-                           BDATA(ss),
-                           BDATA(sss),
-                           *ra);
-
-                    BYTES_DECREF(&s);
-                    BYTES_DECREF(&ss);
-                    BYTES_DECREF(&sss);
-
-                    if (!(quota->spec.flags & MNHTESTO_QF_SENDRA)) {
-                        *ra = 0.0;
-                    }
+                    ++dq->count.accepted;
                 }
+            }
+        }
+        MNHTESTO_DTABLE_UNLOCK(&dquotas);
+    }
 
-            } else {
-                double normvalue;
+    if (quota != NULL && !*park) {
+        if (*res != 0) {
+            if (count != NULL) {
+                (void)__atomic_fetch_add(&count->rejected,
+                                         1,
+                                         __ATOMIC_RELAXED);
+            }
+            mnhtesto_topk_add(&offenders, key, 1);
 
-                normvalue = quota->spec.poena_factor * quota->value;
+            if (!(specs[over]->flags & MNHTESTO_QF_SENDRA)) {
+                *ra = 0.0;
+            }
+        } else {
+            if (count != NULL) {
+                (void)__atomic_fetch_add(&count->accepted,
+                                         1,
+                                         __ATOMIC_RELAXED);
+            }
+            mnhtesto_topk_add(&consumers,
+                              key,
+                              specs[0]->denom_unit.ty == MNHTEST_UREQ ?
+                                1 : amount);
+        }
+    }
+    return quota != NULL;
+}
 
-                quota->prorated = MNHTESTO_QUOTA_PRORATE(
-                    quota, normvalue + (double)amount, now);
 
-                if (quota->prorated <= MNHTESTO_QUOTA_LIMIT(quota)) {
-                    /*
-                     * 200
-                     */
-                    quota_init(quota, now);
-                    assert(MNHTESTO_IN_QUOTA(quota, now));
-                    quota->value = quota->prorated;
+/*
+ * The key of the request by sel in parts, with the separators in
+ * between, and the number of parts, zero if the request is missing
+ * any of the parts of sel.  The parts point into the request.
+ */
+static size_t
+selector_key(mnfcgi_request_t *req,
+             const mnhtesto_selector_t *sel,
+             mnhtesto_qpart_t *parts)
+{
+    size_t i, n;
 
-                } else {
-                    mnbytes_t *xtot, *ytot, *xp, *xnom, *ynom;
-
-                    /*
-                     * previous quota overuse, 429
-                     */
-                    quota->value = normvalue + (double)amount;
-
-                    res = -1;
-                    *ra = (quota->prorated / MNHTESTO_QUOTA_LIMIT(quota)) *
-                            MNHTESTO_QUOTA_UNITS(quota) * MNHTESTO_QUOTAS(quota, now);
-
-                    xtot = mnhtest_unit_str(&quota->spec.denom_unit,
-                                         quota->value, MNHTEST_UNIT_STR_VBASE);
-                    ytot = mnhtest_unit_str(&quota->spec.divisor_unit,
-                                           (double)(now - quota->ts), 0);
-                    xp = mnhtest_unit_str(&quota->spec.denom_unit,
-                                          quota->prorated, MNHTEST_UNIT_STR_VBASE);
-                    xnom = mnhtest_unit_str(&quota->spec.denom_unit,
-                                           quota->spec.denom, 0);
-                    ynom = mnhtest_unit_str(&quota->spec.divisor_unit,
-                                           quota->spec.divisor, 0);
-                    CTRACE("previous quota %s (%" PRId64 ") overuse: "
-                           "%s per %s (prorated %s) (over %s per %s) ra %lf sec",
-                           BDATA(qname),
-                           quota->ts,
-                           BDATA(xtot),
-                           BDATA(ytot),
-                           BDATA(xp),
-                           BDATA(xnom),
-                           BDATA(ynom),
-                           *ra);
-
-                    BYTES_DECREF(&xtot);
-                    BYTES_DECREF(&ytot);
-                    BYTES_DECREF(&xp);
-                    BYTES_DECREF(&xnom);
-                    BYTES_DECREF(&ynom);
-
-                    if (!(quota->spec.flags & MNHTESTO_QF_SENDRA)) {
-                        *ra = 0.0;
-                    }
-                }
+    for (i = 0, n = 0; i < sel->nparts; ++i) {
+        const mnhtesto_selpart_t *sp;
+        mnbytes_t *value;
+
+        sp = &sel->parts[i];
+        if ((value = sp->ty == MNHTESTO_SELECTOR_QUERY ?
+                mnfcgi_request_get_query_term(req, sp->name) :
+                mnfcgi_request_get_param(req, sp->name)) == NULL) {
+            return 0;
+        }
+        if (n > 0) {
+            parts[n].data = MNHTESTO_SELECTOR_SEP;
+            parts[n].len = sizeof(MNHTESTO_SELECTOR_SEP) - 1;
+            ++n;
+        }
+        parts[n].data = BCDATA(value);
+        parts[n].len = strnlen(BCDATA(value), BSZ(value));
+        if (sp->ty == MNHTESTO_SELECTOR_PATH) {
+            parts[n].len = mnhtesto_selector_path(parts[n].data,
+                                                  parts[n].len,
+                                                  sp->nseg);
+        }
+        ++n;
+    }
+    return n;
+}
+
+
+/*
+ * Park the request over a limit of the "s" flag in the queue of its
+ * key till the quota lets it, and return the final decision.  The
+ * request at the head of the queue waits for the quota on the pacer,
+ * the others wait for their turn.  Once past the deadline, or if the
+ * queue is full, the request is decided on as is.  An in-flight limit
+ * tells no retry-after, the head is parked on the full counter then,
+ * till a slot of it is given back.
+ */
+static int
+quota_shape(const mnhtesto_qpart_t *parts,
+            size_t nparts,
+            uint64_t hash,
+            uint64_t amount,
+            mnhtesto_iheld_t *held,
+            double *ra)
+{
+    int res;
+    mnhtesto_swaiter_t waiter, iwaiter, *next;
+    mrkthr_cond_t cond;
+    bool park;
+
+    waiter.deadline = mnhtesto_pacer_now() + shaper.maxwait;
+    waiter.udata = &cond;
+    if (mnhtesto_shaper_enqueue(&shaper, hash, &waiter) != 0) {
+        park = false;
+        (void)quota_update_key(parts,
+                               nparts,
+                               hash,
+                               amount,
+                               &park,
+                               held,
+                               ra,
+                               &res);
+        return res;
+    }
+
+    mrkthr_cond_init(&cond);
+    res = MNHTESTO_QUOTA_OVER;
+    *ra = 0.0;
+    while (true) {
+        uint64_t now, when;
+        int rc;
+
+        if (mnhtesto_shaper_head(&shaper, hash) != &waiter) {
+            if (mrkthr_cond_wait(&cond) != 0) {
+                break;
             }
+            continue;
+        }
+
+        now = mnhtesto_pacer_now();
+        park = now < waiter.deadline;
+        held->full = false;
+        (void)quota_update_key(parts,
+                               nparts,
+                               hash,
+                               amount,
+                               &park,
+                               held,
+                               ra,
+                               &res);
+        if (!park) {
+            break;
+        }
+        if (held->full) {
+            uint64_t over;
+
+            /*
+             * no other request signals cond while this one is the head
+             */
+            over = held->over;
+            iwaiter.udata = &cond;
+            (void)mnhtesto_shaper_enqueue(&iparked, over, &iwaiter);
+            rc = mnhtesto_pacer_wait_on(&cond, waiter.deadline);
+            (void)mnhtesto_shaper_dequeue(&iparked, over, &iwaiter);
+        } else {
+            when = now + MAX((uint64_t)(*ra * (double)MNHTESTO_NSEC),
+                             MNHTESTO_SHAPE_MIN_WAIT);
+            rc = mnhtesto_pacer_wait_until(MIN(when, waiter.deadline));
         }
+        if (rc != 0) {
+            /* interrupted */
+            res = MNHTESTO_QUOTA_OVER;
+            break;
+        }
+    }
+
+    if ((next = mnhtesto_shaper_dequeue(&shaper, hash, &waiter)) != NULL) {
+        mrkthr_cond_signal_one(next->udata);
+    }
+    mrkthr_cond_fini(&cond);
+    return res;
+}
+
+
+/*
+ * Account the request in the quota of the key made of the parts, the
+ * way quota_update_key() does, behind the requests of the key already
+ * parked if any, and return whether the key has a quota.
+ */
+static bool
+quota_update_parts(const mnhtesto_qpart_t *parts,
+                   size_t nparts,
+                   uint64_t amount,
+                   mnhtesto_iheld_t *held,
+                   double *ra,
+                   int *res)
+{
+    uint64_t hash;
+    bool park;
+
+    hash = mnhtesto_qparts_hash(parts, nparts);
+    if (MNHTESTO_SHAPER_HEAD(&shaper, hash) != NULL) {
+        *res = quota_shape(parts, nparts, hash, amount, held, ra);
+        return true;
+    }
+    park = shaper.maxdepth > 0;
+    if (!quota_update_key(parts,
+                          nparts,
+                          hash,
+                          amount,
+                          &park,
+                          held,
+                          ra,
+                          res)) {
+        return false;
+    }
+    if (park) {
+        *res = quota_shape(parts, nparts, hash, amount, held, ra);
+    }
+    return true;
+}
+
+
+/*
+ * The quota of the key of the first of the selectors whose key has
+ * one, or else of the request header, or else the quota bound to the
+ * route.
+ */
+static int
+mnhtesto_update_quota(mnfcgi_request_t *req,
+                      const mnhtesto_route_t *route,
+                      uint64_t amount,
+                      mnhtesto_iheld_t *held,
+                      double *ra)
+{
+    int res = 0;
+    mnhtesto_qpart_t parts[MNHTESTO_SELECTOR_MAX_KEY];
+    mnbytes_t *qname;
+    size_t i, n;
+
+    for (i = 0; i < nselectors; ++i) {
+        if ((n = selector_key(req, &selectors[i], parts)) > 0 &&
+            quota_update_parts(parts, n, amount, held, ra, &res)) {
+            return res;
+        }
+    }
+
+    if ((qname = mnfcgi_request_get_param(req,
+                                          &_http_x_mnhtesto_quota)) == NULL &&
+        route != NULL) {
+        qname = route->quota;
+    }
+    if (qname != NULL) {
+        parts[0].data = BCDATA(qname);
+        parts[0].len = strnlen(BCDATA(qname), BSZ(qname));
+        (void)quota_update_parts(parts, 1, amount, held, ra, &res);
     } else {
         //CTRACE("no quota");
     }
@@ -233,6 +1003,92 @@ mnhtesto_update_quota(mnfcgi_request_t *req, int amount, double *ra)
     return res;
 }
 
+
+static mnbytes_t *
+status_reason(int code)
+{
+    switch (code) {
+    case 400:
+        return &_bad_request;
+    case 403:
+        return &_forbidden;
+    case 404:
+        return &_not_found;
+    case 429:
+        return &_too_much;
+    case 500:
+        return &_internal_server_error;
+    case 501:
+        return &_not_implemented;
+    case 502:
+        return &_bad_gateway;
+    case 503:
+        return &_service_unavailable;
+    case 504:
+        return &_gateway_timeout;
+    default:
+        return &_error;
+    }
+}
+
+
+/*
+ * The query term, or else its default from the route.
+ */
+static mnbytes_t *
+route_term(mnfcgi_request_t *req,
+           const mnhtesto_route_t *route,
+           int term,
+           mnbytes_t *name)
+{
+    mnbytes_t *res;
+
+    if ((res = mnfcgi_request_get_query_term(req, name)) == NULL &&
+        route != NULL) {
+        res = route->terms[term];
+    }
+    return res;
+}
+
+
+static const mnhtesto_route_t *
+request_route(mnfcgi_request_t *req)
+{
+    mnbytes_t *script_name;
+
+    if ((script_name = mnfcgi_request_get_param(req, &_script_name)) ==
+            NULL) {
+        return NULL;
+    }
+    return mnhtesto_routes_match(&routes,
+                                 BCDATA(script_name),
+                                 strlen(BCDATA(script_name)));
+}
+
+
+/*
+ * The priority class of the request by the header, 0 the most
+ * important, the default one if none or not a class.
+ */
+static unsigned
+request_class(mnfcgi_request_t *req)
+{
+    mnbytes_t *priority;
+    char *end;
+    unsigned long cls;
+
+    if ((priority = mnfcgi_request_get_param(
+                    req, &_http_x_mnhtesto_priority)) == NULL) {
+        return MNHTESTO_SHED_DEFAULT_CLASS;
+    }
+    cls = strtoul(BCDATA(priority), &end, 10);
+    if (end == BCDATA(priority) || cls >= MNHTESTO_SHED_NCLASSES) {
+        return MNHTESTO_SHED_DEFAULT_CLASS;
+    }
+    return (unsigned)cls;
+}
+
+
 static int
 mnhtesto_root_get(mnfcgi_request_t *req, RESERVED void *__udata)
 {
@@ -240,15 +1096,56 @@ mnhtesto_root_get(mnfcgi_request_t *req, RESERVED void *__udata)
     BYTES_ALLOCA(_op, "op");
     BYTES_ALLOCA(_bsiz, "bsiz");
     BYTES_ALLOCA(_dlay, "dlay");
-    mnbytes_t *op, *bsiz, *dlay;
-    struct {
-        int bsize;
-        int clen;
-        int delay;
-        int tts;
-        int offset;
-    } params;
+    BYTES_ALLOCA(_gen, "gen");
+    BYTES_ALLOCA(_ent, "ent");
+    BYTES_ALLOCA(_seed, "seed");
+    BYTES_ALLOCA(_clen, "clen");
+    BYTES_ALLOCA(_rate, "rate");
+    BYTES_ALLOCA(_jitr, "jitr");
+    BYTES_ALLOCA(_lat, "lat");
+    mnbytes_t *op, *bsiz, *dlay, *gen, *ent, *seed, *clen, *rate, *jitr, *lat;
+    mnhash_item_t *hit;
+    const mnhtesto_latency_t *dist = NULL;
+    const mnhtesto_route_t *route;
+    mnhtesto_body_params_t params;
     double ra = 0.0l;
+    mnhtesto_reqctx_t *ctx;
+    mnhtesto_reqstat_t *rs;
+    uint64_t start;
+    int code;
+
+    /* see mnhtesto_stdin_end() */
+    ctx = req->udata;
+    rs = &ctx->rs;
+    route = request_route(req);
+    rs->start = mnhtesto_pacer_now();
+    if (route != NULL) {
+        rs->endpoint = route->name;
+    } else if ((rs->endpoint = mnfcgi_request_get_param(
+                    req, &_script_name)) == NULL) {
+        rs->endpoint = &_unknown;
+    }
+    rs->waited = 0;
+    rs->overshoot = 0;
+    rs->timed = false;
+
+    /*
+     * shed before anything else, see mnhtesto_shedder_t
+     */
+    if (mnhtesto_shedder_admit(&shedder, request_class(req)) != 0) {
+        if (MRKUNLIKELY((res = mnfcgi_request_field_addf(
+                            req,
+                            MNFCGI_FADD_OVERRIDE,
+                            &_retry_after,
+                            "%d",
+                            MNHTESTO_SHED_RETRY_AFTER)) != 0)) {
+            goto end;
+        }
+        mnfcgi_app_error(req, 503, &_service_unavailable);
+        update_stats(rs, 503, 0);
+        goto end;
+    }
+    ctx->admitted = true;
 
     /*
      *
@@ -258,7 +1155,7 @@ mnhtesto_root_get(mnfcgi_request_t *req, RESERVED void *__udata)
         //CTRACE("op=%s", BDATA(op));
     }
 
-    if ((bsiz = mnfcgi_request_get_query_term(req, _bsiz)) == NULL) {
+    if ((bsiz = route_term(req, route, MNHTESTO_ROUTE_BSIZ, _bsiz)) == NULL) {
         params.bsize = BSIZE_DEFAULT;
     } else {
         //CTRACE("bsiz=%s", BDATA(bsiz));
@@ -268,84 +1165,499 @@ mnhtesto_root_get(mnfcgi_request_t *req, RESERVED void *__udata)
         }
     }
 
-    params.offset = 0;
-    params.clen = (int)(1 << params.bsize);
-
-    if ((dlay = mnfcgi_request_get_query_term(req, _dlay)) == NULL) {
-        params.delay = DELAY_DEFAULT;
-    } else {
-        //CTRACE("dlay=%s", BDATA(dlay));
-        params.delay = strtol(BCDATA(dlay), NULL, 10);
-        if (!INB0(DELAY_MIN, params.delay, DELAY_MAX)) {
-            params.delay = DELAY_DEFAULT;
-        }
+    params.offset = 0;
+    params.clen = 1ul << params.bsize;
+
+    /*
+     * streamed, clen overrides bsiz
+     */
+    if ((clen = route_term(req, route, MNHTESTO_ROUTE_CLEN, _clen)) != NULL) {
+        mnhtest_unit_t unit;
+        double v;
+
+        if (mnhtest_unit_lex(&unit, BCDATA(clen), &v) == NULL ||
+            !(unit.ty == 0 || unit.ty == MNHTEST_UBYTE) ||
+            !INB0(0.0, v * unit.mult, (double)CLEN_MAX)) {
+            mnfcgi_app_error(req, 400, &_bad_request);
+            update_stats(rs, 400, 0);
+            goto end;
+        }
+        params.clen = (uint64_t)(v * unit.mult);
+    }
+
+    if ((dlay = route_term(req, route, MNHTESTO_ROUTE_DLAY, _dlay)) == NULL) {
+        params.delay = DELAY_DEFAULT;
+    } else {
+        //CTRACE("dlay=%s", BDATA(dlay));
+        params.delay = strtol(BCDATA(dlay), NULL, 10);
+        if (!INB0(DELAY_MIN, params.delay, DELAY_MAX)) {
+            params.delay = DELAY_DEFAULT;
+        }
+    }
+
+    /*
+     * a latency distribution by name, or that of the route, or that
+     * of the endpoint
+     */
+    if ((lat = mnfcgi_request_get_query_term(req, _lat)) != NULL) {
+        if ((hit = hash_get_item(&latencies, lat)) == NULL) {
+            mnfcgi_app_error(req, 400, &_bad_request);
+            update_stats(rs, 400, 0);
+            goto end;
+        }
+        dist = hit->value;
+    } else if (route != NULL && route->lat != NULL) {
+        dist = route->lat;
+    } else if ((lat = mnfcgi_request_get_param(req, &_script_name)) != NULL &&
+               (hit = hash_get_item(&latencies, lat)) != NULL) {
+        dist = hit->value;
+    }
+    if (dist != NULL) {
+        params.tts = mnhtesto_latency_sample(dist);
+    } else {
+        params.tts = (1ul << params.delay) * 1000000ul;
+    }
+
+    gen = route_term(req, route, MNHTESTO_ROUTE_GEN, _gen);
+    ent = route_term(req, route, MNHTESTO_ROUTE_ENT, _ent);
+    if ((params.gen = mnhtesto_bodygen_get(
+                    gen != NULL ? BCDATA(gen) : NULL,
+                    ent != NULL ? (int)strtol(BCDATA(ent), NULL, 10) :
+                                  MNHTESTO_BODYGEN_PAT_ENTROPY_DEFAULT)) ==
+            NULL) {
+        mnfcgi_app_error(req, 400, &_bad_request);
+        update_stats(rs, 400, 0);
+        goto end;
+    }
+    if ((seed = route_term(req, route, MNHTESTO_ROUTE_SEED, _seed)) == NULL) {
+        params.goffset = 0;
+    } else {
+        params.goffset = bytes_hash(seed) % params.gen->sz;
+    }
+
+    /*
+     * paced, a record per pacer tick at most
+     */
+    params.chunk = MNHTESTO_BODY_CHUNK;
+    params.rate = 0.0;
+    params.jitter = 0;
+    if ((rate = route_term(req, route, MNHTESTO_ROUTE_RATE, _rate)) != NULL) {
+        mnhtest_unit_t unit;
+        double v;
+
+        if (mnhtest_unit_lex(&unit, BCDATA(rate), &v) == NULL ||
+            !(unit.ty == 0 || unit.ty == MNHTEST_UBYTE) ||
+            !(v * unit.mult >= 1.0)) {
+            mnfcgi_app_error(req, 400, &_bad_request);
+            update_stats(rs, 400, 0);
+            goto end;
+        }
+        params.rate = v * unit.mult;
+        params.chunk = MIN((double)MNHTESTO_BODY_CHUNK,
+                           MAX(1.0,
+                               params.rate * (double)MNHTESTO_PACER_TICK /
+                                   (double)MNHTESTO_NSEC));
+
+        if ((jitr = route_term(req,
+                               route,
+                               MNHTESTO_ROUTE_JITR,
+                               _jitr)) != NULL) {
+            params.jitter = strtol(BCDATA(jitr), NULL, 10);
+            if (!INB0(0, params.jitter, JITTER_MAX)) {
+                params.jitter = 0;
+            }
+        }
+    }
+
+    if (mnhtesto_update_quota(req,
+                              route,
+                              params.clen,
+                              &ctx->held,
+                              &ra) != 0) {
+        if (ra > 0.0l) {
+            if (MRKUNLIKELY((res = mnfcgi_request_field_addf(
+                                req,
+                                MNFCGI_FADD_OVERRIDE,
+                                &_retry_after,
+                                "%d",
+                                (int)(ra + 1.0l))) != 0)) {
+                goto end;
+            }
+        }
+        mnfcgi_app_error(req, 429, &_too_much);
+        update_stats(rs, 429, 0);
+        goto end;
+    }
+
+    /*
+     * the status mix of the route, errors take the delay too
+     */
+    if (route != NULL && (code = mnhtesto_route_status(route)) != 200) {
+        if (request_wait_until(rs, mnhtesto_pacer_now() + params.tts) !=
+                0) {
+            return 0;
+        }
+        mnfcgi_app_error(req, code, status_reason(code));
+        update_stats(rs, code, 0);
+        goto end;
+    }
+
+    if (MRKUNLIKELY((res = mnfcgi_request_status_set(req, 200, &_ok)) != 0)) {
+        goto end;
+    }
+
+    if (MRKUNLIKELY((res = mnfcgi_request_field_addf(
+                        req,
+                        MNFCGI_FADD_OVERRIDE,
+                        &_content_length,
+                        "%" PRIu64,
+                        params.clen)) != 0)) {
+        goto end;
+    }
+
+    if (MRKUNLIKELY((res = mnfcgi_request_headers_end(req)) != 0)) {
+        goto end;
+    }
+
+    //CTRACE("bsize=%d delay=%d clen=%d(%08x) tts=%ld",
+    //       params.bsize,
+    //       params.delay,
+    //       params.clen,
+    //       params.clen,
+    //       params.tts);
+
+
+    start = mnhtesto_pacer_now();
+    if (params.tts > 0) {
+        start += params.tts;
+        if (request_wait_until(rs, start) != 0) {
+            return 0;
+        }
+    }
+
+    while (params.offset < params.clen) {
+        if (params.rate > 0.0) {
+            double due;
+
+            /*
+             * the schedule is kept by offset, jitter does not
+             * accumulate
+             */
+            due = (double)params.offset / params.rate;
+            if (params.jitter > 0) {
+                due += (double)params.chunk / params.rate *
+                       (double)((long)(random() % (2 * params.jitter + 1)) -
+                                params.jitter) / 100.0;
+            }
+            if (due > 0.0 &&
+                request_wait_until(
+                    rs,
+                    MNHTESTO_PACER_TICK_CEIL(
+                        start +
+                        (uint64_t)(due * (double)MNHTESTO_NSEC))) != 0) {
+                return 0;
+            }
+        }
+        if ((res = mnfcgi_render_stdout(req, mnhtesto_body, &params)) != 0) {
+            break;
+        }
+    }
+    update_stats(rs, 200, params.clen);
+
+
+end:
+    return res;
+}
+
+
+static void
+render_histograms(mnhtesto_metrics_t *m,
+                  const char *name,
+                  const char *help,
+                  bool overshoot)
+{
+    size_t i;
+
+    mnhtesto_metrics_type(m, name, "histogram", help);
+    for (i = 0; i < totals.rstats.nentries; ++i) {
+        mnhtesto_rstat_t *rstat;
+        const char *labels[4];
+        char code[16];
+
+        rstat = totals.rstats.entries[i];
+        if (overshoot && rstat->overshoot.count == 0) {
+            continue;
+        }
+        (void)snprintf(code, sizeof(code), "%d", rstat->status);
+        labels[0] = "endpoint";
+        labels[1] = rstat->endpoint;
+        labels[2] = "code";
+        labels[3] = code;
+        mnhtesto_metrics_histogram(m,
+                                   name,
+                                   labels,
+                                   2,
+                                   overshoot ? &rstat->overshoot :
+                                               &rstat->service);
+    }
+}
+
+
+/*
+ * Quotas that have seen requests, then the dynamic ones by their keys
+ * along with their templates.  The table may be swapped by a reload
+ * while yielding, hence it is not held across yields, nor is the lock
+ * of the dynamic quotas.
+ */
+static void
+render_quota_counts(mnhtesto_metrics_t *m,
+                    const char *name,
+                    const char *help,
+                    bool rejected)
+{
+    uint32_t id;
+    size_t i;
+
+    mnhtesto_metrics_type(m, name, "counter", help);
+    for (id = 0; id < quotas.nelems; ++id) {
+        mnhtesto_qcount_t *count;
+
+        count = MNHTESTO_QTABLE_COUNT(&quotas, id);
+        if (count->accepted > 0 || count->rejected > 0) {
+            mnhtesto_metrics_begin(m, name);
+            mnhtesto_metrics_label(
+                m, "quota", BCDATA(MNHTESTO_QTABLE_QNAME(&quotas, id)));
+            mnhtesto_metrics_u64(m,
+                                 rejected ? count->rejected :
+                                            count->accepted);
+        }
+        if (id % MNHTESTO_RELOAD_CHUNK == MNHTESTO_RELOAD_CHUNK - 1) {
+            (void)mrkthr_yield();
+        }
+    }
+
+    for (i = 0; dquotas.state != NULL && i < dquotas.state->nentries; ) {
+        size_t end;
+
+        MNHTESTO_DTABLE_LOCK(&dquotas);
+        end = MIN(i + MNHTESTO_RELOAD_CHUNK, dquotas.state->nentries);
+        for (; i < end; ++i) {
+            mnhtesto_dquota_t *dq;
+            char key[MNHTESTO_DQUOTA_KEYSZ + 1];
+
+            dq = &dquotas.entries[i];
+            if (dq->tmpl == MNHTESTO_QTABLE_NONE ||
+                (dq->count.accepted == 0 && dq->count.rejected == 0)) {
+                continue;
+            }
+            (void)memcpy(key, dq->key, dq->len);
+            key[dq->len] = '\0';
+            mnhtesto_metrics_begin(m, name);
+            mnhtesto_metrics_label(m, "quota", key);
+            mnhtesto_metrics_label(
+                m,
+                "template",
+                BCDATA(MNHTESTO_QTABLE_QNAME(&quotas, dq->tmpl)));
+            mnhtesto_metrics_u64(m,
+                                 rejected ? dq->count.rejected :
+                                            dq->count.accepted);
+        }
+        MNHTESTO_DTABLE_UNLOCK(&dquotas);
+        (void)mrkthr_yield();
+    }
+}
+
+
+static void
+render_metrics(mnhtesto_metrics_t *m)
+{
+    unsigned i;
+
+    mnhtesto_metrics_reset(m);
+
+    mnhtesto_metrics_type(m,
+                          "mnhtesto_requests_total",
+                          "counter",
+                          "Requests by status.");
+    for (i = 0; i < countof(totals.nreq); ++i) {
+        if (totals.nreq[i] > 0) {
+            mnhtesto_metrics_begin(m, "mnhtesto_requests_total");
+            mnhtesto_metrics_label_int(m, "code", (int)i);
+            mnhtesto_metrics_u64(m, totals.nreq[i]);
+        }
+    }
+    mnhtesto_metrics_type(m,
+                          "mnhtesto_response_bytes_total",
+                          "counter",
+                          "Response body bytes by status.");
+    for (i = 0; i < countof(totals.nbytes); ++i) {
+        if (totals.nreq[i] > 0) {
+            mnhtesto_metrics_begin(m, "mnhtesto_response_bytes_total");
+            mnhtesto_metrics_label_int(m, "code", (int)i);
+            mnhtesto_metrics_u64(m, totals.nbytes[i]);
+        }
+    }
+
+    mnhtesto_metrics_type(m,
+                          "mnhtesto_threads",
+                          "gauge",
+                          "Request threads of the FastCGI app.");
+    mnhtesto_metrics_begin(m, "mnhtesto_threads");
+    mnhtesto_metrics_u64(m, (uint64_t)totals.nthreads);
+
+    if (shed_latency > 0) {
+        mnhtesto_metrics_type(m,
+                              "mnhtesto_shed_total",
+                              "counter",
+                              "Requests shed by priority class.");
+        for (i = 0; i < countof(totals.nshed); ++i) {
+            mnhtesto_metrics_begin(m, "mnhtesto_shed_total");
+            mnhtesto_metrics_label_int(m, "class", (int)i);
+            mnhtesto_metrics_u64(m, totals.nshed[i]);
+        }
+        mnhtesto_metrics_type(m,
+                              "mnhtesto_shed_limit",
+                              "gauge",
+                              "Adaptive limit of the requests served at "
+                              "once.");
+        mnhtesto_metrics_begin(m, "mnhtesto_shed_limit");
+        mnhtesto_metrics_double(m, totals.shed_limit);
+    }
+
+    render_histograms(m,
+                      "mnhtesto_service_seconds",
+                      "Request handling time less the timed waits.",
+                      false);
+    render_histograms(m,
+                      "mnhtesto_overshoot_seconds",
+                      "Lateness of the timed waits of a request.",
+                      true);
+
+    render_quota_counts(m,
+                        "mnhtesto_quota_accepted_total",
+                        "Requests within the quota.",
+                        false);
+    render_quota_counts(m,
+                        "mnhtesto_quota_rejected_total",
+                        "Requests over the quota.",
+                        true);
+
+    if (dquotas.ntmpls > 0 && dquotas.state != NULL) {
+        mnhtesto_metrics_type(m,
+                              "mnhtesto_dynamic_quotas",
+                              "gauge",
+                              "Quotas instantiated from templates.");
+        mnhtesto_metrics_begin(m, "mnhtesto_dynamic_quotas");
+        mnhtesto_metrics_u64(m, dquotas.state->nused);
+        mnhtesto_metrics_type(m,
+                              "mnhtesto_dynamic_quota_evictions_total",
+                              "counter",
+                              "Idle dynamic quotas evicted for new keys.");
+        mnhtesto_metrics_begin(m, "mnhtesto_dynamic_quota_evictions_total");
+        mnhtesto_metrics_u64(m, dquotas.state->nevicted);
     }
+}
 
-    params.tts = (int)(1 << params.delay);
 
-    if (mnhtesto_update_quota(req, params.clen, &ra) != 0) {
-        if (ra > 0.0l) {
-            if (MRKUNLIKELY((res = mnfcgi_request_field_addf(
-                                req,
-                                MNFCGI_FADD_OVERRIDE,
-                                &_retry_after,
-                                "%d",
-                                (int)(ra + 1.0l))) != 0)) {
-                goto end;
-            }
-        }
-        mnfcgi_app_error(req, 429, &_too_much);
-        update_stats(req, 429, 0);
-        goto end;
+static ssize_t
+mnhtesto_metrics_body(mnfcgi_record_t *rec,
+                      mnbytestream_t *bs,
+                      UNUSED void *udata)
+{
+    ssize_t res;
+    size_t *offset = mnfcgi_stdout_get_udata(rec);
+    size_t sz;
+
+    sz = MIN(MNHTESTO_BODY_CHUNK, metrics.sz - *offset);
+    res = mnfcgi_cat(bs, sz, metrics.buf + *offset);
+    *offset += sz;
+    return res;
+}
+
+
+/*
+ * Cumulative counters, and the latency histograms, of all of the
+ * workers, in the Prometheus text format.  A scrape while another is
+ * being rendered or sent gets 503.
+ */
+static int
+mnhtesto_metrics_get(mnfcgi_request_t *req, RESERVED void *__udata)
+{
+    int res = 0;
+    size_t offset;
+
+    if (scraping) {
+        mnfcgi_app_error(req, 503, &_service_unavailable);
+        return 0;
     }
+    scraping = true;
 
+    mnhtesto_collect_stats();
+    render_metrics(&metrics);
 
     if (MRKUNLIKELY((res = mnfcgi_request_status_set(req, 200, &_ok)) != 0)) {
         goto end;
     }
-
+    if (MRKUNLIKELY((res = mnfcgi_request_field_addb(req,
+                                                     MNFCGI_FADD_OVERRIDE,
+                                                     &_content_type,
+                                                     &_text_plain)) != 0)) {
+        goto end;
+    }
     if (MRKUNLIKELY((res = mnfcgi_request_field_addf(
                         req,
                         MNFCGI_FADD_OVERRIDE,
                         &_content_length,
-                        "%d",
-                        params.clen)) != 0)) {
+                        "%zu",
+                        metrics.sz)) != 0)) {
         goto end;
     }
-
     if (MRKUNLIKELY((res = mnfcgi_request_headers_end(req)) != 0)) {
         goto end;
     }
 
-    //CTRACE("bsize=%d delay=%d clen=%d(%08x) tts=%d",
-    //       params.bsize,
-    //       params.delay,
-    //       params.clen,
-    //       params.clen,
-    //       params.tts);
-
-
-    if (mrkthr_sleep(params.tts) != 0) {
-        return 0;
-    }
-
-    while (params.offset < params.clen) {
-        if ((res = mnfcgi_render_stdout(req, mnhtesto_body, &params)) != 0) {
+    for (offset = 0; offset < metrics.sz;) {
+        if ((res = mnfcgi_render_stdout(req,
+                                        mnhtesto_metrics_body,
+                                        &offset)) != 0) {
             break;
         }
     }
-    update_stats(req, 200, params.clen);
-
 
 end:
+    scraping = false;
     return res;
 }
 
 
+int
+mnhtesto_params_complete(mnfcgi_request_t *req, void *udata)
+{
+    mnbytes_t *script_name;
+
+    /*
+     * reserved, regardless of the routes
+     */
+    if ((script_name = mnfcgi_request_get_param(req, &_script_name)) !=
+            NULL &&
+        strcmp(BCDATA(script_name), BCDATA(&__metrics)) == 0) {
+        req->udata = mnhtesto_metrics_get;
+        return 0;
+    }
+
+    if (request_route(req) != NULL) {
+        req->udata = mnhtesto_root_get;
+        return 0;
+    }
+    return mnfcgi_app_params_complete_select_exact(req, udata);
+}
+
+
 int
 mnhtesto_stdin_end(mnfcgi_request_t *req, void *udata)
 {
     mnfcgi_app_callback_t cb;
+    mnhtesto_reqctx_t ctx;
 
     (void)mnfcgi_request_field_addf(req, 0,
             &_server, "%s/%s", PACKAGE, VERSION);
@@ -357,7 +1669,21 @@ mnhtesto_stdin_end(mnfcgi_request_t *req, void *udata)
             &_pragma, &_no_cache);
 
     if ((cb = req->udata) != NULL) {
+        /*
+         * once the callback is taken, udata is what the request
+         * holds till it is finished
+         */
+        ctx.held.n = 0;
+        ctx.admitted = false;
+        req->udata = &ctx;
         (void)cb(req, udata);
+        inflight_release(&ctx.held);
+        if (ctx.admitted) {
+            /* the lag of the loop is in the lateness of the waits */
+            mnhtesto_shedder_done(&shedder,
+                                  reqstat_service(&ctx.rs) +
+                                      ctx.rs.overshoot);
+        }
 
     } else {
         mnfcgi_app_error(req, 501, &_not_implemented);
@@ -386,15 +1712,20 @@ static mnfcgi_app_endpoint_table_t endpoints[] = {
     { &__qwe9, {mnhtesto_root_get, NULL,} },
     { &__qwea, {mnhtesto_root_get, NULL,} },
     { &__qweb, {mnhtesto_root_get, NULL,} },
+    { &__metrics, {mnhtesto_metrics_get, NULL,} },
 };
 
 
 static int
-quota_item_init(UNUSED mnbytes_t *qname,
+quota_item_init(mnbytes_t *qname,
+                mnhtesto_quota_spec_t *spec,
                 mnhtesto_quota_t *quota,
                 UNUSED void *udata)
 {
-    quota_init(quota, MRKTHR_GET_NOW_SEC());
+    mnhtesto_quota_init(spec,
+                        quota,
+                        mrkthr_get_now_nsec(),
+                        bytes_hash(qname));
     return 0;
 }
 
@@ -404,6 +1735,7 @@ mnhtesto_app_init(mnfcgi_app_t *app)
 {
     unsigned i;
 
+    fcgi_app = app;
     for (i = 0; i < countof(endpoints); ++i) {
         if (MRKUNLIKELY(mnfcgi_app_register_endpoint(app,
                                                      &endpoints[i])) != 0) {
@@ -411,155 +1743,559 @@ mnhtesto_app_init(mnfcgi_app_t *app)
         }
     }
 
-    for (i = 0; i < countof(d); ++i) {
-        d[i] = 'Y';
+    if (quotas.shm != NULL) {
+        uint32_t id;
+
+        /*
+         * shared quota states are zero until the first worker to come
+         * up gets to them, unless restored from the state file
+         */
+        for (id = 0; id < quotas.nelems; ++id) {
+            mnhtesto_quota_t *quota;
+
+            quota = MNHTESTO_QTABLE_QUOTA(&quotas, id);
+            MNHTESTO_QTABLE_LOCK(&quotas, id);
+            if (quota->ts == 0 && quota->value == 0) {
+                (void)quota_item_init(MNHTESTO_QTABLE_QNAME(&quotas, id),
+                                      MNHTESTO_QTABLE_SPEC(&quotas, id),
+                                      quota,
+                                      NULL);
+            }
+            MNHTESTO_QTABLE_UNLOCK(&quotas, id);
+        }
+
+    } else if (quotas.map == NULL) {
+        /*
+         * mapped quota states survive app restarts
+         */
+        (void)mnhtesto_qtable_traverse(
+            &quotas,
+            (mnhtesto_qtable_traverser_t)quota_item_init,
+            NULL);
+        if (state_file != NULL &&
+            mnhtesto_qtable_map(&quotas, state_file) != 0) {
+            CTRACE("failed to map %s, quota states will not persist",
+                   state_file);
+        }
+    }
+    return 0;
+}
+
+
+static void
+reload_yield(void)
+{
+    (void)mrkthr_yield();
+}
+
+
+/*
+ * Parse quotas from src into table.  Src is either a quota
+ * specification, or "@" followed by the name of a quota file, or a
+ * quota image.  When reloading, yield to other threads every
+ * MNHTESTO_RELOAD_CHUNK quotas.
+ */
+static int
+load_quotas(mnhtesto_qtable_t *table, const char *src, bool reload)
+{
+    int res;
+
+    if (*src == '@') {
+        res = mnhtesto_qload_file(table,
+                                  src + 1,
+                                  MNHTESTO_RELOAD_CHUNK,
+                                  reload ? reload_yield : NULL);
+
+    } else {
+        char *s;
+
+        if ((s = strdup(src)) == NULL) {
+            FAIL("strdup");
+        }
+        res = mnhtesto_qload_line(table, s);
+        free(s);
+    }
+
+    TRRET(res);
+}
+
+
+/*
+ * Load quotas at startup, and remember src for reloads.
+ */
+int
+mnhtesto_add_quotas(const char *src)
+{
+    int res;
+    mnbytes_t **s;
+
+    if ((res = load_quotas(&quotas, src, false)) != 0) {
+        return res;
     }
 
-    hash_traverse(&quotas, (hash_traverser_t)quota_item_init, NULL);
+    if (MRKUNLIKELY((s = array_incr(&quota_sources)) == NULL)) {
+        FAIL("array_incr");
+    }
+    *s = bytes_new_from_str(src);
+    BYTES_INCREF(*s);
     return 0;
 }
 
 
-/**
- * Quota specification:
- *  name ":" denominator "/"
- *
+/*
+ * Rebuild the quota table from the quota sources off the hot path,
+ * and swap it in.  Quota states are carried over for the keys whose
+ * spec is unchanged.  The old keys are looked up in chunks, yielding
+ * in between, and their states and counters are copied right before
+ * the swap, with no yield, so that no update of the meantime is lost.
  */
 int
-parse_quota(char *s)
+mnhtesto_reload_quotas(void)
 {
     int res = 0;
-    char *p;
-    mnbytes_t *qname = NULL;
-    mnbytes_t *denom = NULL;
-    mnbytes_t *divisor = NULL;
-    mnbytes_t *poena_factor = NULL;
-    mnbytes_t *flags = NULL;
-    mnhtesto_quota_t *quota;
-    mnhash_item_t *hit;
+    mnhtesto_qtable_t table, old;
+    mnarray_iter_t it;
+    mnbytes_t **s;
+    uint32_t *oids;
+    uint64_t now;
+    uint32_t id;
+
+    if (reloading) {
+        CTRACE("quota reload is already in progress");
+        return 0;
+    }
+    if (quotas.shm != NULL) {
+        CTRACE("quotas are shared by the workers, restart to reload");
+        return 0;
+    }
+    reloading = true;
 
-    if ((p = strchr(s, ':')) == NULL) {
-        goto err;
-    }
-    *p = '\0';
-    qname = bytes_new_from_str(s);
-
-    s = ++p;
-    if ((p = strchr(s, '/')) == NULL) {
-        goto err;
-    }
-    *p = '\0';
-    denom = bytes_new_from_str(s);
-
-    s = ++p;
-    if ((p = strchr(s, ':')) != NULL) {
-        *p = '\0';
-        divisor = bytes_new_from_str(s);
-        s = ++p;
-        if ((p = strchr(s, ':')) != NULL) {
-            *p = '\0';
-            poena_factor = bytes_new_from_str(s);
-            s = ++p;
-            flags = bytes_new_from_str(s);
-        } else {
-            poena_factor = bytes_new_from_str(s);
+    mnhtesto_qtable_init(&table, quotas.nelems);
+
+    for (s = array_first(&quota_sources, &it);
+         s != NULL;
+         s = array_next(&quota_sources, &it)) {
+        if ((res = load_quotas(&table, BCDATA(*s), true)) != 0) {
+            CTRACE("failed to reload quotas from %s", BDATA(*s));
+            mnhtesto_qtable_fini(&table);
+            goto end;
         }
-    } else {
-        divisor = bytes_new_from_str(s);
+    }
+    if ((res = mnhtesto_qtable_link(&table)) != 0) {
+        CTRACE("failed to link the reloaded quotas");
+        mnhtesto_qtable_fini(&table);
+        goto end;
     }
 
-    if ((quota = malloc(sizeof(mnhtesto_quota_t))) == NULL) {
+    if ((oids = malloc(sizeof(uint32_t) * MAX(table.nelems, 1))) == NULL) {
         FAIL("malloc");
     }
+    now = mrkthr_get_now_nsec();
+    for (id = 0; id < table.nelems; ++id) {
+        mnbytes_t *qname;
+        mnhtesto_quota_spec_t *spec;
+
+        qname = MNHTESTO_QTABLE_QNAME(&table, id);
+        spec = MNHTESTO_QTABLE_SPEC(&table, id);
+
+        oids[id] = mnhtesto_qtable_get(&quotas, qname);
+        mnhtesto_quota_init(spec,
+                            MNHTESTO_QTABLE_QUOTA(&table, id),
+                            now,
+                            bytes_hash(qname));
+
+        if (id % MNHTESTO_RELOAD_CHUNK == MNHTESTO_RELOAD_CHUNK - 1) {
+            (void)mrkthr_yield();
+            now = mrkthr_get_now_nsec();
+        }
+    }
+
+    /*
+     * overuse records and heavy hitters refer to the old key ids
+     */
+    mnhtesto_overuse_flush();
+    mnhtesto_topk_init(&consumers);
+    mnhtesto_topk_init(&offenders);
+
+    /*
+     * counters are by key, whatever the spec
+     */
+    for (id = 0; id < table.nelems; ++id) {
+        if (oids[id] == MNHTESTO_QTABLE_NONE) {
+            continue;
+        }
+        if (memcmp(MNHTESTO_QTABLE_SPEC(&table, id),
+                   MNHTESTO_QTABLE_SPEC(&quotas, oids[id]),
+                   sizeof(mnhtesto_quota_spec_t)) == 0) {
+            *MNHTESTO_QTABLE_QUOTA(&table, id) =
+                *MNHTESTO_QTABLE_QUOTA(&quotas, oids[id]);
+        }
+        *MNHTESTO_QTABLE_COUNT(&table, id) =
+            *MNHTESTO_QTABLE_COUNT(&quotas, oids[id]);
+    }
+    free(oids);
+
+    old = quotas;
+    quotas = table;
+    mnhtesto_dtable_bind(&dquotas, &quotas, &old);
+    mnhtesto_qtable_fini(&old);
+    if (state_file != NULL &&
+        mnhtesto_qtable_map(&quotas, state_file) != 0) {
+        CTRACE("failed to map %s, quota states will not persist",
+               state_file);
+    }
+    CTRACE("reloaded %zu quotas", quotas.nelems);
+
+end:
+    reloading = false;
+    return res;
+}
+
+
+/*
+ * Define a latency distribution, name=spec.  Names starting with "/"
+ * are the endpoint defaults.
+ */
+int
+mnhtesto_add_latency(const char *s)
+{
+    const char *p;
+    mnbytes_t *name;
+    mnhtesto_latency_t *lat;
 
-    if (mnhtest_unit_parse(&quota->spec.denom_unit,
-                           denom,
-                           &quota->spec.denom) == NULL) {
-        goto err;
+    if ((p = strchr(s, '=')) == NULL || p == s) {
+        TRRET(MNHTESTO_ADD_LATENCY + 1);
+    }
+    if ((lat = malloc(sizeof(mnhtesto_latency_t))) == NULL) {
+        FAIL("malloc");
+    }
+    if (mnhtesto_latency_parse(lat, p + 1) != 0) {
+        free(lat);
+        TRRET(MNHTESTO_ADD_LATENCY + 2);
     }
+    name = bytes_new_from_str_len(s, p - s);
+    if (hash_get_item(&latencies, name) != NULL) {
+        BYTES_DECREF(&name);
+        mnhtesto_latency_fini(lat);
+        free(lat);
+        TRRET(MNHTESTO_ADD_LATENCY + 3);
+    }
+    BYTES_INCREF(name);
+    hash_set_item(&latencies, name, lat);
+    return 0;
+}
+
 
-    if (mnhtest_unit_parse(&quota->spec.divisor_unit,
-                           divisor,
-                           &quota->spec.divisor) == NULL) {
-        goto err;
+/*
+ * Add a quota selector, see selector.h.  Selectors are tried in the
+ * order added, before the request header.
+ */
+int
+mnhtesto_add_selector(const char *s)
+{
+    if (nselectors == countof(selectors)) {
+        TRRET(MNHTESTO_ADD_SELECTOR + 1);
+    }
+    if (mnhtesto_selector_parse(&selectors[nselectors], s) != 0) {
+        TRRET(MNHTESTO_ADD_SELECTOR + 2);
     }
+    ++nselectors;
+    return 0;
+}
 
-    if (poena_factor != NULL) {
-        double pf;
 
-        if ((pf = strtod(BCDATA(poena_factor), NULL)) == 0.0) {
-            if (errno != ERANGE) {
-                quota->spec.poena_factor = pf;
-            }
-        } else {
-            quota->spec.poena_factor = pf;
-        }
-    } else {
-        /* default */
-        quota->spec.poena_factor = MNHTESTO_DEFAULT_POENA_FACTOR;
+/*
+ * Load routes from the file at path, and recompile the routing trie.
+ */
+int
+mnhtesto_add_routes(const char *path)
+{
+    if (mnhtesto_routes_load(&routes, path) != 0) {
+        TRRET(MNHTESTO_ADD_ROUTES + 1);
+    }
+    if (mnhtesto_routes_compile(&routes) != 0) {
+        TRRET(MNHTESTO_ADD_ROUTES + 2);
     }
+    return 0;
+}
 
-    quota->spec.flags = 0;
-    if (flags != NULL) {
-        unsigned char *p;
 
-        for (p = BDATA(flags); *p != '\0'; ++p) {
-            switch (*p) {
-            case 'h':
-                quota->spec.flags |= MNHTESTO_QF_SENDRA;
-                break;
+static int
+quota_item_clear(UNUSED mnbytes_t *qname,
+                 UNUSED mnhtesto_quota_spec_t *spec,
+                 mnhtesto_quota_t *quota,
+                 UNUSED void *udata)
+{
+    memset(quota, 0, sizeof(mnhtesto_quota_t));
+    return 0;
+}
 
-            default:
-                break;
-            }
-        }
+
+/*
+ * Link the quotas to their parents, make room for the stats of n
+ * workers, and for the dynamic quotas, and, if the workers are to be
+ * forked, share the quotas with them.  Call once the quotas are
+ * loaded, before forking.
+ */
+int
+mnhtesto_workers_init(unsigned n)
+{
+    if (mnhtesto_qtable_link(&quotas) != 0) {
+        TRRET(MNHTESTO_WORKERS_INIT + 2);
+    }
+
+    nworkers = n;
+    mnhtesto_dtable_init(&dquotas, dquota_cap, n > 0);
+    mnhtesto_dtable_bind(&dquotas, &quotas, NULL);
+    mnhtesto_shaper_init(&shaper, shape_depth, shape_wait * 1000000ul);
+    mnhtesto_inflight_init(&inflight);
+    mnhtesto_shaper_init(&iparked, SIZE_MAX, 0);
+    mnhtesto_shedder_init(&shedder, shed_latency * 1000000ul, shed_max);
+    wstats = mnhtesto_wstats_new(MAX(n, 1));
+    if ((wscratch = malloc(sizeof(mnhtesto_wstats_t))) == NULL) {
+        FAIL("malloc");
+    }
+    if ((totals.ticks = calloc(MAX(n, 1), sizeof(uint64_t))) == NULL) {
+        FAIL("calloc");
     }
 
-    if ((hit = hash_get_item(&quotas, qname)) != NULL) {
+    if (n > 0) {
         /*
-         * duplicate quota
+         * the workers initialize the states, see mnhtesto_app_init()
          */
-        goto err;
+        (void)mnhtesto_qtable_traverse(
+            &quotas,
+            (mnhtesto_qtable_traverser_t)quota_item_clear,
+            NULL);
+        if (state_file != NULL &&
+            mnhtesto_qtable_map(&quotas, state_file) != 0) {
+            CTRACE("failed to map %s, quota states will not persist",
+                   state_file);
+        }
+        if (mnhtesto_qtable_share(&quotas) != 0) {
+            TRRET(MNHTESTO_WORKERS_INIT + 1);
+        }
     }
+    return 0;
+}
 
-    BYTES_INCREF(qname);
-    hash_set_item(&quotas, qname, quota);
 
-    //CTRACE("pf %s/%lf fl %s/%08x",
-    //       BDATASAFE(poena_factor),
-    //       quota->spec.poena_factor,
-    //       BDATASAFE(flags),
-    //       quota->spec.flags);
+/*
+ * In the parent, once the worker pid is gone: free the shared locks it
+ * held, the states under them are left as is.
+ */
+void
+mnhtesto_worker_gone(pid_t pid)
+{
+    size_t n;
 
-end:
-    BYTES_DECREF(&denom);
-    BYTES_DECREF(&divisor);
-    BYTES_DECREF(&poena_factor);
-    BYTES_DECREF(&flags);
-    TRRET(res);
+    n = mnhtesto_qtable_break(&quotas, (uint32_t)pid);
+    if (dquotas.shared &&
+        mnhtesto_qtable_break_lock(&dquotas.state->lock, (uint32_t)pid)) {
+        ++n;
+    }
+    if (n > 0) {
+        CTRACE("broke %zu quota locks held by %d", n, (int)pid);
+    }
+}
+
+
+/*
+ * In the forked worker idx, before mrkthr_init().  A respawned worker
+ * carries on from the stats it last published.
+ */
+void
+mnhtesto_worker_start(unsigned idx)
+{
+    mnhtesto_wstats_t *w;
+    size_t i;
 
-err:
-    BYTES_DECREF(&qname);
-    res = PARSE_QUOTA + 1;
-    goto end;
+    worker = idx;
+    mnhtesto_qtable_owner();
+
+    /*
+     * the timer is the parent's
+     */
+    mnhtesto_pacer_fini();
+    mnhtesto_pacer_init();
+
+    w = &wstats[idx];
+    if (w->seq & 1) {
+        /* gone while publishing */
+        mnhtesto_wstats_end(w);
+    }
+    memcpy(nreq, w->nreq, sizeof(nreq));
+    memcpy(nbytes, w->nbytes, sizeof(nbytes));
+    memcpy(shedder.nshed, w->nshed, sizeof(shedder.nshed));
+    for (i = 0; i < w->nrstats; ++i) {
+        mnhtesto_rstats_merge(&rstats, &w->rstats[i]);
+    }
 }
 
 
+/*
+ * Copy the stats of this worker to its slot.  The heavy hitters go at
+ * the end of an interval only, and start over.  Histograms are copied
+ * only as they change.
+ */
 static void
-mnhtesto_quota_destroy(mnhtesto_quota_t **quota)
+publish_stats(bool interval)
+{
+    mnhtesto_wstats_t *w;
+    size_t i;
+
+    w = &wstats[worker];
+    mnhtesto_wstats_begin(w);
+    w->pid = getpid();
+    w->nthreads = fcgi_app != NULL ?
+        mnfcgi_app_get_stats(fcgi_app)->nthreads : 0;
+    memcpy(w->nreq, nreq, sizeof(nreq));
+    memcpy(w->nbytes, nbytes, sizeof(nbytes));
+    memcpy(w->nshed, shedder.nshed, sizeof(shedder.nshed));
+    w->shed_limit = shedder.limit;
+    for (i = 0; i < rstats.nentries; ++i) {
+        mnhtesto_rstat_t *rstat;
+
+        rstat = rstats.entries[i];
+        if (i < w->nrstats &&
+            w->rstats[i].service.count == rstat->service.count &&
+            w->rstats[i].overshoot.count == rstat->overshoot.count) {
+            continue;
+        }
+        w->rstats[i] = *rstat;
+    }
+    w->nrstats = rstats.nentries;
+    if (interval) {
+        w->consumers = consumers;
+        w->offenders = offenders;
+        ++w->tick;
+        mnhtesto_topk_init(&consumers);
+        mnhtesto_topk_init(&offenders);
+    }
+    mnhtesto_wstats_end(w);
+}
+
+
+void
+mnhtesto_publish_stats(void)
+{
+    publish_stats(true);
+}
+
+
+/*
+ * Rebuild totals from the slots of all of the workers.  Counters and
+ * histograms are summed anew, the heavy hitters of each interval are
+ * merged once.  The stats of other workers are as of their last
+ * publication.  A copy torn by a busy worker is off by what it did
+ * meanwhile.
+ */
+void
+mnhtesto_collect_stats(void)
+{
+    unsigned i;
+    size_t j;
+
+    publish_stats(false);
+
+    memset(totals.nreq, 0, sizeof(totals.nreq));
+    memset(totals.nbytes, 0, sizeof(totals.nbytes));
+    totals.nthreads = 0;
+    memset(totals.nshed, 0, sizeof(totals.nshed));
+    totals.shed_limit = 0.0;
+    for (j = 0; j < totals.rstats.nentries; ++j) {
+        mnhtesto_hdr_init(&totals.rstats.entries[j]->service);
+        mnhtesto_hdr_init(&totals.rstats.entries[j]->overshoot);
+    }
+
+    for (i = 0; i < MAX(nworkers, 1); ++i) {
+        if (mnhtesto_wstats_read(&wstats[i], wscratch) != 0) {
+            CTRACE("worker %u is busy, its stats may be off", i);
+        }
+        for (j = 0; j < countof(totals.nreq); ++j) {
+            totals.nreq[j] += wscratch->nreq[j];
+            totals.nbytes[j] += wscratch->nbytes[j];
+        }
+        totals.nthreads += wscratch->nthreads;
+        for (j = 0; j < countof(totals.nshed); ++j) {
+            totals.nshed[j] += wscratch->nshed[j];
+        }
+        totals.shed_limit += wscratch->shed_limit;
+        for (j = 0; j < wscratch->nrstats; ++j) {
+            mnhtesto_rstats_merge(&totals.rstats, &wscratch->rstats[j]);
+        }
+        if (wscratch->tick != totals.ticks[i]) {
+            totals.ticks[i] = wscratch->tick;
+            mnhtesto_topk_merge(&totals.consumers, &wscratch->consumers);
+            mnhtesto_topk_merge(&totals.offenders, &wscratch->offenders);
+        }
+    }
+}
+
+
+/*
+ * The name of the quota of the heavy hitter key, a new reference, its
+ * first limit, and a copy of the state of the limit.  A dynamic quota
+ * is named by its key, and has no limit if evicted since, then it is
+ * named by its hash.
+ */
+mnbytes_t *
+mnhtesto_topk_quota(uint64_t key,
+                    mnhtesto_quota_spec_t **spec,
+                    mnhtesto_quota_t *quota)
 {
-    if (*quota != NULL) {
-        free(*quota);
-        *quota = NULL;
+    mnbytes_t *qname;
+    mnhtesto_dquota_t *dq;
+    uint64_t hash;
+
+    *spec = NULL;
+    if (!(key & MNHTESTO_TOPK_DQUOTA)) {
+        if (key >= quotas.nelems) {
+            qname = bytes_printf("#%" PRIu64, key);
+        } else {
+            qname = MNHTESTO_QTABLE_QNAME(&quotas, (uint32_t)key);
+            *spec = MNHTESTO_QTABLE_SPEC(&quotas, (uint32_t)key);
+            *quota = *MNHTESTO_QTABLE_QUOTA(&quotas, (uint32_t)key);
+        }
+        BYTES_INCREF(qname);
+        return qname;
+    }
+
+    /*
+     * the top bit of the hash is that of the key
+     */
+    hash = key & ~MNHTESTO_TOPK_DQUOTA;
+    MNHTESTO_DTABLE_LOCK(&dquotas);
+    if ((dq = mnhtesto_dtable_find(&dquotas, hash)) == NULL) {
+        dq = mnhtesto_dtable_find(&dquotas, key);
+    }
+    if (dq != NULL) {
+        qname = bytes_printf("%.*s", (int)dq->len, dq->key);
+        *spec = MNHTESTO_QTABLE_SPEC(&quotas, dq->tmpl);
+        *quota = dq->quota[0];
+    } else {
+        qname = bytes_printf("%016" PRIx64, hash);
     }
+    MNHTESTO_DTABLE_UNLOCK(&dquotas);
+    BYTES_INCREF(qname);
+    return qname;
 }
 
 
 static int
-quota_item_finalizer(mnbytes_t *key, mnhtesto_quota_t *quota)
+latency_item_fini(mnbytes_t *key, mnhtesto_latency_t *lat)
 {
     BYTES_DECREF(&key);
-    mnhtesto_quota_destroy(&quota);
+    mnhtesto_latency_fini(lat);
+    free(lat);
+    return 0;
+}
+
+
+static int
+quota_source_fini(mnbytes_t **s)
+{
+    BYTES_DECREF(s);
     return 0;
 }
 
@@ -567,17 +2303,56 @@ quota_item_finalizer(mnbytes_t *key, mnhtesto_quota_t *quota)
 void
 mnhtesto_init(void)
 {
-    hash_init(&quotas,
+    mnhtesto_pacer_init();
+    mnhtesto_qtable_init(&quotas, 0);
+    if (array_init(&quota_sources,
+                   sizeof(mnbytes_t *),
+                   0,
+                   NULL,
+                   (array_finalizer_t)quota_source_fini) != 0) {
+        FAIL("array_init");
+    }
+    hash_init(&latencies,
               17,
               (hash_hashfn_t)bytes_hash,
               (hash_item_comparator_t)bytes_cmp,
-              (hash_item_finalizer_t)quota_item_finalizer);
-
+              (hash_item_finalizer_t)latency_item_fini);
+    mnhtesto_routes_init(&routes);
+    mnhtesto_rstats_init(&rstats);
+    mnhtesto_metrics_init(&metrics);
+    mnhtesto_topk_init(&consumers);
+    mnhtesto_topk_init(&offenders);
+    memset(&totals, 0, sizeof(totals));
+    mnhtesto_rstats_init(&totals.rstats);
+    mnhtesto_topk_init(&totals.consumers);
+    mnhtesto_topk_init(&totals.offenders);
 }
 
 
 void
 mnhtesto_fini(void)
 {
-    hash_fini(&quotas);
+    if (wstats != NULL) {
+        mnhtesto_wstats_destroy(wstats, MAX(nworkers, 1));
+        wstats = NULL;
+    }
+    free(wscratch);
+    wscratch = NULL;
+    free(totals.ticks);
+    totals.ticks = NULL;
+    mnhtesto_dtable_fini(&dquotas);
+    mnhtesto_shaper_fini(&shaper);
+    mnhtesto_inflight_fini(&inflight);
+    mnhtesto_shaper_fini(&iparked);
+    mnhtesto_rstats_fini(&totals.rstats);
+    mnhtesto_metrics_fini(&metrics);
+    mnhtesto_rstats_fini(&rstats);
+    mnhtesto_routes_fini(&routes);
+    while (nselectors > 0) {
+        mnhtesto_selector_fini(&selectors[--nselectors]);
+    }
+    hash_fini(&latencies);
+    (void)array_fini(&quota_sources);
+    mnhtesto_qtable_fini(&quotas);
+    mnhtesto_pacer_fini();
 }
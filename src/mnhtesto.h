@@ -1,81 +1,83 @@
 #ifndef MNHTESTO_H
 #define MNHTESTO_H
 
+#include <sys/types.h>
+
 #include <mnfcgi_app.h>
-#include "units.h"
+#include "bodygen.h"
+#include "dquota.h"
+#include "inflight.h"
+#include "latency.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "quota.h"
+#include "qload.h"
+#include "qtable.h"
+#include "route.h"
+#include "rstats.h"
+#include "selector.h"
+#include "shaper.h"
+#include "shedder.h"
+#include "topk.h"
+#include "workers.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+extern mnbytes_t _x_mnhtesto_quota;
+extern mnbytes_t _x_mnhtesto_priority;
+
 /*
- * quota specification syntax:
- *  quota           ::= qname ":" denom "/" divisor
- *                      [":" poena-factor [":" flags]]
- *  qname           ::= ALNUM
- *  denom           ::= num [s-unit]
- *  divisor         ::= num [t-unit]
- *  s-unit          ::= (s-mult "Bytes") / "Requests"
- *  s-mult          ::= "K" / "M" / "G"
- *  t-unit          ::= "sec" / "min" / "hour" / "day"
- *  poena-factor    ::= FLOATNUM ;; typically [0.0, 1.0], default 1.0
- *  flags           ::= any combination of:
- *                      - "h" send the retry-after: header
+ * Heavy hitter keys are quota key ids, or the hashes of the keys of
+ * dynamic quotas with the top bit set.
  */
-typedef struct _mnhtesto_quota_spec {
-    double denom;
-    mnhtest_unit_t denom_unit;
-    double divisor;
-    mnhtest_unit_t divisor_unit;
-    double poena_factor;
-#define MNHTESTO_QF_SENDRA (0x01)
-    unsigned flags;
-} mnhtesto_quota_spec_t;
-
-
-typedef struct _mnhtesto_quota {
-    mnhtesto_quota_spec_t spec;
-    uint64_t ts;
-    double value;
-    double prorated;
-} mnhtesto_quota_t;
-
-
-#define MNHTESTO_QUOTA_LIMIT(q) \
-    ((q)->spec.denom * (q)->spec.denom_unit.mult)
-
-#define MNHTESTO_QUOTA_UNITS(q) \
-    ((q)->spec.divisor * (q)->spec.divisor_unit.mult)
-
-#define MNHTESTO_QUOTAS(q, _ts) \
-    (((double)(_ts - (q)->ts)) / MNHTESTO_QUOTA_UNITS(q))
-
-
-#define MNHTESTO_QUOTA_PER_UNIT(q)  \
-    (MNHTESTO_QUOTA_LIMIT(q) / MNHTESTO_QUOTA_UNITS(q))
-
-
-#define MNHTESTO_IN_QUOTA(q, _ts)              \
-    INB1((q)->ts,                              \
-         (_ts),                                \
-         ((q)->ts + MNHTESTO_QUOTA_UNITS(q)))  \
-
-
-#define MNHTESTO_QUOTA_PRORATE_PER_UNIT(q, v, _ts)  \
-    ((v) / ((double)(_ts - (q)->ts)))
-
-
-#define MNHTESTO_QUOTA_PRORATE(q, v, _ts)   \
-    (MNHTESTO_QUOTA_PRORATE_PER_UNIT(q, v, _ts) * MNHTESTO_QUOTA_UNITS(q))
+#define MNHTESTO_TOPK_DQUOTA (1ull << 63)
 
+/*
+ * FCGI_STDOUT payload per record, a multiple of 8 so that records need
+ * no padding
+ */
+#define MNHTESTO_BODY_CHUNK (MNFCGI_MAX_PAYLOAD & ~7)
 
-extern mnbytes_t _x_mnhtesto_quota;
+/*
+ * Stats of all of the workers as of the last mnhtesto_collect_stats(),
+ * the heavy hitters are those of the intervals published since they
+ * were last reset.
+ */
+typedef struct _mnhtesto_stats {
+    unsigned long nreq[MNHTESTO_NCODES];
+    unsigned long nbytes[MNHTESTO_NCODES];
+    int nthreads;
+    unsigned long nshed[MNHTESTO_SHED_NCLASSES];
+    /* the sum of those of the workers */
+    double shed_limit;
+    mnhtesto_rstats_t rstats;
+    mnhtesto_topk_t consumers;
+    mnhtesto_topk_t offenders;
+    /* the last tick merged, per worker */
+    uint64_t *ticks;
+} mnhtesto_stats_t;
 
 void mnhtesto_init(void);
 void mnhtesto_fini(void);
-int parse_quota(char *);
+int mnhtesto_add_quotas(const char *);
+int mnhtesto_reload_quotas(void);
+int mnhtesto_add_latency(const char *);
+int mnhtesto_add_routes(const char *);
+int mnhtesto_add_selector(const char *);
+void mnhtesto_overuse_flush(void);
+int mnhtesto_params_complete(mnfcgi_request_t *, void *);
 int mnhtesto_stdin_end(mnfcgi_request_t *, void *);
 int mnhtesto_app_init(mnfcgi_app_t *);
+int mnhtesto_workers_init(unsigned);
+void mnhtesto_worker_start(unsigned);
+void mnhtesto_worker_gone(pid_t);
+void mnhtesto_publish_stats(void);
+void mnhtesto_collect_stats(void);
+mnbytes_t *mnhtesto_topk_quota(uint64_t,
+                               mnhtesto_quota_spec_t **,
+                               mnhtesto_quota_t *);
 
 #ifdef __cplusplus
 }
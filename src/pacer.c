@@ -0,0 +1,198 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include <mrkthr.h>
+
+#include "diag.h"
+#include "config.h"
+
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
+#include "pacer.h"
+#include "twheel.h"
+
+#define PACER_USEC (1000ul)
+
+/* in microseconds */
+static mnhtesto_twheel_t wheel;
+#ifdef HAVE_SYS_TIMERFD_H
+static int tfd = -1;
+/* the wheel tick the timer is armed at */
+static uint64_t armed = MNHTESTO_TWHEEL_NEVER;
+#else
+/* the pacer is idle while there are no waiters */
+static mrkthr_cond_t kick;
+#endif
+
+
+uint64_t
+mnhtesto_pacer_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+
+void
+mnhtesto_pacer_init(void)
+{
+    mnhtesto_twheel_init(&wheel, mnhtesto_pacer_now() / PACER_USEC);
+#ifdef HAVE_SYS_TIMERFD_H
+    if ((tfd = timerfd_create(CLOCK_MONOTONIC,
+                              TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+        FAIL("timerfd_create");
+    }
+    armed = MNHTESTO_TWHEEL_NEVER;
+#else
+    mrkthr_cond_init(&kick);
+#endif
+}
+
+
+void
+mnhtesto_pacer_fini(void)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+    if (tfd != -1) {
+        (void)close(tfd);
+        tfd = -1;
+    }
+#else
+    mrkthr_cond_fini(&kick);
+#endif
+}
+
+
+#ifdef HAVE_SYS_TIMERFD_H
+/*
+ * Re-arm the timer if the next wheel event has changed.
+ */
+static void
+pacer_arm(void)
+{
+    uint64_t next;
+    struct itimerspec its = {{0, 0}, {0, 0}};
+
+    if ((next = mnhtesto_twheel_next(&wheel)) == armed) {
+        return;
+    }
+    if (next != MNHTESTO_TWHEEL_NEVER) {
+        its.it_value.tv_sec = next / (1000000000ul / PACER_USEC);
+        its.it_value.tv_nsec = next % (1000000000ul / PACER_USEC) * PACER_USEC;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+            /* zero disarms */
+            its.it_value.tv_nsec = 1;
+        }
+    }
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+        FAIL("timerfd_settime");
+    }
+    armed = next;
+}
+#endif
+
+
+static void
+pacer_fire(mnhtesto_timer_t *timer, UNUSED void *udata)
+{
+    mrkthr_cond_signal_one(timer->udata);
+}
+
+
+int
+mnhtesto_pacer_run(UNUSED int argc, UNUSED void **argv)
+{
+    while (true) {
+#ifdef HAVE_SYS_TIMERFD_H
+        uint64_t nexp;
+
+        if (mrkthr_wait_for_read(tfd) != 0) {
+            break;
+        }
+        /* the expiration count, or EAGAIN if re-armed meanwhile */
+        (void)read(tfd, &nexp, sizeof(nexp));
+        armed = MNHTESTO_TWHEEL_NEVER;
+#else
+        if (wheel.ntimers == 0) {
+            if (mrkthr_cond_wait(&kick) != 0) {
+                break;
+            }
+            continue;
+        }
+        if (mrkthr_sleep(1) != 0) {
+            break;
+        }
+#endif
+
+        (void)mnhtesto_twheel_advance(&wheel,
+                                      mnhtesto_pacer_now() / PACER_USEC,
+                                      pacer_fire,
+                                      NULL);
+#ifdef HAVE_SYS_TIMERFD_H
+        pacer_arm();
+#endif
+    }
+
+    return 0;
+}
+
+
+/*
+ * Wait until when (nanoseconds of mnhtesto_pacer_now()) is over, to
+ * the microsecond.
+ */
+int
+mnhtesto_pacer_wait_until(uint64_t when)
+{
+    int res;
+    mrkthr_cond_t cond;
+
+    mrkthr_cond_init(&cond);
+    res = mnhtesto_pacer_wait_on(&cond, when);
+    mrkthr_cond_fini(&cond);
+
+    return res;
+}
+
+
+/*
+ * Wait on cond till it is signalled, or till when is over, the way
+ * mnhtesto_pacer_wait_until() does.
+ */
+int
+mnhtesto_pacer_wait_on(mrkthr_cond_t *cond, uint64_t when)
+{
+    int res;
+    mnhtesto_timer_t timer;
+
+    if (when <= mnhtesto_pacer_now()) {
+        return 0;
+    }
+
+    timer.pprev = NULL;
+    timer.udata = cond;
+    mnhtesto_twheel_add(&wheel, &timer, (when + PACER_USEC - 1) / PACER_USEC);
+#ifdef HAVE_SYS_TIMERFD_H
+    pacer_arm();
+#else
+    if (wheel.ntimers == 1) {
+        mrkthr_cond_signal_one(&kick);
+    }
+#endif
+
+    res = mrkthr_cond_wait(cond);
+    /* interrupted, or signalled before the timer fired */
+    mnhtesto_twheel_del(&wheel, &timer);
+
+    return res;
+}
@@ -0,0 +1,41 @@
+#ifndef MNHTESTO_PACER_H
+#define MNHTESTO_PACER_H
+
+#include <stdint.h>
+
+#include <mrkthr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Timed waits with the microsecond resolution.  Waiters are kept on
+ * a hierarchical timer wheel, and the pacer thread releases them.
+ * Where timerfd is available, the pacer waits on a single timer
+ * armed at the next wheel event, and all the waiters due by then are
+ * released at once.  Otherwise the wheel is advanced every
+ * millisecond while there are waiters.
+ *
+ * The times are in nanoseconds of mnhtesto_pacer_now().  Waits that
+ * need no more than the pacer tick resolution should be rounded to
+ * it, so that they share wakeups.
+ */
+#define MNHTESTO_PACER_TICK_MSEC (10)
+#define MNHTESTO_PACER_TICK (MNHTESTO_PACER_TICK_MSEC * 1000000ul)
+#define MNHTESTO_PACER_TICK_CEIL(t)                                    \
+    (((t) + MNHTESTO_PACER_TICK - 1) / MNHTESTO_PACER_TICK *           \
+     MNHTESTO_PACER_TICK)
+
+void mnhtesto_pacer_init(void);
+void mnhtesto_pacer_fini(void);
+uint64_t mnhtesto_pacer_now(void);
+int mnhtesto_pacer_run(int, void **);
+int mnhtesto_pacer_wait_until(uint64_t);
+int mnhtesto_pacer_wait_on(mrkthr_cond_t *, uint64_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_PACER_H */
@@ -0,0 +1,412 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "qload.h"
+
+
+static uint32_t
+qload_put(mnhtesto_qtable_t *table,
+          const char *qname,
+          const mnhtesto_quota_spec_t *spec)
+{
+    mnbytes_t *q;
+    uint32_t id;
+
+    q = bytes_new_from_str(qname);
+    BYTES_INCREF(q);
+    id = mnhtesto_qtable_put(table, q, spec);
+    BYTES_DECREF(&q);
+    return id;
+}
+
+
+/*
+ * Parse the quota specification s in place, and add it to table, a
+ * key per limit, see mnhtesto_qtable_t.
+ */
+int
+mnhtesto_qload_line(mnhtesto_qtable_t *table, char *s)
+{
+    char *qname, *parent, *limit;
+    uint32_t id;
+    unsigned i;
+
+    if ((limit = strchr(s, ':')) == NULL) {
+        TRRET(MNHTESTO_QLOAD_LINE + 1);
+    }
+    *limit++ = '\0';
+    qname = s;
+    if ((parent = strchr(qname, '^')) != NULL) {
+        *parent++ = '\0';
+        if (*parent == '\0') {
+            TRRET(MNHTESTO_QLOAD_LINE + 3);
+        }
+    }
+
+    for (i = 0, id = MNHTESTO_QTABLE_NONE; limit != NULL; ++i) {
+        mnhtesto_quota_spec_t spec;
+        char *next;
+        uint32_t lid;
+
+        if (i == MNHTESTO_QUOTA_MAX_LIMITS) {
+            TRRET(MNHTESTO_QLOAD_LINE + 4);
+        }
+        if ((next = strchr(limit, ',')) != NULL) {
+            *next++ = '\0';
+        }
+        if (mnhtesto_quota_parse_limit(limit, &spec) != 0) {
+            TRRET(MNHTESTO_QLOAD_LINE + 5);
+        }
+        if (i == 0) {
+            lid = qload_put(table, qname, &spec);
+        } else {
+            char buf[MNHTESTO_QLOAD_LINE_MAX + 8];
+
+            (void)snprintf(buf, sizeof(buf), "%s#%u", qname, i);
+            lid = qload_put(table, buf, &spec);
+        }
+        if (lid == MNHTESTO_QTABLE_NONE) {
+            /*
+             * duplicate quota
+             */
+            TRRET(MNHTESTO_QLOAD_LINE + 2);
+        }
+        if (i == 0) {
+            id = lid;
+        }
+        assert(lid == id + i);
+        limit = next;
+    }
+    MNHTESTO_QTABLE_NLIMITS(table, id) = (uint16_t)i;
+
+    if (parent != NULL) {
+        mnbytes_t *p;
+
+        p = bytes_new_from_str(parent);
+        BYTES_INCREF(p);
+        mnhtesto_qtable_parent(table, id, p);
+        BYTES_DECREF(&p);
+    }
+    return 0;
+}
+
+
+/*
+ * One quota specification per line, empty lines are skipped.
+ */
+static int
+qload_text(mnhtesto_qtable_t *table,
+           const char *buf,
+           size_t sz,
+           unsigned chunk,
+           mnhtesto_qload_yield_t yield)
+{
+    const char *p, *end, *eol;
+    size_t nlines;
+    char line[MNHTESTO_QLOAD_LINE_MAX];
+
+    end = buf + sz;
+    for (p = buf, nlines = 1;
+         (eol = memchr(p, '\n', end - p)) != NULL;
+         p = eol + 1, ++nlines) {
+    }
+    mnhtesto_qtable_reserve(table, nlines);
+
+    for (p = buf, nlines = 0; p < end; p = eol + 1, ++nlines) {
+        size_t len;
+
+        if ((eol = memchr(p, '\n', end - p)) == NULL) {
+            eol = end;
+        }
+        if ((len = eol - p) == 0) {
+            continue;
+        }
+        if (len >= sizeof(line)) {
+            TRRET(MNHTESTO_QLOAD_FILE + 1);
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+
+        if (mnhtesto_qload_line(table, line) != 0) {
+            TRRET(MNHTESTO_QLOAD_FILE + 2);
+        }
+
+        if (yield != NULL && nlines % chunk == chunk - 1) {
+            yield();
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Check the image, and add its keys to table, see qload.h.
+ */
+static int
+qload_image(mnhtesto_qtable_t *table,
+            const mnhtesto_qimage_header_t *h,
+            size_t sz,
+            unsigned chunk,
+            mnhtesto_qload_yield_t yield)
+{
+    int res = 0;
+    uint32_t *spec_ids;
+    mnhtesto_qimage_key_t *keys;
+    char *names;
+    uint32_t first, i;
+
+    if (sz < sizeof(mnhtesto_qimage_header_t) ||
+        h->version != MNHTESTO_QIMAGE_VERSION ||
+        h->specsz != sizeof(mnhtesto_quota_spec_t) ||
+        MNHTESTO_QIMAGE_SIZE(h) != sz ||
+        (h->namesz > 0 && MNHTESTO_QIMAGE_NAMES(h)[h->namesz - 1] != '\0')) {
+        TRRET(MNHTESTO_QLOAD_FILE + 3);
+    }
+
+    if ((spec_ids = malloc(sizeof(uint32_t) * (h->nspecs + 1))) == NULL) {
+        FAIL("malloc");
+    }
+    for (i = 0; i < h->nspecs; ++i) {
+        spec_ids[i] = mnhtesto_qtable_spec_id(table,
+                                              &MNHTESTO_QIMAGE_SPECS(h)[i]);
+    }
+
+    mnhtesto_qtable_reserve(table, h->nkeys);
+    first = table->nelems;
+    keys = MNHTESTO_QIMAGE_KEYS(h);
+    names = MNHTESTO_QIMAGE_NAMES(h);
+    for (i = 0; i < h->nkeys; ++i) {
+        mnbytes_t *q;
+        uint32_t id;
+
+        if (keys[i].spec_id >= h->nspecs ||
+            keys[i].name >= h->namesz ||
+            keys[i].nlimits == 0 ||
+            keys[i].nlimits > MNHTESTO_QUOTA_MAX_LIMITS ||
+            keys[i].nlimits > h->nkeys - i ||
+            (keys[i].parent != MNHTESTO_QTABLE_NONE &&
+             keys[i].parent >= h->namesz)) {
+            res = MNHTESTO_QLOAD_FILE + 4;
+            break;
+        }
+        q = bytes_new_from_str(names + keys[i].name);
+        BYTES_INCREF(q);
+        id = mnhtesto_qtable_put_id(table, q, spec_ids[keys[i].spec_id]);
+        BYTES_DECREF(&q);
+        if (id == MNHTESTO_QTABLE_NONE) {
+            res = MNHTESTO_QLOAD_FILE + 5;
+            break;
+        }
+        assert(id == first + i);
+
+        if (yield != NULL && i % chunk == chunk - 1) {
+            yield();
+        }
+    }
+
+    /*
+     * the keys of the limits of a quota are in a row, as they were
+     */
+    for (i = 0; res == 0 && i < h->nkeys; ++i) {
+        MNHTESTO_QTABLE_NLIMITS(table, first + i) =
+            (uint16_t)keys[i].nlimits;
+        if (keys[i].parent != MNHTESTO_QTABLE_NONE) {
+            mnbytes_t *p;
+
+            p = bytes_new_from_str(names + keys[i].parent);
+            BYTES_INCREF(p);
+            mnhtesto_qtable_parent(table, first + i, p);
+            BYTES_DECREF(&p);
+        }
+    }
+
+    free(spec_ids);
+    TRRET(res);
+}
+
+
+/*
+ * Load the quotas from either a text file or a compiled image at
+ * path.  The file is mapped, and the table is sized for it up front.
+ * If yield is given, it is called every chunk quotas.
+ */
+int
+mnhtesto_qload_file(mnhtesto_qtable_t *table,
+                    const char *path,
+                    unsigned chunk,
+                    mnhtesto_qload_yield_t yield)
+{
+    int res;
+    int fd;
+    struct stat sb;
+    void *buf;
+
+    assert(yield == NULL || chunk > 0);
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        TRRET(MNHTESTO_QLOAD_FILE + 6);
+    }
+    if (fstat(fd, &sb) == -1) {
+        (void)close(fd);
+        TRRET(MNHTESTO_QLOAD_FILE + 7);
+    }
+    if (sb.st_size == 0) {
+        (void)close(fd);
+        return 0;
+    }
+    if ((buf = mmap(NULL,
+                    sb.st_size,
+                    PROT_READ,
+                    MAP_PRIVATE,
+                    fd,
+                    0)) == MAP_FAILED) {
+        (void)close(fd);
+        TRRET(MNHTESTO_QLOAD_FILE + 8);
+    }
+    (void)close(fd);
+    (void)madvise(buf, sb.st_size, MADV_SEQUENTIAL);
+
+    if ((size_t)sb.st_size >= sizeof(uint32_t) &&
+        *(uint32_t *)buf == MNHTESTO_QIMAGE_MAGIC) {
+        res = qload_image(table, buf, sb.st_size, chunk, yield);
+    } else {
+        res = qload_text(table, buf, sb.st_size, chunk, yield);
+    }
+
+    (void)munmap(buf, sb.st_size);
+    TRRET(res);
+}
+
+
+static int
+qimage_write_all(int fd, const void *buf, size_t sz)
+{
+    const char *p;
+
+    for (p = buf; sz > 0;) {
+        ssize_t nwritten;
+
+        if ((nwritten = write(fd, p, sz)) <= 0) {
+            return -1;
+        }
+        p += nwritten;
+        sz -= nwritten;
+    }
+    return 0;
+}
+
+
+/*
+ * The parent of key id by name, linked or not yet, NULL if none.
+ */
+static mnbytes_t *
+qimage_parent(mnhtesto_qtable_t *table, uint32_t id)
+{
+    size_t i;
+
+    if (MNHTESTO_QTABLE_PARENT(table, id) != MNHTESTO_QTABLE_NONE) {
+        return MNHTESTO_QTABLE_QNAME(table,
+                                     MNHTESTO_QTABLE_PARENT(table, id));
+    }
+    for (i = 0; i < table->nlinks; ++i) {
+        if (table->links[i].id == id) {
+            return table->links[i].parent;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Write the quotas of table as a compiled image to path.
+ */
+int
+mnhtesto_qimage_write(mnhtesto_qtable_t *table, const char *path)
+{
+    int res = 0;
+    int fd;
+    mnhtesto_qimage_header_t h;
+    mnhtesto_qimage_key_t *keys;
+    char *names;
+    size_t i, namesz;
+
+    for (i = 0, namesz = 0; i < table->nelems; ++i) {
+        mnbytes_t *parent;
+
+        namesz += strlen(BCDATA(table->qnames[i])) + 1;
+        if ((parent = qimage_parent(table, i)) != NULL) {
+            namesz += strlen(BCDATA(parent)) + 1;
+        }
+    }
+    if (namesz > UINT32_MAX) {
+        TRRET(MNHTESTO_QIMAGE_WRITE + 1);
+    }
+
+    if ((keys = malloc(sizeof(mnhtesto_qimage_key_t) *
+                       (table->nelems + 1))) == NULL) {
+        FAIL("malloc");
+    }
+    if ((names = malloc(namesz + 1)) == NULL) {
+        FAIL("malloc");
+    }
+    for (i = 0, namesz = 0; i < table->nelems; ++i) {
+        mnbytes_t *parent;
+        size_t sz;
+
+        sz = strlen(BCDATA(table->qnames[i])) + 1;
+        keys[i].spec_id = table->qkeys[i].spec_id;
+        keys[i].name = (uint32_t)namesz;
+        keys[i].nlimits = MNHTESTO_QTABLE_NLIMITS(table, i);
+        keys[i].parent = MNHTESTO_QTABLE_NONE;
+        memcpy(names + namesz, BDATA(table->qnames[i]), sz);
+        namesz += sz;
+        if ((parent = qimage_parent(table, i)) != NULL) {
+            sz = strlen(BCDATA(parent)) + 1;
+            keys[i].parent = (uint32_t)namesz;
+            memcpy(names + namesz, BDATA(parent), sz);
+            namesz += sz;
+        }
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = MNHTESTO_QIMAGE_MAGIC;
+    h.version = MNHTESTO_QIMAGE_VERSION;
+    h.specsz = sizeof(mnhtesto_quota_spec_t);
+    h.nspecs = table->nspecs;
+    h.nkeys = table->nelems;
+    h.namesz = namesz;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        res = MNHTESTO_QIMAGE_WRITE + 2;
+        goto end;
+    }
+    if (qimage_write_all(fd, &h, sizeof(h)) != 0 ||
+        qimage_write_all(fd,
+                         table->specs,
+                         table->nspecs * sizeof(mnhtesto_quota_spec_t)) != 0 ||
+        qimage_write_all(fd,
+                         keys,
+                         table->nelems * sizeof(mnhtesto_qimage_key_t)) != 0 ||
+        qimage_write_all(fd, names, namesz) != 0) {
+        res = MNHTESTO_QIMAGE_WRITE + 3;
+    }
+    (void)close(fd);
+
+end:
+    free(names);
+    free(keys);
+    TRRET(res);
+}
@@ -0,0 +1,74 @@
+#ifndef MNHTESTO_QLOAD_H
+#define MNHTESTO_QLOAD_H
+
+#include <stdint.h>
+
+#include "qtable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compiled quota image, as written by mnhquotac.  The header is
+ * followed by nspecs specs, nkeys keys, and namesz bytes of
+ * NUL-terminated key names.  Images are in the host byte order and
+ * struct layout, and are not portable.
+ *
+ * Parents are kept by name, they need not be in the same image.
+ *
+ * An image is not the table itself: several of them, and quota files,
+ * go into one table, and the table owns its key names.  Loading an
+ * image skips the parsing and interns each spec once, but still
+ * allocates each key name and inserts it into the index.
+ */
+#define MNHTESTO_QIMAGE_MAGIC (0x4951484eu)
+#define MNHTESTO_QIMAGE_VERSION (2)
+typedef struct _mnhtesto_qimage_header {
+    uint32_t magic;
+    uint32_t version;
+    /* sizeof(mnhtesto_quota_spec_t) */
+    uint32_t specsz;
+    uint32_t nspecs;
+    uint32_t nkeys;
+    uint32_t namesz;
+} mnhtesto_qimage_header_t;
+
+typedef struct _mnhtesto_qimage_key {
+    uint32_t spec_id;
+    /* offset in the names */
+    uint32_t name;
+    /* see mnhtesto_qkey_t */
+    uint32_t nlimits;
+    /* offset in the names, MNHTESTO_QTABLE_NONE for none */
+    uint32_t parent;
+} mnhtesto_qimage_key_t;
+
+#define MNHTESTO_QIMAGE_SPECS(h)                                       \
+    ((mnhtesto_quota_spec_t *)((mnhtesto_qimage_header_t *)(h) + 1))
+#define MNHTESTO_QIMAGE_KEYS(h)                                        \
+    ((mnhtesto_qimage_key_t *)(MNHTESTO_QIMAGE_SPECS(h) + (h)->nspecs))
+#define MNHTESTO_QIMAGE_NAMES(h)                                       \
+    ((char *)(MNHTESTO_QIMAGE_KEYS(h) + (h)->nkeys))
+#define MNHTESTO_QIMAGE_SIZE(h)                        \
+    (sizeof(mnhtesto_qimage_header_t) +                 \
+     (h)->nspecs * sizeof(mnhtesto_quota_spec_t) +      \
+     (h)->nkeys * sizeof(mnhtesto_qimage_key_t) +       \
+     (h)->namesz)
+
+#define MNHTESTO_QLOAD_LINE_MAX (1024)
+
+typedef void (*mnhtesto_qload_yield_t)(void);
+
+int mnhtesto_qload_line(mnhtesto_qtable_t *, char *);
+int mnhtesto_qload_file(mnhtesto_qtable_t *,
+                        const char *,
+                        unsigned,
+                        mnhtesto_qload_yield_t);
+int mnhtesto_qimage_write(mnhtesto_qtable_t *, const char *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_QLOAD_H */
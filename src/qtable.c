@@ -0,0 +1,1032 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/hash.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "qtable.h"
+
+
+/* see mnhtesto_qtable_owner() */
+static uint32_t qtable_self = 0;
+
+
+static size_t
+qtable_nslots(size_t nelems)
+{
+    size_t nslots;
+
+    for (nslots = MNHTESTO_QTABLE_MIN_SLOTS;
+         nelems * 100 > nslots * MNHTESTO_QTABLE_MAX_LOAD;
+         nslots <<= 1) {
+    }
+    return nslots;
+}
+
+
+static void *
+qtable_realloc(void *p, size_t nelems, size_t elsz)
+{
+    if ((p = realloc(p, nelems * elsz)) == NULL) {
+        FAIL("realloc");
+    }
+    return p;
+}
+
+
+/*
+ * specs are zeroed before they are filled in, so the padding does not
+ * matter
+ */
+static uint64_t
+spec_hash(mnhtesto_quota_spec_t *spec)
+{
+    unsigned char *p;
+    size_t i;
+    uint64_t res;
+
+    /* FNV-1a */
+    for (p = (unsigned char *)spec, i = 0, res = 14695981039346656037ul;
+         i < sizeof(mnhtesto_quota_spec_t);
+         ++i) {
+        res ^= p[i];
+        res *= 1099511628211ul;
+    }
+    return res;
+}
+
+
+static int
+spec_cmp(mnhtesto_quota_spec_t *a, mnhtesto_quota_spec_t *b)
+{
+    return memcmp(a, b, sizeof(mnhtesto_quota_spec_t));
+}
+
+
+/*
+ * Size the table for nelems keys without resizing.
+ */
+void
+mnhtesto_qtable_init(mnhtesto_qtable_t *table, size_t nelems)
+{
+    table->nslots = qtable_nslots(nelems);
+    if ((table->slots = calloc(table->nslots,
+                               sizeof(mnhtesto_qslot_t))) == NULL) {
+        FAIL("calloc");
+    }
+
+    table->elcap = MAX(nelems, MNHTESTO_QTABLE_MIN_SLOTS);
+    table->nelems = 0;
+    table->qnames = qtable_realloc(NULL, table->elcap, sizeof(mnbytes_t *));
+    table->qkeys = qtable_realloc(NULL,
+                                  table->elcap,
+                                  sizeof(mnhtesto_qkey_t));
+    table->quotas = qtable_realloc(NULL,
+                                   table->elcap,
+                                   sizeof(mnhtesto_quota_t));
+    table->counts = qtable_realloc(NULL,
+                                   table->elcap,
+                                   sizeof(mnhtesto_qcount_t));
+    table->links = NULL;
+    table->nlinks = 0;
+    table->chains = NULL;
+    table->nchains = 0;
+    table->map = NULL;
+    table->mapsz = 0;
+    table->shm = NULL;
+    table->shmsz = 0;
+    table->locks = NULL;
+
+    table->speccap = MNHTESTO_QTABLE_MIN_SLOTS;
+    table->nspecs = 0;
+    table->specs = qtable_realloc(NULL,
+                                  table->speccap,
+                                  sizeof(mnhtesto_quota_spec_t));
+    /*
+     * keys are pointers into specs, the index is rebuilt when specs
+     * are reallocated
+     */
+    hash_init(&table->spec_index,
+              61,
+              (hash_hashfn_t)spec_hash,
+              (hash_item_comparator_t)spec_cmp,
+              NULL);
+}
+
+
+void
+mnhtesto_qtable_fini(mnhtesto_qtable_t *table)
+{
+    size_t i;
+
+    hash_fini(&table->spec_index);
+    free(table->specs);
+    table->specs = NULL;
+    table->nspecs = 0;
+    table->speccap = 0;
+
+    for (i = 0; i < table->nelems; ++i) {
+        BYTES_DECREF(&table->qnames[i]);
+    }
+    free(table->qnames);
+    table->qnames = NULL;
+    free(table->qkeys);
+    table->qkeys = NULL;
+    for (i = 0; i < table->nlinks; ++i) {
+        BYTES_DECREF(&table->links[i].parent);
+    }
+    free(table->links);
+    table->links = NULL;
+    table->nlinks = 0;
+    free(table->chains);
+    table->chains = NULL;
+    table->nchains = 0;
+    if (table->shm != NULL) {
+        if (table->map == NULL) {
+            /* quotas are in shm */
+            table->quotas = NULL;
+        }
+        (void)munmap(table->shm, table->shmsz);
+        table->shm = NULL;
+        table->shmsz = 0;
+        table->locks = NULL;
+    } else {
+        free(table->counts);
+    }
+    table->counts = NULL;
+    if (table->map != NULL) {
+        (void)munmap(table->map, table->mapsz);
+        table->map = NULL;
+        table->mapsz = 0;
+    } else {
+        free(table->quotas);
+    }
+    table->quotas = NULL;
+    table->nelems = 0;
+    table->elcap = 0;
+
+    free(table->slots);
+    table->slots = NULL;
+    table->nslots = 0;
+}
+
+
+/*
+ * FNV-1a of the parts, one after another.
+ */
+uint64_t
+mnhtesto_qparts_hash(const mnhtesto_qpart_t *parts, size_t nparts)
+{
+    uint64_t hash = 0xcbf29ce484222325ul;
+    size_t i, j;
+
+    for (i = 0; i < nparts; ++i) {
+        for (j = 0; j < parts[i].len; ++j) {
+            hash ^= (unsigned char)parts[i].data[j];
+            hash *= 0x100000001b3ul;
+        }
+    }
+    return hash;
+}
+
+
+size_t
+mnhtesto_qparts_len(const mnhtesto_qpart_t *parts, size_t nparts)
+{
+    size_t i, len;
+
+    for (i = 0, len = 0; i < nparts; ++i) {
+        len += parts[i].len;
+    }
+    return len;
+}
+
+
+/*
+ * Whether the parts, one after another, start with the len bytes at
+ * s.
+ */
+bool
+mnhtesto_qparts_prefix(const mnhtesto_qpart_t *parts,
+                       size_t nparts,
+                       const char *s,
+                       size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < nparts && len > 0; ++i) {
+        size_t sz;
+
+        sz = MIN(parts[i].len, len);
+        if (memcmp(parts[i].data, s, sz) != 0) {
+            return false;
+        }
+        s += sz;
+        len -= sz;
+    }
+    return len == 0;
+}
+
+
+/*
+ * Copy the parts, one after another, to buf up to sz bytes, and
+ * return the number of bytes copied.
+ */
+size_t
+mnhtesto_qparts_copy(const mnhtesto_qpart_t *parts,
+                     size_t nparts,
+                     char *buf,
+                     size_t sz)
+{
+    size_t i, len;
+
+    for (i = 0, len = 0; i < nparts && len < sz; ++i) {
+        size_t n;
+
+        n = MIN(parts[i].len, sz - len);
+        memcpy(buf + len, parts[i].data, n);
+        len += n;
+    }
+    return len;
+}
+
+
+static mnhtesto_qpart_t
+qtable_part(mnbytes_t *qname)
+{
+    mnhtesto_qpart_t part;
+
+    part.data = BCDATA(qname);
+    part.len = strnlen(BCDATA(qname), BSZ(qname));
+    return part;
+}
+
+
+static mnhtesto_qslot_t *
+qtable_probe(mnhtesto_qtable_t *table,
+             const mnhtesto_qpart_t *parts,
+             size_t nparts,
+             uint64_t hash)
+{
+    size_t mask, idx, len;
+    uint32_t tag;
+
+    len = nparts == 1 ? parts[0].len : mnhtesto_qparts_len(parts, nparts);
+
+    mask = table->nslots - 1;
+    tag = (uint32_t)(hash >> 32);
+    for (idx = hash & mask; ; idx = (idx + 1) & mask) {
+        mnhtesto_qslot_t *slot;
+        mnbytes_t *key;
+
+        slot = &table->slots[idx];
+        if (slot->id == 0) {
+            return slot;
+        }
+        if (slot->tag != tag) {
+            continue;
+        }
+        key = table->qnames[slot->id - 1];
+        if (BSZ(key) == len + 1 &&
+            (nparts == 1 ? memcmp(BCDATA(key), parts[0].data, len) == 0 :
+             mnhtesto_qparts_prefix(parts, nparts, BCDATA(key), len))) {
+            return slot;
+        }
+    }
+}
+
+
+static void
+qtable_rehash(mnhtesto_qtable_t *table, size_t nslots)
+{
+    size_t i;
+
+    free(table->slots);
+    table->nslots = nslots;
+    if ((table->slots = calloc(table->nslots,
+                               sizeof(mnhtesto_qslot_t))) == NULL) {
+        FAIL("calloc");
+    }
+
+    for (i = 0; i < table->nelems; ++i) {
+        mnhtesto_qslot_t *slot;
+        mnhtesto_qpart_t part;
+        uint64_t hash;
+
+        part = qtable_part(table->qnames[i]);
+        hash = mnhtesto_qparts_hash(&part, 1);
+        slot = qtable_probe(table, &part, 1, hash);
+        slot->tag = (uint32_t)(hash >> 32);
+        slot->id = i + 1;
+    }
+}
+
+
+static void
+qtable_elcap(mnhtesto_qtable_t *table, size_t elcap)
+{
+    table->elcap = elcap;
+    table->qnames = qtable_realloc(table->qnames,
+                                   table->elcap,
+                                   sizeof(mnbytes_t *));
+    table->qkeys = qtable_realloc(table->qkeys,
+                                  table->elcap,
+                                  sizeof(mnhtesto_qkey_t));
+    table->quotas = qtable_realloc(table->quotas,
+                                   table->elcap,
+                                   sizeof(mnhtesto_quota_t));
+    table->counts = qtable_realloc(table->counts,
+                                   table->elcap,
+                                   sizeof(mnhtesto_qcount_t));
+}
+
+
+/*
+ * Make room for nelems more keys without resizing.
+ */
+void
+mnhtesto_qtable_reserve(mnhtesto_qtable_t *table, size_t nelems)
+{
+    size_t nslots;
+
+    assert(table->map == NULL);
+    assert(table->shm == NULL);
+
+    nelems += table->nelems;
+    if ((nslots = qtable_nslots(nelems)) > table->nslots) {
+        qtable_rehash(table, nslots);
+    }
+    if (nelems > table->elcap) {
+        qtable_elcap(table, nelems);
+    }
+}
+
+
+/*
+ * Return the spec id of spec, adding it if needed.
+ */
+uint32_t
+mnhtesto_qtable_spec_id(mnhtesto_qtable_t *table,
+                        const mnhtesto_quota_spec_t *spec)
+{
+    mnhash_item_t *hit;
+    size_t i;
+
+    if ((hit = hash_get_item(&table->spec_index, (void *)spec)) != NULL) {
+        return (uint32_t)(uintptr_t)hit->value;
+    }
+
+    if (table->nspecs == table->speccap) {
+        table->speccap <<= 1;
+        table->specs = qtable_realloc(table->specs,
+                                      table->speccap,
+                                      sizeof(mnhtesto_quota_spec_t));
+        hash_fini(&table->spec_index);
+        hash_init(&table->spec_index,
+                  61,
+                  (hash_hashfn_t)spec_hash,
+                  (hash_item_comparator_t)spec_cmp,
+                  NULL);
+        for (i = 0; i < table->nspecs; ++i) {
+            hash_set_item(&table->spec_index,
+                          &table->specs[i],
+                          (void *)(uintptr_t)i);
+        }
+    }
+
+    table->specs[table->nspecs] = *spec;
+    hash_set_item(&table->spec_index,
+                  &table->specs[table->nspecs],
+                  (void *)(uintptr_t)table->nspecs);
+    return (uint32_t)table->nspecs++;
+}
+
+
+uint32_t
+mnhtesto_qtable_get(mnhtesto_qtable_t *table, mnbytes_t *qname)
+{
+    mnhtesto_qpart_t part;
+
+    part = qtable_part(qname);
+    return mnhtesto_qtable_get_parts(table,
+                                     &part,
+                                     1,
+                                     mnhtesto_qparts_hash(&part, 1));
+}
+
+
+/*
+ * The key id of the key made of the parts one after another, of the
+ * hash given by mnhtesto_qparts_hash().
+ */
+uint32_t
+mnhtesto_qtable_get_parts(mnhtesto_qtable_t *table,
+                          const mnhtesto_qpart_t *parts,
+                          size_t nparts,
+                          uint64_t hash)
+{
+    mnhtesto_qslot_t *slot;
+
+    slot = qtable_probe(table, parts, nparts, hash);
+    return slot->id - 1;
+}
+
+
+/*
+ * Add qname of spec_id, and return its key id with the quota state
+ * zeroed, or MNHTESTO_QTABLE_NONE if qname is already there.
+ */
+uint32_t
+mnhtesto_qtable_put_id(mnhtesto_qtable_t *table,
+                       mnbytes_t *qname,
+                       uint32_t spec_id)
+{
+    mnhtesto_qslot_t *slot;
+    mnhtesto_qpart_t part;
+    uint64_t hash;
+    uint32_t id;
+
+    /*
+     * mapped states cannot grow
+     */
+    assert(table->map == NULL);
+    assert(table->shm == NULL);
+    assert(spec_id < table->nspecs);
+
+    if ((table->nelems + 1) * 100 > table->nslots * MNHTESTO_QTABLE_MAX_LOAD) {
+        qtable_rehash(table, table->nslots << 1);
+    }
+
+    part = qtable_part(qname);
+    hash = mnhtesto_qparts_hash(&part, 1);
+    slot = qtable_probe(table, &part, 1, hash);
+    if (slot->id != 0) {
+        return MNHTESTO_QTABLE_NONE;
+    }
+
+    if (table->nelems == table->elcap) {
+        qtable_elcap(table, table->elcap << 1);
+    }
+
+    id = (uint32_t)table->nelems++;
+    table->qnames[id] = qname;
+    BYTES_INCREF(qname);
+    table->qkeys[id].spec_id = spec_id;
+    memset(&table->quotas[id], 0, sizeof(mnhtesto_quota_t));
+    memset(&table->counts[id], 0, sizeof(mnhtesto_qcount_t));
+    table->qkeys[id].nlimits = 1;
+    table->qkeys[id].parent = MNHTESTO_QTABLE_NONE;
+    table->qkeys[id].up = 0;
+    table->qkeys[id].nup = 0;
+    slot->tag = (uint32_t)(hash >> 32);
+    slot->id = id + 1;
+    return id;
+}
+
+
+uint32_t
+mnhtesto_qtable_put(mnhtesto_qtable_t *table,
+                    mnbytes_t *qname,
+                    const mnhtesto_quota_spec_t *spec)
+{
+    return mnhtesto_qtable_put_id(table,
+                                  qname,
+                                  mnhtesto_qtable_spec_id(table, spec));
+}
+
+
+/*
+ * Make the quota named parent the parent of the quota of key id, once
+ * linked.
+ */
+void
+mnhtesto_qtable_parent(mnhtesto_qtable_t *table,
+                       uint32_t id,
+                       mnbytes_t *parent)
+{
+    mnhtesto_qlink_t *link;
+
+    assert(id < table->nelems);
+
+    table->links = qtable_realloc(table->links,
+                                  table->nlinks + 1,
+                                  sizeof(mnhtesto_qlink_t));
+    link = &table->links[table->nlinks++];
+    link->id = id;
+    link->parent = parent;
+    BYTES_INCREF(parent);
+}
+
+
+/*
+ * Lay out the keys of the limits of the quota of key id, and of its
+ * parents, up, at the end of the chains.  Return their number, or
+ * zero if there are more than MNHTESTO_QUOTA_MAX_CHAIN of them, which
+ * is also the case of a loop.
+ */
+static size_t
+qtable_chain_add(mnhtesto_qtable_t *table, uint32_t id, size_t *cap)
+{
+    size_t n = 0;
+
+    if (table->nchains + MNHTESTO_QUOTA_MAX_CHAIN > *cap) {
+        *cap = MAX(*cap * 2, MNHTESTO_QUOTA_MAX_CHAIN * 16);
+        table->chains = qtable_realloc(table->chains,
+                                       *cap,
+                                       sizeof(uint32_t));
+    }
+    for (; id != MNHTESTO_QTABLE_NONE;
+         id = MNHTESTO_QTABLE_PARENT(table, id)) {
+        uint32_t i;
+
+        for (i = 0; i < MNHTESTO_QTABLE_NLIMITS(table, id); ++i) {
+            if (n == MNHTESTO_QUOTA_MAX_CHAIN) {
+                return 0;
+            }
+            table->chains[table->nchains + n++] = id + i;
+        }
+    }
+    return n;
+}
+
+
+/*
+ * Resolve the parents by name, and lay out the chains of the parents.
+ * Fail if a parent is not there, or if a chain loops, or is longer
+ * than MNHTESTO_QUOTA_MAX_CHAIN limits.
+ */
+int
+mnhtesto_qtable_link(mnhtesto_qtable_t *table)
+{
+    int res = 0;
+    uint32_t *up, *nup;
+    size_t i, cap;
+    uint32_t id;
+
+    for (i = 0; i < table->nlinks; ++i) {
+        mnhtesto_qlink_t *link;
+
+        link = &table->links[i];
+        id = mnhtesto_qtable_get(table, link->parent);
+        if (id == MNHTESTO_QTABLE_NONE) {
+            CTRACE("no parent quota %s", BDATA(link->parent));
+            TRRET(MNHTESTO_QTABLE_LINK + 1);
+        }
+        MNHTESTO_QTABLE_PARENT(table, link->id) = id;
+    }
+
+    /*
+     * the chain of a parent, once for all of its children
+     */
+    up = qtable_realloc(NULL, table->nelems + 1, sizeof(uint32_t));
+    nup = qtable_realloc(NULL, table->nelems + 1, sizeof(uint32_t));
+    memset(up, 0xff, sizeof(uint32_t) * table->nelems);
+    free(table->chains);
+    table->chains = NULL;
+    table->nchains = 0;
+    for (id = 0, cap = 0; id < table->nelems; ++id) {
+        mnhtesto_qkey_t *qkey;
+        uint32_t parent;
+
+        qkey = &table->qkeys[id];
+        qkey->up = 0;
+        qkey->nup = 0;
+        if ((parent = qkey->parent) == MNHTESTO_QTABLE_NONE) {
+            continue;
+        }
+        if (up[parent] == MNHTESTO_QTABLE_NONE) {
+            up[parent] = (uint32_t)table->nchains;
+            nup[parent] = (uint32_t)qtable_chain_add(table,
+                                                     parent,
+                                                     &cap);
+            table->nchains += nup[parent];
+        }
+        if (nup[parent] == 0 ||
+            qkey->nlimits + nup[parent] > MNHTESTO_QUOTA_MAX_CHAIN) {
+            CTRACE("limits of %s loop, or are too many",
+                   BDATA(table->qnames[id]));
+            res = MNHTESTO_QTABLE_LINK + 2;
+            break;
+        }
+        qkey->up = up[parent];
+        qkey->nup = (uint16_t)nup[parent];
+    }
+    free(up);
+    free(nup);
+    if (res != 0) {
+        TRRET(res);
+    }
+
+    for (i = 0; i < table->nlinks; ++i) {
+        BYTES_DECREF(&table->links[i].parent);
+    }
+    free(table->links);
+    table->links = NULL;
+    table->nlinks = 0;
+    return 0;
+}
+
+
+static uint64_t
+qtable_tag(mnhtesto_qtable_t *table, uint32_t id)
+{
+    return bytes_hash(table->qnames[id]) ^
+           spec_hash(MNHTESTO_QTABLE_SPEC(table, id));
+}
+
+
+static mnhtesto_qstate_header_t *
+qstate_map(int fd, size_t sz)
+{
+    void *m;
+
+    if ((m = mmap(NULL,
+                  sz,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED,
+                  fd,
+                  0)) == MAP_FAILED) {
+        return NULL;
+    }
+    return m;
+}
+
+
+/*
+ * Resume the states of the keys of the table from the nrecs records of
+ * a state file laid out for another table, by their tags.  The tags
+ * of the file are indexed by open addressing, they are hashes
+ * already.
+ */
+static void
+qstate_resume(mnhtesto_qtable_t *table,
+              const uint64_t *tags,
+              const mnhtesto_quota_t *quotas,
+              size_t nrecs)
+{
+    uint32_t *index;
+    size_t nslots, i;
+
+    nslots = qtable_nslots(nrecs);
+    if ((index = calloc(nslots, sizeof(uint32_t))) == NULL) {
+        FAIL("calloc");
+    }
+    /* record number plus one, zero is empty */
+    for (i = 0; i < nrecs; ++i) {
+        size_t slot;
+
+        for (slot = tags[i] & (nslots - 1);
+             index[slot] != 0;
+             slot = (slot + 1) & (nslots - 1)) {
+        }
+        index[slot] = (uint32_t)i + 1;
+    }
+    for (i = 0; i < table->nelems; ++i) {
+        uint64_t tag;
+        size_t slot;
+
+        tag = qtable_tag(table, i);
+        for (slot = tag & (nslots - 1);
+             index[slot] != 0;
+             slot = (slot + 1) & (nslots - 1)) {
+            if (tags[index[slot] - 1] == tag) {
+                table->quotas[i] = quotas[index[slot] - 1];
+                break;
+            }
+        }
+    }
+    free(index);
+}
+
+
+/*
+ * Move the quota states into the state file at path.  The states of
+ * the keys that are found in the file under the same tag are resumed
+ * from it, the rest are written over.  If the file is laid out for
+ * this very table, it is mapped in place, else it is laid out anew.
+ * Either way, every key tag is computed, a hash of its name and spec.
+ *
+ * Records are not updated atomically, a crash can leave some of them
+ * torn.
+ */
+int
+mnhtesto_qtable_map(mnhtesto_qtable_t *table, const char *path)
+{
+    int res = 0;
+    int fd;
+    struct stat sb;
+    mnhtesto_qstate_header_t *h;
+    size_t sz, i;
+
+    assert(table->map == NULL);
+    assert(table->shm == NULL);
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) {
+        TRRET(MNHTESTO_QTABLE_MAP + 1);
+    }
+    if (fstat(fd, &sb) == -1) {
+        res = MNHTESTO_QTABLE_MAP + 2;
+        goto end;
+    }
+
+    sz = MNHTESTO_QSTATE_SIZE(table->nelems);
+
+    if ((size_t)sb.st_size >= sizeof(mnhtesto_qstate_header_t)) {
+        if ((h = qstate_map(fd, sb.st_size)) == NULL) {
+            res = MNHTESTO_QTABLE_MAP + 3;
+            goto end;
+        }
+        if (h->magic == MNHTESTO_QSTATE_MAGIC &&
+            h->version == MNHTESTO_QSTATE_VERSION &&
+            h->recsz == sizeof(mnhtesto_quota_t) &&
+            (size_t)sb.st_size == MNHTESTO_QSTATE_SIZE(h->nrecs)) {
+            uint64_t *tags;
+            mnhtesto_quota_t *quotas;
+
+            tags = MNHTESTO_QSTATE_TAGS(h);
+            quotas = MNHTESTO_QSTATE_QUOTAS(h);
+
+            if (h->nrecs == table->nelems) {
+                for (i = 0; i < table->nelems; ++i) {
+                    if (tags[i] != qtable_tag(table, i)) {
+                        break;
+                    }
+                }
+                if (i == table->nelems) {
+                    /*
+                     * in place
+                     */
+                    free(table->quotas);
+                    table->quotas = quotas;
+                    table->map = h;
+                    table->mapsz = sz;
+                    goto end;
+                }
+            }
+
+            qstate_resume(table, tags, quotas, h->nrecs);
+        }
+        (void)munmap(h, sb.st_size);
+    }
+
+    /*
+     * lay out anew
+     */
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, sz) != 0) {
+        res = MNHTESTO_QTABLE_MAP + 4;
+        goto end;
+    }
+    if ((h = qstate_map(fd, sz)) == NULL) {
+        res = MNHTESTO_QTABLE_MAP + 3;
+        goto end;
+    }
+    h->magic = MNHTESTO_QSTATE_MAGIC;
+    h->version = MNHTESTO_QSTATE_VERSION;
+    h->recsz = sizeof(mnhtesto_quota_t);
+    h->nrecs = table->nelems;
+    for (i = 0; i < table->nelems; ++i) {
+        MNHTESTO_QSTATE_TAGS(h)[i] = qtable_tag(table, i);
+        MNHTESTO_QSTATE_QUOTAS(h)[i] = table->quotas[i];
+    }
+    free(table->quotas);
+    table->quotas = MNHTESTO_QSTATE_QUOTAS(h);
+    table->map = h;
+    table->mapsz = sz;
+
+end:
+    (void)close(fd);
+    TRRET(res);
+}
+
+
+int
+mnhtesto_qtable_traverse(mnhtesto_qtable_t *table,
+                         mnhtesto_qtable_traverser_t cb,
+                         void *udata)
+{
+    size_t i;
+
+    for (i = 0; i < table->nelems; ++i) {
+        int res;
+
+        if ((res = cb(table->qnames[i],
+                      MNHTESTO_QTABLE_SPEC(table, i),
+                      MNHTESTO_QTABLE_QUOTA(table, i),
+                      udata)) != 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Move the lock stripes, the counters, and the quota states unless
+ * they are mapped to the state file already, to memory shared with
+ * the processes forked afterwards.  The table cannot change any more.
+ */
+int
+mnhtesto_qtable_share(mnhtesto_qtable_t *table)
+{
+    size_t locksz, countsz, quotasz;
+    char *p;
+
+    assert(table->shm == NULL);
+
+    locksz = sizeof(uint32_t) * MNHTESTO_QTABLE_NLOCKS;
+    countsz = sizeof(mnhtesto_qcount_t) * table->nelems;
+    quotasz = table->map == NULL ?
+        sizeof(mnhtesto_quota_t) * table->nelems : 0;
+    table->shmsz = locksz + countsz + quotasz;
+    if ((p = mmap(NULL,
+                  table->shmsz,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS,
+                  -1,
+                  0)) == MAP_FAILED) {
+        table->shmsz = 0;
+        TRRET(MNHTESTO_QTABLE_SHARE + 1);
+    }
+    table->shm = p;
+
+    table->locks = (uint32_t *)p;
+    memset(table->locks, 0, locksz);
+    p += locksz;
+    mnhtesto_qtable_owner();
+
+    memcpy(p, table->counts, countsz);
+    free(table->counts);
+    table->counts = (mnhtesto_qcount_t *)p;
+    p += countsz;
+
+    if (table->map == NULL) {
+        memcpy(p, table->quotas, quotasz);
+        free(table->quotas);
+        table->quotas = (mnhtesto_quota_t *)p;
+    }
+    return 0;
+}
+
+
+/*
+ * The pid of this process, as the holder of the locks it takes.  Set
+ * in each process, getpid() is a system call.
+ */
+void
+mnhtesto_qtable_owner(void)
+{
+    qtable_self = (uint32_t)getpid();
+}
+
+
+/*
+ * The critical sections are a quota update, spin, and give the CPU
+ * away when the holder looks preempted.
+ */
+void
+mnhtesto_qtable_spin(uint32_t *lock)
+{
+    unsigned i;
+    uint32_t expected;
+
+    assert(qtable_self != 0);
+
+    for (i = 0, expected = 0;
+         !__atomic_compare_exchange_n(lock,
+                                      &expected,
+                                      qtable_self,
+                                      false,
+                                      __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED);
+         ++i, expected = 0) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+            if (++i % 128 == 0) {
+                (void)sched_yield();
+            }
+        }
+    }
+}
+
+
+/*
+ * Free the lock if it is held by pid, a process gone, and return
+ * whether it was.
+ */
+bool
+mnhtesto_qtable_break_lock(uint32_t *lock, uint32_t pid)
+{
+    return __atomic_compare_exchange_n(lock,
+                                       &pid,
+                                       0,
+                                       false,
+                                       __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Free the lock stripes held by pid, a process gone, and return their
+ * number.  The states under them may be torn, they are left as is.
+ */
+size_t
+mnhtesto_qtable_break(mnhtesto_qtable_t *table, uint32_t pid)
+{
+    size_t i, n;
+
+    if (table->locks == NULL) {
+        return 0;
+    }
+    for (i = 0, n = 0; i < MNHTESTO_QTABLE_NLOCKS; ++i) {
+        if (mnhtesto_qtable_break_lock(&table->locks[i], pid)) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+
+void
+mnhtesto_qtable_lock(mnhtesto_qtable_t *table, uint32_t id)
+{
+    mnhtesto_qtable_spin(&table->locks[id & (MNHTESTO_QTABLE_NLOCKS - 1)]);
+}
+
+
+/*
+ * The distinct stripes of the n keys of a chain, in order.
+ */
+static size_t
+qtable_stripes(const uint32_t *ids, size_t n, uint32_t *stripes)
+{
+    size_t nstripes, i;
+
+    assert(n <= MNHTESTO_QUOTA_MAX_CHAIN);
+
+    for (i = 0, nstripes = 0; i < n; ++i) {
+        uint32_t stripe;
+        size_t j;
+
+        stripe = ids[i] & (MNHTESTO_QTABLE_NLOCKS - 1);
+        for (j = nstripes; j > 0 && stripes[j - 1] > stripe; --j) {
+        }
+        if (j > 0 && stripes[j - 1] == stripe) {
+            continue;
+        }
+        memmove(&stripes[j + 1],
+                &stripes[j],
+                sizeof(uint32_t) * (nstripes - j));
+        stripes[j] = stripe;
+        ++nstripes;
+    }
+    return nstripes;
+}
+
+
+/*
+ * Lock the stripes of the n keys of a chain, each one once, in order
+ * so that overlapping chains do not deadlock.  A no-op unless shared.
+ */
+void
+mnhtesto_qtable_lock_chain(mnhtesto_qtable_t *table,
+                           const uint32_t *ids,
+                           size_t n)
+{
+    uint32_t stripes[MNHTESTO_QUOTA_MAX_CHAIN];
+    size_t nstripes, i;
+
+    if (table->locks == NULL) {
+        return;
+    }
+    nstripes = qtable_stripes(ids, n, stripes);
+    for (i = 0; i < nstripes; ++i) {
+        mnhtesto_qtable_spin(&table->locks[stripes[i]]);
+    }
+}
+
+
+void
+mnhtesto_qtable_unlock_chain(mnhtesto_qtable_t *table,
+                             const uint32_t *ids,
+                             size_t n)
+{
+    uint32_t stripes[MNHTESTO_QUOTA_MAX_CHAIN];
+    size_t nstripes, i;
+
+    if (table->locks == NULL) {
+        return;
+    }
+    nstripes = qtable_stripes(ids, n, stripes);
+    for (i = 0; i < nstripes; ++i) {
+        __atomic_store_n(&table->locks[stripes[i]], 0, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,265 @@
+#ifndef MNHTESTO_QTABLE_H
+#define MNHTESTO_QTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/hash.h>
+
+#include "quota.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Quota table.  Keys are numbered in the order of insertion, and the
+ * key id indexes the parallel arrays of key names, key records and
+ * quota states.  Specs are deduplicated in a shared spec table.
+ *
+ * A quota of several limits takes consecutive keys, a key per limit:
+ * the first one is named after the quota, the others after it with
+ * "#1", "#2", ... appended.  The first one links to the first one of
+ * the parent quota, if any.  Parents are given by name as the quotas
+ * are loaded, and are resolved by mnhtesto_qtable_link(), which lays
+ * out the keys of the limits of every parent and of its parents, up,
+ * in a row, shared by the children.
+ *
+ * The index over the key names is open addressing (linear probing).
+ * A slot keeps the upper half of the key hash next to the key id.
+ * Key names are NUL terminated, as bytes_new_from_str() makes them.
+ * They are hashed by FNV-1a, that takes a key in parts one after
+ * another, so that a key made of several pieces of a request is looked
+ * up without being put together.
+ */
+typedef struct _mnhtesto_qslot {
+    uint32_t tag;
+    /* key id + 1, zero for an empty slot */
+    uint32_t id;
+} mnhtesto_qslot_t;
+
+
+/*
+ * A piece of a key, not NUL terminated.
+ */
+typedef struct _mnhtesto_qpart {
+    const char *data;
+    size_t len;
+} mnhtesto_qpart_t;
+
+
+/*
+ * Cumulative per key, not in the state file.
+ */
+typedef struct _mnhtesto_qcount {
+    uint64_t accepted;
+    uint64_t rejected;
+} mnhtesto_qcount_t;
+
+
+/*
+ * Looked up along with the spec on every update, the limits and the
+ * parents are kept next to the spec id, in 16 bytes so that the keys
+ * of the limits of a quota tend to share a cache line.
+ */
+typedef struct _mnhtesto_qkey {
+    uint32_t spec_id;
+    /* MNHTESTO_QTABLE_NONE for none */
+    uint32_t parent;
+    /* the keys of the limits of the parents in the chains, once linked */
+    uint32_t up;
+    uint16_t nup;
+    /* the limits are this key and the next nlimits - 1 */
+    uint16_t nlimits;
+} mnhtesto_qkey_t;
+
+
+/*
+ * A parent by name, until linked.
+ */
+typedef struct _mnhtesto_qlink {
+    uint32_t id;
+    mnbytes_t *parent;
+} mnhtesto_qlink_t;
+
+
+typedef struct _mnhtesto_qtable {
+    mnhtesto_qslot_t *slots;
+    /* power of 2 */
+    size_t nslots;
+
+    /*
+     * per key
+     */
+    mnbytes_t **qnames;
+    mnhtesto_qkey_t *qkeys;
+    mnhtesto_quota_t *quotas;
+    mnhtesto_qcount_t *counts;
+    size_t nelems;
+    size_t elcap;
+
+    mnhtesto_qlink_t *links;
+    size_t nlinks;
+    uint32_t *chains;
+    size_t nchains;
+
+    /*
+     * state file, quotas point into it when mapped
+     */
+    void *map;
+    size_t mapsz;
+
+    /*
+     * shared with the processes forked afterwards, see
+     * mnhtesto_qtable_share()
+     */
+    void *shm;
+    size_t shmsz;
+    uint32_t *locks;
+
+    /*
+     * shared
+     */
+    mnhtesto_quota_spec_t *specs;
+    size_t nspecs;
+    size_t speccap;
+    /* mnhtesto_quota_spec_t * -> spec id */
+    mnhash_t spec_index;
+} mnhtesto_qtable_t;
+
+
+/*
+ * State file.  The header is followed by nrecs key tags, and then by
+ * nrecs quota states, in the host byte order.  A key tag is the hash
+ * of the key name and its spec, a state is resumed by the key of the
+ * same tag, wherever it is in the file, so that the keys added or
+ * removed do not reset the states of the others.
+ */
+#define MNHTESTO_QSTATE_MAGIC (0x514f484eu)
+#define MNHTESTO_QSTATE_VERSION (1)
+typedef struct _mnhtesto_qstate_header {
+    uint32_t magic;
+    uint32_t version;
+    /* sizeof(mnhtesto_quota_t) */
+    uint32_t recsz;
+    uint32_t nrecs;
+} mnhtesto_qstate_header_t;
+
+#define MNHTESTO_QSTATE_TAGS(h) ((uint64_t *)((h) + 1))
+#define MNHTESTO_QSTATE_QUOTAS(h)                                      \
+    ((mnhtesto_quota_t *)(MNHTESTO_QSTATE_TAGS(h) + (h)->nrecs))
+#define MNHTESTO_QSTATE_SIZE(n)                \
+    (sizeof(mnhtesto_qstate_header_t) +         \
+     (n) * (sizeof(uint64_t) + sizeof(mnhtesto_quota_t)))
+
+
+#define MNHTESTO_QTABLE_MIN_SLOTS (16)
+/* max load factor, percent */
+#define MNHTESTO_QTABLE_MAX_LOAD (70)
+#define MNHTESTO_QTABLE_NONE (UINT32_MAX)
+
+#define MNHTESTO_QTABLE_QNAME(t, id) ((t)->qnames[(id)])
+#define MNHTESTO_QTABLE_SPEC(t, id)                                    \
+    (&(t)->specs[(t)->qkeys[(id)].spec_id])
+#define MNHTESTO_QTABLE_QUOTA(t, id) (&(t)->quotas[(id)])
+#define MNHTESTO_QTABLE_COUNT(t, id) (&(t)->counts[(id)])
+#define MNHTESTO_QTABLE_NLIMITS(t, id) ((t)->qkeys[(id)].nlimits)
+#define MNHTESTO_QTABLE_PARENT(t, id) ((t)->qkeys[(id)].parent)
+
+/*
+ * The keys of the limits of the quota of key id, and then of its
+ * parents, up, to ids, and their number to n, once linked.  On the
+ * hot path, a call would hold off the updates of the states until the
+ * key record is in.
+ */
+#define MNHTESTO_QTABLE_CHAIN(t, id, ids, n)                           \
+do {                                                                   \
+    const mnhtesto_qkey_t *_qkey = &(t)->qkeys[(id)];                  \
+    size_t _i;                                                         \
+    for ((n) = 0; (n) < _qkey->nlimits; ++(n)) {                       \
+        (ids)[(n)] = (id) + (uint32_t)(n);                             \
+    }                                                                  \
+    for (_i = 0; _i < _qkey->nup; ++_i) {                              \
+        (ids)[(n)++] = (t)->chains[_qkey->up + _i];                    \
+    }                                                                  \
+} while (0)
+
+/*
+ * Lock stripes of the quota states of a shared table, a no-op unless
+ * shared.  A lock is the pid of its holder, zero if free, so that the
+ * locks of a process gone in a critical section can be broken by
+ * mnhtesto_qtable_break().  The holder is told by
+ * mnhtesto_qtable_owner() in each process.
+ */
+#define MNHTESTO_QTABLE_NLOCKS (1024)
+#define MNHTESTO_QTABLE_LOCK(t, id)                                    \
+do {                                                                   \
+    if ((t)->locks != NULL) {                                          \
+        mnhtesto_qtable_lock((t), (id));                               \
+    }                                                                  \
+} while (0)
+#define MNHTESTO_QTABLE_UNLOCK(t, id)                                  \
+do {                                                                   \
+    if ((t)->locks != NULL) {                                          \
+        __atomic_store_n(                                              \
+            &(t)->locks[(id) & (MNHTESTO_QTABLE_NLOCKS - 1)],          \
+            0,                                                         \
+            __ATOMIC_RELEASE);                                         \
+    }                                                                  \
+} while (0)
+
+typedef int (*mnhtesto_qtable_traverser_t)(mnbytes_t *,
+                                           mnhtesto_quota_spec_t *,
+                                           mnhtesto_quota_t *,
+                                           void *);
+
+void mnhtesto_qtable_init(mnhtesto_qtable_t *, size_t);
+void mnhtesto_qtable_fini(mnhtesto_qtable_t *);
+void mnhtesto_qtable_reserve(mnhtesto_qtable_t *, size_t);
+uint32_t mnhtesto_qtable_spec_id(mnhtesto_qtable_t *,
+                                 const mnhtesto_quota_spec_t *);
+uint32_t mnhtesto_qtable_get(mnhtesto_qtable_t *, mnbytes_t *);
+uint32_t mnhtesto_qtable_get_parts(mnhtesto_qtable_t *,
+                                   const mnhtesto_qpart_t *,
+                                   size_t,
+                                   uint64_t);
+uint32_t mnhtesto_qtable_put_id(mnhtesto_qtable_t *, mnbytes_t *, uint32_t);
+uint32_t mnhtesto_qtable_put(mnhtesto_qtable_t *,
+                             mnbytes_t *,
+                             const mnhtesto_quota_spec_t *);
+void mnhtesto_qtable_parent(mnhtesto_qtable_t *, uint32_t, mnbytes_t *);
+int mnhtesto_qtable_link(mnhtesto_qtable_t *);
+int mnhtesto_qtable_map(mnhtesto_qtable_t *, const char *);
+int mnhtesto_qtable_share(mnhtesto_qtable_t *);
+void mnhtesto_qtable_owner(void);
+void mnhtesto_qtable_spin(uint32_t *);
+bool mnhtesto_qtable_break_lock(uint32_t *, uint32_t);
+size_t mnhtesto_qtable_break(mnhtesto_qtable_t *, uint32_t);
+void mnhtesto_qtable_lock(mnhtesto_qtable_t *, uint32_t);
+void mnhtesto_qtable_lock_chain(mnhtesto_qtable_t *,
+                                const uint32_t *,
+                                size_t);
+void mnhtesto_qtable_unlock_chain(mnhtesto_qtable_t *,
+                                  const uint32_t *,
+                                  size_t);
+int mnhtesto_qtable_traverse(mnhtesto_qtable_t *,
+                             mnhtesto_qtable_traverser_t,
+                             void *);
+uint64_t mnhtesto_qparts_hash(const mnhtesto_qpart_t *, size_t);
+size_t mnhtesto_qparts_len(const mnhtesto_qpart_t *, size_t);
+bool mnhtesto_qparts_prefix(const mnhtesto_qpart_t *,
+                            size_t,
+                            const char *,
+                            size_t);
+size_t mnhtesto_qparts_copy(const mnhtesto_qpart_t *,
+                            size_t,
+                            char *,
+                            size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_QTABLE_H */
@@ -0,0 +1,560 @@
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "quota.h"
+
+
+static char *
+quota_field(char **s, int sep)
+{
+    char *res, *p;
+
+    res = *s;
+    if ((p = strchr(res, sep)) != NULL) {
+        *p = '\0';
+        *s = p + 1;
+    } else {
+        *s = NULL;
+    }
+    return res;
+}
+
+
+/*
+ * Parse the quota specification s of a single limit in place, qname
+ * is set to point into s.
+ */
+int
+mnhtesto_quota_parse(char *s, char **qname, mnhtesto_quota_spec_t *spec)
+{
+    if (strchr(s, ':') == NULL) {
+        TRRET(MNHTESTO_QUOTA_PARSE + 1);
+    }
+    *qname = quota_field(&s, ':');
+    return mnhtesto_quota_parse_limit(s, spec);
+}
+
+
+static unsigned
+quota_flags(const char *flags)
+{
+    unsigned res;
+    const char *p;
+
+    res = 0;
+    for (p = flags; *p != '\0'; ++p) {
+        switch (*p) {
+        case 'h':
+            res |= MNHTESTO_QF_SENDRA;
+            break;
+
+        case 'g':
+            res &= ~MNHTESTO_QF_MODE;
+            res |= MNHTESTO_QF_GCRA;
+            break;
+
+        case 'w':
+            res &= ~MNHTESTO_QF_MODE;
+            res |= MNHTESTO_QF_SWC;
+            break;
+
+        case 's':
+            res |= MNHTESTO_QF_SHAPE;
+            break;
+
+        default:
+            break;
+        }
+    }
+    return res;
+}
+
+
+/*
+ * An in-flight limit is a request-based one of a second, so that it
+ * is prepared the usual way, and never accounted in time.
+ */
+static int
+quota_parse_inflight(char *s, mnhtesto_quota_spec_t *spec)
+{
+    char *num, *end;
+    unsigned long n;
+
+    num = quota_field(&s, ':');
+    n = strtoul(num, &end, 10);
+    if (!isdigit((unsigned char)num[0]) ||
+        strcmp(end, "inflight") != 0 ||
+        n == 0 ||
+        n > (UINT32_MAX >> 1)) {
+        TRRET(MNHTESTO_QUOTA_PARSE + 7);
+    }
+
+    spec->denom = (double)n;
+    mnhtest_unit_init(&spec->denom_unit, MNHTEST_UREQ, 1.0);
+    spec->divisor = 1.0;
+    mnhtest_unit_init(&spec->divisor_unit, MNHTEST_USEC, 1.0);
+    spec->flags = MNHTESTO_QF_INFLIGHT;
+    if (s != NULL) {
+        spec->flags |= quota_flags(s) & MNHTESTO_QF_SHAPE;
+    }
+    return mnhtesto_quota_spec_prepare(spec, 0.0);
+}
+
+
+/*
+ * Parse the limit s in place.  The spec is zeroed before it is filled
+ * in, and prepared.
+ */
+int
+mnhtesto_quota_parse_limit(char *s, mnhtesto_quota_spec_t *spec)
+{
+    char *denom, *divisor, *poena_factor, *flags, *burst;
+    double burst_value = 0.0;
+
+    memset(spec, 0, sizeof(mnhtesto_quota_spec_t));
+
+    if (strchr(s, '/') == NULL) {
+        if (strstr(s, "inflight") != NULL) {
+            return quota_parse_inflight(s, spec);
+        }
+        TRRET(MNHTESTO_QUOTA_PARSE + 2);
+    }
+    denom = quota_field(&s, '/');
+    divisor = quota_field(&s, ':');
+    poena_factor = s != NULL ? quota_field(&s, ':') : NULL;
+    flags = s != NULL ? quota_field(&s, ':') : NULL;
+    burst = s;
+
+    if (mnhtest_unit_lex(&spec->denom_unit, denom, &spec->denom) == NULL) {
+        TRRET(MNHTESTO_QUOTA_PARSE + 3);
+    }
+
+    if (mnhtest_unit_lex(&spec->divisor_unit,
+                         divisor,
+                         &spec->divisor) == NULL) {
+        TRRET(MNHTESTO_QUOTA_PARSE + 4);
+    }
+
+    if (poena_factor != NULL) {
+        double pf;
+
+        errno = 0;
+        if ((pf = strtod(poena_factor, NULL)) == 0.0) {
+            if (errno != ERANGE) {
+                spec->poena_factor = pf;
+            }
+        } else {
+            spec->poena_factor = pf;
+        }
+    } else {
+        /* default */
+        spec->poena_factor = MNHTESTO_DEFAULT_POENA_FACTOR;
+    }
+
+    spec->flags = flags != NULL ? quota_flags(flags) : 0;
+
+    if (burst != NULL) {
+        mnhtest_unit_t burst_unit;
+        double b;
+
+        if (mnhtest_unit_lex(&burst_unit, burst, &b) == NULL) {
+            TRRET(MNHTESTO_QUOTA_PARSE + 5);
+        }
+        if (burst_unit.ty == 0) {
+            /* plain number of denom units */
+            burst_value = b;
+        } else if (burst_unit.ty == spec->denom_unit.ty) {
+            burst_value = b * burst_unit.mult / spec->denom_unit.mult;
+        } else {
+            TRRET(MNHTESTO_QUOTA_PARSE + 6);
+        }
+    }
+
+    return mnhtesto_quota_spec_prepare(spec, burst_value);
+}
+
+
+/*
+ * Precompute the quota scale, and the integer GCRA parameters.  Burst
+ * is in the denom units, non-positive means denom.
+ */
+int
+mnhtesto_quota_spec_prepare(mnhtesto_quota_spec_t *spec, double burst)
+{
+    double limit, units, emission, whole, tolerance;
+
+    limit = spec->denom * spec->denom_unit.mult;
+    units = spec->divisor * spec->divisor_unit.mult;
+    if (!(limit > 0.0) || !(units >= 1.0)) {
+        TRRET(MNHTESTO_QUOTA_SPEC_PREPARE + 1);
+    }
+
+    /*
+     * leave the headroom of one limit for overuse
+     */
+    for (spec->shift = 0;
+         limit / (double)(1ul << spec->shift) > (double)(UINT32_MAX >> 1);
+         ++spec->shift) {
+    }
+    spec->limit = limit / (double)(1ul << spec->shift);
+    spec->units = (uint64_t)units;
+    spec->window = spec->units * MNHTESTO_NSEC;
+
+    if (spec->flags & MNHTESTO_QF_MODE) {
+        /* not applicable */
+        spec->poena_factor = 0.0;
+    }
+
+    if (!(burst > 0.0)) {
+        burst = spec->denom;
+    }
+
+    /*
+     * in fixed point, so that the rates of more than a base unit per
+     * nanosecond hold, bytes in particular
+     */
+    emission = units * (double)MNHTESTO_NSEC / limit;
+    if (!(emission * 4294967296.0 >= 1.0)) {
+        TRRET(MNHTESTO_QUOTA_SPEC_PREPARE + 3);
+    }
+    tolerance = emission * burst * spec->denom_unit.mult;
+    if (!(tolerance < (double)(UINT64_MAX >> 1))) {
+        TRRET(MNHTESTO_QUOTA_SPEC_PREPARE + 2);
+    }
+
+    whole = floor(emission);
+    spec->emission = (uint64_t)whole;
+    if ((emission - whole) * 4294967296.0 + 0.5 >= 4294967296.0) {
+        ++spec->emission;
+        spec->emission_frac = 0;
+    } else {
+        spec->emission_frac =
+            (uint32_t)((emission - whole) * 4294967296.0 + 0.5);
+    }
+    spec->tolerance = (uint64_t)tolerance;
+    spec->burst = (uint64_t)(tolerance / emission);
+    return 0;
+}
+
+
+static uint32_t
+quota_value(double v)
+{
+    if (v >= (double)UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    return (uint32_t)(v + 0.5);
+}
+
+
+static uint32_t
+quota_add(uint32_t v, uint64_t amount)
+{
+    return amount >= (uint64_t)(UINT32_MAX - v) ? UINT32_MAX :
+                                                  v + (uint32_t)amount;
+}
+
+
+static void
+quota_init_fw(const mnhtesto_quota_spec_t *spec,
+              mnhtesto_quota_t *quota,
+              uint64_t now)
+{
+    quota->ts = now;
+    quota->ts -= quota->ts % MNHTESTO_QUOTA_UNITS(spec);
+    quota->value = 0;
+    quota->prorated = 0;
+}
+
+
+/*
+ * The sliding window start is shifted back by jitter (modulo the
+ * window), so that quotas of the same divisor do not roll over at the
+ * same instant.  The fixed window stays aligned.
+ */
+void
+mnhtesto_quota_init(const mnhtesto_quota_spec_t *spec,
+                    mnhtesto_quota_t *quota,
+                    uint64_t now,
+                    uint64_t jitter)
+{
+    if (spec->flags & MNHTESTO_QF_GCRA) {
+        quota->ts = 0;
+        quota->value = 0;
+        quota->prorated = 0;
+    } else if (spec->flags & MNHTESTO_QF_SWC) {
+        quota->ts = now - jitter % spec->window;
+        quota->value = 0;
+        quota->prorated = 0;
+    } else {
+        quota_init_fw(spec, quota, now / MNHTESTO_NSEC);
+    }
+}
+
+
+static int
+quota_update_fw(const mnhtesto_quota_spec_t *spec,
+                mnhtesto_quota_t *quota,
+                uint64_t now,
+                uint64_t amount,
+                double *ra)
+{
+    now /= MNHTESTO_NSEC;
+
+    if (MNHTESTO_IN_QUOTA(spec, quota, now)) {
+        quota->value = quota_add(quota->value, amount);
+        if ((double)quota->value <= MNHTESTO_QUOTA_LIMIT(spec)) {
+            /*
+             * 200
+             */
+        } else {
+            /*
+             * 429
+             */
+            *ra = ((double)quota->value / MNHTESTO_QUOTA_LIMIT(spec)) *
+                    (double)MNHTESTO_QUOTA_UNITS(spec);
+            return MNHTESTO_QUOTA_OVER;
+        }
+
+    } else {
+        double normvalue, prorated;
+
+        normvalue = spec->poena_factor * (double)quota->value;
+
+        prorated = MNHTESTO_QUOTA_PRORATE(
+            spec, quota, normvalue + (double)amount, now);
+        quota->prorated = quota_value(prorated);
+
+        if (prorated <= MNHTESTO_QUOTA_LIMIT(spec)) {
+            /*
+             * 200
+             */
+            quota_init_fw(spec, quota, now);
+            assert(MNHTESTO_IN_QUOTA(spec, quota, now));
+            quota->value = quota->prorated;
+
+        } else {
+            /*
+             * previous quota overuse, 429
+             */
+            quota->value = quota_value(normvalue + (double)amount);
+
+            *ra = (prorated / MNHTESTO_QUOTA_LIMIT(spec)) *
+                    (double)MNHTESTO_QUOTA_UNITS(spec) *
+                    MNHTESTO_QUOTAS(spec, quota, now);
+            return MNHTESTO_QUOTA_OVERPREV;
+        }
+    }
+
+    return MNHTESTO_QUOTA_OK;
+}
+
+
+/*
+ * Generic cell rate algorithm: admit if the new theoretical arrival
+ * time is within the burst tolerance from now.
+ */
+static int
+quota_update_gcra(const mnhtesto_quota_spec_t *spec,
+                  mnhtesto_quota_t *quota,
+                  uint64_t now,
+                  uint64_t amount,
+                  double *ra)
+{
+    uint64_t tat, frac, part;
+
+    /*
+     * amount * emission cannot overflow when it fits in the tolerance
+     */
+    if (MRKUNLIKELY(amount > spec->burst)) {
+        *ra = (double)spec->tolerance / (double)MNHTESTO_NSEC;
+        return MNHTESTO_QUOTA_OVER;
+    }
+    if (quota->ts >= now) {
+        tat = quota->ts;
+        frac = quota->prorated;
+    } else {
+        tat = now;
+        frac = 0;
+    }
+
+    /*
+     * amount times the fraction, by its high and low 32 bits
+     */
+    part = (amount & UINT32_MAX) * spec->emission_frac;
+    frac += part & UINT32_MAX;
+    tat += amount * spec->emission +
+           (amount >> 32) * spec->emission_frac +
+           (part >> 32) +
+           (frac >> 32);
+
+    if (tat - now > spec->tolerance) {
+        *ra = (double)(tat - now - spec->tolerance) / (double)MNHTESTO_NSEC;
+        return MNHTESTO_QUOTA_OVER;
+    }
+
+    quota->ts = tat;
+    quota->prorated = (uint32_t)frac;
+    return MNHTESTO_QUOTA_OK;
+}
+
+
+/*
+ * Sliding window counter: the previous window count weighted by its
+ * remaining overlap with the sliding window, plus the current window
+ * count.  Rejected amounts are not accounted.
+ */
+static int
+quota_update_swc(const mnhtesto_quota_spec_t *spec,
+                 mnhtesto_quota_t *quota,
+                 uint64_t now,
+                 uint64_t amount,
+                 double *ra)
+{
+    uint64_t elapsed;
+    double limit, window, weighted;
+
+    if (MRKUNLIKELY(now < quota->ts)) {
+        now = quota->ts;
+    }
+    elapsed = now - quota->ts;
+    if (elapsed >= spec->window) {
+        uint64_t n;
+
+        n = elapsed / spec->window;
+        quota->prorated = n == 1 ? quota->value : 0;
+        quota->value = 0;
+        quota->ts += n * spec->window;
+        elapsed -= n * spec->window;
+    }
+
+    limit = MNHTESTO_QUOTA_LIMIT(spec);
+    window = (double)spec->window;
+    weighted = (double)quota->prorated * ((window - (double)elapsed) / window) +
+               (double)quota->value + (double)amount;
+
+    if (weighted > limit) {
+        double spare;
+
+        /*
+         * wait until the previous window share decays enough, or till
+         * the next window
+         */
+        spare = limit - (double)quota->value - (double)amount;
+        if (spare >= 0.0 && quota->prorated > 0) {
+            *ra = ((window - spare * window / (double)quota->prorated) -
+                   (double)elapsed) / (double)MNHTESTO_NSEC;
+        } else {
+            *ra = (window - (double)elapsed) / (double)MNHTESTO_NSEC;
+        }
+        return MNHTESTO_QUOTA_OVER;
+    }
+
+    quota->value = quota_add(quota->value, amount);
+    return MNHTESTO_QUOTA_OK;
+}
+
+
+/*
+ * Account amount in the quota at now (nanoseconds).  For the
+ * request-based quotas amount is ignored, and the in-flight ones are
+ * always within, see inflight.h.  On overuse, ra is set to the
+ * suggested retry-after in seconds.
+ */
+int
+mnhtesto_quota_update(const mnhtesto_quota_spec_t *spec,
+                      mnhtesto_quota_t *quota,
+                      uint64_t now,
+                      uint64_t amount,
+                      double *ra)
+{
+    uint64_t scaled;
+
+    if (spec->flags & MNHTESTO_QF_INFLIGHT) {
+        return MNHTESTO_QUOTA_OK;
+    }
+
+    if (spec->denom_unit.ty == MNHTEST_UREQ) {
+        amount = 1;
+    }
+
+    if (spec->flags & MNHTESTO_QF_GCRA) {
+        return quota_update_gcra(spec, quota, now, amount, ra);
+    }
+
+    scaled = (amount >> spec->shift) +
+             ((amount & ((1ul << spec->shift) - 1)) != 0);
+    if (spec->flags & MNHTESTO_QF_SWC) {
+        return quota_update_swc(spec, quota, now, scaled, ra);
+    }
+    return quota_update_fw(spec, quota, now, scaled, ra);
+}
+
+
+/*
+ * Account amount in all of the n quotas, or in none of them.  Each one
+ * is updated on a copy, and the copies are committed only if all of
+ * them are within.  Otherwise, those over are committed as
+ * mnhtesto_quota_update() leaves them, the rest are not touched, ra is
+ * the longest retry-after of them, and over is the index of the first.
+ */
+int
+mnhtesto_quota_update_chain(const mnhtesto_quota_spec_t **specs,
+                            mnhtesto_quota_t **quotas,
+                            size_t n,
+                            uint64_t now,
+                            uint64_t amount,
+                            double *ra,
+                            size_t *over)
+{
+    mnhtesto_quota_t tmp[MNHTESTO_QUOTA_MAX_CHAIN];
+    int res = MNHTESTO_QUOTA_OK;
+    size_t i;
+
+    assert(n > 0 && n <= MNHTESTO_QUOTA_MAX_CHAIN);
+
+    /*
+     * the usual quota of a single limit
+     */
+    if (n == 1) {
+        *ra = 0.0;
+        *over = 0;
+        return mnhtesto_quota_update(specs[0], quotas[0], now, amount, ra);
+    }
+
+    *ra = 0.0;
+    for (i = 0; i < n; ++i) {
+        double r = 0.0;
+        int rr;
+
+        tmp[i] = *quotas[i];
+        if ((rr = mnhtesto_quota_update(specs[i],
+                                        &tmp[i],
+                                        now,
+                                        amount,
+                                        &r)) != MNHTESTO_QUOTA_OK) {
+            if (res == MNHTESTO_QUOTA_OK) {
+                res = rr;
+                *over = i;
+            }
+            *ra = MAX(*ra, r);
+            *quotas[i] = tmp[i];
+        }
+    }
+
+    if (res == MNHTESTO_QUOTA_OK) {
+        for (i = 0; i < n; ++i) {
+            *quotas[i] = tmp[i];
+        }
+    }
+    return res;
+}
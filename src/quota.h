@@ -0,0 +1,177 @@
+#ifndef MNHTESTO_QUOTA_H
+#define MNHTESTO_QUOTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "units.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * quota specification syntax:
+ *  quota           ::= qname ["^" parent] ":" limit *("," limit)
+ *  limit           ::= denom "/" divisor
+ *                      [":" poena-factor [":" flags [":" burst]]] /
+ *                      num "inflight" [":" flags]
+ *  qname           ::= ALNUM
+ *  parent          ::= qname
+ *  denom           ::= num [s-unit]
+ *  divisor         ::= num [t-unit]
+ *  s-unit          ::= (s-mult "Bytes") / "Requests"
+ *  s-mult          ::= "K" / "M" / "G"
+ *  t-unit          ::= "sec" / "min" / "hour" / "day"
+ *  poena-factor    ::= FLOATNUM ;; typically [0.0, 1.0], default 1.0
+ *  flags           ::= any combination of:
+ *                      - "h" send the retry-after: header
+ *                      - "g" GCRA (token bucket) mode instead of the
+ *                        prorated fixed window, poena-factor is
+ *                        ignored
+ *                      - "w" sliding window counter mode instead of
+ *                        the prorated fixed window, poena-factor is
+ *                        ignored
+ *                      - "s" shape: queue the requests over the
+ *                        limit until they fit rather than reject
+ *                        them, see shaper.h
+ *  burst           ::= num [s-unit] ;; GCRA only, default denom
+ *
+ * An "inflight" limit bounds the requests of the quota being served at
+ * once rather than their volume, see inflight.h, only the "s" flag
+ * applies to it.
+ */
+typedef struct _mnhtesto_quota_spec {
+    double denom;
+    mnhtest_unit_t denom_unit;
+    double divisor;
+    mnhtest_unit_t divisor_unit;
+    double poena_factor;
+#define MNHTESTO_QF_SENDRA  (0x01)
+#define MNHTESTO_QF_GCRA    (0x02)
+#define MNHTESTO_QF_SWC     (0x04)
+#define MNHTESTO_QF_MODE    (MNHTESTO_QF_GCRA | MNHTESTO_QF_SWC)
+#define MNHTESTO_QF_SHAPE   (0x08)
+#define MNHTESTO_QF_INFLIGHT (0x10)
+    unsigned flags;
+    /*
+     * Precomputed by mnhtesto_quota_spec_prepare().
+     *
+     * Quota values are counted in denom base units shifted right by
+     * shift, so that they fit in the 32-bit state; limit is in the
+     * same scale.
+     */
+    unsigned shift;
+    double limit;
+    /*
+     * divisor in seconds, and in nanoseconds
+     */
+    uint64_t units;
+    uint64_t window;
+    /*
+     * GCRA: emission interval per denom base unit, in nanoseconds and
+     * the fraction of a nanosecond in 1/2^32, the burst tolerance in
+     * nanoseconds, and the burst in base units.
+     */
+    uint64_t emission;
+    uint32_t emission_frac;
+    uint64_t tolerance;
+    uint64_t burst;
+} mnhtesto_quota_spec_t;
+
+
+/*
+ * Per-key quota state, see mnhtesto_quota_spec_t for its scale.
+ *
+ * In the fixed window mode, ts is the window start in seconds.  In
+ * the GCRA mode, ts is the theoretical arrival time in nanoseconds,
+ * prorated is its fraction of a nanosecond in 1/2^32, and value is not
+ * used.  In the sliding window
+ * counter mode, ts is the current window start in nanoseconds, value
+ * is the current window count, and prorated is the previous window
+ * count.
+ */
+typedef struct _mnhtesto_quota {
+    uint64_t ts;
+    uint32_t value;
+    uint32_t prorated;
+} mnhtesto_quota_t;
+
+
+#define MNHTESTO_QUOTA_LIMIT(s) ((s)->limit)
+
+#define MNHTESTO_QUOTA_UNITS(s) ((s)->units)
+
+#define MNHTESTO_QUOTAS(s, q, _ts) \
+    (((double)(_ts - (q)->ts)) / (double)MNHTESTO_QUOTA_UNITS(s))
+
+
+#define MNHTESTO_QUOTA_PER_UNIT(s)  \
+    (MNHTESTO_QUOTA_LIMIT(s) / (double)MNHTESTO_QUOTA_UNITS(s))
+
+
+#define MNHTESTO_IN_QUOTA(s, q, _ts)            \
+    INB1((q)->ts,                               \
+         (_ts),                                 \
+         ((q)->ts + MNHTESTO_QUOTA_UNITS(s)))   \
+
+
+#define MNHTESTO_QUOTA_PRORATE_PER_UNIT(q, v, _ts)  \
+    ((v) / ((double)(_ts - (q)->ts)))
+
+
+#define MNHTESTO_QUOTA_PRORATE(s, q, v, _ts)    \
+    (MNHTESTO_QUOTA_PRORATE_PER_UNIT(q, v, _ts) * \
+     (double)MNHTESTO_QUOTA_UNITS(s))
+
+
+/*
+ * quota value in denom base units
+ */
+#define MNHTESTO_QUOTA_VALUE(s, v) ((double)((uint64_t)(v) << (s)->shift))
+
+
+#define MNHTESTO_NSEC (1000000000ul)
+
+/*
+ * mnhtesto_quota_update() results
+ */
+#define MNHTESTO_QUOTA_OK       (0)
+#define MNHTESTO_QUOTA_OVER     (-1)
+#define MNHTESTO_QUOTA_OVERPREV (-2)
+
+#define MNHTESTO_DEFAULT_POENA_FACTOR   (0.0l)
+
+/*
+ * A quota of several limits is accounted in all of them, or in none,
+ * and then in those of its parent, up.  The limits of a quota, and
+ * the limits along the chain of parents are bounded.
+ */
+#define MNHTESTO_QUOTA_MAX_LIMITS (4)
+#define MNHTESTO_QUOTA_MAX_CHAIN (16)
+
+int mnhtesto_quota_parse(char *, char **, mnhtesto_quota_spec_t *);
+int mnhtesto_quota_parse_limit(char *, mnhtesto_quota_spec_t *);
+int mnhtesto_quota_spec_prepare(mnhtesto_quota_spec_t *, double);
+void mnhtesto_quota_init(const mnhtesto_quota_spec_t *,
+                         mnhtesto_quota_t *,
+                         uint64_t,
+                         uint64_t);
+int mnhtesto_quota_update(const mnhtesto_quota_spec_t *,
+                          mnhtesto_quota_t *,
+                          uint64_t,
+                          uint64_t,
+                          double *);
+int mnhtesto_quota_update_chain(const mnhtesto_quota_spec_t **,
+                                mnhtesto_quota_t **,
+                                size_t,
+                                uint64_t,
+                                uint64_t,
+                                double *,
+                                size_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_QUOTA_H */
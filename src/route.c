@@ -0,0 +1,522 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "route.h"
+
+#define ROUTE_SPACE " \t\r\n"
+
+static const char *route_terms[MNHTESTO_ROUTE_NTERMS] = {
+    "bsiz",
+    "dlay",
+    "gen",
+    "ent",
+    "seed",
+    "clen",
+    "rate",
+    "jitr",
+};
+
+
+typedef struct _route_key {
+    const char *s;
+    size_t sz;
+    uint32_t id;
+    bool prefix;
+} route_key_t;
+
+
+void
+mnhtesto_routes_init(mnhtesto_routes_t *routes)
+{
+    memset(routes, 0, sizeof(mnhtesto_routes_t));
+}
+
+
+static void
+route_fini(mnhtesto_route_t *route)
+{
+    unsigned i;
+
+    BYTES_DECREF(&route->name);
+    BYTES_DECREF(&route->path);
+    for (i = 0; i < countof(route->terms); ++i) {
+        BYTES_DECREF(&route->terms[i]);
+    }
+    BYTES_DECREF(&route->quota);
+    if (route->lat != NULL) {
+        mnhtesto_latency_fini(route->lat);
+        free(route->lat);
+        route->lat = NULL;
+    }
+}
+
+
+static void
+trie_fini(mnhtesto_routes_t *routes)
+{
+    free(routes->nodes);
+    routes->nodes = NULL;
+    routes->nnodes = 0;
+    free(routes->edges);
+    routes->edges = NULL;
+    routes->nedges = 0;
+}
+
+
+void
+mnhtesto_routes_fini(mnhtesto_routes_t *routes)
+{
+    size_t i;
+
+    trie_fini(routes);
+    for (i = 0; i < routes->nroutes; ++i) {
+        route_fini(&routes->routes[i]);
+    }
+    free(routes->routes);
+    memset(routes, 0, sizeof(mnhtesto_routes_t));
+}
+
+
+/*
+ * code ":" weight *("," code ":" weight)
+ */
+static int
+route_status_parse(mnhtesto_route_t *route, char *s)
+{
+    uint64_t cum = 0;
+
+    if (route->nstatus > 0) {
+        return 1;
+    }
+    while (true) {
+        char *end;
+        long code, weight;
+
+        code = strtol(s, &end, 10);
+        if (end == s || *end != ':' || !INB0(100, code, 599)) {
+            return 1;
+        }
+        s = end + 1;
+        weight = strtol(s, &end, 10);
+        if (end == s || weight < 0) {
+            return 1;
+        }
+        cum += (uint64_t)weight;
+        if (route->nstatus == countof(route->status) || cum > UINT32_MAX) {
+            return 1;
+        }
+        route->status[route->nstatus].code = (int)code;
+        route->status[route->nstatus].cum = (uint32_t)cum;
+        ++route->nstatus;
+
+        if (*end == '\0') {
+            break;
+        }
+        if (*end != ',') {
+            return 1;
+        }
+        s = end + 1;
+    }
+
+    return cum > 0 ? 0 : 1;
+}
+
+
+/*
+ * Parse the route s in place, and add it.  Routes take effect once
+ * compiled.
+ */
+int
+mnhtesto_routes_add(mnhtesto_routes_t *routes, char *s)
+{
+    int res = 0;
+    mnhtesto_route_t *route;
+    char *path;
+    size_t sz;
+
+    s += strspn(s, ROUTE_SPACE);
+    path = s;
+    s += strcspn(s, ROUTE_SPACE);
+    if (*s != '\0') {
+        *s++ = '\0';
+    }
+    if (*path != '/') {
+        TRRET(MNHTESTO_ROUTES_ADD + 1);
+    }
+
+    if (routes->nroutes == routes->cap) {
+        routes->cap = routes->cap == 0 ? 16 : routes->cap << 1;
+        if ((routes->routes = realloc(
+                        routes->routes,
+                        sizeof(mnhtesto_route_t) * routes->cap)) == NULL) {
+            FAIL("realloc");
+        }
+    }
+    route = &routes->routes[routes->nroutes];
+    memset(route, 0, sizeof(mnhtesto_route_t));
+
+    route->name = bytes_new_from_str(path);
+    BYTES_INCREF(route->name);
+    sz = strlen(path);
+    if (path[sz - 1] == '*') {
+        route->prefix = true;
+        --sz;
+    }
+    route->path = bytes_new_from_str_len(path, sz);
+    BYTES_INCREF(route->path);
+
+    while (*(s += strspn(s, ROUTE_SPACE)) != '\0') {
+        char *attr, *value;
+        unsigned i;
+
+        attr = s;
+        s += strcspn(s, ROUTE_SPACE);
+        if (*s != '\0') {
+            *s++ = '\0';
+        }
+        if ((value = strchr(attr, '=')) == NULL) {
+            res = MNHTESTO_ROUTES_ADD + 2;
+            goto err;
+        }
+        *value++ = '\0';
+
+        if (strcmp(attr, "lat") == 0) {
+            if (route->lat != NULL) {
+                res = MNHTESTO_ROUTES_ADD + 3;
+                goto err;
+            }
+            if ((route->lat = malloc(sizeof(mnhtesto_latency_t))) == NULL) {
+                FAIL("malloc");
+            }
+            if (mnhtesto_latency_parse(route->lat, value) != 0) {
+                free(route->lat);
+                route->lat = NULL;
+                res = MNHTESTO_ROUTES_ADD + 4;
+                goto err;
+            }
+
+        } else if (strcmp(attr, "status") == 0) {
+            if (route_status_parse(route, value) != 0) {
+                res = MNHTESTO_ROUTES_ADD + 5;
+                goto err;
+            }
+
+        } else if (strcmp(attr, "quota") == 0) {
+            if (route->quota != NULL) {
+                res = MNHTESTO_ROUTES_ADD + 3;
+                goto err;
+            }
+            route->quota = bytes_new_from_str(value);
+            BYTES_INCREF(route->quota);
+
+        } else {
+            for (i = 0; i < countof(route_terms); ++i) {
+                if (strcmp(attr, route_terms[i]) == 0) {
+                    break;
+                }
+            }
+            if (i == countof(route_terms)) {
+                res = MNHTESTO_ROUTES_ADD + 6;
+                goto err;
+            }
+            if (route->terms[i] != NULL) {
+                res = MNHTESTO_ROUTES_ADD + 3;
+                goto err;
+            }
+            route->terms[i] = bytes_new_from_str(value);
+            BYTES_INCREF(route->terms[i]);
+        }
+    }
+
+    ++routes->nroutes;
+    return 0;
+
+err:
+    route_fini(route);
+    TRRET(res);
+}
+
+
+/*
+ * A route per line, see route.h.
+ */
+int
+mnhtesto_routes_load(mnhtesto_routes_t *routes, const char *path)
+{
+    int res = 0;
+    FILE *f;
+    char line[MNHTESTO_ROUTE_LINE_MAX];
+
+    if ((f = fopen(path, "r")) == NULL) {
+        TRRET(MNHTESTO_ROUTES_LOAD + 1);
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *p;
+        size_t sz;
+
+        sz = strlen(line);
+        if (sz == sizeof(line) - 1 && line[sz - 1] != '\n' && !feof(f)) {
+            res = MNHTESTO_ROUTES_LOAD + 2;
+            break;
+        }
+        p = line + strspn(line, ROUTE_SPACE);
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+        if (mnhtesto_routes_add(routes, p) != 0) {
+            res = MNHTESTO_ROUTES_LOAD + 3;
+            break;
+        }
+    }
+
+    (void)fclose(f);
+    TRRET(res);
+}
+
+
+static int
+route_key_cmp(const void *a, const void *b)
+{
+    const route_key_t *x = a, *y = b;
+    int diff;
+
+    if ((diff = memcmp(x->s, y->s, MIN(x->sz, y->sz))) != 0) {
+        return diff;
+    }
+    return x->sz < y->sz ? -1 : x->sz > y->sz ? 1 : 0;
+}
+
+
+static uint32_t
+trie_node(mnhtesto_routes_t *routes, size_t *cap)
+{
+    uint32_t n;
+
+    if (routes->nnodes == *cap) {
+        *cap = *cap == 0 ? 256 : *cap << 1;
+        if ((routes->nodes = realloc(
+                        routes->nodes,
+                        sizeof(mnhtesto_rnode_t) * *cap)) == NULL) {
+            FAIL("realloc");
+        }
+    }
+    n = routes->nnodes++;
+    memset(&routes->nodes[n], 0, sizeof(mnhtesto_rnode_t));
+    return n;
+}
+
+
+static uint32_t
+trie_edges(mnhtesto_routes_t *routes, size_t *cap, size_t n)
+{
+    uint32_t e;
+
+    while (routes->nedges + n > *cap) {
+        *cap = *cap == 0 ? 256 : *cap << 1;
+        if ((routes->edges = realloc(
+                        routes->edges,
+                        sizeof(mnhtesto_redge_t) * *cap)) == NULL) {
+            FAIL("realloc");
+        }
+    }
+    e = routes->nedges;
+    routes->nedges += n;
+    return e;
+}
+
+
+/*
+ * The keys in [lo, hi) are sorted and share the first depth bytes, the
+ * keys of exactly depth bytes come first.  Edges of a node are
+ * reserved before its subtries are built, so that they are
+ * contiguous.
+ */
+static int
+trie_build(mnhtesto_routes_t *routes,
+           const route_key_t *keys,
+           size_t lo,
+           size_t hi,
+           size_t depth,
+           size_t *ncap,
+           size_t *ecap,
+           uint32_t *node)
+{
+    uint32_t n, e;
+    size_t i, j, ngroups;
+
+    n = trie_node(routes, ncap);
+    for (; lo < hi && keys[lo].sz == depth; ++lo) {
+        uint32_t *id;
+
+        id = keys[lo].prefix ? &routes->nodes[n].prefix :
+                               &routes->nodes[n].exact;
+        if (*id != 0) {
+            /*
+             * duplicate route
+             */
+            TRRET(MNHTESTO_ROUTES_COMPILE + 1);
+        }
+        *id = keys[lo].id + 1;
+    }
+
+    for (i = lo, ngroups = 0; i < hi; i = j, ++ngroups) {
+        for (j = i + 1;
+             j < hi && keys[j].s[depth] == keys[i].s[depth];
+             ++j) {
+        }
+    }
+    e = trie_edges(routes, ecap, ngroups);
+    routes->nodes[n].edge_first = e;
+    routes->nodes[n].edge_count = (uint16_t)ngroups;
+
+    for (i = lo; i < hi; i = j, ++e) {
+        uint32_t child;
+
+        for (j = i + 1;
+             j < hi && keys[j].s[depth] == keys[i].s[depth];
+             ++j) {
+        }
+        routes->edges[e].label = (uint8_t)keys[i].s[depth];
+        if (trie_build(routes,
+                       keys,
+                       i,
+                       j,
+                       depth + 1,
+                       ncap,
+                       ecap,
+                       &child) != 0) {
+            TRRET(MNHTESTO_ROUTES_COMPILE + 2);
+        }
+        routes->edges[e].child = child;
+    }
+
+    *node = n;
+    return 0;
+}
+
+
+/*
+ * (Re)build the trie over all the routes added so far.
+ */
+int
+mnhtesto_routes_compile(mnhtesto_routes_t *routes)
+{
+    int res;
+    route_key_t *keys;
+    size_t i, ncap, ecap;
+    uint32_t root;
+
+    trie_fini(routes);
+    if (routes->nroutes == 0) {
+        return 0;
+    }
+    if (routes->nroutes >= UINT32_MAX) {
+        TRRET(MNHTESTO_ROUTES_COMPILE + 3);
+    }
+
+    if ((keys = malloc(sizeof(route_key_t) * routes->nroutes)) == NULL) {
+        FAIL("malloc");
+    }
+    for (i = 0; i < routes->nroutes; ++i) {
+        keys[i].s = BCDATA(routes->routes[i].path);
+        keys[i].sz = strlen(keys[i].s);
+        keys[i].id = (uint32_t)i;
+        keys[i].prefix = routes->routes[i].prefix;
+    }
+    qsort(keys, routes->nroutes, sizeof(route_key_t), route_key_cmp);
+
+    ncap = 0;
+    ecap = 0;
+    if ((res = trie_build(routes,
+                          keys,
+                          0,
+                          routes->nroutes,
+                          0,
+                          &ncap,
+                          &ecap,
+                          &root)) != 0) {
+        trie_fini(routes);
+    }
+    assert(res != 0 || root == 0);
+    free(keys);
+    TRRET(res);
+}
+
+
+const mnhtesto_route_t *
+mnhtesto_routes_match(const mnhtesto_routes_t *routes,
+                      const char *path,
+                      size_t sz)
+{
+    const mnhtesto_rnode_t *node;
+    uint32_t best;
+    size_t i;
+
+    if (routes->nnodes == 0) {
+        return NULL;
+    }
+
+    for (i = 0, node = routes->nodes, best = 0; i < sz; ++i) {
+        uint8_t c;
+        uint32_t lo, hi;
+
+        if (node->prefix != 0) {
+            best = node->prefix;
+        }
+        c = (uint8_t)path[i];
+        lo = node->edge_first;
+        hi = lo + node->edge_count;
+        while (lo < hi) {
+            uint32_t mid;
+
+            mid = (lo + hi) / 2;
+            if (routes->edges[mid].label < c) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == node->edge_first + node->edge_count ||
+            routes->edges[lo].label != c) {
+            goto end;
+        }
+        node = &routes->nodes[routes->edges[lo].child];
+    }
+
+    if (node->exact != 0) {
+        best = node->exact;
+    } else if (node->prefix != 0) {
+        best = node->prefix;
+    }
+
+end:
+    return best != 0 ? &routes->routes[best - 1] : NULL;
+}
+
+
+/*
+ * Sample the status mix, 200 if none.
+ */
+int
+mnhtesto_route_status(const mnhtesto_route_t *route)
+{
+    uint32_t r;
+    unsigned i;
+
+    if (route->nstatus == 0) {
+        return 200;
+    }
+    r = (uint32_t)(random() % route->status[route->nstatus - 1].cum);
+    for (i = 0; r >= route->status[i].cum; ++i) {
+    }
+    return route->status[i].code;
+}
@@ -0,0 +1,108 @@
+#ifndef MNHTESTO_ROUTE_H
+#define MNHTESTO_ROUTE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mrkcommon/bytes.h>
+
+#include "latency.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * route file syntax, a route per line:
+ *  route           ::= path *(SP attribute)
+ *  path            ::= "/" *VCHAR ["*"]    ;; "*" matches by prefix
+ *  attribute       ::= "lat=" latency      ;; see latency.h
+ *                    / "status=" code ":" weight *("," code ":" weight)
+ *                    / "quota=" quota-name
+ *                    / term "=" value
+ *  term            ::= "bsiz" / "dlay" / "gen" / "ent" / "seed" /
+ *                      "clen" / "rate" / "jitr"
+ *
+ * Empty lines and lines starting with "#" are skipped.  The terms are
+ * the defaults of the query terms of the same name.  Status codes
+ * other than 200 are answered with an error response of that code.
+ */
+#define MNHTESTO_ROUTE_BSIZ (0)
+#define MNHTESTO_ROUTE_DLAY (1)
+#define MNHTESTO_ROUTE_GEN  (2)
+#define MNHTESTO_ROUTE_ENT  (3)
+#define MNHTESTO_ROUTE_SEED (4)
+#define MNHTESTO_ROUTE_CLEN (5)
+#define MNHTESTO_ROUTE_RATE (6)
+#define MNHTESTO_ROUTE_JITR (7)
+#define MNHTESTO_ROUTE_NTERMS (8)
+#define MNHTESTO_ROUTE_MAX_STATUS (8)
+#define MNHTESTO_ROUTE_LINE_MAX (1024)
+
+typedef struct _mnhtesto_route_status {
+    int code;
+    /* cumulative weight */
+    uint32_t cum;
+} mnhtesto_route_status_t;
+
+typedef struct _mnhtesto_route {
+    /* as given, and without the trailing "*" */
+    mnbytes_t *name;
+    mnbytes_t *path;
+    bool prefix;
+    /* NULL for none */
+    mnbytes_t *terms[MNHTESTO_ROUTE_NTERMS];
+    mnhtesto_latency_t *lat;
+    mnbytes_t *quota;
+    mnhtesto_route_status_t status[MNHTESTO_ROUTE_MAX_STATUS];
+    unsigned nstatus;
+} mnhtesto_route_t;
+
+/*
+ * Routes, and the trie of their paths.  The trie is compiled into
+ * flat arrays: a node has edge_count edges from edge_first, sorted by
+ * label, and refers to the route matching the path up to the node
+ * exactly, and to the route matching it by prefix (route id + 1, zero
+ * for none).  Matching is a binary search among the edges of a node
+ * per byte of the path, the longest prefix wins unless there is an
+ * exact match.
+ */
+typedef struct _mnhtesto_rnode {
+    uint32_t edge_first;
+    uint32_t exact;
+    uint32_t prefix;
+    uint16_t edge_count;
+} mnhtesto_rnode_t;
+
+typedef struct _mnhtesto_redge {
+    uint32_t child;
+    uint8_t label;
+} mnhtesto_redge_t;
+
+typedef struct _mnhtesto_routes {
+    mnhtesto_route_t *routes;
+    size_t nroutes;
+    size_t cap;
+
+    mnhtesto_rnode_t *nodes;
+    size_t nnodes;
+    mnhtesto_redge_t *edges;
+    size_t nedges;
+} mnhtesto_routes_t;
+
+void mnhtesto_routes_init(mnhtesto_routes_t *);
+void mnhtesto_routes_fini(mnhtesto_routes_t *);
+int mnhtesto_routes_add(mnhtesto_routes_t *, char *);
+int mnhtesto_routes_load(mnhtesto_routes_t *, const char *);
+int mnhtesto_routes_compile(mnhtesto_routes_t *);
+const mnhtesto_route_t *mnhtesto_routes_match(const mnhtesto_routes_t *,
+                                              const char *,
+                                              size_t);
+int mnhtesto_route_status(const mnhtesto_route_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_ROUTE_H */
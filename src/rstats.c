@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "rstats.h"
+
+#define RSTATS_NAMELEN (MNHTESTO_RSTATS_NAMESZ - 1)
+
+
+void
+mnhtesto_rstats_init(mnhtesto_rstats_t *rstats)
+{
+    memset(rstats, 0, sizeof(mnhtesto_rstats_t));
+}
+
+
+void
+mnhtesto_rstats_fini(mnhtesto_rstats_t *rstats)
+{
+    size_t i;
+
+    for (i = 0; i < rstats->nentries; ++i) {
+        free(rstats->entries[i]);
+    }
+    memset(rstats, 0, sizeof(mnhtesto_rstats_t));
+}
+
+
+/*
+ * FNV-1a of the name as kept
+ */
+static uint64_t
+rstats_hash(const char *s)
+{
+    uint64_t hash = 0xcbf29ce484222325ul;
+    const char *end;
+
+    for (end = s + RSTATS_NAMELEN; *s != '\0' && s < end; ++s) {
+        hash ^= (unsigned char)*s;
+        hash *= 0x100000001b3ul;
+    }
+    return hash;
+}
+
+
+static mnhtesto_rstat_t *
+rstats_new(mnhtesto_rstats_t *rstats, const char *endpoint, int status)
+{
+    mnhtesto_rstat_t *rstat;
+
+    if ((rstat = malloc(sizeof(mnhtesto_rstat_t))) == NULL) {
+        FAIL("malloc");
+    }
+    (void)strncpy(rstat->endpoint, endpoint, RSTATS_NAMELEN);
+    rstat->endpoint[RSTATS_NAMELEN] = '\0';
+    rstat->status = status;
+    rstat->nreported = 0;
+    mnhtesto_hdr_init(&rstat->service);
+    mnhtesto_hdr_init(&rstat->overshoot);
+    rstats->entries[rstats->nentries++] = rstat;
+    return rstat;
+}
+
+
+/*
+ * The histograms of the endpoint and status, created on first use.
+ */
+mnhtesto_rstat_t *
+mnhtesto_rstats_get(mnhtesto_rstats_t *rstats,
+                    const char *endpoint,
+                    int status)
+{
+    uint64_t hash;
+    size_t idx;
+    unsigned i;
+
+    hash = rstats_hash(endpoint) ^
+           ((uint64_t)status * 0x9e3779b97f4a7c15ul);
+    for (i = 0, idx = hash & (MNHTESTO_RSTATS_SLOTS - 1);
+         i < MNHTESTO_RSTATS_SLOTS;
+         ++i, idx = (idx + 1) & (MNHTESTO_RSTATS_SLOTS - 1)) {
+        mnhtesto_rstat_t *rstat;
+
+        if (rstats->slots[idx] == 0) {
+            break;
+        }
+        rstat = rstats->entries[rstats->slots[idx] - 1];
+        if (rstat->status == status &&
+            strncmp(rstat->endpoint, endpoint, RSTATS_NAMELEN) == 0) {
+            return rstat;
+        }
+    }
+
+    if (rstats->nentries < MNHTESTO_RSTATS_MAX) {
+        rstats->slots[idx] = (uint16_t)(rstats->nentries + 1);
+        return rstats_new(rstats, endpoint, status);
+    }
+
+    /*
+     * the overflow entry, any status
+     */
+    if (rstats->nentries == MNHTESTO_RSTATS_MAX) {
+        return rstats_new(rstats, "*", 0);
+    }
+    return rstats->entries[MNHTESTO_RSTATS_MAX];
+}
+
+
+/*
+ * Add the histograms of an entry, from another set, to those of the
+ * same endpoint and status.
+ */
+void
+mnhtesto_rstats_merge(mnhtesto_rstats_t *rstats, const mnhtesto_rstat_t *src)
+{
+    mnhtesto_rstat_t *rstat;
+
+    rstat = mnhtesto_rstats_get(rstats, src->endpoint, src->status);
+    mnhtesto_hdr_merge(&rstat->service, &src->service);
+    mnhtesto_hdr_merge(&rstat->overshoot, &src->overshoot);
+}
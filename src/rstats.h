@@ -0,0 +1,56 @@
+#ifndef MNHTESTO_RSTATS_H
+#define MNHTESTO_RSTATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hdr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Request latency histograms per endpoint and status.  The service
+ * time is the time of handling a request less its timed waits, the
+ * overshoot is how much later than due the timed waits were over.
+ *
+ * There are at most MNHTESTO_RSTATS_MAX of them, requests beyond that
+ * are recorded under the endpoint "*" and status 0.  Entries are kept
+ * in the order of creation, and indexed by open addressing.  An entry
+ * is self-contained, endpoints are truncated to MNHTESTO_RSTATS_NAMESZ
+ * - 1 bytes, so that it can be copied to other processes.
+ */
+#define MNHTESTO_RSTATS_MAX (256)
+#define MNHTESTO_RSTATS_NAMESZ (128)
+/* power of 2, twice the max */
+#define MNHTESTO_RSTATS_SLOTS (512)
+
+typedef struct _mnhtesto_rstat {
+    char endpoint[MNHTESTO_RSTATS_NAMESZ];
+    int status;
+    /* the service count as of the last report */
+    uint64_t nreported;
+    mnhtesto_hdr_t service;
+    mnhtesto_hdr_t overshoot;
+} mnhtesto_rstat_t;
+
+typedef struct _mnhtesto_rstats {
+    mnhtesto_rstat_t *entries[MNHTESTO_RSTATS_MAX + 1];
+    size_t nentries;
+    /* entry index + 1, zero for an empty slot */
+    uint16_t slots[MNHTESTO_RSTATS_SLOTS];
+} mnhtesto_rstats_t;
+
+void mnhtesto_rstats_init(mnhtesto_rstats_t *);
+void mnhtesto_rstats_fini(mnhtesto_rstats_t *);
+mnhtesto_rstat_t *mnhtesto_rstats_get(mnhtesto_rstats_t *,
+                                      const char *,
+                                      int);
+void mnhtesto_rstats_merge(mnhtesto_rstats_t *, const mnhtesto_rstat_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_RSTATS_H */
@@ -0,0 +1,159 @@
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "selector.h"
+
+
+void
+mnhtesto_selector_fini(mnhtesto_selector_t *sel)
+{
+    size_t i;
+
+    for (i = 0; i < sel->nparts; ++i) {
+        BYTES_DECREF(&sel->parts[i].name);
+    }
+    sel->nparts = 0;
+}
+
+
+/*
+ * HTTP_ and the field name upper case, dashes to underscores, the way
+ * the web server passes header fields as FastCGI params.
+ */
+static mnbytes_t *
+selector_header(const char *field)
+{
+    mnbytes_t *name;
+    size_t i;
+
+    for (i = 0; field[i] != '\0'; ++i) {
+        if (!(isalnum((unsigned char)field[i]) ||
+              field[i] == '-' ||
+              field[i] == '_')) {
+            return NULL;
+        }
+    }
+    if (i == 0) {
+        return NULL;
+    }
+    name = bytes_printf("HTTP_%s", field);
+    for (i = 5; BDATA(name)[i] != '\0'; ++i) {
+        BDATA(name)[i] = BDATA(name)[i] == '-' ?
+            '_' : toupper((unsigned char)BDATA(name)[i]);
+    }
+    return name;
+}
+
+
+static int
+selector_part(mnhtesto_selpart_t *part, const char *s)
+{
+    part->nseg = 0;
+    part->name = NULL;
+
+    if (strcmp(s, "addr") == 0) {
+        part->ty = MNHTESTO_SELECTOR_ADDR;
+        part->name = bytes_new_from_str("REMOTE_ADDR");
+
+    } else if (strcmp(s, "path") == 0 || strncmp(s, "path:", 5) == 0) {
+        part->ty = MNHTESTO_SELECTOR_PATH;
+        if (s[4] == ':') {
+            char *end;
+            unsigned long nseg;
+
+            nseg = strtoul(s + 5, &end, 10);
+            if (!isdigit((unsigned char)s[5]) ||
+                *end != '\0' ||
+                nseg == 0 ||
+                nseg > UINT16_MAX) {
+                TRRET(MNHTESTO_SELECTOR_PARSE + 1);
+            }
+            part->nseg = (unsigned)nseg;
+        }
+        part->name = bytes_new_from_str("SCRIPT_NAME");
+
+    } else if (strncmp(s, "query:", 6) == 0) {
+        part->ty = MNHTESTO_SELECTOR_QUERY;
+        if (s[6] == '\0') {
+            TRRET(MNHTESTO_SELECTOR_PARSE + 2);
+        }
+        part->name = bytes_new_from_str(s + 6);
+
+    } else if (strncmp(s, "header:", 7) == 0) {
+        part->ty = MNHTESTO_SELECTOR_HEADER;
+        if ((part->name = selector_header(s + 7)) == NULL) {
+            TRRET(MNHTESTO_SELECTOR_PARSE + 3);
+        }
+
+    } else {
+        TRRET(MNHTESTO_SELECTOR_PARSE + 4);
+    }
+    BYTES_INCREF(part->name);
+    return 0;
+}
+
+
+int
+mnhtesto_selector_parse(mnhtesto_selector_t *sel, const char *s)
+{
+    char *buf, *p, *q;
+    int res;
+
+    memset(sel, 0, sizeof(mnhtesto_selector_t));
+    if ((buf = strdup(s)) == NULL) {
+        FAIL("strdup");
+    }
+
+    res = 0;
+    for (p = buf; p != NULL; p = q) {
+        if ((q = strchr(p, '+')) != NULL) {
+            *q++ = '\0';
+        }
+        if (sel->nparts == MNHTESTO_SELECTOR_MAX_PARTS) {
+            res = MNHTESTO_SELECTOR_PARSE + 5;
+            break;
+        }
+        if ((res = selector_part(&sel->parts[sel->nparts], p)) != 0) {
+            break;
+        }
+        ++sel->nparts;
+    }
+
+    free(buf);
+    if (res != 0) {
+        mnhtesto_selector_fini(sel);
+        TRRET(res);
+    }
+    return 0;
+}
+
+
+/*
+ * The length of the first nseg segments of path, the whole path if
+ * nseg is zero or it has no more segments.
+ */
+size_t
+mnhtesto_selector_path(const char *path, size_t len, unsigned nseg)
+{
+    size_t i;
+
+    if (nseg == 0) {
+        return len;
+    }
+    for (i = 1; i < len; ++i) {
+        if (path[i] == '/' && --nseg == 0) {
+            return i;
+        }
+    }
+    return len;
+}
@@ -0,0 +1,59 @@
+#ifndef MNHTESTO_SELECTOR_H
+#define MNHTESTO_SELECTOR_H
+
+#include <stddef.h>
+
+#include <mrkcommon/bytes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Quota selector syntax:
+ *  selector        ::= part *("+" part)
+ *  part            ::= "addr"              ;; client address
+ *                    / "path" [":" nseg]   ;; request path, or its
+ *                                          ;; first nseg segments
+ *                    / "query:" term       ;; query term
+ *                    / "header:" field     ;; HTTP header field
+ *
+ * The quota key of a request is the values of the parts joined by
+ * MNHTESTO_SELECTOR_SEP, "10.0.0.1|/api" of "addr+path:1" for
+ * example.  A selector selects nothing from a request missing any of
+ * its parts.
+ *
+ * The parts are looked up by the names of their FastCGI params, or of
+ * their query terms, prepared here once.
+ */
+#define MNHTESTO_SELECTOR_ADDR      (0)
+#define MNHTESTO_SELECTOR_PATH      (1)
+#define MNHTESTO_SELECTOR_QUERY     (2)
+#define MNHTESTO_SELECTOR_HEADER    (3)
+#define MNHTESTO_SELECTOR_MAX_PARTS (4)
+/* the parts and the separators in between */
+#define MNHTESTO_SELECTOR_MAX_KEY (MNHTESTO_SELECTOR_MAX_PARTS * 2 - 1)
+#define MNHTESTO_SELECTOR_SEP "|"
+
+typedef struct _mnhtesto_selpart {
+    int ty;
+    /* MNHTESTO_SELECTOR_PATH, zero for the whole path */
+    unsigned nseg;
+    /* param name, or query term */
+    mnbytes_t *name;
+} mnhtesto_selpart_t;
+
+typedef struct _mnhtesto_selector {
+    mnhtesto_selpart_t parts[MNHTESTO_SELECTOR_MAX_PARTS];
+    size_t nparts;
+} mnhtesto_selector_t;
+
+int mnhtesto_selector_parse(mnhtesto_selector_t *, const char *);
+void mnhtesto_selector_fini(mnhtesto_selector_t *);
+size_t mnhtesto_selector_path(const char *, size_t, unsigned);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_SELECTOR_H */
@@ -0,0 +1,180 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "shaper.h"
+
+#define SHAPER_NEXT(s, slot) (((slot) + 1) & ((s)->nslots - 1))
+
+
+void
+mnhtesto_shaper_init(mnhtesto_shaper_t *shaper,
+                     size_t maxdepth,
+                     uint64_t maxwait)
+{
+    memset(shaper, 0, sizeof(mnhtesto_shaper_t));
+    shaper->maxdepth = maxdepth;
+    shaper->maxwait = maxwait;
+    shaper->nslots = MNHTESTO_SHAPER_MIN_SLOTS;
+    if ((shaper->queues = calloc(shaper->nslots,
+                                 sizeof(mnhtesto_squeue_t))) == NULL) {
+        FAIL("calloc");
+    }
+}
+
+
+void
+mnhtesto_shaper_fini(mnhtesto_shaper_t *shaper)
+{
+    free(shaper->queues);
+    memset(shaper, 0, sizeof(mnhtesto_shaper_t));
+}
+
+
+/*
+ * The slot of the queue of hash, or else the empty slot it would take.
+ */
+static size_t
+shaper_probe(const mnhtesto_shaper_t *shaper, uint64_t hash)
+{
+    size_t slot;
+
+    for (slot = hash & (shaper->nslots - 1);
+         shaper->queues[slot].head != NULL;
+         slot = SHAPER_NEXT(shaper, slot)) {
+        if (shaper->queues[slot].hash == hash) {
+            break;
+        }
+    }
+    return slot;
+}
+
+
+static void
+shaper_grow(mnhtesto_shaper_t *shaper)
+{
+    mnhtesto_squeue_t *queues;
+    size_t nslots, i;
+
+    queues = shaper->queues;
+    nslots = shaper->nslots;
+    shaper->nslots <<= 1;
+    if ((shaper->queues = calloc(shaper->nslots,
+                                 sizeof(mnhtesto_squeue_t))) == NULL) {
+        FAIL("calloc");
+    }
+    for (i = 0; i < nslots; ++i) {
+        if (queues[i].head != NULL) {
+            shaper->queues[shaper_probe(shaper, queues[i].hash)] = queues[i];
+        }
+    }
+    free(queues);
+}
+
+
+/*
+ * Backward shift, the queues after the deleted one move up unless
+ * they are at their home slot already.
+ */
+static void
+shaper_delete(mnhtesto_shaper_t *shaper, size_t slot)
+{
+    size_t next;
+
+    for (next = SHAPER_NEXT(shaper, slot);
+         shaper->queues[next].head != NULL;
+         next = SHAPER_NEXT(shaper, next)) {
+        size_t home;
+
+        home = shaper->queues[next].hash & (shaper->nslots - 1);
+        /* home cyclically in (slot, next] stays */
+        if (slot <= next ? (slot < home && home <= next) :
+                           (slot < home || home <= next)) {
+            continue;
+        }
+        shaper->queues[slot] = shaper->queues[next];
+        slot = next;
+    }
+    memset(&shaper->queues[slot], 0, sizeof(mnhtesto_squeue_t));
+    --shaper->nqueues;
+}
+
+
+mnhtesto_swaiter_t *
+mnhtesto_shaper_head(const mnhtesto_shaper_t *shaper, uint64_t hash)
+{
+    return shaper->queues[shaper_probe(shaper, hash)].head;
+}
+
+
+/*
+ * Add waiter at the tail of the queue of hash, and return non-zero if
+ * the queue is full already.
+ */
+int
+mnhtesto_shaper_enqueue(mnhtesto_shaper_t *shaper,
+                        uint64_t hash,
+                        mnhtesto_swaiter_t *waiter)
+{
+    mnhtesto_squeue_t *queue;
+
+    if ((shaper->nqueues + 1) * 2 > shaper->nslots) {
+        shaper_grow(shaper);
+    }
+    queue = &shaper->queues[shaper_probe(shaper, hash)];
+    if (queue->depth >= shaper->maxdepth) {
+        return 1;
+    }
+    waiter->next = NULL;
+    if (queue->head == NULL) {
+        queue->hash = hash;
+        queue->head = waiter;
+        ++shaper->nqueues;
+    } else {
+        queue->tail->next = waiter;
+    }
+    queue->tail = waiter;
+    ++queue->depth;
+    return 0;
+}
+
+
+/*
+ * Remove waiter from the queue of hash, and return the next head if
+ * waiter was the head, NULL otherwise.
+ */
+mnhtesto_swaiter_t *
+mnhtesto_shaper_dequeue(mnhtesto_shaper_t *shaper,
+                        uint64_t hash,
+                        mnhtesto_swaiter_t *waiter)
+{
+    mnhtesto_squeue_t *queue;
+    mnhtesto_swaiter_t **pw, *prev;
+    size_t slot;
+
+    slot = shaper_probe(shaper, hash);
+    queue = &shaper->queues[slot];
+    assert(queue->head != NULL);
+
+    for (pw = &queue->head, prev = NULL;
+         *pw != waiter;
+         prev = *pw, pw = &(*pw)->next) {
+        assert(*pw != NULL);
+    }
+    *pw = waiter->next;
+    if (queue->tail == waiter) {
+        queue->tail = prev;
+    }
+    --queue->depth;
+
+    if (queue->head == NULL) {
+        shaper_delete(shaper, slot);
+        return NULL;
+    }
+    return prev == NULL ? queue->head : NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef MNHTESTO_SHAPER_H
+#define MNHTESTO_SHAPER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Wait queues of the requests over a limit of the "s" flag, a FIFO per
+ * quota key.  A request joins the queue of its key, of at most
+ * maxdepth requests, and waits for its turn no longer than maxwait.
+ * Only the request at the head of a queue waits for the quota, on a
+ * timer, and it hands the head over to the next one as it leaves, so
+ * that there is a timer per key rather than per request.  Requests of
+ * a key that has a queue join it rather than overtake it.
+ *
+ * The queues are indexed by the hash of the key, by open addressing,
+ * and are there only while there are requests waiting.  Keys of the
+ * same hash share a queue.  Per process.
+ */
+#define MNHTESTO_SHAPER_DEFAULT_DEPTH (64)
+#define MNHTESTO_SHAPER_DEFAULT_WAIT_MSEC (1000)
+#define MNHTESTO_SHAPER_MIN_SLOTS (16)
+
+typedef struct _mnhtesto_swaiter {
+    struct _mnhtesto_swaiter *next;
+    /* nanoseconds */
+    uint64_t deadline;
+    void *udata;
+} mnhtesto_swaiter_t;
+
+typedef struct _mnhtesto_squeue {
+    uint64_t hash;
+    /* NULL for an empty slot */
+    mnhtesto_swaiter_t *head;
+    mnhtesto_swaiter_t *tail;
+    size_t depth;
+} mnhtesto_squeue_t;
+
+typedef struct _mnhtesto_shaper {
+    mnhtesto_squeue_t *queues;
+    /* power of 2 */
+    size_t nslots;
+    size_t nqueues;
+    /* zero for no shaping */
+    size_t maxdepth;
+    /* nanoseconds */
+    uint64_t maxwait;
+} mnhtesto_shaper_t;
+
+/*
+ * The request at the head of the queue of hash, NULL if none.
+ */
+#define MNHTESTO_SHAPER_HEAD(s, hash)                                  \
+    ((s)->nqueues == 0 ? NULL : mnhtesto_shaper_head((s), (hash)))
+
+void mnhtesto_shaper_init(mnhtesto_shaper_t *, size_t, uint64_t);
+void mnhtesto_shaper_fini(mnhtesto_shaper_t *);
+mnhtesto_swaiter_t *mnhtesto_shaper_head(const mnhtesto_shaper_t *,
+                                         uint64_t);
+int mnhtesto_shaper_enqueue(mnhtesto_shaper_t *,
+                            uint64_t,
+                            mnhtesto_swaiter_t *);
+mnhtesto_swaiter_t *mnhtesto_shaper_dequeue(mnhtesto_shaper_t *,
+                                            uint64_t,
+                                            mnhtesto_swaiter_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_SHAPER_H */
@@ -0,0 +1,82 @@
+#include <assert.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "shedder.h"
+
+/* the weight of a latency in the short term average */
+#define SHEDDER_WEIGHT (0.1)
+/* the fraction of the limit cut per request finished over the target */
+#define SHEDDER_BACKOFF (0.02)
+
+/*
+ * the share of the limit of a priority class
+ */
+static const double shares[MNHTESTO_SHED_NCLASSES] = {1.0, 0.9, 0.75, 0.5};
+
+
+/*
+ * The limit starts at maxlimit, no shedding if target is zero.
+ */
+void
+mnhtesto_shedder_init(mnhtesto_shedder_t *shedder,
+                      uint64_t target,
+                      size_t maxlimit)
+{
+    memset(shedder, 0, sizeof(mnhtesto_shedder_t));
+    shedder->target = target;
+    shedder->maxlimit = MAX((double)maxlimit, 1.0);
+    shedder->limit = shedder->maxlimit;
+}
+
+
+/*
+ * Let a request of the priority class cls in, and return non-zero if
+ * it is to be shed instead.  A request let in is finished by
+ * mnhtesto_shedder_done().
+ */
+int
+mnhtesto_shedder_admit(mnhtesto_shedder_t *shedder, unsigned cls)
+{
+    assert(cls < MNHTESTO_SHED_NCLASSES);
+
+    if (shedder->target > 0 &&
+        (double)shedder->inflight >= MAX(shedder->limit * shares[cls], 1.0)) {
+        ++shedder->nshed[cls];
+        return 1;
+    }
+    ++shedder->inflight;
+    return 0;
+}
+
+
+/*
+ * Finish a request let in, of latency nanoseconds, and adjust the
+ * limit.  The limit does not grow while under half of it is in use,
+ * it would tell nothing of the latency at the limit.
+ */
+void
+mnhtesto_shedder_done(mnhtesto_shedder_t *shedder, uint64_t latency)
+{
+    size_t inflight;
+
+    assert(shedder->inflight > 0);
+
+    inflight = shedder->inflight--;
+    if (shedder->target == 0) {
+        return;
+    }
+
+    shedder->latency += ((double)latency - shedder->latency) *
+                        SHEDDER_WEIGHT;
+    if (shedder->latency > (double)shedder->target) {
+        shedder->limit = MAX(1.0, shedder->limit * (1.0 - SHEDDER_BACKOFF));
+    } else if ((double)inflight * 2.0 >= shedder->limit) {
+        shedder->limit = MIN(shedder->maxlimit,
+                             shedder->limit + 1.0 / shedder->limit);
+    }
+}
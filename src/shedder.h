@@ -0,0 +1,49 @@
+#ifndef MNHTESTO_SHEDDER_H
+#define MNHTESTO_SHEDDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Adaptive limit of the requests served at once, by AIMD.  A request
+ * tells its latency as it is finished, less its deliberate delays:
+ * the handling and the writes, and the lateness of its timed waits,
+ * that is the lag of the event loop.  While the short term average of
+ * it is over the target, every request finished cuts the limit by a
+ * fraction, else the limit grows by about one per limit of requests
+ * finished.  The limit is between one and maxlimit.  The requests over
+ * it are shed rather than let the latency collapse.
+ *
+ * Requests are of priority classes, 0 the most important, and a class
+ * is let in only below its share of the limit, so that the less
+ * important classes are shed first.  Per process.
+ */
+#define MNHTESTO_SHED_NCLASSES (4)
+#define MNHTESTO_SHED_DEFAULT_CLASS (1)
+/* the suggested retry-after of a request shed, seconds */
+#define MNHTESTO_SHED_RETRY_AFTER (1)
+
+typedef struct _mnhtesto_shedder {
+    /* nanoseconds, zero for no shedding */
+    uint64_t target;
+    double limit;
+    double maxlimit;
+    size_t inflight;
+    /* nanoseconds */
+    double latency;
+    unsigned long nshed[MNHTESTO_SHED_NCLASSES];
+} mnhtesto_shedder_t;
+
+void mnhtesto_shedder_init(mnhtesto_shedder_t *, uint64_t, size_t);
+int mnhtesto_shedder_admit(mnhtesto_shedder_t *, unsigned);
+void mnhtesto_shedder_done(mnhtesto_shedder_t *, uint64_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_SHEDDER_H */
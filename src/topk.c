@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "topk.h"
+
+#define TOPK_SLOT(key)                                                 \
+    ((uint32_t)((uint64_t)(key) * 0x9e3779b97f4a7c15ull >> 53) &       \
+     (MNHTESTO_TOPK_SLOTS - 1))
+#define TOPK_NEXT(slot) (((slot) + 1) & (MNHTESTO_TOPK_SLOTS - 1))
+
+
+void
+mnhtesto_topk_init(mnhtesto_topk_t *topk)
+{
+    memset(topk, 0, sizeof(mnhtesto_topk_t));
+}
+
+
+static uint32_t
+topk_probe(const mnhtesto_topk_t *topk, uint64_t key)
+{
+    uint32_t slot;
+
+    for (slot = TOPK_SLOT(key);
+         topk->slots[slot] != 0 &&
+            topk->heap[topk->slots[slot] - 1].key != key;
+         slot = TOPK_NEXT(slot)) {
+    }
+    return slot;
+}
+
+
+/*
+ * Backward shift, the slots after the deleted one move up unless
+ * they are at their home slot already.
+ */
+static void
+topk_unindex(mnhtesto_topk_t *topk, uint32_t slot)
+{
+    uint32_t next;
+
+    for (next = TOPK_NEXT(slot);
+         topk->slots[next] != 0;
+         next = TOPK_NEXT(next)) {
+        uint32_t home;
+
+        home = TOPK_SLOT(topk->heap[topk->slots[next] - 1].key);
+        /* home cyclically in (slot, next] stays */
+        if (slot <= next ? (slot < home && home <= next) :
+                           (slot < home || home <= next)) {
+            continue;
+        }
+        topk->slots[slot] = topk->slots[next];
+        topk->heap[topk->slots[slot] - 1].slot = slot;
+        slot = next;
+    }
+    topk->slots[slot] = 0;
+}
+
+
+/*
+ * The counter at idx moves down as a hole, and is stored once.
+ */
+static void
+topk_sift_down(mnhtesto_topk_t *topk, unsigned idx)
+{
+    mnhtesto_topk_counter_t tmp;
+
+    tmp = topk->heap[idx];
+    while (true) {
+        unsigned child;
+
+        child = 2 * idx + 1;
+        if (child >= topk->nheap) {
+            break;
+        }
+        if (child + 1 < topk->nheap &&
+            topk->heap[child + 1].count < topk->heap[child].count) {
+            ++child;
+        }
+        if (tmp.count <= topk->heap[child].count) {
+            break;
+        }
+        topk->heap[idx] = topk->heap[child];
+        topk->slots[topk->heap[idx].slot] = idx + 1;
+        idx = child;
+    }
+    topk->heap[idx] = tmp;
+    topk->slots[tmp.slot] = idx + 1;
+}
+
+
+static void
+topk_sift_up(mnhtesto_topk_t *topk, unsigned idx)
+{
+    mnhtesto_topk_counter_t tmp;
+
+    tmp = topk->heap[idx];
+    while (idx > 0) {
+        unsigned parent;
+
+        parent = (idx - 1) / 2;
+        if (topk->heap[parent].count <= tmp.count) {
+            break;
+        }
+        topk->heap[idx] = topk->heap[parent];
+        topk->slots[topk->heap[idx].slot] = idx + 1;
+        idx = parent;
+    }
+    topk->heap[idx] = tmp;
+    topk->slots[tmp.slot] = idx + 1;
+}
+
+
+void
+mnhtesto_topk_add(mnhtesto_topk_t *topk, uint64_t key, uint64_t weight)
+{
+    uint32_t slot;
+    mnhtesto_topk_counter_t *c;
+
+    topk->total += weight;
+
+    slot = topk_probe(topk, key);
+    if (topk->slots[slot] != 0) {
+        c = &topk->heap[topk->slots[slot] - 1];
+        c->count += weight;
+        topk_sift_down(topk, topk->slots[slot] - 1);
+        return;
+    }
+
+    if (topk->nheap < MNHTESTO_TOPK_K) {
+        c = &topk->heap[topk->nheap];
+        c->key = key;
+        c->slot = slot;
+        c->count = weight;
+        c->error = 0;
+        topk->slots[slot] = ++topk->nheap;
+        topk_sift_up(topk, topk->nheap - 1);
+        return;
+    }
+
+    /*
+     * take over the least counter
+     */
+    c = &topk->heap[0];
+    topk_unindex(topk, c->slot);
+    slot = topk_probe(topk, key);
+    c->key = key;
+    c->slot = slot;
+    c->error = c->count;
+    c->count += weight;
+    topk->slots[slot] = 1;
+    topk_sift_down(topk, 0);
+}
+
+
+/*
+ * Add the counters of src to dst, with their errors.  The counts of a
+ * summary add up to its total, so do the totals.
+ */
+void
+mnhtesto_topk_merge(mnhtesto_topk_t *dst, const mnhtesto_topk_t *src)
+{
+    unsigned i;
+
+    for (i = 0; i < src->nheap; ++i) {
+        uint32_t slot;
+
+        mnhtesto_topk_add(dst, src->heap[i].key, src->heap[i].count);
+        slot = topk_probe(dst, src->heap[i].key);
+        dst->heap[dst->slots[slot] - 1].error += src->heap[i].error;
+    }
+}
+
+
+static int
+topk_cmp(const mnhtesto_topk_counter_t *a, const mnhtesto_topk_counter_t *b)
+{
+    return a->count > b->count ? -1 : a->count < b->count ? 1 : 0;
+}
+
+
+/*
+ * Up to n counters of the highest counts, in descending order.
+ */
+size_t
+mnhtesto_topk_top(const mnhtesto_topk_t *topk,
+                  mnhtesto_topk_counter_t *top,
+                  size_t n)
+{
+    mnhtesto_topk_counter_t heap[MNHTESTO_TOPK_K];
+
+    memcpy(heap, topk->heap, sizeof(mnhtesto_topk_counter_t) * topk->nheap);
+    qsort(heap,
+          topk->nheap,
+          sizeof(mnhtesto_topk_counter_t),
+          (int (*)(const void *, const void *))topk_cmp);
+    n = MIN(n, topk->nheap);
+    memcpy(top, heap, sizeof(mnhtesto_topk_counter_t) * n);
+    return n;
+}
@@ -0,0 +1,52 @@
+#ifndef MNHTESTO_TOPK_H
+#define MNHTESTO_TOPK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Heavy hitters of a weighted stream of keys, space-saving: there are
+ * MNHTESTO_TOPK_K counters, and a key that has none takes over the one
+ * of the least count, inheriting the count as its error.  Any key of
+ * weight over total / MNHTESTO_TOPK_K has a counter, and a count
+ * overestimates the weight of its key by at most its error.
+ *
+ * The counters are a min-heap by count, and are indexed by key by
+ * open addressing.  Memory is fixed, and an update is O(log K).
+ */
+#define MNHTESTO_TOPK_K (1024)
+/* power of 2, twice K */
+#define MNHTESTO_TOPK_SLOTS (2048)
+
+typedef struct _mnhtesto_topk_counter {
+    uint64_t key;
+    uint64_t count;
+    uint64_t error;
+    /* index slot */
+    uint32_t slot;
+} mnhtesto_topk_counter_t;
+
+typedef struct _mnhtesto_topk {
+    mnhtesto_topk_counter_t heap[MNHTESTO_TOPK_K];
+    unsigned nheap;
+    /* heap index + 1, zero for an empty slot */
+    uint16_t slots[MNHTESTO_TOPK_SLOTS];
+    uint64_t total;
+} mnhtesto_topk_t;
+
+void mnhtesto_topk_init(mnhtesto_topk_t *);
+void mnhtesto_topk_add(mnhtesto_topk_t *, uint64_t, uint64_t);
+void mnhtesto_topk_merge(mnhtesto_topk_t *, const mnhtesto_topk_t *);
+size_t mnhtesto_topk_top(const mnhtesto_topk_t *,
+                         mnhtesto_topk_counter_t *,
+                         size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_TOPK_H */
@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "twheel.h"
+
+#define TWHEEL_MASK (MNHTESTO_TWHEEL_NSLOTS - 1)
+#define TWHEEL_SHIFT(l) (MNHTESTO_TWHEEL_BITS * (l))
+/* the farthest a timer can be placed at */
+#define TWHEEL_SPAN (1ul << TWHEEL_SHIFT(MNHTESTO_TWHEEL_NLEVELS))
+
+
+void
+mnhtesto_twheel_init(mnhtesto_twheel_t *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(mnhtesto_twheel_t));
+    wheel->now = now;
+}
+
+
+static uint64_t
+rotr(uint64_t v, unsigned n)
+{
+    return n == 0 ? v : (v >> n) | (v << (64 - n));
+}
+
+
+/*
+ * The timer goes to the finest level its expiry is within a turn of,
+ * a slot at the level l is taken at the first tick of the slot, so
+ * that it is never late.  Timers beyond the top level turn are
+ * placed at its far end, and re-placed from there.
+ */
+static void
+twheel_link(mnhtesto_twheel_t *wheel, mnhtesto_timer_t *timer)
+{
+    uint64_t expires, delta;
+    unsigned l, slot;
+    mnhtesto_timer_t **head;
+
+    expires = MAX(timer->expires, wheel->now);
+    delta = expires - wheel->now;
+    for (l = 0;
+         l < MNHTESTO_TWHEEL_NLEVELS - 1 &&
+            delta >= (1ul << TWHEEL_SHIFT(l + 1));
+         ++l) {
+    }
+    if (delta >= TWHEEL_SPAN) {
+        expires = wheel->now + TWHEEL_SPAN - 1;
+    }
+    slot = (expires >> TWHEEL_SHIFT(l)) & TWHEEL_MASK;
+
+    head = &wheel->slots[l][slot];
+    if ((timer->next = *head) != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->where = l * MNHTESTO_TWHEEL_NSLOTS + slot;
+    wheel->occupied[l] |= 1ul << slot;
+}
+
+
+static void
+twheel_unlink(mnhtesto_twheel_t *wheel, mnhtesto_timer_t *timer)
+{
+    unsigned l, slot;
+
+    if ((*timer->pprev = timer->next) != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+
+    l = timer->where / MNHTESTO_TWHEEL_NSLOTS;
+    slot = timer->where % MNHTESTO_TWHEEL_NSLOTS;
+    if (wheel->slots[l][slot] == NULL) {
+        wheel->occupied[l] &= ~(1ul << slot);
+    }
+}
+
+
+/*
+ * Expires is in ticks, timers already expired fire at the next
+ * advance.
+ */
+void
+mnhtesto_twheel_add(mnhtesto_twheel_t *wheel,
+                    mnhtesto_timer_t *timer,
+                    uint64_t expires)
+{
+    assert(timer->pprev == NULL);
+    timer->expires = expires;
+    twheel_link(wheel, timer);
+    ++wheel->ntimers;
+}
+
+
+void
+mnhtesto_twheel_del(mnhtesto_twheel_t *wheel, mnhtesto_timer_t *timer)
+{
+    if (timer->pprev != NULL) {
+        twheel_unlink(wheel, timer);
+        --wheel->ntimers;
+    }
+}
+
+
+/*
+ * The first tick at or after now that either fires timers, or moves
+ * them down a level.
+ */
+uint64_t
+mnhtesto_twheel_next(const mnhtesto_twheel_t *wheel)
+{
+    uint64_t res;
+    unsigned l;
+
+    if (wheel->ntimers == 0) {
+        return MNHTESTO_TWHEEL_NEVER;
+    }
+
+    res = MNHTESTO_TWHEEL_NEVER;
+    for (l = 0; l < MNHTESTO_TWHEEL_NLEVELS; ++l) {
+        uint64_t first, tick;
+
+        if (wheel->occupied[l] == 0) {
+            continue;
+        }
+        /* the first slot boundary at the level */
+        first = (wheel->now + (1ul << TWHEEL_SHIFT(l)) - 1) >> TWHEEL_SHIFT(l);
+        tick = (first +
+                (uint64_t)__builtin_ctzll(
+                    rotr(wheel->occupied[l], first & TWHEEL_MASK))) <<
+               TWHEEL_SHIFT(l);
+        res = MIN(res, tick);
+    }
+
+    return res;
+}
+
+
+/*
+ * Process all ticks up to and including upto, calling fire for each
+ * expired timer, which is off the wheel by then.  The fire callback
+ * may add and delete timers.  Returns the number of timers fired.
+ */
+size_t
+mnhtesto_twheel_advance(mnhtesto_twheel_t *wheel,
+                        uint64_t upto,
+                        mnhtesto_twheel_fire_t fire,
+                        void *udata)
+{
+    size_t nfired;
+    uint64_t tick;
+
+    nfired = 0;
+    while ((tick = mnhtesto_twheel_next(wheel)) <= upto) {
+        mnhtesto_timer_t *list, *timer;
+        unsigned l, slot;
+
+        wheel->now = tick;
+
+        /*
+         * top down, a timer moved down may land in a slot due at
+         * this very tick
+         */
+        for (l = MNHTESTO_TWHEEL_NLEVELS - 1; l > 0; --l) {
+            if (tick & ((1ul << TWHEEL_SHIFT(l)) - 1)) {
+                continue;
+            }
+            slot = (tick >> TWHEEL_SHIFT(l)) & TWHEEL_MASK;
+            list = wheel->slots[l][slot];
+            wheel->slots[l][slot] = NULL;
+            wheel->occupied[l] &= ~(1ul << slot);
+            while ((timer = list) != NULL) {
+                list = timer->next;
+                twheel_link(wheel, timer);
+            }
+        }
+
+        slot = tick & TWHEEL_MASK;
+        if ((list = wheel->slots[0][slot]) != NULL) {
+            list->pprev = &list;
+        }
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~(1ul << slot);
+
+        /*
+         * timers added by fire go after this tick
+         */
+        wheel->now = tick + 1;
+        while ((timer = list) != NULL) {
+            if ((list = timer->next) != NULL) {
+                list->pprev = &list;
+            }
+            timer->pprev = NULL;
+            --wheel->ntimers;
+            ++nfired;
+            fire(timer, udata);
+        }
+    }
+
+    if (upto != MNHTESTO_TWHEEL_NEVER && wheel->now <= upto) {
+        wheel->now = upto + 1;
+    }
+
+    return nfired;
+}
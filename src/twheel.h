@@ -0,0 +1,60 @@
+#ifndef MNHTESTO_TWHEEL_H
+#define MNHTESTO_TWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hierarchical timer wheel.  Slots of the level l are
+ * MNHTESTO_TWHEEL_NSLOTS^l ticks wide, a timer is kept at the level
+ * its expiry is distant at, and is moved down a level each time its
+ * slot comes round, till it fires from the level 0.  Adding and
+ * deleting a timer is constant time, and so is finding the next
+ * tick the wheel has anything to do at.
+ *
+ * The ticks are abstract, the wheel's now is the first tick not yet
+ * processed.
+ */
+#define MNHTESTO_TWHEEL_BITS (6)
+#define MNHTESTO_TWHEEL_NSLOTS (1 << MNHTESTO_TWHEEL_BITS)
+#define MNHTESTO_TWHEEL_NLEVELS (6)
+#define MNHTESTO_TWHEEL_NEVER (UINT64_MAX)
+
+typedef struct _mnhtesto_timer {
+    struct _mnhtesto_timer *next;
+    /* NULL when not on the wheel */
+    struct _mnhtesto_timer **pprev;
+    uint64_t expires;
+    /* level * MNHTESTO_TWHEEL_NSLOTS + slot */
+    unsigned where;
+    void *udata;
+} mnhtesto_timer_t;
+
+typedef struct _mnhtesto_twheel {
+    uint64_t now;
+    size_t ntimers;
+    /* non-empty slots, per level */
+    uint64_t occupied[MNHTESTO_TWHEEL_NLEVELS];
+    mnhtesto_timer_t *slots[MNHTESTO_TWHEEL_NLEVELS][MNHTESTO_TWHEEL_NSLOTS];
+} mnhtesto_twheel_t;
+
+typedef void (*mnhtesto_twheel_fire_t)(mnhtesto_timer_t *, void *);
+
+void mnhtesto_twheel_init(mnhtesto_twheel_t *, uint64_t);
+void mnhtesto_twheel_add(mnhtesto_twheel_t *, mnhtesto_timer_t *, uint64_t);
+void mnhtesto_twheel_del(mnhtesto_twheel_t *, mnhtesto_timer_t *);
+uint64_t mnhtesto_twheel_next(const mnhtesto_twheel_t *);
+size_t mnhtesto_twheel_advance(mnhtesto_twheel_t *,
+                               uint64_t,
+                               mnhtesto_twheel_fire_t,
+                               void *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_TWHEEL_H */
@@ -2,7 +2,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
-#include <string.h> /* _GNU_SOURCE for strcasestr() on linux */
+#include <string.h>
+#include <strings.h>
 
 #include <mrkcommon/dumpm.h>
 #include <mrkcommon/util.h>
@@ -64,18 +65,58 @@ mnhtest_unit_normalize(mnhtest_unit_t *dst, mnhtest_unit_t *src, double v)
 }
 
 
+/*
+ * Unit names are matched by prefix, case-insensitively.  The names of
+ * the same initial letter are adjacent, unit_initials maps the initial
+ * letter to the first of them, plus one.
+ */
+static struct {
+    const char *name;
+    size_t sz;
+    int ty;
+    double mult;
+} unit_names[] = {
+    {"byte", 4, MNHTEST_UBYTE, 1.0},
+    {"d", 1, MNHTEST_USEC, 86400.0},
+    {"gb", 2, MNHTEST_UBYTE, (double)(1024 * 1024 * 1024)},
+    {"hr", 2, MNHTEST_USEC, 3600.0},
+    {"hour", 4, MNHTEST_USEC, 3600.0},
+    {"kb", 2, MNHTEST_UBYTE, 1024.0},
+    {"mb", 2, MNHTEST_UBYTE, (double)(1024 * 1024)},
+    {"min", 3, MNHTEST_USEC, 60.0},
+    {"req", 3, MNHTEST_UREQ, 1.0},
+    {"sec", 3, MNHTEST_USEC, 1.0},
+    {"w", 1, MNHTEST_USEC, 604800.0},
+};
+
+static unsigned char unit_initials[256] = {
+    ['b'] = 1, ['B'] = 1,
+    ['d'] = 2, ['D'] = 2,
+    ['g'] = 3, ['G'] = 3,
+    ['h'] = 4, ['H'] = 4,
+    ['k'] = 6, ['K'] = 6,
+    ['m'] = 7, ['M'] = 7,
+    ['r'] = 9, ['R'] = 9,
+    ['s'] = 10, ['S'] = 10,
+    ['w'] = 11, ['W'] = 11,
+};
+
+
 /**
- * Simplistic unit parser.
- *
+ * Parse a number followed by an optional unit name in a single pass
+ * over s.  Return the end of the unit name.
  */
-unsigned char *
-mnhtest_unit_parse(mnhtest_unit_t *unit, mnbytes_t *s, double *v)
+const char *
+mnhtest_unit_lex(mnhtest_unit_t *unit, const char *s, double *v)
 {
-    char *endptr = NULL, *p;
+    char *endptr = NULL;
+    const char *p;
+    unsigned i;
 
     mnhtest_unit_init(unit, 0, 0.0);
 
-    if ((*v = strtod(BCDATA(s), &endptr)) == 0.0) {
+    errno = 0;
+    if ((*v = strtod(s, &endptr)) == 0.0) {
         if (errno == ERANGE) {
             TRRETNULL(MNHTEST_UNIT_PARSE + 1);
         } else {
@@ -88,77 +129,36 @@ mnhtest_unit_parse(mnhtest_unit_t *unit, mnbytes_t *s, double *v)
     while (*endptr == ' ') {
         ++endptr;
     }
-    p = endptr;
-    while (isalpha(*p)) {
-        ++p;
+    for (p = endptr; isalpha((unsigned char)*p); ++p) {
     }
-    if (strcasestr(endptr, "gb") == endptr ||
-        strcasestr(endptr, "gbyte") == endptr ||
-        strcasestr(endptr, "gbytes") == endptr) {
-        unit->ty = MNHTEST_UBYTE;
-        unit->mult = (double)(1024 * 1024 * 1024);
-
-    } else if (strcasestr(endptr, "mb") == endptr ||
-               strcasestr(endptr, "mbyte") == endptr ||
-               strcasestr(endptr, "mbytes") == endptr) {
-        unit->ty = MNHTEST_UBYTE;
-        unit->mult = (double)(1024 * 1024);
-
-    } else if (strcasestr(endptr, "kb") == endptr ||
-               strcasestr(endptr, "kbyte") == endptr ||
-               strcasestr(endptr, "kbytes") == endptr) {
-        unit->ty = MNHTEST_UBYTE;
-        unit->mult = (double)(1024);
-
-    } else if (strcasestr(endptr, "byte") == endptr ||
-               strcasestr(endptr, "bytes") == endptr) {
-        unit->ty = MNHTEST_UBYTE;
-        unit->mult = (double)(1);
-
-    } else if (strcasestr(endptr, "req") == endptr ||
-               strcasestr(endptr, "request") == endptr ||
-               strcasestr(endptr, "requests") == endptr) {
-        unit->ty = MNHTEST_UREQ;
-        unit->mult = (double)(1);
-
-    } else if (strcasestr(endptr, "sec") == endptr ||
-               strcasestr(endptr, "second") == endptr ||
-               strcasestr(endptr, "seconds") == endptr) {
-        unit->ty = MNHTEST_USEC;
-        unit->mult = (double)(1);
-
-    } else if (strcasestr(endptr, "min") == endptr ||
-               strcasestr(endptr, "minute") == endptr ||
-               strcasestr(endptr, "minutes") == endptr) {
-        unit->ty = MNHTEST_USEC;
-        unit->mult = (double)(60);
-
-    } else if (strcasestr(endptr, "hr") == endptr ||
-               strcasestr(endptr, "hour") == endptr ||
-               strcasestr(endptr, "hours") == endptr) {
-        unit->ty = MNHTEST_USEC;
-        unit->mult = (double)(3600);
-
-    } else if (strcasestr(endptr, "d") == endptr ||
-               strcasestr(endptr, "day") == endptr ||
-               strcasestr(endptr, "days") == endptr) {
-        unit->ty = MNHTEST_USEC;
-        unit->mult = (double)(86400);
-
-    } else if (strcasestr(endptr, "w") == endptr ||
-               strcasestr(endptr, "week") == endptr ||
-               strcasestr(endptr, "weeks") == endptr) {
-        unit->ty = MNHTEST_USEC;
-        unit->mult = (double)(604800);
 
-    } else {
-        /*
-         * unknown unit, extension?
-         */
-        unit->mult = (double)(1);
+    for (i = unit_initials[(unsigned char)*endptr];
+         i > 0 &&
+         i <= countof(unit_names) &&
+         tolower((unsigned char)*endptr) == unit_names[i - 1].name[0];
+         ++i) {
+        if ((size_t)(p - endptr) >= unit_names[i - 1].sz &&
+            strncasecmp(endptr,
+                        unit_names[i - 1].name,
+                        unit_names[i - 1].sz) == 0) {
+            unit->ty = unit_names[i - 1].ty;
+            unit->mult = unit_names[i - 1].mult;
+            return p;
+        }
     }
 
-    return (unsigned char *)p;
+    /*
+     * unknown unit, extension?
+     */
+    unit->mult = (double)(1);
+    return p;
+}
+
+
+unsigned char *
+mnhtest_unit_parse(mnhtest_unit_t *unit, mnbytes_t *s, double *v)
+{
+    return (unsigned char *)mnhtest_unit_lex(unit, BCDATA(s), v);
 }
 
 
@@ -23,6 +23,7 @@ typedef struct _mnhtest_unit {
 
 void mnhtest_unit_init(mnhtest_unit_t *, int, double);
 double mnhtest_unit_normalize(mnhtest_unit_t *, mnhtest_unit_t *, double);
+const char *mnhtest_unit_lex(mnhtest_unit_t *, const char *, double *);
 unsigned char *mnhtest_unit_parse(mnhtest_unit_t *, mnbytes_t *, double *);
 #define MNHTEST_UNIT_STR_SHORT (0x01)
 #define MNHTEST_UNIT_STR_VBASE (0x02)
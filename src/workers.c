@@ -0,0 +1,85 @@
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+
+#include "workers.h"
+
+/* reads given up on a busy writer */
+#define WSTATS_READ_RETRIES (8)
+
+
+/*
+ * Stats of n workers, shared with the processes forked afterwards.
+ * Pages are only touched as the histograms are used.
+ */
+mnhtesto_wstats_t *
+mnhtesto_wstats_new(unsigned n)
+{
+    void *m;
+
+    if ((m = mmap(NULL,
+                  sizeof(mnhtesto_wstats_t) * n,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS,
+                  -1,
+                  0)) == MAP_FAILED) {
+        FAIL("mmap");
+    }
+    return m;
+}
+
+
+void
+mnhtesto_wstats_destroy(mnhtesto_wstats_t *wstats, unsigned n)
+{
+    (void)munmap(wstats, sizeof(mnhtesto_wstats_t) * n);
+}
+
+
+void
+mnhtesto_wstats_begin(mnhtesto_wstats_t *wstats)
+{
+    __atomic_store_n(&wstats->seq, wstats->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void
+mnhtesto_wstats_end(mnhtesto_wstats_t *wstats)
+{
+    __atomic_store_n(&wstats->seq, wstats->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * A consistent copy of src, if the writer lets it within a few
+ * retries, non-zero otherwise.
+ */
+int
+mnhtesto_wstats_read(const mnhtesto_wstats_t *src, mnhtesto_wstats_t *dst)
+{
+    unsigned i;
+
+    for (i = 0; i < WSTATS_READ_RETRIES; ++i) {
+        uint64_t seq;
+        size_t nrstats;
+
+        if ((seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE)) & 1) {
+            continue;
+        }
+        nrstats = MIN(__atomic_load_n(&src->nrstats, __ATOMIC_RELAXED),
+                      countof(src->rstats));
+        memcpy(dst, src, MNHTESTO_WSTATS_SIZE(nrstats));
+        dst->nrstats = MIN(dst->nrstats, nrstats);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,58 @@
+#ifndef MNHTESTO_WORKERS_H
+#define MNHTESTO_WORKERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rstats.h"
+#include "shedder.h"
+#include "topk.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Stats of a worker process, in memory shared by all of the workers.
+ * A worker publishes its own once in a while, and anyone reads all of
+ * them to aggregate.  Writes are bracketed by mnhtesto_wstats_begin()
+ * and mnhtesto_wstats_end(), seq is odd meanwhile, and readers retry
+ * on a change of seq.
+ *
+ * Request counters and histograms are cumulative, the heavy hitters
+ * are those of the last interval, tick counts the intervals, the shed
+ * limit is the current one.
+ */
+#define MNHTESTO_NCODES (600)
+
+typedef struct _mnhtesto_wstats {
+    uint64_t seq;
+    pid_t pid;
+    uint64_t tick;
+    int nthreads;
+    unsigned long nreq[MNHTESTO_NCODES];
+    unsigned long nbytes[MNHTESTO_NCODES];
+    unsigned long nshed[MNHTESTO_SHED_NCLASSES];
+    double shed_limit;
+    mnhtesto_topk_t consumers;
+    mnhtesto_topk_t offenders;
+    size_t nrstats;
+    /* the last one, only nrstats are copied */
+    mnhtesto_rstat_t rstats[MNHTESTO_RSTATS_MAX + 1];
+} mnhtesto_wstats_t;
+
+#define MNHTESTO_WSTATS_SIZE(n)                                        \
+    (offsetof(mnhtesto_wstats_t, rstats) + (n) * sizeof(mnhtesto_rstat_t))
+
+mnhtesto_wstats_t *mnhtesto_wstats_new(unsigned);
+void mnhtesto_wstats_destroy(mnhtesto_wstats_t *, unsigned);
+void mnhtesto_wstats_begin(mnhtesto_wstats_t *);
+void mnhtesto_wstats_end(mnhtesto_wstats_t *);
+int mnhtesto_wstats_read(const mnhtesto_wstats_t *, mnhtesto_wstats_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MNHTESTO_WORKERS_H */
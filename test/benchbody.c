@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "mnhtesto.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define BSIZE_MAX 21
+/* bytes rendered per measurement */
+#define NBYTES (1ul << 32)
+#define FCGI_HEADER_LEN 8
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+/*
+ * What mnfcgi does for a record: the header, the payload copied into
+ * the output buffer, and the padding to 8 bytes.
+ */
+static void
+render_record(char *out, const char *src, size_t sz)
+{
+    size_t padding;
+
+    padding = (8 - (sz % 8)) % 8;
+    memset(out, 1, FCGI_HEADER_LEN);
+    memcpy(out + FCGI_HEADER_LEN, src, sz);
+    memset(out + FCGI_HEADER_LEN + sz, 0, padding);
+}
+
+
+static uint64_t
+render_body(char *out, const mnhtesto_bodygen_t *gen, size_t clen, size_t nreq)
+{
+    uint64_t start;
+    size_t goffset, j;
+
+    goffset = 0;
+    start = nsec_now();
+    for (j = 0; j < nreq; ++j) {
+        size_t offset;
+
+        for (offset = 0; offset < clen;) {
+            size_t sz;
+
+            sz = MIN(MNHTESTO_BODY_CHUNK, clen - offset);
+            sz = MIN(sz, gen->sz - goffset);
+            render_record(out, gen->buf + goffset, sz);
+            offset += sz;
+            goffset += sz;
+            if (goffset == gen->sz) {
+                goffset = 0;
+            }
+        }
+    }
+    return nsec_now() - start;
+}
+
+
+/*
+ * Bytes/sec on one core of rendering a clen body into FCGI_STDOUT
+ * records: the records copied from a body sized buffer at the running
+ * offset, and the records copied from the body generators.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        unsigned bsize;
+    } data[] = {
+        {0, 10},
+        {0, 16},
+        {0, 18},
+        {0, BSIZE_MAX},
+    };
+    char *body, *out;
+    UNITTEST_PROLOG;
+
+    if ((body = malloc(1 << (BSIZE_MAX + 1))) == NULL) {
+        FAIL("malloc");
+    }
+    memset(body, 'Y', 1 << (BSIZE_MAX + 1));
+    if ((out = malloc(FCGI_HEADER_LEN + MNFCGI_MAX_PAYLOAD + 8)) == NULL) {
+        FAIL("malloc");
+    }
+    if (mnhtesto_bodygen_init(MNHTESTO_BODY_CHUNK, 1, NULL) != 0) {
+        FAIL("mnhtesto_bodygen_init");
+    }
+
+    FOREACHDATA {
+        size_t clen, nreq, j;
+        uint64_t start, before;
+
+        clen = 1ul << CDATA.bsize;
+        nreq = NBYTES / clen;
+
+        start = nsec_now();
+        for (j = 0; j < nreq; ++j) {
+            size_t offset;
+
+            for (offset = 0; offset < clen;) {
+                size_t sz;
+
+                sz = MIN(MNFCGI_MAX_PAYLOAD, clen - offset);
+                render_record(out, body + offset, sz);
+                offset += sz;
+            }
+        }
+        before = nsec_now() - start;
+
+        TRACE("clen %8zu GB/s: offset %6.2lf y %6.2lf rnd %6.2lf pat %6.2lf",
+              clen,
+              (double)(nreq * clen) / (double)before,
+              (double)(nreq * clen) /
+                (double)render_body(out,
+                                    mnhtesto_bodygen_get("y", 0),
+                                    clen,
+                                    nreq),
+              (double)(nreq * clen) /
+                (double)render_body(out,
+                                    mnhtesto_bodygen_get("rnd", 0),
+                                    clen,
+                                    nreq),
+              (double)(nreq * clen) /
+                (double)render_body(out,
+                                    mnhtesto_bodygen_get("pat", 4),
+                                    clen,
+                                    nreq));
+    }
+
+    mnhtesto_bodygen_fini();
+    free(body);
+    free(out);
+}
+
+
+int
+main(void)
+{
+    bench0();
+    return 0;
+}
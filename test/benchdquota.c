@@ -0,0 +1,300 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "dquota.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NKEYS (1000 * 1000)
+#define NEVENTS (1 << 22)
+#define KEYSZ 24
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+static int
+u32cmp_desc(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x > y ? -1 : x < y ? 1 : 0;
+}
+
+
+/*
+ * Key indices of a zipfian popularity, scattered over the keys.
+ */
+static void
+zipf_stream(uint32_t *stream, double s)
+{
+    double *cdf;
+    unsigned j;
+
+    if ((cdf = malloc(sizeof(double) * NKEYS)) == NULL) {
+        FAIL("malloc");
+    }
+    for (j = 0; j < NKEYS; ++j) {
+        cdf[j] = (j > 0 ? cdf[j - 1] : 0.0) + 1.0 / pow((double)(j + 1), s);
+    }
+    for (j = 0; j < NEVENTS; ++j) {
+        double r;
+        unsigned lo, hi;
+
+        r = (double)random() / (double)RAND_MAX * cdf[NKEYS - 1];
+        for (lo = 0, hi = NKEYS - 1; lo < hi;) {
+            unsigned mid = (lo + hi) / 2;
+
+            if (cdf[mid] < r) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        stream[j] = (uint32_t)(((uint64_t)lo * 7919) % NKEYS);
+    }
+    free(cdf);
+}
+
+
+/*
+ * An instance taken over by another key starts counting anew, and the
+ * evicted key is no longer found.
+ */
+static void
+test0(void)
+{
+    mnhtesto_qtable_t table;
+    mnhtesto_dtable_t dt;
+    mnhtesto_quota_spec_t spec;
+    mnhtesto_qpart_t a, b;
+    mnhtesto_dquota_t *dq;
+    UNUSED mnhtesto_dquota_t *found;
+    mnbytes_t *tmpl;
+    uint32_t id;
+    char s[64];
+    char *qname;
+
+    mnhtesto_qtable_init(&table, 1);
+    (void)strcpy(s, "ip-*:100/1sec:1.0:g");
+    if (mnhtesto_quota_parse(s, &qname, &spec) != 0) {
+        FAIL("mnhtesto_quota_parse");
+    }
+    tmpl = bytes_new_from_str(qname);
+    BYTES_INCREF(tmpl);
+    (void)mnhtesto_qtable_put(&table, tmpl, &spec);
+    BYTES_DECREF(&tmpl);
+    mnhtesto_dtable_init(&dt, 1, false);
+    mnhtesto_dtable_bind(&dt, &table, NULL);
+
+    a.data = "ip-10.0.0.1";
+    a.len = strlen(a.data);
+    b.data = "ip-10.0.0.2";
+    b.len = strlen(b.data);
+    if ((dq = mnhtesto_dtable_get(&dt,
+                                  &table,
+                                  &a,
+                                  1,
+                                  mnhtesto_qparts_hash(&a, 1),
+                                  0,
+                                  &id)) == NULL) {
+        FAIL("mnhtesto_dtable_get");
+    }
+    dq->count.accepted = 3;
+    dq->count.rejected = 1;
+    found = mnhtesto_dtable_find(&dt, mnhtesto_qparts_hash(&a, 1));
+    assert(found == dq);
+
+    found = mnhtesto_dtable_get(&dt,
+                                &table,
+                                &b,
+                                1,
+                                mnhtesto_qparts_hash(&b, 1),
+                                0,
+                                &id);
+    assert(found == dq && dt.state->nevicted == 1);
+    assert(dq->count.accepted == 0 && dq->count.rejected == 0);
+    found = mnhtesto_dtable_find(&dt, mnhtesto_qparts_hash(&a, 1));
+    assert(found == NULL);
+    found = mnhtesto_dtable_find(&dt, mnhtesto_qparts_hash(&b, 1));
+    assert(found == dq);
+
+    mnhtesto_dtable_fini(&dt);
+    mnhtesto_qtable_fini(&table);
+}
+
+
+/*
+ * The cost of a lookup over a million client keys under the "ip-*"
+ * template, and how many lookups find the instance of their key still
+ * there, against those an ideal cache of the hottest keys would serve.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        double s;
+        size_t cap;
+    } data[] = {
+        {0, 0.8, 16 * 1024},
+        {0, 0.8, 64 * 1024},
+        {0, 1.0, 16 * 1024},
+        {0, 1.0, 64 * 1024},
+        {0, 1.2, 64 * 1024},
+    };
+    char *keys;
+    unsigned j;
+    UNITTEST_PROLOG;
+
+    if ((keys = malloc(KEYSZ * NKEYS)) == NULL) {
+        FAIL("malloc");
+    }
+    for (j = 0; j < NKEYS; ++j) {
+        (void)snprintf(keys + j * KEYSZ,
+                       KEYSZ,
+                       "ip-10.%u.%u.%u",
+                       j >> 16,
+                       (j >> 8) & 0xff,
+                       j & 0xff);
+    }
+
+    FOREACHDATA {
+        mnhtesto_qtable_t table;
+        mnhtesto_dtable_t dt;
+        mnhtesto_quota_spec_t spec;
+        mnbytes_t *tmpl;
+        uint32_t *stream, *counts;
+        uint64_t start, elapsed, nhits, ideal;
+        char s[64];
+        char *qname;
+
+        mnhtesto_qtable_init(&table, 2);
+        (void)strcpy(s, "ip-*:100/1sec:1.0:g");
+        if (mnhtesto_quota_parse(s, &qname, &spec) != 0) {
+            FAIL("mnhtesto_quota_parse");
+        }
+        tmpl = bytes_new_from_str(qname);
+        BYTES_INCREF(tmpl);
+        (void)mnhtesto_qtable_put(&table, tmpl, &spec);
+        BYTES_DECREF(&tmpl);
+
+        mnhtesto_dtable_init(&dt, CDATA.cap, false);
+        mnhtesto_dtable_bind(&dt, &table, NULL);
+
+        if ((stream = malloc(sizeof(uint32_t) * NEVENTS)) == NULL) {
+            FAIL("malloc");
+        }
+        if ((counts = calloc(NKEYS, sizeof(uint32_t))) == NULL) {
+            FAIL("calloc");
+        }
+        zipf_stream(stream, CDATA.s);
+
+        nhits = 0;
+        start = nsec_now();
+        for (j = 0; j < NEVENTS; ++j) {
+            mnhtesto_qpart_t key;
+            UNUSED mnhtesto_dquota_t *dq;
+            UNUSED uint32_t id;
+            uint64_t nmisses;
+
+            key.data = keys + stream[j] * KEYSZ;
+            key.len = strlen(key.data);
+            /* a miss either takes a free instance, or evicts one */
+            nmisses = dt.state->nused + dt.state->nevicted;
+            dq = mnhtesto_dtable_get(&dt,
+                                     &table,
+                                     &key,
+                                     1,
+                                     mnhtesto_qparts_hash(&key, 1),
+                                     j,
+                                     &id);
+            assert(dq != NULL && id == 0);
+            nhits += dt.state->nused + dt.state->nevicted == nmisses;
+        }
+        elapsed = nsec_now() - start;
+
+        /*
+         * every instance is still indexed
+         */
+        assert(dt.state->nused == CDATA.cap);
+        for (j = 0; j < CDATA.cap; ++j) {
+            mnhtesto_dquota_t *dq;
+            UNUSED mnhtesto_dquota_t *found;
+            mnhtesto_qpart_t key;
+            UNUSED uint32_t id;
+
+            dq = &dt.entries[j];
+            key.data = dq->key;
+            key.len = dq->len;
+            found = mnhtesto_dtable_get(&dt,
+                                        &table,
+                                        &key,
+                                        1,
+                                        mnhtesto_qparts_hash(&key, 1),
+                                        0,
+                                        &id);
+            assert(found == dq);
+            found = mnhtesto_dtable_find(&dt, dq->hash);
+            assert(found == dq);
+        }
+        assert(dt.state->nused == CDATA.cap);
+
+        /*
+         * the ideal: first sights of the hottest cap keys only miss
+         */
+        for (j = 0; j < NEVENTS; ++j) {
+            ++counts[stream[j]];
+        }
+        qsort(counts, NKEYS, sizeof(uint32_t), u32cmp_desc);
+        for (j = 0, ideal = 0; j < CDATA.cap; ++j) {
+            ideal += counts[j] > 0 ? counts[j] - 1 : 0;
+        }
+
+        TRACE("zipf %.1lf cap %zu: %.1lf ns/lookup, hits %.1lf%% "
+              "(ideal %.1lf%%), %zu evicted, %zu bytes",
+              CDATA.s,
+              CDATA.cap,
+              (double)elapsed / (double)NEVENTS,
+              (double)nhits * 100.0 / (double)NEVENTS,
+              (double)ideal * 100.0 / (double)NEVENTS,
+              (size_t)dt.state->nevicted,
+              dt.memsz);
+
+        free(stream);
+        free(counts);
+        mnhtesto_dtable_fini(&dt);
+        mnhtesto_qtable_fini(&table);
+    }
+
+    free(keys);
+}
+
+
+int
+main(void)
+{
+    test0();
+    bench0();
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "hdr.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NSAMPLES (1 << 22)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+
+static int
+u64cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/*
+ * Nanosecond latencies, log-uniform across the range, recorded, and
+ * their percentiles against those of the sorted samples.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        uint64_t lo;
+        uint64_t hi;
+    } data[] = {
+        {0, 1000ul, 1000000ul},
+        {0, 10000ul, 100000000ul},
+        {0, 100ul, 10000000000ul},
+    };
+    static const double ps[] = {50.0, 90.0, 99.0, 99.9};
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_hdr_t *hdr;
+        uint64_t *samples;
+        uint64_t res[countof(ps)];
+        uint64_t start, elapsed;
+        double span, maxerr;
+        unsigned j;
+
+        if ((hdr = malloc(sizeof(mnhtesto_hdr_t))) == NULL) {
+            FAIL("malloc");
+        }
+        if ((samples = malloc(sizeof(uint64_t) * NSAMPLES)) == NULL) {
+            FAIL("malloc");
+        }
+        span = (double)CDATA.hi / (double)CDATA.lo;
+        for (j = 0; j < NSAMPLES; ++j) {
+            double r;
+
+            r = (double)random() / (double)RAND_MAX;
+            samples[j] = (uint64_t)((double)CDATA.lo * pow(span, r));
+        }
+
+        mnhtesto_hdr_init(hdr);
+        start = nsec_now();
+        for (j = 0; j < NSAMPLES; ++j) {
+            mnhtesto_hdr_record(hdr, samples[j]);
+        }
+        elapsed = nsec_now() - start;
+        assert(hdr->count == NSAMPLES);
+
+        mnhtesto_hdr_percentiles(hdr, ps, res, countof(ps));
+        qsort(samples, NSAMPLES, sizeof(uint64_t), u64cmp);
+        assert(hdr->max == samples[NSAMPLES - 1]);
+
+        maxerr = 0.0;
+        for (j = 0; j < countof(ps); ++j) {
+            uint64_t exact;
+            double err;
+
+            exact = samples[(size_t)((double)NSAMPLES * ps[j] / 100.0) - 1];
+            err = ((double)res[j] - (double)exact) / (double)exact;
+            maxerr = MAX(maxerr, err < 0.0 ? -err : err);
+        }
+
+        TRACE("%12" PRIu64 "..%-12" PRIu64 " ns: %.2lf ns/record, "
+              "p50 %" PRIu64 " p99.9 %" PRIu64 ", max error %.2lf%%, "
+              "%zu bytes",
+              CDATA.lo,
+              CDATA.hi,
+              (double)elapsed / (double)NSAMPLES,
+              res[0],
+              res[3],
+              maxerr * 100.0,
+              sizeof(mnhtesto_hdr_t));
+
+        free(samples);
+        free(hdr);
+    }
+}
+
+
+int
+main(void)
+{
+    bench0();
+    return 0;
+}
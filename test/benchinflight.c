@@ -0,0 +1,233 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "inflight.h"
+#include "quota.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NHELD (1024)
+#define NOPS (1 << 22)
+#define SCATTER(i) ((uint64_t)(i) * 0x9e3779b97f4a7c15ul)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+static void
+test0(void)
+{
+    struct {
+        long rnd;
+        const char *in;
+        int res;
+        double limit;
+        unsigned flags;
+    } data[] = {
+        {0, "q:8inflight", 0, 8.0, MNHTESTO_QF_INFLIGHT},
+        {0, "q:1inflight:hs", 0, 1.0,
+            MNHTESTO_QF_INFLIGHT | MNHTESTO_QF_SHAPE},
+        {0, "q:0inflight", 1, 0.0, 0},
+        {0, "q:inflight", 1, 0.0, 0},
+        {0, "q:8inflights", 1, 0.0, 0},
+        {0, "q:8", 1, 0.0, 0},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_quota_spec_t spec;
+        mnhtesto_quota_t quota;
+        char s[64];
+        char *qname;
+        double ra;
+        int res;
+        unsigned j;
+
+        (void)strcpy(s, CDATA.in);
+        res = mnhtesto_quota_parse(s, &qname, &spec) != 0;
+        assert(res == CDATA.res);
+        if (res != 0) {
+            continue;
+        }
+        assert(MNHTESTO_QUOTA_LIMIT(&spec) == CDATA.limit);
+        assert(spec.flags == CDATA.flags);
+
+        /* never accounted in time */
+        mnhtesto_quota_init(&spec, &quota, 0, 0);
+        for (j = 0; j < 100; ++j) {
+            res = mnhtesto_quota_update(&spec, &quota, 0, 1, &ra);
+            assert(res == MNHTESTO_QUOTA_OK);
+        }
+    }
+}
+
+
+/*
+ * Counters are bounded, and are gone once released, the counters of
+ * colliding hashes survive the deletion of one another.  A refusal
+ * records the full counter.
+ */
+static void
+test1(void)
+{
+    mnhtesto_inflight_t inflight;
+    mnhtesto_iheld_t a, b;
+    UNUSED uint32_t count;
+    UNUSED int res;
+    unsigned i;
+
+    mnhtesto_inflight_init(&inflight);
+    a.n = b.n = 0;
+    a.full = b.full = false;
+    res = mnhtesto_inflight_acquire(&inflight, 1, 2, &a);
+    assert(res == 0);
+    res = mnhtesto_inflight_acquire(&inflight, 2, 1, &a);
+    assert(res == 0);
+    res = mnhtesto_inflight_acquire(&inflight, 1, 2, &b);
+    assert(res == 0);
+    assert(!b.full);
+    res = mnhtesto_inflight_acquire(&inflight, 1, 2, &b);
+    assert(res != 0);
+    assert(b.full && b.over == 1);
+    res = mnhtesto_inflight_acquire(&inflight, 2, 1, &b);
+    assert(res != 0);
+    assert(b.full && b.over == 2);
+    assert(!a.full);
+    assert(a.n == 2 && b.n == 1);
+    count = mnhtesto_inflight_count(&inflight, 1);
+    assert(count == 2);
+    mnhtesto_inflight_release(&inflight, &a);
+    assert(a.n == 0);
+    count = mnhtesto_inflight_count(&inflight, 1);
+    assert(count == 1);
+    count = mnhtesto_inflight_count(&inflight, 2);
+    assert(count == 0);
+    mnhtesto_inflight_release(&inflight, &b);
+    assert(inflight.nused == 0);
+
+    /*
+     * hashes of the same home slot, and in between, then released in
+     * another order
+     */
+    for (i = 0; i < NHELD; ++i) {
+        mnhtesto_iheld_t held;
+        uint64_t hash;
+
+        held.n = 0;
+        hash = (i % 2) ? (uint64_t)i << 32 : i;
+        res = mnhtesto_inflight_acquire(&inflight, hash, 1, &held);
+        assert(res == 0);
+    }
+    assert(inflight.nused == NHELD);
+    for (i = 0; i < NHELD; i += 3) {
+        mnhtesto_iheld_t held;
+
+        held.hashes[0] = (i % 2) ? (uint64_t)i << 32 : i;
+        held.n = 1;
+        mnhtesto_inflight_release(&inflight, &held);
+    }
+    for (i = 0; i < NHELD; ++i) {
+        uint64_t hash;
+
+        hash = (i % 2) ? (uint64_t)i << 32 : i;
+        count = mnhtesto_inflight_count(&inflight, hash);
+        assert(count == (i % 3 == 0 ? 0u : 1u));
+    }
+    mnhtesto_inflight_fini(&inflight);
+}
+
+
+/*
+ * The cost of letting a request in and of finishing it, of a chain of
+ * nlimits in-flight limits, over nkeys keys of NHELD requests in
+ * flight in all.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        unsigned nkeys;
+        unsigned nlimits;
+    } data[] = {
+        {0, 1, 1},
+        {0, 32, 1},
+        {0, NHELD, 1},
+        {0, NHELD, 2},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_inflight_t inflight;
+        mnhtesto_iheld_t *held;
+        uint64_t start, elapsed;
+        unsigned j, k;
+
+        if ((held = malloc(sizeof(mnhtesto_iheld_t) * NHELD)) == NULL) {
+            FAIL("malloc");
+        }
+        mnhtesto_inflight_init(&inflight);
+        for (j = 0; j < NHELD; ++j) {
+            held[j].n = 0;
+            for (k = 0; k < CDATA.nlimits; ++k) {
+                if (mnhtesto_inflight_acquire(
+                        &inflight,
+                        SCATTER(j % CDATA.nkeys) + k,
+                        NHELD,
+                        &held[j]) != 0) {
+                    FAIL("mnhtesto_inflight_acquire");
+                }
+            }
+        }
+        start = nsec_now();
+        for (j = 0; j < NOPS; ++j) {
+            mnhtesto_iheld_t *h;
+
+            h = &held[(j * 7919) % NHELD];
+            mnhtesto_inflight_release(&inflight, h);
+            for (k = 0; k < CDATA.nlimits; ++k) {
+                (void)mnhtesto_inflight_acquire(
+                    &inflight,
+                    SCATTER(((j * 7919) % NHELD) % CDATA.nkeys) + k,
+                    NHELD,
+                    h);
+            }
+        }
+        elapsed = nsec_now() - start;
+        assert(inflight.nused == CDATA.nkeys * CDATA.nlimits);
+        TRACE("%4u keys %u limits: %.1lf ns/request",
+              CDATA.nkeys,
+              CDATA.nlimits,
+              (double)elapsed / (double)NOPS);
+        mnhtesto_inflight_fini(&inflight);
+        free(held);
+    }
+}
+
+
+int
+main(void)
+{
+    test0();
+    test1();
+    bench0();
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "latency.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NSAMPLES (1 << 22)
+#define HIST_PATH "benchlatency.hist"
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/*
+ * Bad specs are rejected, a histogram of no weight in particular.
+ */
+static void
+test0(void)
+{
+    struct {
+        long rnd;
+        const char *spec;
+        const char *hist;
+    } data[] = {
+        {0, "lognormal:20ms:1xyz", NULL},
+        {0, "pareto:5ms:", NULL},
+        {0, "pareto:5ms:0", NULL},
+        {0, "hist:@" HIST_PATH, ""},
+        {0, "hist:@" HIST_PATH, "1ms 0\n5ms 0\n"},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_latency_t lat;
+        UNUSED int res;
+
+        if (CDATA.hist != NULL) {
+            FILE *f;
+
+            if ((f = fopen(HIST_PATH, "w")) == NULL) {
+                FAIL("fopen");
+            }
+            fprintf(f, "%s", CDATA.hist);
+            (void)fclose(f);
+        }
+        res = mnhtesto_latency_parse(&lat, CDATA.spec);
+        assert(res != 0);
+    }
+    (void)unlink(HIST_PATH);
+}
+
+
+/*
+ * ns per sample, and the sampled percentiles in milliseconds.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        const char *spec;
+    } data[] = {
+        {0, "fixed:200us"},
+        {0, "uniform:1ms:10ms"},
+        {0, "exp:20ms"},
+        {0, "lognormal:20ms:1"},
+        {0, "pareto:5ms:1.5"},
+        {0, "hist:@" HIST_PATH},
+    };
+    uint64_t *samples;
+    FILE *f;
+    UNITTEST_PROLOG;
+
+    if ((f = fopen(HIST_PATH, "w")) == NULL) {
+        FAIL("fopen");
+    }
+    fprintf(f, "1ms 50\n5ms 30\n20ms 15\n100ms 4\n1s 1\n");
+    (void)fclose(f);
+
+    if ((samples = malloc(sizeof(uint64_t) * NSAMPLES)) == NULL) {
+        FAIL("malloc");
+    }
+
+    FOREACHDATA {
+        mnhtesto_latency_t lat;
+        uint64_t start, elapsed;
+        unsigned j;
+
+        if (mnhtesto_latency_parse(&lat, CDATA.spec) != 0) {
+            FAIL("mnhtesto_latency_parse");
+        }
+        start = nsec_now();
+        for (j = 0; j < NSAMPLES; ++j) {
+            samples[j] = mnhtesto_latency_sample(&lat);
+        }
+        elapsed = nsec_now() - start;
+        qsort(samples, NSAMPLES, sizeof(uint64_t), cmp_u64);
+
+        TRACE("%-20s %5.2lf ns/sample p50 %8.3lf p99 %8.3lf p99.9 %8.3lf ms",
+              CDATA.spec,
+              (double)elapsed / (double)NSAMPLES,
+              (double)samples[NSAMPLES / 2] / 1000000.0,
+              (double)samples[NSAMPLES / 100 * 99] / 1000000.0,
+              (double)samples[NSAMPLES / 1000 * 999] / 1000000.0);
+        mnhtesto_latency_fini(&lat);
+    }
+
+    free(samples);
+    (void)unlink(HIST_PATH);
+}
+
+
+int
+main(void)
+{
+    test0();
+    bench0();
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "metrics.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NSCRAPES 16
+#define NHISTOGRAMS 256
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+
+/*
+ * A scrape as mnhtesto renders it: accept and reject counters of
+ * nkeys quotas, and service and overshoot histograms of the maximum of
+ * endpoints, into the same buffer every time.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        unsigned nkeys;
+    } data[] = {
+        {0, 1000},
+        {0, 100 * 1000},
+        {0, 1000 * 1000},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_metrics_t m;
+        mnhtesto_hdr_t *hdr;
+        char **qnames;
+        uint64_t *counts;
+        uint64_t start, elapsed, first;
+        size_t cap;
+        unsigned j, k;
+
+        if ((qnames = malloc(sizeof(char *) * CDATA.nkeys)) == NULL) {
+            FAIL("malloc");
+        }
+        if ((counts = malloc(sizeof(uint64_t) * CDATA.nkeys)) == NULL) {
+            FAIL("malloc");
+        }
+        for (j = 0; j < CDATA.nkeys; ++j) {
+            if ((qnames[j] = malloc(32)) == NULL) {
+                FAIL("malloc");
+            }
+            (void)snprintf(qnames[j], 32, "client-%08u", j);
+            counts[j] = random();
+        }
+        if ((hdr = malloc(sizeof(mnhtesto_hdr_t))) == NULL) {
+            FAIL("malloc");
+        }
+        mnhtesto_hdr_init(hdr);
+        for (j = 0; j < 100000; ++j) {
+            mnhtesto_hdr_record(hdr, random() % 100000000ul);
+        }
+
+        mnhtesto_metrics_init(&m);
+        first = 0;
+        cap = 0;
+        start = nsec_now();
+        for (k = 0; k < NSCRAPES; ++k) {
+            mnhtesto_metrics_reset(&m);
+            mnhtesto_metrics_type(&m,
+                                  "mnhtesto_service_seconds",
+                                  "histogram",
+                                  "Service time.");
+            for (j = 0; j < NHISTOGRAMS; ++j) {
+                const char *labels[4] = {"endpoint", "/api/v1/x", "code",
+                                         "200"};
+
+                mnhtesto_metrics_histogram(&m,
+                                           "mnhtesto_service_seconds",
+                                           labels,
+                                           2,
+                                           hdr);
+            }
+            mnhtesto_metrics_type(&m,
+                                  "mnhtesto_quota_accepted_total",
+                                  "counter",
+                                  "Accepted.");
+            for (j = 0; j < CDATA.nkeys; ++j) {
+                mnhtesto_metrics_begin(&m, "mnhtesto_quota_accepted_total");
+                mnhtesto_metrics_label(&m, "quota", qnames[j]);
+                mnhtesto_metrics_u64(&m, counts[j]);
+            }
+            mnhtesto_metrics_type(&m,
+                                  "mnhtesto_quota_rejected_total",
+                                  "counter",
+                                  "Rejected.");
+            for (j = 0; j < CDATA.nkeys; ++j) {
+                mnhtesto_metrics_begin(&m, "mnhtesto_quota_rejected_total");
+                mnhtesto_metrics_label(&m, "quota", qnames[j]);
+                mnhtesto_metrics_u64(&m, counts[j] >> 4);
+            }
+            if (k == 0) {
+                first = nsec_now() - start;
+                cap = m.cap;
+            }
+        }
+        elapsed = nsec_now() - start - first;
+        /* no growth after the first scrape */
+        if (m.cap != cap) {
+            FAIL("mnhtesto_metrics_reset");
+        }
+
+        TRACE("%8u keys: %.2lf ms/scrape (first %.2lf ms), %zu bytes, "
+              "%.1lf ns/sample",
+              CDATA.nkeys,
+              (double)elapsed / (NSCRAPES - 1) / 1000000.0,
+              (double)first / 1000000.0,
+              m.sz,
+              (double)elapsed / (NSCRAPES - 1) /
+                (double)(2 * CDATA.nkeys + NHISTOGRAMS * 22));
+
+        mnhtesto_metrics_fini(&m);
+        for (j = 0; j < CDATA.nkeys; ++j) {
+            free(qnames[j]);
+        }
+        free(qnames);
+        free(counts);
+        free(hdr);
+    }
+}
+
+
+int
+main(void)
+{
+    bench0();
+    return 0;
+}
@@ -0,0 +1,285 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "qload.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NKEYS (100 * 1000)
+#define NTENANTS (100)
+#define NORGS (10)
+#define NDECISIONS (1 << 22)
+/* runs of each, the best one counts */
+#define NRUNS (3)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+static void
+load(mnhtesto_qtable_t *table, const char *fmt, unsigned i, unsigned p)
+{
+    char s[MNHTESTO_QLOAD_LINE_MAX];
+
+    (void)snprintf(s, sizeof(s), fmt, i, p);
+    if (mnhtesto_qload_line(table, s) != 0) {
+        FAIL("mnhtesto_qload_line");
+    }
+}
+
+
+/*
+ * A request over the parent limit is counted in none of the limits of
+ * the child.
+ */
+static void
+test0(void)
+{
+    mnhtesto_qtable_t table;
+    uint32_t ids[MNHTESTO_QUOTA_MAX_CHAIN];
+    const mnhtesto_quota_spec_t *specs[MNHTESTO_QUOTA_MAX_CHAIN];
+    mnhtesto_quota_t *states[MNHTESTO_QUOTA_MAX_CHAIN];
+    mnbytes_t *qname;
+    uint32_t id;
+    size_t n, i, over;
+    unsigned j, naccepted;
+
+    mnhtesto_qtable_init(&table, 0);
+    load(&table, "p:5/1min", 0, 0);
+    load(&table, "c^p:10/1min:1.0:g,100/1hour", 0, 0);
+    if (mnhtesto_qtable_link(&table) != 0) {
+        FAIL("mnhtesto_qtable_link");
+    }
+    qname = bytes_new_from_str("c");
+    BYTES_INCREF(qname);
+    id = mnhtesto_qtable_get(&table, qname);
+    assert(id != MNHTESTO_QTABLE_NONE);
+    MNHTESTO_QTABLE_CHAIN(&table, id, ids, n);
+    assert(n == 3);
+    for (i = 0; i < n; ++i) {
+        specs[i] = MNHTESTO_QTABLE_SPEC(&table, ids[i]);
+        states[i] = MNHTESTO_QTABLE_QUOTA(&table, ids[i]);
+        mnhtesto_quota_init(specs[i], states[i], MNHTESTO_NSEC, 0);
+    }
+
+    for (j = 0, naccepted = 0, over = 0; j < 10; ++j) {
+        double ra;
+
+        if (mnhtesto_quota_update_chain(specs,
+                                        states,
+                                        n,
+                                        MNHTESTO_NSEC,
+                                        1,
+                                        &ra,
+                                        &over) == MNHTESTO_QUOTA_OK) {
+            ++naccepted;
+        } else {
+            assert(over == 2);
+        }
+    }
+    assert(naccepted == 5);
+    assert(MNHTESTO_QUOTA_VALUE(specs[1], states[1]->value) == 5.0);
+    TRACE("child %.0lf of parent %.0lf",
+          MNHTESTO_QUOTA_VALUE(specs[1], states[1]->value),
+          MNHTESTO_QUOTA_VALUE(specs[2], states[2]->value));
+
+    BYTES_DECREF(&qname);
+    mnhtesto_qtable_fini(&table);
+}
+
+
+/*
+ * The cost of a decision, from the key lookup to the commit, against
+ * that of the first limit of the key alone on the same table.  Limits
+ * are generous enough for all of the requests to pass, so that every
+ * one of them is committed.
+ *
+ * A request server makes a decision in between much else, so that its
+ * cache misses do not overlap with those of the next decision.  The
+ * next key depends on the result here to the same effect.
+ */
+static uint64_t
+run(mnhtesto_qtable_t *table,
+    mnbytes_t **lkeys,
+    const unsigned *order,
+    size_t nchain,
+    bool single)
+{
+    uint64_t start, now;
+    unsigned j, naccepted;
+    int res;
+
+    now = MNHTESTO_NSEC;
+    for (j = 0; j < table->nelems; ++j) {
+        mnhtesto_quota_init(MNHTESTO_QTABLE_SPEC(table, j),
+                            MNHTESTO_QTABLE_QUOTA(table, j),
+                            now,
+                            j);
+    }
+
+    naccepted = 0;
+    res = MNHTESTO_QUOTA_OK;
+    start = nsec_now();
+    for (j = 0; j < NDECISIONS; ++j) {
+        mnbytes_t *key;
+        uint32_t id;
+        double ra;
+
+        key = lkeys[(order[j] + (unsigned)res) % NKEYS];
+        key->hash = 0;
+        id = mnhtesto_qtable_get(table, key);
+        now += 16;
+
+        if (single) {
+            res = mnhtesto_quota_update(MNHTESTO_QTABLE_SPEC(table, id),
+                                        MNHTESTO_QTABLE_QUOTA(table, id),
+                                        now,
+                                        1,
+                                        &ra);
+        } else {
+            uint32_t ids[MNHTESTO_QUOTA_MAX_CHAIN];
+            const mnhtesto_quota_spec_t *specs[MNHTESTO_QUOTA_MAX_CHAIN];
+            mnhtesto_quota_t *states[MNHTESTO_QUOTA_MAX_CHAIN];
+            size_t n, i, over;
+
+            MNHTESTO_QTABLE_CHAIN(table, id, ids, n);
+            if (MRKUNLIKELY(n != nchain)) {
+                FAIL("MNHTESTO_QTABLE_CHAIN");
+            }
+            for (i = 0; i < n; ++i) {
+                specs[i] = MNHTESTO_QTABLE_SPEC(table, ids[i]);
+                states[i] = MNHTESTO_QTABLE_QUOTA(table, ids[i]);
+            }
+            res = mnhtesto_quota_update_chain(specs,
+                                              states,
+                                              n,
+                                              now,
+                                              1,
+                                              &ra,
+                                              &over);
+        }
+        naccepted += res == MNHTESTO_QUOTA_OK;
+    }
+    assert(naccepted == NDECISIONS);
+    return nsec_now() - start;
+}
+
+
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        const char *name;
+        /* key, and the parents if any */
+        const char *fmt[3];
+        size_t n;
+    } data[] = {
+        {0, "1 limit", {"k%u:1000000/1sec", NULL, NULL}, 1},
+        {0,
+         "2 limits",
+         {"k%u:1000000/1sec,1000000000/1hour", NULL, NULL},
+         2},
+        {0,
+         "2 limits + parent",
+         {"k%u^t%u:1000000/1sec,1000000000/1hour",
+          "t%u:1000000/1sec:1.0:g",
+          NULL},
+         3},
+        {0,
+         "2 limits + 2 parents",
+         {"k%u^t%u:1000000/1sec,1000000000/1hour",
+          "t%u^o%u:1000000/1sec:1.0:g",
+          "o%u:1000000/1sec:1.0:w"},
+         4},
+    };
+    mnbytes_t **lkeys;
+    unsigned *order;
+    unsigned j;
+    UNITTEST_PROLOG;
+
+    if ((lkeys = malloc(sizeof(mnbytes_t *) * NKEYS)) == NULL) {
+        FAIL("malloc");
+    }
+    if ((order = malloc(sizeof(unsigned) * NDECISIONS)) == NULL) {
+        FAIL("malloc");
+    }
+    for (j = 0; j < NKEYS; ++j) {
+        lkeys[j] = bytes_printf("k%u", j);
+        BYTES_INCREF(lkeys[j]);
+    }
+    for (j = 0; j < NDECISIONS; ++j) {
+        order[j] = random() % NKEYS;
+    }
+
+    FOREACHDATA {
+        mnhtesto_qtable_t table;
+        uint64_t single, chain;
+        unsigned k;
+
+        mnhtesto_qtable_init(&table, NKEYS * 2);
+        for (j = 0; j < NKEYS; ++j) {
+            load(&table, CDATA.fmt[0], j, j % NTENANTS);
+        }
+        for (j = 0; CDATA.fmt[1] != NULL && j < NTENANTS; ++j) {
+            load(&table, CDATA.fmt[1], j, j % NORGS);
+        }
+        for (j = 0; CDATA.fmt[2] != NULL && j < NORGS; ++j) {
+            load(&table, CDATA.fmt[2], j, 0);
+        }
+        if (mnhtesto_qtable_link(&table) != 0) {
+            FAIL("mnhtesto_qtable_link");
+        }
+
+        for (k = 0, single = chain = UINT64_MAX; k < NRUNS; ++k) {
+            single = MIN(single,
+                         run(&table, lkeys, order, CDATA.n, true));
+            chain = MIN(chain,
+                        run(&table, lkeys, order, CDATA.n, false));
+        }
+
+        TRACE("%-22s %zu states: %6.1lf ns/decision, "
+              "first limit alone %6.1lf ns",
+              CDATA.name,
+              CDATA.n,
+              (double)chain / (double)NDECISIONS,
+              (double)single / (double)NDECISIONS);
+
+        mnhtesto_qtable_fini(&table);
+    }
+
+    for (j = 0; j < NKEYS; ++j) {
+        BYTES_DECREF(&lkeys[j]);
+    }
+    free(lkeys);
+    free(order);
+}
+
+
+int
+main(void)
+{
+    test0();
+    bench0();
+    return 0;
+}
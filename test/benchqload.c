@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "qload.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define TEXT_PATH "benchqload.txt"
+#define IMAGE_PATH "benchqload.qi"
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+/*
+ * Load time of a quota file in the text form, and compiled, with a
+ * handful of distinct specs.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        unsigned nkeys;
+    } data[] = {
+        {0, 1000},
+        {0, 100 * 1000},
+        {0, 1000 * 1000},
+    };
+    const char *specs[] = {
+        "100req/1sec",
+        "10MB/1min:0.5:h",
+        "80req/5sec:0:hg:20",
+        "1GB/1d:0:w",
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        FILE *f;
+        mnhtesto_qtable_t table;
+        uint64_t start, text, image;
+        unsigned j;
+
+        if ((f = fopen(TEXT_PATH, "w")) == NULL) {
+            FAIL("fopen");
+        }
+        for (j = 0; j < CDATA.nkeys; ++j) {
+            fprintf(f, "qwe%07u:%s\n", j, specs[j % countof(specs)]);
+        }
+        (void)fclose(f);
+
+        mnhtesto_qtable_init(&table, 0);
+        start = nsec_now();
+        if (mnhtesto_qload_file(&table, TEXT_PATH, 0, NULL) != 0) {
+            FAIL("mnhtesto_qload_file");
+        }
+        text = nsec_now() - start;
+        assert(table.nelems == CDATA.nkeys);
+        if (mnhtesto_qimage_write(&table, IMAGE_PATH) != 0) {
+            FAIL("mnhtesto_qimage_write");
+        }
+        mnhtesto_qtable_fini(&table);
+
+        mnhtesto_qtable_init(&table, 0);
+        start = nsec_now();
+        if (mnhtesto_qload_file(&table, IMAGE_PATH, 0, NULL) != 0) {
+            FAIL("mnhtesto_qload_file");
+        }
+        image = nsec_now() - start;
+        assert(table.nelems == CDATA.nkeys);
+        assert(table.nspecs == countof(specs));
+        mnhtesto_qtable_fini(&table);
+
+        TRACE("%8u quotas: text %8.2lf ms, image %8.2lf ms",
+              CDATA.nkeys,
+              (double)text / 1000000.0,
+              (double)image / 1000000.0);
+
+        (void)unlink(TEXT_PATH);
+        (void)unlink(IMAGE_PATH);
+    }
+}
+
+
+int
+main(void)
+{
+    bench0();
+    return 0;
+}
@@ -0,0 +1,300 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/hash.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "qtable.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NLOOKUPS (1 << 22)
+/*
+ * the chained hash as configured in mnhtesto_init() before the
+ * qtable, at 1M keys it would take way too long to populate
+ */
+#define HASH_NBUCKETS 17
+#define HASH_NLOOKUPS (1 << 14)
+#define HASH_MAX_KEYS (100 * 1000)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+static int
+quota_item_finalizer(mnbytes_t *key, mnhtesto_quota_t *quota)
+{
+    BYTES_DECREF(&key);
+    free(quota);
+    return 0;
+}
+
+
+static void
+qstate_table(mnhtesto_qtable_t *table,
+             const char *path,
+             const char **names,
+             size_t n)
+{
+    mnhtesto_quota_spec_t spec;
+    size_t i;
+
+    memset(&spec, 0, sizeof(mnhtesto_quota_spec_t));
+    mnhtesto_qtable_init(table, 0);
+    for (i = 0; i < n; ++i) {
+        if (mnhtesto_qtable_put(table,
+                                bytes_new_from_str(names[i]),
+                                &spec) == MNHTESTO_QTABLE_NONE) {
+            FAIL("mnhtesto_qtable_put");
+        }
+    }
+    if (mnhtesto_qtable_map(table, path) != 0) {
+        FAIL("mnhtesto_qtable_map");
+    }
+}
+
+
+/*
+ * States are resumed from the state file by key, a key added in the
+ * middle or removed does not reset the others.
+ */
+static void
+test0(void)
+{
+    const char *a[] = {"k0", "k1", "k2", "k3", "k4", "k5"};
+    const char *b[] = {"k0", "k1", "new", "k2", "k4", "k5"};
+    char path[] = "/tmp/benchqtable.XXXXXX";
+    mnhtesto_qtable_t table;
+    size_t i;
+    int fd;
+
+    if ((fd = mkstemp(path)) == -1) {
+        FAIL("mkstemp");
+    }
+    (void)close(fd);
+
+    qstate_table(&table, path, a, countof(a));
+    for (i = 0; i < countof(a); ++i) {
+        MNHTESTO_QTABLE_QUOTA(&table, i)->ts = 1000 + i;
+    }
+    mnhtesto_qtable_fini(&table);
+
+    /* laid out anew, then in place */
+    for (i = 0; i < 2; ++i) {
+        size_t j;
+
+        qstate_table(&table, path, b, countof(b));
+        for (j = 0; j < countof(b); ++j) {
+            assert(MNHTESTO_QTABLE_QUOTA(&table, j)->ts ==
+                   (b[j][0] == 'k' ? 1000ul + (b[j][1] - '0') : 0ul));
+        }
+        mnhtesto_qtable_fini(&table);
+    }
+    (void)unlink(path);
+}
+
+
+/*
+ * The lock stripes held by a process gone are broken, those of others
+ * are not.
+ */
+static void
+test1(void)
+{
+    const char *a[] = {"k0", "k1"};
+    char path[] = "/tmp/benchqtable.XXXXXX";
+    mnhtesto_qtable_t table;
+    UNUSED size_t nbroken;
+    pid_t pid;
+    int fd, status;
+
+    if ((fd = mkstemp(path)) == -1) {
+        FAIL("mkstemp");
+    }
+    (void)close(fd);
+    qstate_table(&table, path, a, countof(a));
+    if (mnhtesto_qtable_share(&table) != 0) {
+        FAIL("mnhtesto_qtable_share");
+    }
+
+    MNHTESTO_QTABLE_LOCK(&table, 1);
+    if ((pid = fork()) == -1) {
+        FAIL("fork");
+    }
+    if (pid == 0) {
+        mnhtesto_qtable_owner();
+        MNHTESTO_QTABLE_LOCK(&table, 0);
+        _exit(0);
+    }
+    if (waitpid(pid, &status, 0) != pid) {
+        FAIL("waitpid");
+    }
+    nbroken = mnhtesto_qtable_break(&table, (uint32_t)pid);
+    assert(nbroken == 1);
+    nbroken = mnhtesto_qtable_break(&table, (uint32_t)pid);
+    assert(nbroken == 0);
+    MNHTESTO_QTABLE_LOCK(&table, 0);
+    MNHTESTO_QTABLE_UNLOCK(&table, 0);
+    MNHTESTO_QTABLE_UNLOCK(&table, 1);
+    nbroken = mnhtesto_qtable_break(&table, (uint32_t)getpid());
+    assert(nbroken == 0);
+
+    mnhtesto_qtable_fini(&table);
+    (void)unlink(path);
+}
+
+
+/*
+ * Lookup keys are distinct objects from the stored keys, and get
+ * their hash reset as a freshly received request parameter would.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        unsigned nkeys;
+    } data[] = {
+        {0, 1000},
+        {0, 100 * 1000},
+        {0, 1000 * 1000},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnbytes_t **keys, **lkeys;
+        unsigned *order;
+        mnhtesto_qtable_t table;
+        mnhtesto_quota_spec_t spec;
+        uint64_t start, elapsed;
+        unsigned j, nfound;
+
+        if ((keys = malloc(sizeof(mnbytes_t *) * CDATA.nkeys)) == NULL) {
+            FAIL("malloc");
+        }
+        if ((lkeys = malloc(sizeof(mnbytes_t *) * CDATA.nkeys)) == NULL) {
+            FAIL("malloc");
+        }
+        if ((order = malloc(sizeof(unsigned) * NLOOKUPS)) == NULL) {
+            FAIL("malloc");
+        }
+        for (j = 0; j < CDATA.nkeys; ++j) {
+            keys[j] = bytes_printf("qwe%07u", j);
+            BYTES_INCREF(keys[j]);
+            lkeys[j] = bytes_printf("qwe%07u", j);
+            BYTES_INCREF(lkeys[j]);
+        }
+        for (j = 0; j < NLOOKUPS; ++j) {
+            order[j] = random() % CDATA.nkeys;
+        }
+        memset(&spec, 0, sizeof(mnhtesto_quota_spec_t));
+
+        mnhtesto_qtable_init(&table, 0);
+        for (j = 0; j < CDATA.nkeys; ++j) {
+            if (mnhtesto_qtable_put(&table, keys[j], &spec) ==
+                    MNHTESTO_QTABLE_NONE) {
+                FAIL("mnhtesto_qtable_put");
+            }
+        }
+
+        nfound = 0;
+        start = nsec_now();
+        for (j = 0; j < NLOOKUPS; ++j) {
+            mnbytes_t *key;
+
+            key = lkeys[order[j]];
+            key->hash = 0;
+            if (mnhtesto_qtable_get(&table, key) != MNHTESTO_QTABLE_NONE) {
+                ++nfound;
+            }
+        }
+        elapsed = nsec_now() - start;
+        assert(nfound == NLOOKUPS);
+        TRACE("qtable %8u keys %3zu%% load:      %12.0lf lookups/sec "
+              "%zu bytes/key",
+              CDATA.nkeys,
+              table.nelems * 100 / table.nslots,
+              (double)NLOOKUPS * (double)MNHTESTO_NSEC / (double)elapsed,
+              (table.nslots * sizeof(mnhtesto_qslot_t) +
+               table.elcap * (sizeof(mnbytes_t *) +
+                              sizeof(mnhtesto_qkey_t) +
+                              sizeof(mnhtesto_quota_t))) / table.nelems);
+        mnhtesto_qtable_fini(&table);
+
+        if (CDATA.nkeys <= HASH_MAX_KEYS) {
+            mnhash_t hash;
+
+            hash_init(&hash,
+                      HASH_NBUCKETS,
+                      (hash_hashfn_t)bytes_hash,
+                      (hash_item_comparator_t)bytes_cmp,
+                      (hash_item_finalizer_t)quota_item_finalizer);
+            for (j = 0; j < CDATA.nkeys; ++j) {
+                mnhtesto_quota_t *quota;
+
+                if ((quota = calloc(1, sizeof(mnhtesto_quota_t))) == NULL) {
+                    FAIL("calloc");
+                }
+                BYTES_INCREF(keys[j]);
+                hash_set_item(&hash, keys[j], quota);
+            }
+
+            nfound = 0;
+            start = nsec_now();
+            for (j = 0; j < HASH_NLOOKUPS; ++j) {
+                mnbytes_t *key;
+
+                key = lkeys[order[j]];
+                key->hash = 0;
+                if (hash_get_item(&hash, key) != NULL) {
+                    ++nfound;
+                }
+            }
+            elapsed = nsec_now() - start;
+            assert(nfound == HASH_NLOOKUPS);
+            TRACE("hash   %8u keys %3d buckets:   %12.0lf lookups/sec",
+                  CDATA.nkeys,
+                  HASH_NBUCKETS,
+                  (double)HASH_NLOOKUPS * (double)MNHTESTO_NSEC /
+                    (double)elapsed);
+            hash_fini(&hash);
+        }
+
+        for (j = 0; j < CDATA.nkeys; ++j) {
+            BYTES_DECREF(&keys[j]);
+            BYTES_DECREF(&lkeys[j]);
+        }
+        free(keys);
+        free(lkeys);
+        free(order);
+    }
+}
+
+
+int
+main(void)
+{
+    test0();
+    test1();
+    bench0();
+    return 0;
+}
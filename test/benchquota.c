@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "quota.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NDECISIONS (10 * 1000 * 1000)
+#define T0 (1500000000ul * MNHTESTO_NSEC)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+static void
+spec_setup(mnhtesto_quota_spec_t *spec,
+           int ty,
+           double denom,
+           double divisor,
+           unsigned flags)
+{
+    memset(spec, 0, sizeof(mnhtesto_quota_spec_t));
+    spec->denom = denom;
+    mnhtest_unit_init(&spec->denom_unit, ty, 1.0);
+    spec->divisor = divisor;
+    mnhtest_unit_init(&spec->divisor_unit, MNHTEST_USEC, 1.0);
+    spec->poena_factor = 0.5;
+    spec->flags = flags;
+    if (mnhtesto_quota_spec_prepare(spec, 0.0) != 0) {
+        FAIL("mnhtesto_quota_spec_prepare");
+    }
+}
+
+
+/*
+ * GCRA: the burst is let in at once, then the limit rate, and the
+ * retry-after of the request over the burst is the emission interval.
+ * Rates of more than a byte per nanosecond hold.
+ */
+static void
+test0(void)
+{
+    mnhtesto_quota_spec_t spec;
+    mnhtesto_quota_t quota;
+    uint64_t now, naccepted;
+    unsigned k;
+    UNUSED int res;
+    double ra;
+
+    spec_setup(&spec, MNHTEST_UREQ, 10.0, 1.0, MNHTESTO_QF_GCRA);
+    if (mnhtesto_quota_spec_prepare(&spec, 5.0) != 0) {
+        FAIL("mnhtesto_quota_spec_prepare");
+    }
+    assert(spec.burst == 5);
+    mnhtesto_quota_init(&spec, &quota, T0, 0);
+    for (k = 0; k < 5; ++k) {
+        res = mnhtesto_quota_update(&spec, &quota, T0, 1, &ra);
+        assert(res == 0);
+    }
+    res = mnhtesto_quota_update(&spec, &quota, T0, 1, &ra);
+    assert(res == MNHTESTO_QUOTA_OVER);
+    assert(fabs(ra - 0.1) < 1e-9);
+
+    /* 1000 rps offered for 100 sec */
+    naccepted = 0;
+    for (now = T0 + 1000000; now <= T0 + 100 * MNHTESTO_NSEC;
+         now += 1000000) {
+        if (mnhtesto_quota_update(&spec, &quota, now, 1, &ra) == 0) {
+            ++naccepted;
+        }
+    }
+    assert(naccepted == 1000);
+
+    /* 1.5GB/sec, 3GB/sec offered for 10 sec, after the burst */
+    spec_setup(&spec, MNHTEST_UBYTE, 1.5e9, 1.0, MNHTESTO_QF_GCRA);
+    mnhtesto_quota_init(&spec, &quota, T0, 0);
+    naccepted = 0;
+    for (now = T0; now < T0 + 10 * MNHTESTO_NSEC; now += 1000) {
+        if (mnhtesto_quota_update(&spec, &quota, now, 3000, &ra) == 0) {
+            naccepted += 3000;
+        }
+    }
+    naccepted -= spec.burst;
+    assert(fabs((double)naccepted / 1.5e10 - 1.0) < 0.001);
+}
+
+
+/*
+ * Sliding window counter, of the previous window full: the requests
+ * just past its edge are refused, mid-window the share of the limit
+ * that the previous window leaves is let in, and the retry-after is
+ * until its share decays enough.
+ */
+static void
+test1(void)
+{
+    mnhtesto_quota_spec_t spec;
+    mnhtesto_quota_t quota;
+    unsigned k;
+    UNUSED int res;
+    double ra;
+
+    spec_setup(&spec, MNHTEST_UREQ, 10.0, 1.0, MNHTESTO_QF_SWC);
+    mnhtesto_quota_init(&spec, &quota, T0, 0);
+    for (k = 0; k < 10; ++k) {
+        res = mnhtesto_quota_update(&spec, &quota, T0 + k, 1, &ra);
+        assert(res == 0);
+    }
+    res = mnhtesto_quota_update(&spec, &quota, T0 + k, 1, &ra);
+    assert(res == MNHTESTO_QUOTA_OVER);
+    assert(fabs(ra - 1.0) < 1e-6);
+
+    /* just past the edge, 10 * (1 - 1ns) + 1 is over */
+    res = mnhtesto_quota_update(&spec,
+                                &quota,
+                                T0 + MNHTESTO_NSEC + 1,
+                                1,
+                                &ra);
+    assert(res == MNHTESTO_QUOTA_OVER);
+    assert(fabs(ra - 0.1) < 1e-6);
+
+    /* mid-window, 10 - 10 * 0.5 */
+    for (k = 0; k < 5; ++k) {
+        res = mnhtesto_quota_update(&spec,
+                                    &quota,
+                                    T0 + MNHTESTO_NSEC * 3 / 2,
+                                    1,
+                                    &ra);
+        assert(res == 0);
+    }
+    res = mnhtesto_quota_update(&spec,
+                                &quota,
+                                T0 + MNHTESTO_NSEC * 3 / 2,
+                                1,
+                                &ra);
+    assert(res == MNHTESTO_QUOTA_OVER);
+    /* 10 * (1 - 0.6) + 5 + 1 */
+    assert(fabs(ra - 0.1) < 1e-6);
+    res = mnhtesto_quota_update(&spec,
+                                &quota,
+                                T0 + MNHTESTO_NSEC * 3 / 2 +
+                                    (uint64_t)(ra * MNHTESTO_NSEC),
+                                1,
+                                &ra);
+    assert(res == 0);
+}
+
+
+/*
+ * ns per mnhtesto_quota_update() decision, the clock advancing by
+ * step nanoseconds between decisions.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        const char *name;
+        int ty;
+        double denom;
+        double divisor;
+        int amount;
+        uint64_t step;
+    } data[] = {
+        {0, "100req/1sec, 1k rps", MNHTEST_UREQ, 100.0, 1.0, 1, 1000000},
+        {0, "100req/1sec, 1M rps", MNHTEST_UREQ, 100.0, 1.0, 1, 1000},
+        {0, "1req/10sec, 1M rps", MNHTEST_UREQ, 1.0, 10.0, 1, 1000},
+        {0, "1MB/5sec, 1k x 1KB", MNHTEST_UBYTE, 1048576.0, 5.0, 1024, 1000000},
+    };
+    unsigned flags[] = {0, MNHTESTO_QF_GCRA, MNHTESTO_QF_SWC};
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        unsigned j;
+
+        for (j = 0; j < countof(flags); ++j) {
+            mnhtesto_quota_spec_t spec;
+            mnhtesto_quota_t quota;
+            uint64_t now, start, elapsed;
+            unsigned k, nover;
+            double ra;
+
+            spec_setup(&spec,
+                       CDATA.ty,
+                       CDATA.denom,
+                       CDATA.divisor,
+                       flags[j]);
+            now = T0;
+            mnhtesto_quota_init(&spec, &quota, now, 0);
+            nover = 0;
+
+            start = nsec_now();
+            for (k = 0; k < NDECISIONS; ++k) {
+                now += CDATA.step;
+                if (mnhtesto_quota_update(&spec,
+                                          &quota,
+                                          now,
+                                          CDATA.amount,
+                                          &ra) != 0) {
+                    ++nover;
+                }
+            }
+            elapsed = nsec_now() - start;
+
+            TRACE("%-24s %-5s %6.2lf ns/decision, %u%% over",
+                  CDATA.name,
+                  flags[j] & MNHTESTO_QF_GCRA ? "gcra" :
+                  flags[j] & MNHTESTO_QF_SWC ? "swc" : "fixed",
+                  (double)elapsed / (double)NDECISIONS,
+                  (unsigned)((uint64_t)nover * 100 / NDECISIONS));
+        }
+    }
+}
+
+
+int
+main(void)
+{
+    test0();
+    test1();
+    bench0();
+    return 0;
+}
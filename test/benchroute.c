@@ -0,0 +1,141 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "route.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NLOOKUPS (1 << 22)
+/* every that many routes is a prefix */
+#define PREFIX_EVERY 16
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+
+/*
+ * Routes shaped like a site's URLs: a handful of sections, and items
+ * under them, every PREFIX_EVERY-th a prefix.  Lookups are of the
+ * item paths, and of paths under the prefixes.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        unsigned nroutes;
+    } data[] = {
+        {0, 10 * 1000},
+        {0, 100 * 1000},
+        {0, 1000 * 1000},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_routes_t routes;
+        char **paths;
+        unsigned *order;
+        uint64_t start, elapsed, compiled;
+        unsigned j, nfound;
+
+        if ((paths = malloc(sizeof(char *) * CDATA.nroutes)) == NULL) {
+            FAIL("malloc");
+        }
+        if ((order = malloc(sizeof(unsigned) * NLOOKUPS)) == NULL) {
+            FAIL("malloc");
+        }
+
+        mnhtesto_routes_init(&routes);
+        start = nsec_now();
+        for (j = 0; j < CDATA.nroutes; ++j) {
+            char line[128];
+
+            (void)snprintf(line,
+                           sizeof(line),
+                           "/api/v1/section%02u/item%07u%s lat=fixed:%uus",
+                           j % 37,
+                           j,
+                           j % PREFIX_EVERY == 0 ? "/*" : "",
+                           j % 1000);
+            if (mnhtesto_routes_add(&routes, line) != 0) {
+                FAIL("mnhtesto_routes_add");
+            }
+            if ((paths[j] = malloc(64)) == NULL) {
+                FAIL("malloc");
+            }
+            (void)snprintf(paths[j],
+                           64,
+                           "/api/v1/section%02u/item%07u%s",
+                           j % 37,
+                           j,
+                           j % PREFIX_EVERY == 0 ? "/some/thing" : "");
+        }
+        if (mnhtesto_routes_compile(&routes) != 0) {
+            FAIL("mnhtesto_routes_compile");
+        }
+        compiled = nsec_now() - start;
+
+        for (j = 0; j < NLOOKUPS; ++j) {
+            order[j] = random() % CDATA.nroutes;
+        }
+
+        nfound = 0;
+        start = nsec_now();
+        for (j = 0; j < NLOOKUPS; ++j) {
+            const char *path;
+            const mnhtesto_route_t *route;
+
+            path = paths[order[j]];
+            route = mnhtesto_routes_match(&routes, path, strlen(path));
+            if (route != NULL && route == &routes.routes[order[j]]) {
+                ++nfound;
+            }
+        }
+        elapsed = nsec_now() - start;
+        assert(nfound == NLOOKUPS);
+
+        TRACE("%8u routes: %12.0lf lookups/sec, %zu nodes, "
+              "%zu bytes/route, loaded in %.1lf ms",
+              CDATA.nroutes,
+              (double)NLOOKUPS * 1000000000.0 / (double)elapsed,
+              routes.nnodes,
+              (routes.nnodes * sizeof(mnhtesto_rnode_t) +
+               routes.nedges * sizeof(mnhtesto_redge_t)) /
+                CDATA.nroutes,
+              (double)compiled / 1000000.0);
+
+        for (j = 0; j < CDATA.nroutes; ++j) {
+            free(paths[j]);
+        }
+        mnhtesto_routes_fini(&routes);
+        free(paths);
+        free(order);
+    }
+}
+
+
+int
+main(void)
+{
+    bench0();
+    return 0;
+}
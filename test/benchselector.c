@@ -0,0 +1,302 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/bytes.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "dquota.h"
+#include "selector.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NADDRS (10 * 1000)
+#define NROUTES (10)
+#define NLOOKUPS (1 << 22)
+/* runs of each, the best one counts */
+#define NRUNS (3)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+static void
+test0(void)
+{
+    struct {
+        long rnd;
+        const char *in;
+        int res;
+        size_t nparts;
+        const char *name;
+    } data[] = {
+        {0, "addr", 0, 1, "REMOTE_ADDR"},
+        {0, "path:2+addr", 0, 2, "SCRIPT_NAME"},
+        {0, "header:x-api-key", 0, 1, "HTTP_X_API_KEY"},
+        {0, "query:user+path+addr+header:Host", 0, 4, "user"},
+        {0, "addr+addr+addr+addr+addr", 1, 0, NULL},
+        {0, "path:0", 1, 0, NULL},
+        {0, "path:x", 1, 0, NULL},
+        {0, "query:", 1, 0, NULL},
+        {0, "header:a b", 1, 0, NULL},
+        {0, "addr+", 1, 0, NULL},
+        {0, "port", 1, 0, NULL},
+    };
+    UNUSED size_t len;
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_selector_t sel;
+        int res;
+
+        res = mnhtesto_selector_parse(&sel, CDATA.in) != 0;
+        assert(res == CDATA.res);
+        if (res == 0) {
+            assert(sel.nparts == CDATA.nparts);
+            assert(strcmp(BCDATA(sel.parts[0].name), CDATA.name) == 0);
+            mnhtesto_selector_fini(&sel);
+        }
+    }
+
+    len = mnhtesto_selector_path("/a/b/c", 6, 0);
+    assert(len == 6);
+    len = mnhtesto_selector_path("/a/b/c", 6, 1);
+    assert(len == 2);
+    len = mnhtesto_selector_path("/a/b/c", 6, 2);
+    assert(len == 4);
+    len = mnhtesto_selector_path("/a/b/c", 6, 3);
+    assert(len == 6);
+    len = mnhtesto_selector_path("/", 1, 1);
+    assert(len == 1);
+}
+
+
+/*
+ * A key in parts finds the quota, and the dynamic quota, of the same
+ * key put together.
+ */
+static void
+test1(void)
+{
+    mnhtesto_qtable_t table;
+    mnhtesto_dtable_t dt;
+    mnhtesto_quota_spec_t spec;
+    mnhtesto_qpart_t parts[3], whole;
+    UNUSED mnhtesto_dquota_t *dq, *found;
+    mnbytes_t *qname;
+    UNUSED uint32_t id, got;
+    uint32_t tmpl;
+    char s[64];
+    char *name;
+
+    (void)strcpy(s, "q:100/1sec");
+    if (mnhtesto_quota_parse(s, &name, &spec) != 0) {
+        FAIL("mnhtesto_quota_parse");
+    }
+    mnhtesto_qtable_init(&table, 0);
+    qname = bytes_new_from_str("10.0.0.1|/api");
+    BYTES_INCREF(qname);
+    id = mnhtesto_qtable_put(&table, qname, &spec);
+    BYTES_DECREF(&qname);
+    qname = bytes_new_from_str("10.*");
+    BYTES_INCREF(qname);
+    (void)mnhtesto_qtable_put(&table, qname, &spec);
+    BYTES_DECREF(&qname);
+
+    parts[0].data = "10.0.0.1";
+    parts[0].len = 8;
+    parts[1].data = MNHTESTO_SELECTOR_SEP;
+    parts[1].len = 1;
+    parts[2].data = "/api/v1";
+    parts[2].len = mnhtesto_selector_path(parts[2].data, 7, 1);
+    got = mnhtesto_qtable_get_parts(&table,
+                                    parts,
+                                    3,
+                                    mnhtesto_qparts_hash(parts, 3));
+    assert(got == id);
+    parts[2].len = 7;
+    got = mnhtesto_qtable_get_parts(&table,
+                                    parts,
+                                    3,
+                                    mnhtesto_qparts_hash(parts, 3));
+    assert(got == MNHTESTO_QTABLE_NONE);
+
+    mnhtesto_dtable_init(&dt, 16, false);
+    mnhtesto_dtable_bind(&dt, &table, NULL);
+    dq = mnhtesto_dtable_get(&dt,
+                             &table,
+                             parts,
+                             3,
+                             mnhtesto_qparts_hash(parts, 3),
+                             0,
+                             &tmpl);
+    assert(dq != NULL && tmpl == 1);
+    whole.data = "10.0.0.1|/api/v1";
+    whole.len = strlen(whole.data);
+    found = mnhtesto_dtable_get(&dt,
+                                &table,
+                                &whole,
+                                1,
+                                mnhtesto_qparts_hash(&whole, 1),
+                                0,
+                                &tmpl);
+    assert(found == dq);
+    assert(dt.state->nused == 1);
+
+    mnhtesto_dtable_fini(&dt);
+    mnhtesto_qtable_fini(&table);
+}
+
+
+/*
+ * The per client address and route quota of "addr+path:1", the key
+ * looked up in parts straight from the request params, against the
+ * key put together in a new mnbytes_t first.
+ */
+static uint64_t
+run(mnhtesto_qtable_t *table,
+    mnbytes_t **addrs,
+    mnbytes_t **paths,
+    const unsigned *order,
+    bool together)
+{
+    uint64_t start;
+    unsigned j, nfound;
+
+    nfound = 0;
+    start = nsec_now();
+    for (j = 0; j < NLOOKUPS; ++j) {
+        mnbytes_t *addr, *path;
+        uint32_t id;
+
+        addr = addrs[order[j] % NADDRS];
+        path = paths[order[j] / NADDRS];
+        if (together) {
+            mnbytes_t *qname;
+            size_t len;
+
+            len = mnhtesto_selector_path(BCDATA(path),
+                                         strlen(BCDATA(path)),
+                                         1);
+            qname = bytes_printf("%s" MNHTESTO_SELECTOR_SEP "%.*s",
+                                 BCDATA(addr),
+                                 (int)len,
+                                 BCDATA(path));
+            BYTES_INCREF(qname);
+            id = mnhtesto_qtable_get(table, qname);
+            BYTES_DECREF(&qname);
+        } else {
+            mnhtesto_qpart_t parts[3];
+
+            parts[0].data = BCDATA(addr);
+            parts[0].len = strnlen(BCDATA(addr), BSZ(addr));
+            parts[1].data = MNHTESTO_SELECTOR_SEP;
+            parts[1].len = sizeof(MNHTESTO_SELECTOR_SEP) - 1;
+            parts[2].data = BCDATA(path);
+            parts[2].len = mnhtesto_selector_path(
+                BCDATA(path), strnlen(BCDATA(path), BSZ(path)), 1);
+            id = mnhtesto_qtable_get_parts(table,
+                                           parts,
+                                           3,
+                                           mnhtesto_qparts_hash(parts, 3));
+        }
+        nfound += id != MNHTESTO_QTABLE_NONE;
+    }
+    assert(nfound == NLOOKUPS);
+    return nsec_now() - start;
+}
+
+
+static void
+bench0(void)
+{
+    mnhtesto_qtable_t table;
+    mnhtesto_quota_spec_t spec;
+    mnbytes_t **addrs, *paths[NROUTES];
+    unsigned *order;
+    uint64_t parts, together;
+    unsigned j, k;
+
+    if ((addrs = malloc(sizeof(mnbytes_t *) * NADDRS)) == NULL) {
+        FAIL("malloc");
+    }
+    if ((order = malloc(sizeof(unsigned) * NLOOKUPS)) == NULL) {
+        FAIL("malloc");
+    }
+    for (j = 0; j < NADDRS; ++j) {
+        addrs[j] = bytes_printf("10.%u.%u.%u",
+                                j >> 16,
+                                (j >> 8) & 0xff,
+                                j & 0xff);
+        BYTES_INCREF(addrs[j]);
+    }
+    for (j = 0; j < NROUTES; ++j) {
+        paths[j] = bytes_printf("/api%u/items/%u", j, j * 7919);
+        BYTES_INCREF(paths[j]);
+    }
+    for (j = 0; j < NLOOKUPS; ++j) {
+        order[j] = random() % (NADDRS * NROUTES);
+    }
+
+    memset(&spec, 0, sizeof(mnhtesto_quota_spec_t));
+    mnhtesto_qtable_init(&table, NADDRS * NROUTES);
+    for (j = 0; j < NADDRS * NROUTES; ++j) {
+        mnbytes_t *qname;
+
+        qname = bytes_printf("%s" MNHTESTO_SELECTOR_SEP "/api%u",
+                             BCDATA(addrs[j % NADDRS]),
+                             j / NADDRS);
+        BYTES_INCREF(qname);
+        if (mnhtesto_qtable_put(&table, qname, &spec) ==
+                MNHTESTO_QTABLE_NONE) {
+            FAIL("mnhtesto_qtable_put");
+        }
+        BYTES_DECREF(&qname);
+    }
+
+    for (k = 0, parts = together = UINT64_MAX; k < NRUNS; ++k) {
+        parts = MIN(parts, run(&table, addrs, paths, order, false));
+        together = MIN(together, run(&table, addrs, paths, order, true));
+    }
+    TRACE("%u keys addr+path:1: in parts %.1lf ns/lookup, "
+          "put together %.1lf ns/lookup",
+          NADDRS * NROUTES,
+          (double)parts / (double)NLOOKUPS,
+          (double)together / (double)NLOOKUPS);
+
+    mnhtesto_qtable_fini(&table);
+    for (j = 0; j < NADDRS; ++j) {
+        BYTES_DECREF(&addrs[j]);
+    }
+    for (j = 0; j < NROUTES; ++j) {
+        BYTES_DECREF(&paths[j]);
+    }
+    free(addrs);
+    free(order);
+}
+
+
+int
+main(void)
+{
+    test0();
+    test1();
+    bench0();
+    return 0;
+}
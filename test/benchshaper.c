@@ -0,0 +1,323 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "quota.h"
+#include "shaper.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NWAITERS (1024)
+#define NOPS (1 << 22)
+#define NARRIVALS (100 * 1000)
+/* nanoseconds, as in mnhtesto.c */
+#define SHAPE_MIN_WAIT (1000000ul)
+#define SCATTER(i) ((uint64_t)(i) * 0x9e3779b97f4a7c15ul)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+/*
+ * Queues are FIFO and bounded, a waiter leaves from anywhere, and the
+ * queues of colliding hashes survive the deletion of one another.
+ */
+static void
+test0(void)
+{
+    mnhtesto_shaper_t shaper;
+    mnhtesto_swaiter_t w[NWAITERS];
+    UNUSED mnhtesto_swaiter_t *head;
+    UNUSED int res;
+    unsigned i;
+
+    mnhtesto_shaper_init(&shaper, 3, 0);
+    head = MNHTESTO_SHAPER_HEAD(&shaper, 1);
+    assert(head == NULL);
+    res = mnhtesto_shaper_enqueue(&shaper, 1, &w[0]);
+    assert(res == 0);
+    res = mnhtesto_shaper_enqueue(&shaper, 1, &w[1]);
+    assert(res == 0);
+    res = mnhtesto_shaper_enqueue(&shaper, 1, &w[2]);
+    assert(res == 0);
+    res = mnhtesto_shaper_enqueue(&shaper, 1, &w[3]);
+    assert(res != 0);
+    head = MNHTESTO_SHAPER_HEAD(&shaper, 1);
+    assert(head == &w[0]);
+
+    /* not the head */
+    head = mnhtesto_shaper_dequeue(&shaper, 1, &w[1]);
+    assert(head == NULL);
+    res = mnhtesto_shaper_enqueue(&shaper, 1, &w[3]);
+    assert(res == 0);
+    head = mnhtesto_shaper_dequeue(&shaper, 1, &w[0]);
+    assert(head == &w[2]);
+    head = mnhtesto_shaper_dequeue(&shaper, 1, &w[2]);
+    assert(head == &w[3]);
+    head = mnhtesto_shaper_dequeue(&shaper, 1, &w[3]);
+    assert(head == NULL);
+    assert(shaper.nqueues == 0);
+    head = MNHTESTO_SHAPER_HEAD(&shaper, 1);
+    assert(head == NULL);
+
+    /*
+     * hashes of the same home slot, and in between, then deleted in
+     * another order
+     */
+    for (i = 0; i < NWAITERS; ++i) {
+        uint64_t hash;
+
+        hash = (i % 2) ? (uint64_t)i << 32 : i;
+        res = mnhtesto_shaper_enqueue(&shaper, hash, &w[i]);
+        assert(res == 0);
+    }
+    assert(shaper.nqueues == NWAITERS);
+    for (i = 0; i < NWAITERS; i += 3) {
+        uint64_t hash;
+
+        hash = (i % 2) ? (uint64_t)i << 32 : i;
+        head = mnhtesto_shaper_dequeue(&shaper, hash, &w[i]);
+        assert(head == NULL);
+    }
+    for (i = 0; i < NWAITERS; ++i) {
+        uint64_t hash;
+
+        hash = (i % 2) ? (uint64_t)i << 32 : i;
+        head = MNHTESTO_SHAPER_HEAD(&shaper, hash);
+        assert(head == (i % 3 == 0 ? NULL : &w[i]));
+    }
+    mnhtesto_shaper_fini(&shaper);
+}
+
+
+/*
+ * The cost of parking a request and of handing the head over, over
+ * nkeys queues of NWAITERS requests in all.  The key hashes are
+ * scattered, as those of mnhtesto_qparts_hash() are.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        unsigned nkeys;
+    } data[] = {
+        {0, 1},
+        {0, 32},
+        {0, NWAITERS},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_shaper_t shaper;
+        mnhtesto_swaiter_t w[NWAITERS];
+        uint64_t start, elapsed;
+        unsigned j;
+
+        mnhtesto_shaper_init(&shaper, NWAITERS, 0);
+        for (j = 0; j < NWAITERS; ++j) {
+            if (mnhtesto_shaper_enqueue(&shaper,
+                                        SCATTER(j % CDATA.nkeys),
+                                        &w[j]) != 0) {
+                FAIL("mnhtesto_shaper_enqueue");
+            }
+        }
+        start = nsec_now();
+        for (j = 0; j < NOPS; ++j) {
+            uint64_t hash;
+            mnhtesto_swaiter_t *head;
+
+            hash = SCATTER((j * 7919) % CDATA.nkeys);
+            head = MNHTESTO_SHAPER_HEAD(&shaper, hash);
+            (void)mnhtesto_shaper_dequeue(&shaper, hash, head);
+            (void)mnhtesto_shaper_enqueue(&shaper, hash, head);
+        }
+        elapsed = nsec_now() - start;
+        assert(shaper.nqueues == CDATA.nkeys);
+        TRACE("%4u keys: %.1lf ns/request",
+              CDATA.nkeys,
+              (double)elapsed / (double)NOPS);
+        mnhtesto_shaper_fini(&shaper);
+    }
+}
+
+
+/*
+ * A key of the "s" flag offered more than its limit, in virtual time:
+ * the head of the queue tries again when the quota tells it to, and
+ * hands the head over as it leaves.  The waits of the requests served
+ * and the timers armed, against the requests parked.
+ */
+static void
+bench1(void)
+{
+    struct {
+        long rnd;
+        const char *limit;
+        /* offered, times the limit */
+        double load;
+        size_t maxdepth;
+        uint64_t maxwait;
+    } data[] = {
+        {0, "k:100/1sec:1.0:gs", 0.9, 64, 1000},
+        {0, "k:100/1sec:1.0:gs", 1.5, 64, 1000},
+        {0, "k:100/1sec:1.0:gs", 1.5, 1000, 1000},
+        {0, "k:100/1sec:1.0:ws", 1.5, 64, 1000},
+        {0, "k:1000/1sec:1.0:gs", 3.0, 64, 100},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_shaper_t shaper;
+        mnhtesto_quota_spec_t spec;
+        mnhtesto_quota_t quota;
+        mnhtesto_swaiter_t *w;
+        uint64_t *arrivals;
+        uint64_t t, retry, waited, maxwaited, ntimers;
+        unsigned j, nserved, nrejected, nparked, nwaited;
+        double rate;
+        char s[64];
+        char *qname;
+
+        (void)strcpy(s, CDATA.limit);
+        if (mnhtesto_quota_parse(s, &qname, &spec) != 0) {
+            FAIL("mnhtesto_quota_parse");
+        }
+        assert(spec.flags & MNHTESTO_QF_SHAPE);
+        rate = spec.limit / (double)spec.units * CDATA.load;
+
+        if ((w = malloc(sizeof(mnhtesto_swaiter_t) * NARRIVALS)) == NULL) {
+            FAIL("malloc");
+        }
+        if ((arrivals = malloc(sizeof(uint64_t) * NARRIVALS)) == NULL) {
+            FAIL("malloc");
+        }
+        /* Poisson */
+        for (j = 0, t = MNHTESTO_NSEC; j < NARRIVALS; ++j) {
+            t += (uint64_t)(-log(1.0 - (double)random() /
+                                 ((double)RAND_MAX + 1.0)) /
+                            rate * (double)MNHTESTO_NSEC);
+            arrivals[j] = t;
+        }
+
+        mnhtesto_shaper_init(&shaper,
+                             CDATA.maxdepth,
+                             CDATA.maxwait * 1000000ul);
+        mnhtesto_quota_init(&spec, &quota, MNHTESTO_NSEC, 0);
+        nserved = nrejected = nparked = nwaited = 0;
+        waited = maxwaited = ntimers = 0;
+        retry = UINT64_MAX;
+        for (j = 0; j <= NARRIVALS; ++j) {
+            uint64_t now;
+            double ra;
+
+            now = j < NARRIVALS ? arrivals[j] : UINT64_MAX - 1;
+
+            /*
+             * the head tries before the next arrival
+             */
+            while (retry <= now) {
+                mnhtesto_swaiter_t *head, *next;
+                uint64_t arrived;
+
+                t = retry;
+                head = MNHTESTO_SHAPER_HEAD(&shaper, 0);
+                arrived = head->deadline - shaper.maxwait;
+                if (mnhtesto_quota_update(&spec,
+                                          &quota,
+                                          t,
+                                          1,
+                                          &ra) == MNHTESTO_QUOTA_OK) {
+                    ++nserved;
+                    ++nwaited;
+                    waited += t - arrived;
+                    maxwaited = MAX(maxwaited, t - arrived);
+                } else if (t >= head->deadline) {
+                    ++nrejected;
+                } else {
+                    retry = t + MAX((uint64_t)(ra * (double)MNHTESTO_NSEC),
+                                    SHAPE_MIN_WAIT);
+                    retry = MIN(retry, head->deadline);
+                    ++ntimers;
+                    continue;
+                }
+                next = mnhtesto_shaper_dequeue(&shaper, 0, head);
+                retry = next != NULL ? t : UINT64_MAX;
+            }
+            if (j == NARRIVALS) {
+                break;
+            }
+
+            w[j].deadline = now + shaper.maxwait;
+            if (MNHTESTO_SHAPER_HEAD(&shaper, 0) != NULL) {
+                if (mnhtesto_shaper_enqueue(&shaper, 0, &w[j]) != 0) {
+                    ++nrejected;
+                } else {
+                    ++nparked;
+                }
+            } else if (mnhtesto_quota_update(&spec,
+                                             &quota,
+                                             now,
+                                             1,
+                                             &ra) == MNHTESTO_QUOTA_OK) {
+                ++nserved;
+            } else if (mnhtesto_shaper_enqueue(&shaper, 0, &w[j]) == 0) {
+                ++nparked;
+                retry = now;
+            } else {
+                ++nrejected;
+            }
+        }
+        assert(nserved + nrejected == NARRIVALS);
+        assert(shaper.nqueues == 0);
+
+        TRACE("%-18s load %.1lf depth %4zu wait %4" PRIu64 " ms: "
+              "served %.1lf%% of the limit, rejected %.1lf%%, "
+              "waited %.1lf ms on average (max %.1lf), "
+              "%.2lf timers/parked",
+              CDATA.limit,
+              CDATA.load,
+              CDATA.maxdepth,
+              CDATA.maxwait,
+              (double)nserved /
+                  ((double)(arrivals[NARRIVALS - 1] - MNHTESTO_NSEC) /
+                   (double)spec.window) /
+                  spec.limit * 100.0,
+              (double)nrejected * 100.0 / (double)NARRIVALS,
+              (double)waited / (double)MAX(nwaited, 1) / 1000000.0,
+              (double)maxwaited / 1000000.0,
+              (double)ntimers / (double)MAX(nparked, 1));
+
+        mnhtesto_shaper_fini(&shaper);
+        free(arrivals);
+        free(w);
+    }
+}
+
+
+int
+main(void)
+{
+    test0();
+    bench0();
+    bench1();
+    return 0;
+}
@@ -0,0 +1,265 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "quota.h"
+#include "shedder.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NOPS (1 << 22)
+#define NARRIVALS (200 * 1000)
+#define MAXJOBS (256)
+/* nanoseconds */
+#define TARGET (5000000ul)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * MNHTESTO_NSEC + ts.tv_nsec;
+}
+
+
+static double
+rnd_exp(double mean)
+{
+    return -log(1.0 - (double)random() / ((double)RAND_MAX + 1.0)) * mean;
+}
+
+
+/*
+ * The limit is kept, and the less important classes are shed first.
+ */
+static void
+test0(void)
+{
+    mnhtesto_shedder_t shedder;
+    UNUSED int res;
+    unsigned i;
+
+    mnhtesto_shedder_init(&shedder, 0, 4);
+    for (i = 0; i < 100; ++i) {
+        res = mnhtesto_shedder_admit(&shedder, MNHTESTO_SHED_NCLASSES - 1);
+        assert(res == 0);
+    }
+    for (i = 0; i < 100; ++i) {
+        mnhtesto_shedder_done(&shedder, 1000000);
+    }
+    assert(shedder.inflight == 0 && shedder.limit == 4.0);
+
+    mnhtesto_shedder_init(&shedder, TARGET, 10);
+    for (i = 0; i < 5; ++i) {
+        res = mnhtesto_shedder_admit(&shedder, 0);
+        assert(res == 0);
+    }
+    /* half of the limit */
+    res = mnhtesto_shedder_admit(&shedder, 3);
+    assert(res != 0);
+    for (i = 0; i < 4; ++i) {
+        res = mnhtesto_shedder_admit(&shedder, 1);
+        assert(res == 0);
+    }
+    res = mnhtesto_shedder_admit(&shedder, 1);
+    assert(res != 0);
+    res = mnhtesto_shedder_admit(&shedder, 0);
+    assert(res == 0);
+    res = mnhtesto_shedder_admit(&shedder, 0);
+    assert(res != 0);
+    assert(shedder.nshed[0] == 1 &&
+           shedder.nshed[1] == 1 &&
+           shedder.nshed[3] == 1);
+
+    /*
+     * the latency goes over the target, and the limit is cut down to
+     * one, then it is back under
+     */
+    for (i = 0; i < 10; ++i) {
+        mnhtesto_shedder_done(&shedder, 1000000);
+    }
+    for (i = 0; i < 1000; ++i) {
+        res = mnhtesto_shedder_admit(&shedder, 0);
+        assert(res == 0);
+        mnhtesto_shedder_done(&shedder, TARGET * 2);
+    }
+    assert(shedder.limit == 1.0);
+    res = mnhtesto_shedder_admit(&shedder, 0);
+    assert(res == 0);
+    res = mnhtesto_shedder_admit(&shedder, 0);
+    assert(res != 0);
+    for (i = 0; i < 1000; ++i) {
+        mnhtesto_shedder_done(&shedder, TARGET / 2);
+        res = mnhtesto_shedder_admit(&shedder, 0);
+        assert(res == 0);
+    }
+    /* as long as half of it is in use */
+    assert(shedder.limit >= 2.0 && shedder.limit < 3.0);
+    mnhtesto_shedder_done(&shedder, TARGET / 2);
+}
+
+
+/*
+ * The cost of letting a request in, and of finishing it.
+ */
+static void
+bench0(void)
+{
+    mnhtesto_shedder_t shedder;
+    uint64_t start, elapsed;
+    unsigned j, nshed;
+
+    mnhtesto_shedder_init(&shedder, TARGET, 64);
+    nshed = 0;
+    start = nsec_now();
+    for (j = 0; j < NOPS; ++j) {
+        if (mnhtesto_shedder_admit(&shedder,
+                                   j % MNHTESTO_SHED_NCLASSES) != 0) {
+            ++nshed;
+            continue;
+        }
+        mnhtesto_shedder_done(&shedder, TARGET / 2 + (j * 7919) % TARGET);
+    }
+    elapsed = nsec_now() - start;
+    TRACE("%.1lf ns/request, %u shed",
+          (double)elapsed / (double)NOPS,
+          nshed);
+}
+
+
+/*
+ * A server of a single processor shared by the requests in flight, of
+ * exponential work of 1 msec on average, offered load times its
+ * capacity, in virtual time.  The requests are of the priority classes
+ * in equal parts.  Without shedding the requests are let in up to
+ * MAXJOBS, the rest are refused as if by --max-req.
+ */
+static void
+bench1(void)
+{
+    struct {
+        long rnd;
+        double load;
+        /* msec */
+        unsigned target;
+    } data[] = {
+        {0, 0.8, 0},
+        {0, 0.8, 10},
+        {0, 2.0, 0},
+        {0, 2.0, 10},
+        {0, 2.0, 3},
+        {0, 4.0, 10},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_shedder_t shedder;
+        struct {
+            double start;
+            double work;
+        } jobs[MAXJOBS];
+        double now, next, busy, latency;
+        unsigned nserved, nrefused, j, cls;
+        unsigned served[MNHTESTO_SHED_NCLASSES];
+        unsigned offered[MNHTESTO_SHED_NCLASSES];
+        size_t njobs, k;
+
+        mnhtesto_shedder_init(&shedder,
+                              CDATA.target * 1000000ul,
+                              MAXJOBS);
+        memset(served, 0, sizeof(served));
+        memset(offered, 0, sizeof(offered));
+        njobs = 0;
+        nserved = nrefused = 0;
+        now = busy = latency = 0.0;
+        next = rnd_exp(1.0 / CDATA.load);
+        for (j = 0; j < NARRIVALS;) {
+            double dt;
+            size_t first;
+
+            /*
+             * the job of the least work left is the next to finish
+             */
+            for (k = 0, first = 0; k < njobs; ++k) {
+                if (jobs[k].work < jobs[first].work) {
+                    first = k;
+                }
+            }
+            dt = njobs > 0 ? jobs[first].work * (double)njobs : INFINITY;
+
+            if (next < now + dt) {
+                dt = next - now;
+                for (k = 0; k < njobs; ++k) {
+                    jobs[k].work -= dt / (double)njobs;
+                }
+                busy += njobs > 0 ? dt : 0.0;
+                now = next;
+                next = now + rnd_exp(1.0 / CDATA.load);
+
+                cls = j++ % MNHTESTO_SHED_NCLASSES;
+                ++offered[cls];
+                if (njobs == MAXJOBS ||
+                    mnhtesto_shedder_admit(&shedder, cls) != 0) {
+                    ++nrefused;
+                    continue;
+                }
+                jobs[njobs].start = now;
+                jobs[njobs].work = rnd_exp(1.0);
+                ++njobs;
+                ++served[cls];
+
+            } else {
+                for (k = 0; k < njobs; ++k) {
+                    jobs[k].work -= dt / (double)njobs;
+                }
+                busy += dt;
+                now += dt;
+                ++nserved;
+                latency += now - jobs[first].start;
+                /* msec to nsec */
+                mnhtesto_shedder_done(
+                    &shedder,
+                    (uint64_t)((now - jobs[first].start) * 1000000.0));
+                jobs[first] = jobs[--njobs];
+            }
+        }
+
+        TRACE("load %.1lf target %2u ms: busy %.1lf%%, "
+              "refused %.1lf%%, latency %.1lf ms on average, "
+              "limit %.1lf, served by class %.0lf%% %.0lf%% %.0lf%% "
+              "%.0lf%%",
+              CDATA.load,
+              CDATA.target,
+              busy * 100.0 / now,
+              (double)nrefused * 100.0 / (double)NARRIVALS,
+              latency / (double)MAX(nserved, 1),
+              shedder.limit,
+              (double)served[0] * 100.0 / (double)offered[0],
+              (double)served[1] * 100.0 / (double)offered[1],
+              (double)served[2] * 100.0 / (double)offered[2],
+              (double)served[3] * 100.0 / (double)offered[3]);
+    }
+}
+
+
+int
+main(void)
+{
+    test0();
+    bench0();
+    bench1();
+    return 0;
+}
@@ -0,0 +1,238 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "config.h"
+#include "unittest.h"
+#include "twheel.h"
+
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NSLEEPERS (100 * 1000)
+/* the delays count from after the sleepers are all added */
+#define SETUP_NSEC (50 * 1000 * 1000ul)
+#define MAX_WAKEUPS (2 * NSLEEPERS)
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+typedef struct _sleeper {
+    mnhtesto_timer_t timer;
+    /* nanoseconds */
+    uint64_t when;
+} sleeper_t;
+
+
+typedef struct _fired {
+    uint64_t now;
+    uint64_t *errors;
+    size_t nerrors;
+} fired_t;
+
+
+static void
+sleeper_fire(mnhtesto_timer_t *timer, fired_t *fired)
+{
+    sleeper_t *sleeper;
+
+    sleeper = (sleeper_t *)timer;
+    assert(fired->now >= sleeper->when);
+    fired->errors[fired->nerrors++] = fired->now - sleeper->when;
+}
+
+
+/*
+ * Sleep till the wheel tick (microseconds), the way the pacer does.
+ */
+static void
+wait_tick(UNUSED int fd, uint64_t tick)
+{
+    struct timespec ts;
+
+    ts.tv_sec = tick / 1000000ul;
+    ts.tv_nsec = tick % 1000000ul * 1000ul;
+#ifdef HAVE_SYS_TIMERFD_H
+    {
+        struct itimerspec its;
+        uint64_t nexp;
+
+        its.it_interval.tv_sec = 0;
+        its.it_interval.tv_nsec = 0;
+        its.it_value = ts;
+        if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+            FAIL("timerfd_settime");
+        }
+        if (read(fd, &nexp, sizeof(nexp)) != sizeof(nexp)) {
+            FAIL("read");
+        }
+    }
+#else
+    (void)clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+#endif
+}
+
+
+static void
+report(const char *name, uint64_t *errors, size_t n)
+{
+    qsort(errors, n, sizeof(uint64_t), cmp_u64);
+    TRACE("%-28s err usec p50 %7.1lf p90 %7.1lf p99 %7.1lf "
+          "p99.9 %7.1lf max %7.1lf",
+          name,
+          (double)errors[n / 2] / 1000.0,
+          (double)errors[n * 9 / 10] / 1000.0,
+          (double)errors[n * 99 / 100] / 1000.0,
+          (double)errors[n * 999 / 1000] / 1000.0,
+          (double)errors[n - 1] / 1000.0);
+}
+
+
+/*
+ * NSLEEPERS concurrent sleepers of random delays within [lo, hi]
+ * microseconds on the wheel, woken by a single timer armed at the
+ * next wheel event.  Reports how late the sleepers were woken up,
+ * how late the timer itself went off, which is the floor of the former,
+ * and, for a reference, the error of the delays rounded to a
+ * millisecond, as mrkthr_sleep() would.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        uint64_t lo;
+        uint64_t hi;
+    } data[] = {
+        {0, 50, 1000},
+        {0, 100, 100000},
+        {0, 1000, 1000000},
+    };
+    sleeper_t *sleepers;
+    fired_t fired;
+    uint64_t *rounded, *late;
+    int fd = -1;
+    UNITTEST_PROLOG;
+
+    if ((sleepers = malloc(sizeof(sleeper_t) * NSLEEPERS)) == NULL) {
+        FAIL("malloc");
+    }
+    if ((fired.errors = malloc(sizeof(uint64_t) * NSLEEPERS)) == NULL) {
+        FAIL("malloc");
+    }
+    if ((rounded = malloc(sizeof(uint64_t) * NSLEEPERS)) == NULL) {
+        FAIL("malloc");
+    }
+    if ((late = malloc(sizeof(uint64_t) * MAX_WAKEUPS)) == NULL) {
+        FAIL("malloc");
+    }
+#ifdef HAVE_SYS_TIMERFD_H
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+        FAIL("timerfd_create");
+    }
+#endif
+
+    FOREACHDATA {
+        mnhtesto_twheel_t wheel;
+        uint64_t start, elapsed, tick;
+        unsigned j, nwakeups;
+        char name[64];
+
+        elapsed = nsec_now();
+        start = elapsed + SETUP_NSEC;
+        mnhtesto_twheel_init(&wheel, elapsed / 1000ul);
+        for (j = 0; j < NSLEEPERS; ++j) {
+            uint64_t delay, ms;
+
+            delay = (CDATA.lo + random() % (CDATA.hi - CDATA.lo + 1)) *
+                    1000ul;
+            sleepers[j].when = start + delay;
+            sleepers[j].timer.pprev = NULL;
+            mnhtesto_twheel_add(&wheel,
+                                &sleepers[j].timer,
+                                (sleepers[j].when + 999ul) / 1000ul);
+
+            ms = (delay + 500000ul) / 1000000ul * 1000000ul;
+            rounded[j] = ms > delay ? ms - delay : delay - ms;
+        }
+        elapsed = nsec_now() - elapsed;
+        assert(elapsed < SETUP_NSEC);
+
+        fired.nerrors = 0;
+        nwakeups = 0;
+        while ((tick = mnhtesto_twheel_next(&wheel)) !=
+                MNHTESTO_TWHEEL_NEVER) {
+            wait_tick(fd, tick);
+            fired.now = nsec_now();
+            if (nwakeups < MAX_WAKEUPS) {
+                late[nwakeups] = fired.now - MIN(fired.now, tick * 1000ul);
+            }
+            ++nwakeups;
+            (void)mnhtesto_twheel_advance(&wheel,
+                                          fired.now / 1000ul,
+                                          (mnhtesto_twheel_fire_t)sleeper_fire,
+                                          &fired);
+        }
+        assert(fired.nerrors == NSLEEPERS);
+
+        TRACE("%u sleepers %" PRIu64 "us..%" PRIu64 "us: "
+              "%.1lf ns/add, %u wakeups",
+              NSLEEPERS,
+              CDATA.lo,
+              CDATA.hi,
+              (double)elapsed / (double)NSLEEPERS,
+              nwakeups);
+        (void)snprintf(name, sizeof(name), "  sleepers");
+        report(name, fired.errors, fired.nerrors);
+        (void)snprintf(name, sizeof(name), "  timer wakeups");
+        report(name, late, MIN(nwakeups, MAX_WAKEUPS));
+        (void)snprintf(name, sizeof(name), "  millisecond sleep rounding");
+        report(name, rounded, NSLEEPERS);
+    }
+
+#ifdef HAVE_SYS_TIMERFD_H
+    (void)close(fd);
+#endif
+    free(late);
+    free(rounded);
+    free(fired.errors);
+    free(sleepers);
+}
+
+
+int
+main(void)
+{
+    bench0();
+    return 0;
+}
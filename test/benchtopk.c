@@ -0,0 +1,188 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "unittest.h"
+#include "topk.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+#define NKEYS (1000 * 1000)
+#define NEVENTS (1 << 22)
+#define NTOP 10
+
+
+static uint64_t
+nsec_now(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+
+/*
+ * Key ids of a zipfian popularity, scattered over the id space.
+ */
+static void
+zipf_stream(uint32_t *stream, double s)
+{
+    double *cdf;
+    unsigned j;
+
+    if ((cdf = malloc(sizeof(double) * NKEYS)) == NULL) {
+        FAIL("malloc");
+    }
+    for (j = 0; j < NKEYS; ++j) {
+        cdf[j] = (j > 0 ? cdf[j - 1] : 0.0) + 1.0 / pow((double)(j + 1), s);
+    }
+    for (j = 0; j < NEVENTS; ++j) {
+        double r;
+        unsigned lo, hi;
+
+        r = (double)random() / (double)RAND_MAX * cdf[NKEYS - 1];
+        for (lo = 0, hi = NKEYS - 1; lo < hi;) {
+            unsigned mid = (lo + hi) / 2;
+
+            if (cdf[mid] < r) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        stream[j] = (uint32_t)(((uint64_t)lo * 7919) % NKEYS);
+    }
+    free(cdf);
+}
+
+
+static int
+u64cmp_desc(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x > y ? -1 : x < y ? 1 : 0;
+}
+
+
+/*
+ * Keys that differ only in their upper half are counted apart.
+ */
+static void
+test0(void)
+{
+    mnhtesto_topk_t topk;
+    mnhtesto_topk_counter_t top[2];
+    UNUSED size_t n;
+
+    mnhtesto_topk_init(&topk);
+    mnhtesto_topk_add(&topk, 1, 3);
+    mnhtesto_topk_add(&topk, 1 | (1ull << 63), 2);
+    mnhtesto_topk_add(&topk, 1, 1);
+    n = mnhtesto_topk_top(&topk, top, countof(top));
+    assert(n == 2);
+    assert(top[0].key == 1 && top[0].count == 4);
+    assert(top[1].key == (1 | (1ull << 63)) && top[1].count == 2);
+}
+
+
+/*
+ * Updates per second, how many of the true top NTOP are reported, and
+ * the largest overestimate among the reported, relative to the true
+ * count.
+ */
+static void
+bench0(void)
+{
+    struct {
+        long rnd;
+        double s;
+    } data[] = {
+        {0, 0.8},
+        {0, 1.0},
+        {0, 1.2},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        mnhtesto_topk_t topk;
+        mnhtesto_topk_counter_t top[NTOP];
+        uint32_t *stream;
+        uint64_t *exact, *sorted;
+        uint64_t start, elapsed;
+        unsigned j, nfound;
+        size_t ntop;
+        double maxerr;
+
+        if ((stream = malloc(sizeof(uint32_t) * NEVENTS)) == NULL) {
+            FAIL("malloc");
+        }
+        if ((exact = calloc(NKEYS, sizeof(uint64_t))) == NULL) {
+            FAIL("calloc");
+        }
+        if ((sorted = malloc(sizeof(uint64_t) * NKEYS)) == NULL) {
+            FAIL("malloc");
+        }
+        zipf_stream(stream, CDATA.s);
+        for (j = 0; j < NEVENTS; ++j) {
+            ++exact[stream[j]];
+        }
+
+        mnhtesto_topk_init(&topk);
+        start = nsec_now();
+        for (j = 0; j < NEVENTS; ++j) {
+            mnhtesto_topk_add(&topk, stream[j], 1);
+        }
+        elapsed = nsec_now() - start;
+        assert(topk.total == NEVENTS);
+
+        ntop = mnhtesto_topk_top(&topk, top, NTOP);
+        memcpy(sorted, exact, sizeof(uint64_t) * NKEYS);
+        qsort(sorted, NKEYS, sizeof(uint64_t), u64cmp_desc);
+
+        nfound = 0;
+        maxerr = 0.0;
+        for (j = 0; j < ntop; ++j) {
+            assert(top[j].count >= exact[top[j].key]);
+            assert(top[j].count - top[j].error <= exact[top[j].key]);
+            if (exact[top[j].key] >= sorted[NTOP - 1]) {
+                ++nfound;
+            }
+            maxerr = MAX(maxerr,
+                         (double)(top[j].count - exact[top[j].key]) /
+                            (double)exact[top[j].key]);
+        }
+
+        TRACE("zipf %.1lf: %.1lf ns/update, top %d found %u, "
+              "max overestimate %.2lf%%, %zu bytes",
+              CDATA.s,
+              (double)elapsed / (double)NEVENTS,
+              NTOP,
+              nfound,
+              maxerr * 100.0,
+              sizeof(mnhtesto_topk_t));
+
+        free(stream);
+        free(exact);
+        free(sorted);
+    }
+}
+
+
+int
+main(void)
+{
+    test0();
+    bench0();
+    return 0;
+}